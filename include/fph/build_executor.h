@@ -0,0 +1,164 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2022 renzibei
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * The executors that run the parallel parts of the Build() of the fph tables.
+ *
+ * By default, the tables are built on the calling thread. After
+ * table.set_build_thread_num(n) or table.set_build_executor(executor, n), the following builds and
+ * rehashes of that table compute the bucket indices of the keys, test the candidates of seed2
+ * and construct the slots in parallel. The table built is the same as the one built on one thread.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#ifndef FPH_HAVE_EXCEPTIONS
+
+#if !(defined(__GNUC__) && !defined(__cpp_exceptions)) && \
+    !(defined(__GNUC__) && defined(__cpp_exceptions) && __cpp_exceptions == 0 ) && \
+    !(defined(_MSC_VER) && !defined(_CPPUNWIND))
+#define FPH_HAVE_EXCEPTIONS 1
+#endif
+
+#endif
+
+namespace fph {
+
+    /**
+     * Runs the parallel parts of a build. A call of executor(task_num, task) should call task(i)
+     * exactly once for every i in [0, task_num), from any threads in any order, and return after
+     * all the calls return. A task may throw, e.g. from the seed hash of the table; then the
+     * executor may skip the tasks not started yet, and should rethrow one of the exceptions after
+     * all the calls started have returned.
+     */
+    using BuildExecutor = std::function<void(size_t task_num, const std::function<void(size_t)> &task)>;
+
+    /**
+     * The threads are not reused: every call, i.e. every parallel part of a build, starts its own
+     * threads. This costs tens of microseconds per call, small next to the parallel parts of the
+     * builds that are large enough to be worth running in parallel. Pass a thread pool to
+     * set_build_executor() to avoid it.
+     * If a thread can not be started, the tasks run on the threads already started and the calling
+     * thread. The first exception thrown by a task is rethrown after all the threads are joined.
+     * @param thread_num the number of threads that run the tasks, including the calling thread
+     * @return an executor that starts thread_num - 1 threads for each call and joins them before
+     * the call returns
+     */
+    inline BuildExecutor MakeThreadBuildExecutor(size_t thread_num) {
+        return [thread_num](size_t task_num, const std::function<void(size_t)> &task) {
+            std::atomic<size_t> next_task_index{0};
+#ifdef FPH_HAVE_EXCEPTIONS
+            std::mutex error_mutex;
+            std::exception_ptr first_error;
+#endif
+            auto run_tasks = [&]() {
+#ifdef FPH_HAVE_EXCEPTIONS
+                try {
+#endif
+                    for (size_t i = next_task_index.fetch_add(1, std::memory_order_relaxed); i < task_num;
+                            i = next_task_index.fetch_add(1, std::memory_order_relaxed)) {
+                        task(i);
+                    }
+#ifdef FPH_HAVE_EXCEPTIONS
+                }
+                catch (...) {
+                    // the other threads stop after their current task
+                    next_task_index.store(task_num, std::memory_order_relaxed);
+                    std::lock_guard<std::mutex> lock(error_mutex);
+                    if (first_error == nullptr) {
+                        first_error = std::current_exception();
+                    }
+                }
+#endif
+            };
+            size_t new_thread_num = std::min(thread_num, task_num);
+            new_thread_num = new_thread_num > 0 ? new_thread_num - 1U : 0;
+            std::vector<std::thread> threads;
+#ifdef FPH_HAVE_EXCEPTIONS
+            try {
+#endif
+                threads.reserve(new_thread_num);
+                for (size_t i = 0; i < new_thread_num; ++i) {
+                    threads.emplace_back(run_tasks);
+                }
+#ifdef FPH_HAVE_EXCEPTIONS
+            }
+            catch (const std::exception &) {
+                // no more threads, the tasks run on the ones already started
+            }
+#endif
+            run_tasks();
+            for (auto &thread: threads) {
+                thread.join();
+            }
+#ifdef FPH_HAVE_EXCEPTIONS
+            if (first_error != nullptr) {
+                std::rethrow_exception(first_error);
+            }
+#endif
+        };
+    }
+
+    namespace parallel_detail {
+
+        /**
+         * Run func(i) for every i in [0, task_num) with executor, or in order on the calling thread
+         * if executor is empty
+         */
+        template<class Func>
+        void RunBuildTasks(const BuildExecutor &executor, size_t task_num, Func &&func) {
+            if (executor && task_num > 1) {
+                std::function<void(size_t)> task = [&func](size_t i) { func(i); };
+                executor(task_num, task);
+            }
+            else {
+                for (size_t i = 0; i < task_num; ++i) {
+                    func(i);
+                }
+            }
+        }
+
+        /**
+         * @return [begin, end) of the chunk_index-th of the chunk_num nearly equal chunks of [0, n)
+         */
+        inline std::pair<size_t, size_t> ChunkRange(size_t n, size_t chunk_num, size_t chunk_index) {
+            size_t chunk_size = n / chunk_num, remain = n % chunk_num;
+            size_t begin = chunk_index * chunk_size + std::min(chunk_index, remain);
+            return {begin, begin + chunk_size + (chunk_index < remain ? 1U : 0U)};
+        }
+
+    } // namespace parallel_detail
+
+} // namespace fph
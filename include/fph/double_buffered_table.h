@@ -0,0 +1,403 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2022 renzibei
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * A double-buffered wrapper of the fph tables for tables that keep growing while being read.
+ *
+ * fph::DoubleBufferedTable<Table> keeps two copies of a table (e.g. fph::DynamicFphMap or
+ * fph::MetaFphMap). The readers look up in the front copy, which is never modified while it is
+ * the front. insert() and erase() only append the operation to a pending list; a worker thread
+ * applies the pending operations to the back copy, where all the rebuilds triggered by the inserts
+ * happen, and publishes the back copy as the new front with an atomic pointer swap. After the
+ * readers of the old front are gone (the grace period), the same operations are applied to the
+ * old front, which becomes the new back. The published copy is handed back to the worker by the
+ * deleter of its shared_ptr when the last reader drops it, so the worker waits on a condition
+ * variable instead of polling the reference count.
+ *
+ * The readers never wait for a rebuild, but the writes are only visible to them after the batch
+ * containing the write is published. Call Flush() to wait for that. A reader that keeps a
+ * Snapshot() for a long time delays the next publication, not the other readers.
+ *
+ * The pending list is bounded by max_pending_op_num. While a reader keeps an old snapshot the
+ * worker can not take the next batch, and once the list is full insert() and erase() block until
+ * the worker catches up. So a thread must not write while it keeps a snapshot, which would wait
+ * for itself; the same holds for Flush().
+ *
+ * If applying an operation throws (e.g. the hash, an allocation or a rebuild of the table), the
+ * worker stops and keeps the exception. Flush() and every following insert() and erase() rethrow
+ * it; the readers keep the last published version.
+ *
+ * fph::DoubleBufferedTable<fph::DynamicFphMap<uint64_t, uint64_t>> table(keys.begin(), keys.end());
+ * // query threads
+ * table.Visit(key, [&](const auto &pair) { sum += pair.second; });
+ * // writer threads
+ * table.insert({new_key, new_value});
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <variant>
+#include <vector>
+
+#ifndef FPH_HAVE_EXCEPTIONS
+
+#if !(defined(__GNUC__) && !defined(__cpp_exceptions)) && \
+    !(defined(__GNUC__) && defined(__cpp_exceptions) && __cpp_exceptions == 0 ) && \
+    !(defined(_MSC_VER) && !defined(_CPPUNWIND))
+#define FPH_HAVE_EXCEPTIONS 1
+#endif
+
+#endif
+
+namespace fph {
+
+    template<class Table>
+    class DoubleBufferedTable {
+    public:
+        using table_type = Table;
+        using key_type = typename Table::key_type;
+        using value_type = typename Table::value_type;
+        using size_type = size_t;
+
+        constexpr static size_t DEFAULT_MAX_PENDING_OP_NUM = size_t(1) << 20U;
+
+        /**
+         * @param publish_op_num the worker applies and publishes the pending operations once there
+         * are at least publish_op_num of them, or when Flush() is called
+         * @param max_pending_op_num the writes block while this many operations wait for the
+         * worker, at least publish_op_num
+         */
+        explicit DoubleBufferedTable(size_t publish_op_num = 1024U,
+                                     size_t max_pending_op_num = DEFAULT_MAX_PENDING_OP_NUM) :
+                DoubleBufferedTable(std::make_unique<Table>(), publish_op_num, max_pending_op_num) {}
+
+        template<class InputIt, typename std::enable_if<!std::is_integral<InputIt>::value, int>::type = 0>
+        DoubleBufferedTable(InputIt first, InputIt last, size_t publish_op_num = 1024U,
+                            size_t max_pending_op_num = DEFAULT_MAX_PENDING_OP_NUM) :
+                DoubleBufferedTable(std::make_unique<Table>(first, last), publish_op_num, max_pending_op_num) {}
+
+        DoubleBufferedTable(const DoubleBufferedTable&) = delete;
+        DoubleBufferedTable& operator=(const DoubleBufferedTable&) = delete;
+
+        // the pending operations that are not published yet are dropped. The snapshots still held
+        // by the readers stay valid.
+        ~DoubleBufferedTable() {
+            {
+                std::lock_guard<std::mutex> lock(write_mutex_);
+                stop_flag_ = true;
+            }
+            write_cv_.notify_all();
+            publish_cv_.notify_all();
+            {
+                std::lock_guard<std::mutex> lock(recycler_->mutex);
+            }
+            recycler_->cv.notify_all();
+            worker_.join();
+            std::lock_guard<std::mutex> lock(recycler_->mutex);
+            // the copies released from now on are deleted by their last readers
+            recycler_->stopped = true;
+            recycler_->table.reset();
+        }
+
+        /**
+         * @return the published version of the table. It is not modified while any reader holds it,
+         * so it can be read without locks as long as the returned pointer is kept.
+         */
+        std::shared_ptr<const Table> Snapshot() const noexcept {
+#if defined(__cpp_lib_atomic_shared_ptr)
+            return front_.load(std::memory_order_acquire);
+#else
+            return std::atomic_load_explicit(&front_, std::memory_order_acquire);
+#endif
+        }
+
+        template<class K = key_type>
+        bool contains(const K &key) const {
+            return Snapshot()->contains(key);
+        }
+
+        /**
+         * Call func(value) if the key is in the published version of the table
+         * @return whether the key is found
+         */
+        template<class K, class Func>
+        bool Visit(const K &key, Func &&func) const {
+            auto snapshot = Snapshot();
+            auto it = snapshot->find(key);
+            if (it == snapshot->end()) {
+                return false;
+            }
+            func(*it);
+            return true;
+        }
+
+        // the size of the published version
+        size_type size() const {
+            return Snapshot()->size();
+        }
+
+        // the number of the published versions, the initial one is 0
+        uint64_t version() const noexcept {
+            return published_version_.load(std::memory_order_acquire);
+        }
+
+        // insert the value if its key is not in the table, visible after the next publication.
+        // Blocks while the pending list is full
+        void insert(const value_type &value) {
+            AddPendingOp(PendingOp(std::in_place_index<0>, value));
+        }
+
+        void insert(value_type &&value) {
+            AddPendingOp(PendingOp(std::in_place_index<0>, std::move(value)));
+        }
+
+        // erase the key if it is in the table, visible after the next publication
+        void erase(const key_type &key) {
+            AddPendingOp(PendingOp(std::in_place_index<1>, key));
+        }
+
+        // the number of the operations that are not published yet
+        size_type pending_size() const {
+            std::lock_guard<std::mutex> lock(write_mutex_);
+            return pending_ops_.size() + applying_op_num_;
+        }
+
+        // wait until all the operations added before the call are published, rethrow the
+        // exception that stopped the worker if any
+        void Flush() {
+            std::unique_lock<std::mutex> lock(write_mutex_);
+            const uint64_t target_op_seq = added_op_seq_;
+            flush_op_seq_ = std::max(flush_op_seq_, target_op_seq);
+            write_cv_.notify_all();
+            publish_cv_.wait(lock, [&]() {
+                return published_op_seq_ >= target_op_seq || worker_error_ != nullptr;
+            });
+            RethrowWorkerError();
+        }
+
+    protected:
+        // index 0: insert a value, index 1: erase a key
+        using PendingOp = std::variant<value_type, key_type>;
+
+        // The published copy goes back here when its last reader drops it
+        struct Recycler {
+            std::mutex mutex;
+            std::condition_variable cv;
+            std::unique_ptr<Table> table;
+            // whether the DoubleBufferedTable is destroyed, then the released copies are deleted
+            bool stopped = false;
+        };
+
+        DoubleBufferedTable(std::unique_ptr<Table> front, size_t publish_op_num, size_t max_pending_op_num) :
+                back_(std::make_unique<Table>(*front)), recycler_(std::make_shared<Recycler>()),
+                publish_op_num_(publish_op_num == 0 ? 1U : publish_op_num),
+                max_pending_op_num_(std::max(max_pending_op_num, publish_op_num_)), published_version_(0),
+                added_op_seq_(0), flush_op_seq_(0), published_op_seq_(0), applying_op_num_(0),
+                stop_flag_(false) {
+            StoreFront(MakePublished(std::move(front)));
+            worker_ = std::thread([this]() { WorkerLoop(); });
+        }
+
+        std::shared_ptr<const Table> MakePublished(std::unique_ptr<Table> table) const {
+            return std::shared_ptr<const Table>(table.release(), [recycler = recycler_](const Table *ptr) {
+                std::unique_ptr<Table> released(const_cast<Table*>(ptr));
+                std::lock_guard<std::mutex> lock(recycler->mutex);
+                if (!recycler->stopped) {
+                    recycler->table = std::move(released);
+                    recycler->cv.notify_all();
+                }
+            });
+        }
+
+        void StoreFront(std::shared_ptr<const Table> front) {
+#if defined(__cpp_lib_atomic_shared_ptr)
+            front_.store(std::move(front), std::memory_order_release);
+#else
+            std::atomic_store_explicit(&front_, std::move(front), std::memory_order_release);
+#endif
+        }
+
+        void AddPendingOp(PendingOp &&op) {
+            bool notify_flag;
+            {
+                std::unique_lock<std::mutex> lock(write_mutex_);
+                // backpressure: the worker takes the whole list when it starts the next batch
+                publish_cv_.wait(lock, [this]() {
+                    return pending_ops_.size() < max_pending_op_num_ || worker_error_ != nullptr
+                           || stop_flag_.load(std::memory_order_relaxed);
+                });
+                RethrowWorkerError();
+                pending_ops_.push_back(std::move(op));
+                ++added_op_seq_;
+                notify_flag = pending_ops_.size() >= publish_op_num_;
+            }
+            if (notify_flag) {
+                write_cv_.notify_all();
+            }
+        }
+
+        static void ApplyOp(Table &table, const PendingOp &op) {
+            if (op.index() == 0) {
+                table.insert(std::get<0>(op));
+            }
+            else {
+                table.erase(std::get<1>(op));
+            }
+        }
+
+        static void ApplyOp(Table &table, PendingOp &&op) {
+            if (op.index() == 0) {
+                table.insert(std::get<0>(std::move(op)));
+            }
+            else {
+                table.erase(std::get<1>(op));
+            }
+        }
+
+        // called with write_mutex_ held
+        void RethrowWorkerError() const {
+#ifdef FPH_HAVE_EXCEPTIONS
+            if (worker_error_ != nullptr) {
+                std::rethrow_exception(worker_error_);
+            }
+#endif
+        }
+
+        void WorkerLoop() {
+#ifdef FPH_HAVE_EXCEPTIONS
+            try {
+                WorkerLoopImp();
+            }
+            catch (...) {
+                // the back copy may hold a part of the batch, so the worker stops here
+                {
+                    std::lock_guard<std::mutex> lock(write_mutex_);
+                    worker_error_ = std::current_exception();
+                }
+                publish_cv_.notify_all();
+            }
+#else
+            WorkerLoopImp();
+#endif
+        }
+
+        void WorkerLoopImp() {
+            std::vector<PendingOp> ops;
+            while (true) {
+                uint64_t batch_op_seq;
+                {
+                    std::unique_lock<std::mutex> lock(write_mutex_);
+                    write_cv_.wait(lock, [this]() {
+                        return stop_flag_.load(std::memory_order_relaxed) || pending_ops_.size() >= publish_op_num_
+                               || (flush_op_seq_ > published_op_seq_ && !pending_ops_.empty());
+                    });
+                    if (stop_flag_.load(std::memory_order_relaxed)) {
+                        return;
+                    }
+                    ops.swap(pending_ops_);
+                    applying_op_num_ = ops.size();
+                    batch_op_seq = published_op_seq_ + ops.size();
+                }
+                // wake the writers waiting for room in the pending list
+                publish_cv_.notify_all();
+                size_t insert_num = 0;
+                for (const auto &op: ops) {
+                    insert_num += op.index() == 0;
+                }
+                // all the rebuilds of this batch happen here, on the copy no reader can see
+                back_->reserve(back_->size() + insert_num);
+                for (const auto &op: ops) {
+                    ApplyOp(*back_, op);
+                }
+
+                // the old front goes to the recycler after its last reader drops it
+                StoreFront(MakePublished(std::move(back_)));
+                published_version_.fetch_add(1, std::memory_order_release);
+                {
+                    std::lock_guard<std::mutex> lock(write_mutex_);
+                    published_op_seq_ = batch_op_seq;
+                    applying_op_num_ = 0;
+                }
+                publish_cv_.notify_all();
+
+                // grace period: wait until the readers of the old front drop their snapshots
+                {
+                    std::unique_lock<std::mutex> lock(recycler_->mutex);
+                    recycler_->cv.wait(lock, [this]() {
+                        return recycler_->table != nullptr || stop_flag_.load(std::memory_order_relaxed);
+                    });
+                    if (recycler_->table == nullptr) {
+                        return;
+                    }
+                    back_ = std::move(recycler_->table);
+                }
+                back_->reserve(back_->size() + insert_num);
+                for (auto &op: ops) {
+                    ApplyOp(*back_, std::move(op));
+                }
+                ops.clear();
+            }
+        }
+
+        // the published version, shared with the readers
+#if defined(__cpp_lib_atomic_shared_ptr)
+        std::atomic<std::shared_ptr<const Table>> front_;
+#else
+        std::shared_ptr<const Table> front_;
+#endif
+        // the copy only the worker uses, nullptr from the publication until the old front is released
+        std::unique_ptr<Table> back_;
+        std::shared_ptr<Recycler> recycler_;
+        const size_t publish_op_num_;
+        const size_t max_pending_op_num_;
+        std::atomic<uint64_t> published_version_;
+
+        mutable std::mutex write_mutex_;
+        std::condition_variable write_cv_;
+        // notified after a publication, when the worker takes the pending list and when it stops
+        std::condition_variable publish_cv_;
+        std::vector<PendingOp> pending_ops_;
+        // the number of operations added, requested to be flushed and published
+        uint64_t added_op_seq_;
+        uint64_t flush_op_seq_;
+        uint64_t published_op_seq_;
+        size_t applying_op_num_;
+        // the exception that stopped the worker
+        std::exception_ptr worker_error_;
+        std::atomic<bool> stop_flag_;
+        std::thread worker_;
+    };
+
+} // namespace fph
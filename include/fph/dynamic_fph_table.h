@@ -78,6 +78,26 @@
 #include <chrono>
 #include <utility>
 #include <algorithm>
+#include <optional>
+
+#include "build_executor.h"
+#include "insert_path_stats.h"
+#include "memory_usage.h"
+#include "slot_occupancy.h"
+
+// Whether the vectorized kernels for 64-bit integer keys are compiled and chosen at run time
+// by the cpu features
+#ifndef FPH_X86_RUNTIME_DISPATCH
+#   if (defined(__GNUC__) || defined(__clang__)) && defined(__x86_64__)
+#       define FPH_X86_RUNTIME_DISPATCH 1
+#   else
+#       define FPH_X86_RUNTIME_DISPATCH 0
+#   endif
+#endif
+
+#if FPH_X86_RUNTIME_DISPATCH
+#include <immintrin.h>
+#endif
 
 
 // flash perfect map
@@ -91,6 +111,12 @@ namespace fph {
 #define FPH_DY_DUAL_BUCKET_SET 0
 #endif
 
+// Set to 0 to always construct a copy of the fill key in every empty slot of DynamicFphSet/Map,
+// see fph::dynamic::UnconstructedEmptySlots
+#ifndef FPH_DY_UNCONSTRUCTED_EMPTY_SLOTS
+#define FPH_DY_UNCONSTRUCTED_EMPTY_SLOTS 1
+#endif
+
 #ifndef FPH_DEBUG_FLAG
 #define FPH_DEBUG_FLAG 0
 #endif
@@ -115,6 +141,17 @@ namespace fph {
 #endif
 #endif
 
+#ifndef FPH_PREFETCH
+#   if FPH_HAS_BUILTIN_OR_GCC_CLANG(__builtin_prefetch)
+#       define FPH_PREFETCH(addr, rw, level) __builtin_prefetch((addr), rw, level)
+#   elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#       include <xmmintrin.h>
+#       define FPH_PREFETCH(addr, rw, level) _mm_prefetch(reinterpret_cast<const char*>(addr), _MM_HINT_T0)
+#   else
+#       define FPH_PREFETCH(addr, rw, level) {}
+#   endif
+#endif
+
 
 #ifndef FPH_LIKELY
 #   if FPH_HAS_BUILTIN_OR_GCC_CLANG(__builtin_expect)
@@ -933,24 +970,20 @@ namespace fph {
 
     namespace dynamic::detail {
 
-        template<class Key,
-                class KeyPointerAllocator=std::allocator<const Key *>,
-                class BucketParamType = uint32_t>
+        /**
+         * A bucket of keys. The keys of all the buckets are stored in one flat entry array, and
+         * the keys of this bucket are the entries [entry_begin, entry_begin + entry_cnt). An entry is
+         * the index of the key in the input during a build, and the position of the slot of the key
+         * after the build. There is room for entry_capacity entries before the next bucket
+         */
+        template<class BucketParamType = uint32_t>
         struct FphBucket {
         public:
             BucketParamType entry_cnt;
-            BucketParamType index;
-            std::vector<const Key *, KeyPointerAllocator> key_array;
-
-            explicit FphBucket(size_t index) noexcept: entry_cnt(0), index(index) {}
-
-            FphBucket() noexcept: entry_cnt(0), index(0) {}
-
-            void AddKey(const Key *key_ptr) {
-                key_array.push_back(key_ptr);
-            }
+            BucketParamType entry_capacity;
+            size_t entry_begin;
 
-        protected:
+            FphBucket() noexcept: entry_cnt(0), entry_capacity(0), entry_begin(0) {}
 
         };
     } // namespace dynamic::detail
@@ -1242,6 +1275,18 @@ namespace fph {
             std::uniform_int_distribution<uint32_t> random_gen;
         };
 
+        /**
+         * Whether the empty slots of DynamicFphSet/Map hold no key object. If true, an empty slot
+         * is told by the occupancy bit of the slot instead of a copy of the fill key, so build,
+         * rehash and clear construct and destroy no key in the empty slots, and a lookup checks the
+         * occupancy bit before comparing the key in the slot.
+         * True by default for the keys that are not trivially copyable, e.g. std::string, whose
+         * copies may allocate. Specialize it as std::false_type to keep the fill keys.
+         * @tparam Key
+         */
+        template<class Key, typename = void>
+        struct UnconstructedEmptySlots : std::bool_constant<!std::is_trivially_copyable<Key>::value> {};
+
     } // namespace dynamic
 
     namespace dynamic::detail {
@@ -1424,6 +1469,7 @@ namespace fph {
                     seed1_(0), seed2_(0),
                     bucket_p_array_{nullptr},
                     slot_(nullptr),
+                    slot_seed0_hash_(nullptr),
                     param_(nullptr) {
 
                 TableParamAllocator  param_alloc{};
@@ -1492,6 +1538,7 @@ namespace fph {
                     seed2_(other.seed2_),
                     bucket_p_array_(nullptr),
                     slot_(nullptr),
+                    slot_seed0_hash_(nullptr),
                     param_(nullptr)
             {
                 if (other.param_ != nullptr) {
@@ -1512,31 +1559,40 @@ namespace fph {
                     memcpy(bucket_p_array_, other.bucket_p_array_,
                            sizeof(BucketParamType) * param_->bucket_num_);
 
-                    KeyAllocator key_alloc;
+                    if (other.slot_seed0_hash_ != nullptr) {
+                        slot_seed0_hash_ = SizeTAllocator{}.allocate(param_->slot_capacity_);
+                        memcpy(slot_seed0_hash_, other.slot_seed0_hash_,
+                               sizeof(size_t) * param_->item_num_ceil_);
+                    }
+
                     for (size_t i = 0; i < param_->item_num_ceil_; ++i) {
                         if (!other.IsSlotEmpty(i)) {
                             std::allocator_traits<Allocator>::construct(param_->alloc_,
                                                                         std::addressof(
                                                                                 slot_[i].mutable_value),
                                                                         other.slot_[i].mutable_value);
+                        } else if FPH_LIKELY(other.slot_ + i != other.param_->default_fill_key_address_) {
+                            ConstructFillKey(slot_ + i, *param_->default_fill_key_);
                         } else {
-                            std::allocator_traits<KeyAllocator>::construct(key_alloc,
-                                                                           std::addressof(
-                                                                                   slot_[i].key),
-                                                                           other.slot_[i].key);
+                            ConstructFillKey(slot_ + i, *param_->second_default_key_);
+                        }
+                    }
+                    if (other.param_->stash_num_ != 0) {
+                        param_->stash_slot_ = SlotAllocator{}.allocate(other.param_->stash_num_);
+                        param_->stash_capacity_ = other.param_->stash_num_;
+                        for (size_t i = 0; i < other.param_->stash_num_; ++i) {
+                            std::allocator_traits<Allocator>::construct(param_->alloc_,
+                                    std::addressof(param_->stash_slot_[i].mutable_value),
+                                    other.param_->stash_slot_[i].mutable_value);
+                            ++param_->stash_num_;
                         }
+                        // the stash is iterated first
+                        param_->begin_it_ = iterator(param_->stash_slot_, this);
                     }
-                    if (other.param_->begin_it_.value_ptr() != nullptr) {
+                    else if (other.param_->begin_it_.value_ptr() != nullptr) {
                         param_->begin_it_ = iterator(
                                 slot_ + (other.param_->begin_it_.value_ptr() - other.slot_), this);
                     }
-                    for (size_t k = 0; k < param_->bucket_num_; ++k) {
-                        auto &temp_bucket = param_->bucket_array_[k];
-                        for (size_t i = 0; i < temp_bucket.key_array.size(); ++i) {
-                            temp_bucket.key_array[i] = std::addressof(slot_[GetSlotPos(
-                                    *(other.param_->bucket_array_[k].key_array[i]))].key);
-                        }
-                    }
                 }
             }
 
@@ -1566,6 +1622,7 @@ namespace fph {
                     seed2_(std::exchange(other.seed2_, 0x832748923732847ULL)),
                     bucket_p_array_(std::exchange(other.bucket_p_array_, nullptr)),
                     slot_(std::exchange(other.slot_, nullptr)),
+                    slot_seed0_hash_(std::exchange(other.slot_seed0_hash_, nullptr)),
                     param_(std::exchange(other.param_, nullptr))
 
             {
@@ -1580,6 +1637,7 @@ namespace fph {
 //                    item_num_mask_(std::exchange(other.item_num_mask_, 0)),
                     slot_index_policy_(std::move(other.slot_index_policy_)),
                     slot_(std::exchange(other.slot_, nullptr)),
+                    slot_seed0_hash_(std::exchange(other.slot_seed0_hash_, nullptr)),
                     param_(std::exchange(other.param_, nullptr)),
 
 #if FPH_DY_DUAL_BUCKET_SET
@@ -1672,40 +1730,37 @@ namespace fph {
                 }
                 new_item_ceil_num = std::min(new_item_ceil_num, MAX_ITEM_NUM_CEIL_LIMIT);
                 new_item_ceil_num = std::max(new_item_ceil_num, DEFAULT_INIT_ITEM_NUM_CEIL);
-                if (new_item_ceil_num != param_->item_num_ceil_) {
-                    slot_index_policy_.UpdateBySlotNum(new_item_ceil_num);
-//                    item_num_mask_ = new_item_ceil_num - 1;
-                    param_->temp_pair_buf_.resize(param_->item_num_ * sizeof(value_type));
-                    value_type *temp_value_buf_start = reinterpret_cast<value_type*>(param_->temp_pair_buf_.data());
-                    value_type *temp_value_buf = temp_value_buf_start;
-                    for (auto it = begin(); it != end(); ++it) {
-                        std::allocator_traits<Allocator>::construct(param_->alloc_,
-                                                                    temp_value_buf++, std::move(*it));
-                    }
+                // the same capacity is rebuilt to merge the stash
+                if (new_item_ceil_num != param_->item_num_ceil_ || param_->stash_num_ != 0
+                    || param_->frozen_) {
+                    RebuildImp(new_item_ceil_num);
+                }
+            }
 
-                    Build<true, true, true>(temp_value_buf_start, temp_value_buf_start + param_->item_num_, seed1_,
-#if FPH_DEBUG_FLAG
-                            true,
-#else
-                                      false,
-#endif
-                                      param_->bits_per_key_,
-#if FPH_DY_DUAL_BUCKET_SET
-                            keys_first_part_ratio_, buckets_first_part_ratio_
-#else
-                                      DEFAULT_KEYS_FIRST_PART_RATIO, DEFAULT_BUCKETS_FIRST_PART_RATIO
-#endif
-                    );
-                    for (auto *temp_buf_ptr = temp_value_buf_start; temp_buf_ptr != temp_value_buf_start + param_->item_num_; temp_buf_ptr++) {
-                        std::allocator_traits<Allocator>::destroy(param_->alloc_, temp_buf_ptr);
+        protected:
+            // Rebuild the table with new_item_ceil_num slots from the elements in it, even if the
+            // capacity does not change
+            void RebuildImp(size_type new_item_ceil_num) {
+                slot_index_policy_.UpdateBySlotNum(new_item_ceil_num);
+//                item_num_mask_ = new_item_ceil_num - 1;
+                param_->temp_pair_buf_.resize(param_->item_num_ * sizeof(value_type));
+                value_type *temp_value_buf_start = reinterpret_cast<value_type*>(param_->temp_pair_buf_.data());
+                value_type *temp_value_buf = temp_value_buf_start;
+                for (auto it = begin(); it != end(); ++it) {
+                    if constexpr (Policy::TRACK_SLOT_RELOCATION) {
+                        param_->slot_relocation_log_.emplace_back(size_t(it.value_ptr() - slot_), NO_SLOT_POS);
                     }
-                    param_->temp_pair_buf_.clear();
-                    param_->temp_pair_buf_.shrink_to_fit();
+                    if (slot_seed0_hash_ != nullptr) {
+                        param_->temp_seed0_hash_buf_.push_back(StoredSeed0Hash(it.value_ptr()));
+                    }
+                    std::allocator_traits<Allocator>::construct(param_->alloc_,
+                                                                temp_value_buf++, std::move(*it));
                 }
 
-
+                BuildFromTempBuf(temp_value_buf_start, param_->item_num_);
             }
 
+        public:
             void reserve(size_type count) {
                 rehash(std::ceil(count / param_->max_load_factor_));
             }
@@ -1725,6 +1780,206 @@ namespace fph {
                 return MAX_LOAD_FACTOR_UPPER_LIMIT;
             }
 
+            /**
+             * Run the parallel parts of the following builds and rehashes of this table on
+             * thread_num threads. The table built does not depend on the number of threads
+             * @param thread_num 0 or 1 to build on the calling thread only
+             */
+            void set_build_thread_num(size_t thread_num) {
+                set_build_executor(thread_num > 1 ? MakeThreadBuildExecutor(thread_num) : BuildExecutor{},
+                                   thread_num);
+            }
+
+            /**
+             * Run the parallel parts of the following builds and rehashes of this table with executor.
+             * The construction of the values and keys only runs in parallel if it does not throw,
+             * and the allocator must be usable from several threads at the same time
+             * @param executor see fph::BuildExecutor, the builds are serial if it is empty
+             * @param concurrency the number of tasks the executor can run at the same time
+             */
+            void set_build_executor(BuildExecutor executor, size_t concurrency) {
+                param_->build_concurrency_ = executor && concurrency > 1 ? concurrency : 1;
+                param_->build_executor_ = std::move(executor);
+            }
+
+            /**
+             * Store the seed0 hash of the key in every slot, which takes sizeof(size_t) more bytes
+             * per slot. Then the rehashes and the rebuilds caused by insert keep seed0 and reuse the
+             * stored hashes instead of calling the hash function, unless no build is found with that
+             * seed0. The lookups also compare the stored hash before comparing the keys. Useful
+             * when the keys are expensive to hash or compare, e.g. long strings
+             * @param store_hash
+             */
+            void set_store_hash(bool store_hash) {
+                if (store_hash == (slot_seed0_hash_ != nullptr) || slot_ == nullptr) {
+                    return;
+                }
+                if (store_hash) {
+                    slot_seed0_hash_ = SizeTAllocator{}.allocate(param_->slot_capacity_);
+                    for (size_t i = 0; i < param_->item_num_ceil_; ++i) {
+                        if (param_->slot_occupancy_.IsOccupied(i)) {
+                            slot_seed0_hash_[i] = hash_(slot_[i].key, seed0_);
+                        }
+                    }
+                }
+                else {
+                    SizeTAllocator{}.deallocate(slot_seed0_hash_, param_->slot_capacity_);
+                    slot_seed0_hash_ = nullptr;
+                }
+            }
+
+            bool store_hash() const noexcept {
+                return slot_seed0_hash_ != nullptr;
+            }
+
+            /**
+             * @return the numbers of the inserts of new keys that found their slots free, moved
+             * their buckets, moved a few other buckets or rebuilt the table, since the table was
+             * constructed or reset_insert_path_stats() was called
+             */
+            InsertPathStats insert_path_stats() const noexcept {
+                return param_->insert_path_stats_;
+            }
+
+            void reset_insert_path_stats() noexcept {
+                param_->insert_path_stats_ = InsertPathStats{};
+            }
+
+            /**
+             * Let an insert whose bucket cannot be re-placed put the new key in a small stash
+             * instead of rebuilding the whole table, while the stash holds no more than
+             * ratio * size() keys. The stash is merged into the slots by the next rehash. A
+             * lookup only searches the stash after missing the slot of the key, so the lookups of
+             * the keys in the slots are as fast as before. While the stash is not empty,
+             * GetPointerNoCheck() compares the key in the slot to know whether to search the stash.
+             * Erasing a key in the stash moves the last key of the stash in its place.
+             * @param ratio in [0, 1), 0 means the table has no stash, which is the default
+             */
+            void max_stash_ratio(float ratio) {
+                if (ratio >= 0.0 && ratio < 1.0) {
+                    param_->max_stash_ratio_ = ratio;
+                }
+            }
+
+            float max_stash_ratio() const {
+                return param_->max_stash_ratio_;
+            }
+
+            /**
+             * Release the state that is only needed to insert and erase: the buckets and their
+             * entries, the tables of the free slots, the tables testing seed2 and the temporary
+             * buffers. The frozen table can still be looked up, iterated and copied. An insert,
+             * erase or clear of a frozen table calls Thaw() first.
+             * @return the number of bytes released
+             */
+            size_t Freeze() {
+                if (param_ == nullptr || param_->frozen_) {
+                    return 0;
+                }
+                size_t released_bytes = ReleaseVector(param_->seed2_test_table_)
+                        + ReleaseVector(param_->tested_hash_vec_)
+                        + ReleaseVector(param_->random_table_)
+                        + ReleaseVector(param_->map_table_)
+                        + ReleaseVector(param_->bucket_array_)
+                        + ReleaseVector(param_->bucket_entry_array_)
+                        + ReleaseVector(param_->temp_byte_buf_vec_)
+                        + ReleaseVector(param_->temp_pair_buf_)
+                        + ReleaseVector(param_->temp_seed0_hash_buf_);
+                param_->bucket_entry_garbage_num_ = 0;
+                param_->frozen_ = true;
+                return released_bytes;
+            }
+
+            /**
+             * Rebuild the state released by Freeze() with a rehash to the same bucket count, which
+             * invalidates the iterators. Does nothing if the table is not frozen.
+             */
+            void Thaw() {
+                if (param_ != nullptr && param_->frozen_) {
+                    rehash(param_->item_num_ceil_);
+                }
+            }
+
+            bool is_frozen() const noexcept {
+                return param_ != nullptr && param_->frozen_;
+            }
+
+            /**
+             * @return the bytes allocated by the table, split into the hot part read by the lookups
+             * and the cold part used to modify and rebuild the table, see fph::TableMemoryUsage
+             */
+            TableMemoryUsage MemoryUsage() const {
+                TableMemoryUsage usage;
+                usage.object_bytes = sizeof(*this);
+                if (param_ == nullptr) {
+                    return usage;
+                }
+                const auto &param = *param_;
+                usage.element_num = param.item_num_;
+                usage.slot_num = param.item_num_ceil_;
+                usage.slot_capacity = param.slot_capacity_;
+                usage.bucket_num = param.bucket_num_;
+                usage.bucket_capacity = param.bucket_capacity_;
+                auto add_vector = [&usage](size_t &bytes, const auto &vec) {
+                    using Vector = std::decay_t<decltype(vec)>;
+                    bytes += VectorBytes<Vector>(vec.capacity());
+                    usage.unused_bytes += VectorBytes<Vector>(vec.capacity() - vec.size());
+                };
+
+                // the elements in the stash are not in the slots
+                const size_t empty_slot_num = param.slot_capacity_ - (param.item_num_ - param.stash_num_);
+                if (slot_ != nullptr) {
+                    usage.slot_bytes = param.slot_capacity_ * sizeof(slot_type);
+                    usage.unused_bytes += empty_slot_num * sizeof(slot_type);
+                }
+                if (bucket_p_array_ != nullptr) {
+                    usage.bucket_param_bytes = param.bucket_capacity_ * sizeof(BucketParamType);
+                    usage.unused_bytes += (param.bucket_capacity_ - param.bucket_num_) * sizeof(BucketParamType);
+                }
+                if (slot_seed0_hash_ != nullptr) {
+                    usage.stored_hash_bytes = param.slot_capacity_ * sizeof(size_t);
+                    usage.unused_bytes += empty_slot_num * sizeof(size_t);
+                }
+                usage.stash_bytes = param.stash_capacity_ * sizeof(slot_type);
+                usage.unused_bytes += (param.stash_capacity_ - param.stash_num_) * sizeof(slot_type);
+                add_vector(usage.stash_bytes, param.stash_seed0_hash_);
+
+                add_vector(usage.bucket_bytes, param.bucket_array_);
+                add_vector(usage.bucket_bytes, param.bucket_entry_array_);
+                usage.unused_bytes += param.bucket_entry_garbage_num_ * sizeof(BucketParamType);
+                add_vector(usage.free_slot_bytes, param.random_table_);
+                add_vector(usage.free_slot_bytes, param.map_table_);
+                if constexpr (EMPTY_SLOTS_UNCONSTRUCTED) {
+                    // the lookups read the occupancy bits to tell the empty slots
+                    usage.meta_data_bytes += param.slot_occupancy_.capacity_bytes();
+                }
+                else {
+                    usage.free_slot_bytes += param.slot_occupancy_.capacity_bytes();
+                }
+                add_vector(usage.seed_test_bytes, param.seed2_test_table_);
+                add_vector(usage.seed_test_bytes, param.tested_hash_vec_);
+                add_vector(usage.temp_buffer_bytes, param.temp_byte_buf_vec_);
+                add_vector(usage.temp_buffer_bytes, param.temp_pair_buf_);
+                add_vector(usage.temp_buffer_bytes, param.temp_seed0_hash_buf_);
+                add_vector(usage.temp_buffer_bytes, param.slot_relocation_log_);
+                usage.object_bytes += sizeof(FphTableParam);
+                if (param.key_gen_ != nullptr) {
+                    usage.object_bytes += sizeof(RandomKeyGenerator);
+                }
+                if (param.default_fill_key_ != nullptr) {
+                    usage.object_bytes += 2U * sizeof(key_type);
+                }
+                return usage;
+            }
+
+            // the number of keys in the stash
+            size_type stash_size() const noexcept {
+                if FPH_UNLIKELY(param_ == nullptr) {
+                    return 0;
+                }
+                return param_->stash_num_;
+            }
+
             float load_factor() const {
                 return static_cast<double>(param_->item_num_) / param_->item_num_ceil_;
             }
@@ -1772,6 +2027,59 @@ namespace fph {
                 }
             }
 
+            /**
+             * Insert the values in [first, last) whose keys are not in the table with a single
+             * rebuild of the table. If a key is repeated in [first, last), only its first value is
+             * inserted. The elements of the table and the new values are moved to one buffer and
+             * built once, instead of triggering a rebuild or a rehash for every few inserts.
+             */
+            template<class InputIt>
+            void InsertBulk(InputIt first, InputIt last) {
+                const key_type *no_erase_key = nullptr;
+                BulkUpdateImp(first, last, no_erase_key, no_erase_key);
+            }
+
+            /**
+             * Erase the keys in [erase_first, erase_last), then insert the values in
+             * [insert_first, insert_last) like InsertBulk(), with a single rebuild of the table.
+             * To replace the value of a key, erase the key and insert it again.
+             */
+            template<class InsertIt, class EraseIt>
+            void ApplyDelta(InsertIt insert_first, InsertIt insert_last, EraseIt erase_first, EraseIt erase_last) {
+                BulkUpdateImp(insert_first, insert_last, erase_first, erase_last);
+            }
+
+            /**
+             * Move the elements of source whose keys are not in this table to this table with a
+             * single rebuild. Like std::unordered_map::merge(), the other elements are left in source.
+             */
+            void merge(DynamicRawSet &source) {
+                if (&source == this || source.empty()) {
+                    return;
+                }
+                // the keys left in the slots of source are moved from and can not be erased by
+                // key, so the elements kept in source are moved out too and source is rebuilt
+                std::vector<value_type> moved_values, left_values;
+                moved_values.reserve(source.size());
+                for (auto it = source.begin(); it != source.end(); ++it) {
+                    if (contains(KeyOfValue(*it))) {
+                        left_values.push_back(std::move(*it));
+                    }
+                    else {
+                        moved_values.push_back(std::move(*it));
+                    }
+                }
+                source.clear();
+                if (!left_values.empty()) {
+                    source.InsertNoDuplicated(left_values.begin(), left_values.end());
+                }
+                InsertBulk(std::make_move_iterator(moved_values.begin()), std::make_move_iterator(moved_values.end()));
+            }
+
+            void merge(DynamicRawSet &&source) {
+                merge(source);
+            }
+
             void insert(std::initializer_list<value_type> ilist) {
                 insert(ilist.begin(), ilist.end());
             }
@@ -1840,22 +2148,32 @@ namespace fph {
             template<class K = key_type>
             FPH_ALWAYS_INLINE iterator find(const key_arg<K>&
                             FPH_RESTRICT key) FPH_FUNC_RESTRICT noexcept {
-                auto slot_pos = GetSlotPos(key);
+                auto k_seed0_hash = hash_(key, seed0_);
+                auto slot_pos = GetSlotPosBySeed0Hash(k_seed0_hash);
                 slot_type *pair_address = slot_ + slot_pos;
-                if FPH_LIKELY(key_equal_(pair_address->key, key)) {
+                if FPH_LIKELY(StoredSeed0HashMayEqual(slot_pos, k_seed0_hash)
+                              && SlotHoldsKey<K>(slot_pos, key)) {
                     return iterator(pair_address, this);
                 }
+                if FPH_UNLIKELY(param_->stash_num_ != 0) {
+                    return iterator(FindInStash<K>(key, k_seed0_hash), this);
+                }
                 return end();
             }
 
             template<class K = key_type>
             FPH_ALWAYS_INLINE const_iterator find(const key_arg<K>&
                         FPH_RESTRICT key) const FPH_FUNC_RESTRICT noexcept {
-                auto slot_pos = GetSlotPos(key);
+                auto k_seed0_hash = hash_(key, seed0_);
+                auto slot_pos = GetSlotPosBySeed0Hash(k_seed0_hash);
                 slot_type *pair_address = slot_ + slot_pos;
-                if FPH_LIKELY(key_equal_(pair_address->key, key)) {
+                if FPH_LIKELY(StoredSeed0HashMayEqual(slot_pos, k_seed0_hash)
+                              && SlotHoldsKey<K>(slot_pos, key)) {
                     return const_iterator(pair_address, this);
                 }
+                if FPH_UNLIKELY(param_->stash_num_ != 0) {
+                    return const_iterator(FindInStash<K>(key, k_seed0_hash), this);
+                }
                 return end();
             }
 
@@ -1909,44 +2227,43 @@ namespace fph {
 
                 if (param_->default_fill_key_ != nullptr) {
                     DestroySlots();
-                    KeyAllocator key_alloc{};
                     for (size_t i = 0; i < param_->item_num_ceil_; ++i) {
-                        std::allocator_traits<KeyAllocator>::construct(key_alloc,
-                                                                       std::addressof(slot_[i].key), *param_->default_fill_key_);
+                        ConstructFillKey(slot_ + i, *param_->default_fill_key_);
                     }
                     if (param_->item_num_ceil_ > 0) {
                         auto default_key_slot_index = GetSlotPos(*param_->default_fill_key_);
-                        std::allocator_traits<KeyAllocator>::destroy(key_alloc,
-                                                                     std::addressof(slot_[default_key_slot_index].key));
-                        std::allocator_traits<KeyAllocator>::construct(key_alloc,
-                                                                       std::addressof(slot_[default_key_slot_index].key), *param_->second_default_key_);
+                        DestroyFillKey(slot_ + default_key_slot_index);
+                        ConstructFillKey(slot_ + default_key_slot_index, *param_->second_default_key_);
                         param_->default_fill_key_bucket_index_ = CompleteGetBucketIndex(*param_->default_fill_key_);
                         param_->default_fill_key_address_ = slot_ + default_key_slot_index;
                     }
                 }
                 param_->filled_count_ = 0;
+                param_->slot_occupancy_.Reset(param_->item_num_ceil_);
+                if FPH_UNLIKELY(param_->frozen_) {
+                    // the rebuild of an empty table only recreates the released state
+                    Thaw();
+                    return;
+                }
                 for (size_t i = 0; i < param_->bucket_num_; ++i ) {
-                    auto &temp_bucket = param_->bucket_array_[i];
-                    temp_bucket.key_array.clear();
-                    temp_bucket.entry_cnt = 0;
+                    param_->bucket_array_[i].entry_cnt = 0;
                 }
             }
 
             template<class K = key_type>
             size_t count(const key_arg<K> &key) const {
-                auto pos = GetSlotPos(key);
-                if (key_equal_(slot_[pos].key, key)) {
-                    return 1U;
-                }
-                return 0U;
+                return contains(key) ? 1U : 0U;
             }
 
             template<class K = key_type>
             bool contains(const key_arg<K>& key ) const {
                 auto pos = GetSlotPos(key);
-                if (key_equal_(slot_[pos].key, key)) {
+                if (SlotHoldsKey<K>(pos, key)) {
                     return true;
                 }
+                if FPH_UNLIKELY(param_->stash_num_ != 0) {
+                    return FindInStash<K>(key, hash_(key, seed0_)) != nullptr;
+                }
                 return false;
             }
 
@@ -2006,7 +2323,8 @@ namespace fph {
             /**
              * Get the pointer of the value without checking whether the two keys are equal.
              * Only use this function when you are sure that the key is in the table and you don't
-             * want to waste cpu cycles in comparing the keys.
+             * want to waste cpu cycles in comparing the keys. The keys are only compared while the
+             * stash is not empty, to find the keys in the stash, see max_stash_ratio().
              * @param key
              * @return
              */
@@ -2014,7 +2332,11 @@ namespace fph {
             FPH_ALWAYS_INLINE pointer GetPointerNoCheck(const key_arg<K>&
                     FPH_RESTRICT key)
             FPH_FUNC_RESTRICT noexcept {
-                size_t pos = GetSlotPos(key);
+                auto k_seed0_hash = hash_(key, seed0_);
+                size_t pos = GetSlotPosBySeed0Hash(k_seed0_hash);
+                if FPH_UNLIKELY(param_->stash_num_ != 0 && !SlotHoldsKey<K>(pos, key)) {
+                    return std::addressof(FindInStash<K>(key, k_seed0_hash)->value);
+                }
                 return std::addressof(slot_[pos].value);
             }
 
@@ -2022,10 +2344,65 @@ namespace fph {
             FPH_ALWAYS_INLINE const_pointer GetPointerNoCheck(const key_arg<K>&
                     FPH_RESTRICT key)
             const FPH_FUNC_RESTRICT noexcept {
-                size_t pos = GetSlotPos(key);
+                auto k_seed0_hash = hash_(key, seed0_);
+                size_t pos = GetSlotPosBySeed0Hash(k_seed0_hash);
+                if FPH_UNLIKELY(param_->stash_num_ != 0 && !SlotHoldsKey<K>(pos, key)) {
+                    return std::addressof(FindInStash<K>(key, k_seed0_hash)->value);
+                }
                 return std::addressof(slot_[pos].value);
             }
 
+            /**
+             * Look up n keys at once. The keys are processed in blocks: all the seed0 hashes of a
+             * block are computed and their bucket params are prefetched, then the slot positions
+             * are computed and the slots are prefetched, and only then are the keys compared. This
+             * keeps many cache misses in flight instead of stalling on each key in turn.
+             * @param keys pointer to the n keys to look up
+             * @param n number of keys
+             * @param out out[i] is set to the address of the value of keys[i], or nullptr if
+             * keys[i] is not in the table
+             */
+            template<class K = key_type>
+            void FindBatch(const key_arg<K>* FPH_RESTRICT keys, size_t n,
+                           pointer* FPH_RESTRICT out) FPH_FUNC_RESTRICT noexcept {
+                BatchLookupImp<K>(keys, n, [out](size_t i, slot_type *slot_address, bool found) {
+                    out[i] = found ? std::addressof(slot_address->value) : nullptr;
+                });
+            }
+
+            template<class K = key_type>
+            void FindBatch(const key_arg<K>* FPH_RESTRICT keys, size_t n,
+                           const_pointer* FPH_RESTRICT out) const FPH_FUNC_RESTRICT noexcept {
+                BatchLookupImp<K>(keys, n, [out](size_t i, slot_type *slot_address, bool found) {
+                    out[i] = found ? std::addressof(slot_address->value) : nullptr;
+                });
+            }
+
+            /**
+             * Check whether each of the n keys is in the table, in the same pipelined way as
+             * FindBatch.
+             * @param keys pointer to the n keys to look up
+             * @param n number of keys
+             * @param out_bitmap bitmap with at least (n + 63) / 64 words; bit (i % 64) of
+             * out_bitmap[i / 64] is set iff keys[i] is in the table. Unused high bits of the last
+             * word are cleared.
+             * @return the number of keys found in the table
+             */
+            template<class K = key_type>
+            size_t ContainsBatch(const key_arg<K>* FPH_RESTRICT keys, size_t n,
+                                 uint64_t* FPH_RESTRICT out_bitmap) const FPH_FUNC_RESTRICT noexcept {
+                size_t word_num = (n + 63U) / 64U;
+                for (size_t i = 0; i < word_num; ++i) {
+                    out_bitmap[i] = 0;
+                }
+                size_t found_cnt = 0;
+                BatchLookupImp<K>(keys, n, [out_bitmap, &found_cnt](size_t i, slot_type *, bool found) {
+                    out_bitmap[i / 64U] |= uint64_t(found) << (i % 64U);
+                    found_cnt += found;
+                });
+                return found_cnt;
+            }
+
 
             /**
              *
@@ -2068,6 +2445,89 @@ namespace fph {
                 return slot_pos;
             }
 
+            /*
+             * The following functions split a lookup into stages, so that the caller can do other
+             * work while the memory of each stage is being prefetched:
+             * GetSeed0Hash -> PrefetchBucketParamBySeed0Hash -> GetSlotPosBySeed0Hash
+             * -> PrefetchSlot -> GetPointerBySlotPos
+             * GetSlotPosBySeed0Hash reads the bucket param, so the slot can only be prefetched after
+             * the bucket param is loaded. Call it some work after PrefetchBucketParamBySeed0Hash, e.g.
+             * bucket params D keys ahead and slots D / 2 keys ahead in a loop over keys, or it waits
+             * for the memory just like find().
+             */
+
+            template<class K = key_type>
+            FPH_ALWAYS_INLINE size_t GetSeed0Hash(const key_arg<K> &key) const FPH_FUNC_RESTRICT noexcept {
+                return hash_(key, seed0_);
+            }
+
+            FPH_ALWAYS_INLINE void PrefetchBucketParamBySeed0Hash(size_t k_seed0_hash) const FPH_FUNC_RESTRICT noexcept {
+                FPH_PREFETCH(bucket_p_array_ + GetBucketIndex(k_seed0_hash), 0, 3);
+            }
+
+            FPH_ALWAYS_INLINE void PrefetchSlot(size_t slot_pos) const FPH_FUNC_RESTRICT noexcept {
+                FPH_PREFETCH(std::addressof(slot_[slot_pos].key), 0, 3);
+            }
+
+            /**
+             * Prefetch the memory needed to look up a key, so that a later find of the key will be
+             * faster. The bucket param is prefetched and then read to prefetch the slot, this read
+             * may wait for the memory if the bucket param is not in the cache. Use
+             * PrefetchBucketParamBySeed0Hash and PrefetchSlot for finer control of prefetch distance.
+             * @param key
+             */
+            template<class K = key_type>
+            FPH_ALWAYS_INLINE void Prefetch(const key_arg<K> &key) const FPH_FUNC_RESTRICT noexcept {
+                PrefetchBySeed0Hash(hash_(key, seed0_));
+            }
+
+            /**
+             * Same as Prefetch(key)
+             * @param k_seed0_hash the seed0 hash of key, get from GetSeed0Hash(key)
+             */
+            FPH_ALWAYS_INLINE void PrefetchBySeed0Hash(size_t k_seed0_hash) const FPH_FUNC_RESTRICT noexcept {
+                PrefetchBucketParamBySeed0Hash(k_seed0_hash);
+                PrefetchSlot(GetSlotPosBySeed0Hash(k_seed0_hash));
+            }
+
+            /**
+             * @param slot_pos the slot position of key
+             * @param k_seed0_hash the seed0 hash of key, only used to search the stash
+             * @param key
+             * @return the address of the value in the slot if the slot holds key, otherwise nullptr
+             */
+            template<class K = key_type>
+            FPH_ALWAYS_INLINE pointer GetPointerBySlotPos(size_t slot_pos, size_t k_seed0_hash,
+                    const key_arg<K> &key) FPH_FUNC_RESTRICT noexcept {
+                slot_type *pair_address = slot_ + slot_pos;
+                if (SlotHoldsKey<K>(slot_pos, key)) {
+                    return std::addressof(pair_address->value);
+                }
+                if FPH_UNLIKELY(param_->stash_num_ != 0) {
+                    pair_address = FindInStash<K>(key, k_seed0_hash);
+                    if (pair_address != nullptr) {
+                        return std::addressof(pair_address->value);
+                    }
+                }
+                return nullptr;
+            }
+
+            template<class K = key_type>
+            FPH_ALWAYS_INLINE const_pointer GetPointerBySlotPos(size_t slot_pos, size_t k_seed0_hash,
+                    const key_arg<K> &key) const FPH_FUNC_RESTRICT noexcept {
+                const slot_type *pair_address = slot_ + slot_pos;
+                if (SlotHoldsKey<K>(slot_pos, key)) {
+                    return std::addressof(pair_address->value);
+                }
+                if FPH_UNLIKELY(param_->stash_num_ != 0) {
+                    pair_address = FindInStash<K>(key, k_seed0_hash);
+                    if (pair_address != nullptr) {
+                        return std::addressof(pair_address->value);
+                    }
+                }
+                return nullptr;
+            }
+
             template<class K = key_type>
             FPH_ALWAYS_INLINE size_t GetSlotPos(const key_arg<K> &key, size_t offset, size_t optional_bit)
             const FPH_FUNC_RESTRICT noexcept {
@@ -2087,6 +2547,11 @@ namespace fph {
                     slot_ = nullptr;
                 }
 
+                if (slot_seed0_hash_ != nullptr) {
+                    SizeTAllocator{}.deallocate(slot_seed0_hash_, param_->slot_capacity_);
+                    slot_seed0_hash_ = nullptr;
+                }
+
                 if (bucket_p_array_ != nullptr) {
                     BucketParamAllocator{}.deallocate(bucket_p_array_, param_->bucket_capacity_);
                     bucket_p_array_ = nullptr;
@@ -2151,21 +2616,28 @@ namespace fph {
             using slot_type = typename Policy::slot_type;
             slot_type *slot_ = nullptr; // direct
 
+            // the seed0 hash of the key in every filled slot, nullptr if the table does not store
+            // the hashes, see set_store_hash()
+            size_t *slot_seed0_hash_ = nullptr; // direct
+
             using SlotAllocator = typename std::allocator_traits<Allocator>::template rebind_alloc<slot_type>;
             using KeyPointerAllocator = typename std::allocator_traits<Allocator>::template rebind_alloc<const key_type *>;
 
             using BoolAllocator = typename std::allocator_traits<Allocator>::template rebind_alloc<bool>;
             using SizeTAllocator = typename std::allocator_traits<Allocator>::template rebind_alloc<size_t>;
+            using OccupancyWordAllocator = typename std::allocator_traits<Allocator>::template rebind_alloc<uint64_t>;
             using KeyRNGAllocator = typename std::allocator_traits<Allocator>::template rebind_alloc<RandomKeyGenerator>;
             using KeyAllocator = typename std::allocator_traits<Allocator>::template rebind_alloc<key_type>;
             using CharAllocator = typename std::allocator_traits<Allocator>::template rebind_alloc<char>;
 
-            using BucketType = detail::FphBucket<key_type, KeyPointerAllocator,
-                                                BucketParamType>;
+            using BucketType = detail::FphBucket<BucketParamType>;
             using BucketAllocator = typename std::allocator_traits<Allocator>::template rebind_alloc<BucketType>;
 
             using SizeTVector = std::vector<size_t, SizeTAllocator>;
             using CharVector = std::vector<char, CharAllocator>;
+            using SlotRelocationAllocator = typename std::allocator_traits<Allocator>::template rebind_alloc<
+                    std::pair<size_t, size_t>>;
+            using SlotRelocationVector = std::vector<std::pair<size_t, size_t>, SlotRelocationAllocator>;
 
             // all the member variables that are used in non-look-up operations will be put in the
             // FphTableParam, so all the lookup operations will not use dereference of pointer
@@ -2200,9 +2672,23 @@ namespace fph {
                    tested_hash_vec_{},
                    random_table_{},
                    map_table_{},
+                   slot_occupancy_{},
                    bucket_array_{},
+                   bucket_entry_array_{},
+                   bucket_entry_garbage_num_(0),
                    temp_byte_buf_vec_{},
-                   temp_pair_buf_{}
+                   temp_pair_buf_{},
+                   temp_seed0_hash_buf_{},
+                   slot_relocation_log_{},
+                   build_executor_{},
+                   build_concurrency_(1),
+                   insert_path_stats_{},
+                   stash_slot_(nullptr),
+                   stash_num_(0),
+                   stash_capacity_(0),
+                   stash_seed0_hash_{},
+                   max_stash_ratio_(0),
+                   frozen_(false)
                 {
                     KeyRNGAllocator key_gen_alloc;
                     key_gen_ = key_gen_alloc.allocate(1);
@@ -2233,9 +2719,23 @@ namespace fph {
                                                                                 tested_hash_vec_(o.tested_hash_vec_),
                                                                                 random_table_(o.random_table_),
                                                                                 map_table_(o.map_table_),
+                                                                                slot_occupancy_(o.slot_occupancy_),
                                                                                 bucket_array_(o.bucket_array_),
+                                                                                bucket_entry_array_(o.bucket_entry_array_),
+                                                                                bucket_entry_garbage_num_(o.bucket_entry_garbage_num_),
                                                                                 temp_byte_buf_vec_(o.temp_byte_buf_vec_),
-                                                                                temp_pair_buf_(o.temp_pair_buf_) {
+                                                                                temp_pair_buf_(o.temp_pair_buf_),
+                                                                                temp_seed0_hash_buf_{},
+                                                                                slot_relocation_log_{},
+                                                                                build_executor_(o.build_executor_),
+                                                                                build_concurrency_(o.build_concurrency_),
+                                                                                insert_path_stats_(o.insert_path_stats_),
+                                                                                stash_slot_(nullptr),
+                                                                                stash_num_(0),
+                                                                                stash_capacity_(0),
+                                                                                stash_seed0_hash_(o.stash_seed0_hash_),
+                                                                                max_stash_ratio_(o.max_stash_ratio_),
+                                                                                frozen_(o.frozen_) {
                     if (o.default_fill_key_ != nullptr) {
                         KeyAllocator key_alloc{};
                         default_fill_key_ = key_alloc.allocate(2);
@@ -2272,6 +2772,11 @@ namespace fph {
                         key_rng_alloc.deallocate(key_gen_, 1);
                         key_gen_ = nullptr;
                     }
+                    // the elements of the stash are destroyed with the slots
+                    if (stash_slot_ != nullptr) {
+                        SlotAllocator{}.deallocate(stash_slot_, stash_capacity_);
+                        stash_slot_ = nullptr;
+                    }
 
                 }
 
@@ -2319,13 +2824,47 @@ namespace fph {
 
                 BucketParamVector random_table_;
                 BucketParamVector map_table_;
+                // one bit per slot, set if the slot is filled, i.e. map_table_[pos] < filled_count_
+                occupancy_detail::SlotOccupancyBits<OccupancyWordAllocator> slot_occupancy_;
                 std::vector<BucketType, BucketAllocator> bucket_array_;
 //                BucketType *bucket_array_;
+                // the entries of all the buckets, see FphBucket
+                BucketParamVector bucket_entry_array_;
+                // the number of entries in bucket_entry_array_ left behind by the buckets that grew
+                size_t bucket_entry_garbage_num_;
                 // TODO: may use pointer to replace vector to save space
 
                 CharVector temp_byte_buf_vec_;
                 // buffer for rehash
                 CharVector temp_pair_buf_;
+                // the stored seed0 hashes of the elements in temp_pair_buf_, empty if the table
+                // does not store the hashes
+                SizeTVector temp_seed0_hash_buf_;
+
+                // (previous slot position, new slot position) of the elements moved by a rehash or
+                // an insert, only recorded if Policy::TRACK_SLOT_RELOCATION is true. The positions
+                // of a new key are NO_SLOT_POS
+                SlotRelocationVector slot_relocation_log_;
+
+                // runs the parallel parts of the builds, the builds are serial if it is empty
+                BuildExecutor build_executor_;
+                // the number of tasks build_executor_ can run at the same time
+                size_t build_concurrency_;
+
+                // how the inserts of new keys were done
+                InsertPathStats insert_path_stats_;
+
+                // the elements whose buckets could not be re-placed by an insert are kept in
+                // stash_slot_[0, stash_num_) until the next build, see max_stash_ratio()
+                slot_type *stash_slot_;
+                size_t stash_num_;
+                size_t stash_capacity_;
+                // the seed0 hashes of the keys in the stash
+                SizeTVector stash_seed0_hash_;
+                // the max ratio of stash_num_ to item_num_, 0 if the table has no stash
+                float max_stash_ratio_;
+                // whether the state only needed to insert and erase is released, see Freeze()
+                bool frozen_;
 
             }; // struct FphTableParam
             // can switch vector to pointer array to save more space
@@ -2360,16 +2899,73 @@ namespace fph {
             static_assert(BUCKET_PARAM_MASK + 1U == MAX_ITEM_NUM_CEIL_LIMIT);
             static_assert(DEFAULT_INIT_ITEM_NUM_CEIL <= MAX_ITEM_NUM_CEIL_LIMIT);
 
+            constexpr static size_t NO_SLOT_POS = std::numeric_limits<size_t>::max();
+
+            // the max number of other buckets moved to free an offset for the bucket of a new key
+            constexpr static size_t MAX_REPAIR_MOVED_BUCKET_NUM = 4;
+            // the number of offsets tried for the bucket of a new key before the table is rebuilt
+            constexpr static size_t MAX_REPAIR_TRY_NUM = 64;
+            // the number of free slots used as the anchors of the offsets tried for a moved bucket
+            constexpr static size_t REPAIR_SEARCH_ANCHOR_NUM = 256;
+
+            // number of keys whose memory accesses are overlapped in the batch lookup functions
+            constexpr static size_t BATCH_LOOKUP_BLOCK_SIZE = 16;
+
+            // the builds of fewer keys are always serial
+            constexpr static size_t PARALLEL_BUILD_MIN_KEY_NUM = size_t(1U) << 15U;
+            // number of chunks of the keys or buckets per concurrent task in a parallel build
+            constexpr static size_t PARALLEL_BUILD_CHUNKS_PER_TASK = 4;
+
             iterator ConstIteratorToIterator(const_iterator const_it) {
                 return iterator(const_it.value_ptr(), this);
             }
 
+            /**
+             * The pipeline shared by the batch lookup functions. For every key, visitor is called
+             * with (index of the key, address of the slot the key maps to, whether the key is in
+             * that slot), in the order of the keys.
+             */
+            template<class K, class Visitor>
+            FPH_ALWAYS_INLINE void BatchLookupImp(const key_arg<K>* FPH_RESTRICT keys, size_t n,
+                                                  Visitor &&visitor) const FPH_FUNC_RESTRICT noexcept {
+                size_t seed0_hash_buf[BATCH_LOOKUP_BLOCK_SIZE];
+                size_t slot_pos_buf[BATCH_LOOKUP_BLOCK_SIZE];
+                const bool search_stash = param_->stash_num_ != 0;
+                for (size_t block_begin = 0; block_begin < n; block_begin += BATCH_LOOKUP_BLOCK_SIZE) {
+                    const size_t block_size = std::min(BATCH_LOOKUP_BLOCK_SIZE, n - block_begin);
+                    const key_arg<K> *block_keys = keys + block_begin;
+                    for (size_t i = 0; i < block_size; ++i) {
+                        size_t k_seed0_hash = hash_(block_keys[i], seed0_);
+                        seed0_hash_buf[i] = k_seed0_hash;
+                        FPH_PREFETCH(bucket_p_array_ + GetBucketIndex(k_seed0_hash), 0, 3);
+                    }
+                    for (size_t i = 0; i < block_size; ++i) {
+                        size_t slot_pos = GetSlotPosBySeed0Hash(seed0_hash_buf[i]);
+                        slot_pos_buf[i] = slot_pos;
+                        FPH_PREFETCH(std::addressof(slot_[slot_pos].key), 0, 3);
+                    }
+                    for (size_t i = 0; i < block_size; ++i) {
+                        slot_type *slot_address = slot_ + slot_pos_buf[i];
+                        bool found = SlotHoldsKey<K>(slot_pos_buf[i], block_keys[i]);
+                        if FPH_UNLIKELY(!found && search_stash) {
+                            slot_type *stash_address = FindInStash<K>(block_keys[i], seed0_hash_buf[i]);
+                            if (stash_address != nullptr) {
+                                slot_address = stash_address;
+                                found = true;
+                            }
+                        }
+                        visitor(block_begin + i, slot_address, found);
+                    }
+                }
+            }
+
 
             void SwapImp(DynamicRawSet &o) noexcept {
                 using std::swap;
                 swap(slot_index_policy_, o.slot_index_policy_);
 //                swap(item_num_mask_, o.item_num_mask_);
                 swap(slot_, o.slot_);
+                swap(slot_seed0_hash_, o.slot_seed0_hash_);
                 swap(param_, o.param_);
 #if FPH_DY_DUAL_BUCKET_SET
                 swap(p1_, o.p1_); swap(p2_, o.p2_);
@@ -2422,6 +3018,9 @@ namespace fph {
 
 
             bool IsSlotEmpty(size_t pos) const FPH_FUNC_RESTRICT {
+                if constexpr (EMPTY_SLOTS_UNCONSTRUCTED) {
+                    return !param_->slot_occupancy_.IsOccupied(pos);
+                }
                 if FPH_LIKELY(slot_ + pos != param_->default_fill_key_address_) {
                     return key_equal_(slot_[pos].key, *param_->default_fill_key_);
                 } else {
@@ -2430,6 +3029,9 @@ namespace fph {
             }
 
             bool IsSlotEmpty(const slot_type* FPH_RESTRICT slot_ptr) const FPH_FUNC_RESTRICT {
+                if constexpr (EMPTY_SLOTS_UNCONSTRUCTED) {
+                    return !param_->slot_occupancy_.IsOccupied(size_t(slot_ptr - slot_));
+                }
                 if FPH_LIKELY(slot_ptr != param_->default_fill_key_address_) {
                     return key_equal_(slot_ptr->key, *param_->default_fill_key_);
                 } else {
@@ -2437,36 +3039,60 @@ namespace fph {
                 }
             }
 
+            // whether the slot at pos holds key, an empty slot never does
+            template<class K = key_type>
+            FPH_ALWAYS_INLINE bool SlotHoldsKey(size_t pos, const key_arg<K> &key) const FPH_FUNC_RESTRICT {
+                if constexpr (EMPTY_SLOTS_UNCONSTRUCTED) {
+                    if (!param_->slot_occupancy_.IsOccupied(pos)) {
+                        return false;
+                    }
+                }
+                return key_equal_(slot_[pos].key, key);
+            }
+
+            // If the stash is not empty, the elements are iterated in the cycle of the stash and
+            // then the filled slots from position 0. The empty slots are skipped with the occupancy
+            // bits instead of comparing their keys with the fill key.
             slot_type *GetNextSlotAddress(const slot_type* FPH_RESTRICT pair_ptr) const FPH_FUNC_RESTRICT {
-                const auto *slot_end = slot_ + param_->item_num_ceil_;
-                for (size_t slot_dis = 1; slot_dis < param_->item_num_ceil_; ++slot_dis) {
-                    // TODO: test whether using branch-less will be faster
-//                    pair_ptr = slot_ + (++pair_ptr - slot_) & item_num_ceil_;
-                    if FPH_UNLIKELY(++pair_ptr >= slot_end) {
-                        pair_ptr = slot_;
+                if FPH_UNLIKELY(IsStashSlot(pair_ptr)) {
+                    if (pair_ptr + 1 < param_->stash_slot_ + param_->stash_num_) {
+                        return const_cast<slot_type*>(pair_ptr + 1);
+                    }
+                    return GetSlotAddressAfterStash();
+                }
+                assert(param_->slot_occupancy_.slot_num() == param_->item_num_ceil_);
+                const size_t now_pos = pair_ptr - slot_;
+                size_t next_pos = param_->slot_occupancy_.FindOccupied(now_pos + 1U);
+                if FPH_UNLIKELY(next_pos >= param_->item_num_ceil_) {
+                    if FPH_UNLIKELY(param_->stash_num_ != 0) {
+                        return param_->stash_slot_;
                     }
-                    if (!IsSlotEmpty(pair_ptr)) {
-                        return const_cast<slot_type*>(pair_ptr);
+                    next_pos = param_->slot_occupancy_.FindOccupied(0);
+                    if (next_pos >= now_pos) {
+                        return nullptr;
                     }
                 }
-                return nullptr;
+                return slot_ + next_pos;
             }
 
-            size_t GetNextSlotPos(size_t now_pos) const FPH_FUNC_RESTRICT {
+            // the first filled slot from position 0, or the stash if all the slots are empty
+            slot_type *GetSlotAddressAfterStash() const FPH_FUNC_RESTRICT {
+                size_t first_pos = param_->slot_occupancy_.FindOccupied(0);
+                if (first_pos < param_->item_num_ceil_) {
+                    return slot_ + first_pos;
+                }
+                return param_->stash_num_ != 0 ? param_->stash_slot_ : nullptr;
+            }
 
-                size_t new_pos = now_pos;
-                for (size_t slot_dis = 1; slot_dis < param_->item_num_ceil_; ++slot_dis) {
-//                    new_pos = (++new_pos) & item_num_mask_;
-                    ++new_pos;
-                    if FPH_UNLIKELY(new_pos >= param_->item_num_ceil_) {
-                        new_pos = 0;
-                    }
-                    if (!IsSlotEmpty(new_pos)) {
-                        return new_pos;
+            size_t GetNextSlotPos(size_t now_pos) const FPH_FUNC_RESTRICT {
+                size_t next_pos = param_->slot_occupancy_.FindOccupied(now_pos + 1U);
+                if (next_pos >= param_->item_num_ceil_) {
+                    next_pos = param_->slot_occupancy_.FindOccupied(0);
+                    if (next_pos >= now_pos) {
+                        return std::numeric_limits<size_t>::max();
                     }
                 }
-                return std::numeric_limits<size_t>::max();
-
+                return next_pos;
             }
 
             FPH_ALWAYS_INLINE static size_t MixSeedAndBit(size_t seed, uint32_t optional_bit) {
@@ -2486,37 +3112,227 @@ namespace fph {
                 return MixValue(hash_k_seed0, seed);
             }
 
-#if FPH_ENABLE_ITERATOR
+            // the seed0 hash of the key in a filled slot, read from the stored hashes if there are
+            FPH_ALWAYS_INLINE size_t SlotSeed0Hash(size_t slot_pos) const FPH_FUNC_RESTRICT noexcept {
+                if (slot_seed0_hash_ != nullptr) {
+                    return slot_seed0_hash_[slot_pos];
+                }
+                return hash_(slot_[slot_pos].key, seed0_);
+            }
 
-            // change begin()
-            void AddNewIterator(slot_type *address) {
-                param_->begin_it_ = iterator(address, this);
+            // record the seed0 hash of the key put in a slot if the table stores the hashes
+            FPH_ALWAYS_INLINE void StoreSeed0Hash(size_t slot_pos, size_t k_seed0_hash) FPH_FUNC_RESTRICT noexcept {
+                if (slot_seed0_hash_ != nullptr) {
+                    slot_seed0_hash_[slot_pos] = k_seed0_hash;
+                }
             }
 
-#endif
+            // false if the table stores the hashes and the key in the slot has another seed0 hash,
+            // the stored hashes of the empty slots are arbitrary
+            FPH_ALWAYS_INLINE bool StoredSeed0HashMayEqual(size_t slot_pos, size_t k_seed0_hash)
+            const FPH_FUNC_RESTRICT noexcept {
+                return slot_seed0_hash_ == nullptr || slot_seed0_hash_[slot_pos] == k_seed0_hash;
+            }
 
+            // the stored seed0 hash of an element in the slots or in the stash
+            size_t StoredSeed0Hash(const slot_type *slot_ptr) const {
+                if FPH_UNLIKELY(IsStashSlot(slot_ptr)) {
+                    return param_->stash_seed0_hash_[slot_ptr - param_->stash_slot_];
+                }
+                assert(slot_seed0_hash_ != nullptr);
+                return slot_seed0_hash_[slot_ptr - slot_];
+            }
 
-            /**
-             * Test whether there is collision in this bucket
-             * @tparam Bucket
-             * @tparam SeedTestTable make sure this is all zero, this will still be all zero after call
-             * @tparam TestedHashVec make sure this is empty, this will still be empty after call
+            FPH_ALWAYS_INLINE bool IsStashSlot(const slot_type *slot_ptr) const noexcept {
+                return param_->stash_num_ != 0 && slot_ptr >= param_->stash_slot_
+                       && slot_ptr < param_->stash_slot_ + param_->stash_num_;
+            }
+
+            // the element of the stash with the key, nullptr if the key is not in the stash
+            template<class K = key_type>
+            slot_type *FindInStash(const key_arg<K> &key, size_t k_seed0_hash) const noexcept {
+                const size_t *stash_seed0_hash = param_->stash_seed0_hash_.data();
+                for (size_t i = 0; i < param_->stash_num_; ++i) {
+                    if (stash_seed0_hash[i] == k_seed0_hash && key_equal_(param_->stash_slot_[i].key, key)) {
+                        return param_->stash_slot_ + i;
+                    }
+                }
+                return nullptr;
+            }
+
+            // whether an insert that cannot re-place its bucket can put the new key in the stash
+            bool CanStashNewKey() const noexcept {
+                return !Policy::TRACK_SLOT_RELOCATION &&
+                       param_->stash_num_ + 1U <= param_->max_stash_ratio_ * (param_->item_num_ + 1U);
+            }
+
+            /**
+             * Append a slot to the stash for a new key, the stash grows like a vector
+             * @param k_seed0_hash
+             * @return the slot, which holds a fill key like an empty slot
+             */
+            slot_type *AllocStashSlot(size_t k_seed0_hash) {
+                if (param_->stash_num_ == param_->stash_capacity_) {
+                    size_t new_capacity = std::max(size_t(4U), param_->stash_capacity_ * 2U);
+                    slot_type *new_stash_slot = SlotAllocator{}.allocate(new_capacity);
+                    for (size_t i = 0; i < param_->stash_num_; ++i) {
+                        std::allocator_traits<Allocator>::construct(param_->alloc_,
+                                std::addressof(new_stash_slot[i].mutable_value),
+                                std::move(param_->stash_slot_[i].mutable_value));
+                        std::allocator_traits<Allocator>::destroy(param_->alloc_,
+                                std::addressof(param_->stash_slot_[i].mutable_value));
+                    }
+                    if (param_->stash_slot_ != nullptr) {
+                        SlotAllocator{}.deallocate(param_->stash_slot_, param_->stash_capacity_);
+                    }
+                    param_->stash_slot_ = new_stash_slot;
+                    param_->stash_capacity_ = new_capacity;
+                }
+                slot_type *stash_address = param_->stash_slot_ + param_->stash_num_;
+                ConstructFillKey(stash_address, *param_->default_fill_key_);
+                param_->stash_seed0_hash_.push_back(k_seed0_hash);
+                ++param_->stash_num_;
+                return stash_address;
+            }
+
+            // destroy the elements of the stash, the memory of the stash is kept
+            void DestroyStash() {
+                for (size_t i = 0; i < param_->stash_num_; ++i) {
+                    std::allocator_traits<Allocator>::destroy(param_->alloc_,
+                            std::addressof(param_->stash_slot_[i].mutable_value));
+                }
+                param_->stash_num_ = 0;
+                param_->stash_seed0_hash_.clear();
+            }
+
+#if FPH_ENABLE_ITERATOR
+
+            // change begin(), which is the first element of the stash if the stash is not empty
+            void AddNewIterator(slot_type *address) {
+                param_->begin_it_ = iterator(param_->stash_num_ != 0 ? param_->stash_slot_ : address, this);
+            }
+
+#endif
+
+
+            // the first entry of the bucket in the entry array
+            FPH_ALWAYS_INLINE BucketParamType* BucketEntryBegin(const BucketType &bucket) {
+                return param_->bucket_entry_array_.data() + bucket.entry_begin;
+            }
+
+            FPH_ALWAYS_INLINE const BucketParamType* BucketEntryBegin(const BucketType &bucket) const {
+                return param_->bucket_entry_array_.data() + bucket.entry_begin;
+            }
+
+            /**
+             * Set the buckets and their entries from the bucket index of every input key, the
+             * entries are the indices of the input keys and are in the input order in every bucket
+             * @param key_bucket_index_vec the bucket index of every input key
+             * @return the max number of keys in a bucket
+             */
+            size_t AssignBucketEntries(const BucketParamVector &key_bucket_index_vec) {
+                auto &bucket_array = param_->bucket_array_;
+                bucket_array.assign(param_->bucket_num_, BucketType{});
+                for (auto bucket_index: key_bucket_index_vec) {
+                    ++bucket_array[bucket_index].entry_capacity;
+                }
+                size_t max_bucket_size = 0, entry_begin = 0;
+                for (auto &bucket: bucket_array) {
+                    bucket.entry_begin = entry_begin;
+                    entry_begin += bucket.entry_capacity;
+                    max_bucket_size = std::max(max_bucket_size, size_t(bucket.entry_capacity));
+                }
+                param_->bucket_entry_array_.resize(key_bucket_index_vec.size());
+                param_->bucket_entry_garbage_num_ = 0;
+                for (size_t i = 0; i < key_bucket_index_vec.size(); ++i) {
+                    auto &bucket = bucket_array[key_bucket_index_vec[i]];
+                    param_->bucket_entry_array_[bucket.entry_begin + bucket.entry_cnt++] = i;
+                }
+                return max_bucket_size;
+            }
+
+            /**
+             * Append the slot position of a new key to the entries of the bucket. A full bucket
+             * is moved to the end of the entry array with twice the capacity, and the entry array
+             * is compacted when more than half of it is left behind by the moved buckets
+             * @param bucket_index
+             * @param slot_pos
+             */
+            void AddBucketEntry(size_t bucket_index, size_t slot_pos) {
+                auto &entry_array = param_->bucket_entry_array_;
+                if FPH_UNLIKELY(param_->bucket_array_[bucket_index].entry_cnt
+                                == param_->bucket_array_[bucket_index].entry_capacity) {
+                    if (param_->bucket_entry_garbage_num_ > entry_array.size() / 2U) {
+                        CompactBucketEntries();
+                    }
+                    auto &bucket = param_->bucket_array_[bucket_index];
+                    size_t new_capacity = std::min(std::max(size_t(2U), size_t(bucket.entry_capacity) * 2U),
+                                                   size_t(std::numeric_limits<BucketParamType>::max()));
+                    size_t new_entry_begin = entry_array.size();
+                    entry_array.resize(new_entry_begin + new_capacity);
+                    std::copy_n(entry_array.begin() + bucket.entry_begin, bucket.entry_cnt,
+                                entry_array.begin() + new_entry_begin);
+                    param_->bucket_entry_garbage_num_ += bucket.entry_capacity;
+                    bucket.entry_begin = new_entry_begin;
+                    bucket.entry_capacity = new_capacity;
+                }
+                auto &bucket = param_->bucket_array_[bucket_index];
+                entry_array[bucket.entry_begin + bucket.entry_cnt] = slot_pos;
+                ++bucket.entry_cnt;
+            }
+
+            // Remove the slot position of a key from the entries of the bucket, keeping the order
+            // of the others
+            void EraseBucketEntry(size_t bucket_index, size_t slot_pos) {
+                auto &bucket = param_->bucket_array_[bucket_index];
+                auto *entry_begin = BucketEntryBegin(bucket);
+                auto *entry_end = entry_begin + bucket.entry_cnt;
+                auto *entry_ptr = std::find(entry_begin, entry_end, static_cast<BucketParamType>(slot_pos));
+                assert(entry_ptr != entry_end);
+                std::copy(entry_ptr + 1, entry_end, entry_ptr);
+                --bucket.entry_cnt;
+            }
+
+            // Pack the entries of the buckets without gaps
+            void CompactBucketEntries() {
+                BucketParamVector new_entry_array;
+                new_entry_array.reserve(param_->item_num_);
+                for (auto &bucket: param_->bucket_array_) {
+                    const auto *entry_begin = BucketEntryBegin(bucket);
+                    size_t new_entry_begin = new_entry_array.size();
+                    new_entry_array.insert(new_entry_array.end(), entry_begin, entry_begin + bucket.entry_cnt);
+                    bucket.entry_begin = new_entry_begin;
+                    bucket.entry_capacity = bucket.entry_cnt;
+                }
+                param_->bucket_entry_array_.swap(new_entry_array);
+                param_->bucket_entry_garbage_num_ = 0;
+            }
+
+            /**
+             * Test whether there is collision in this bucket
+             * @tparam Seed0HashOfEntry
+             * @tparam SeedTestTable make sure this is all zero, this will still be all zero after call
+             * @tparam TestedHashVec make sure this is empty, this will still be empty after call
              * @param testing_bucket
+             * @param seed0_hash_of_entry returns the seed0 hash of the key of an entry of the bucket
              * @param seed2_test_table
              * @param tested_hash_vec
              * @param seed
              * @return true if pass the test
              */
-            template<class Bucket, class SeedTestTable, class TestedHashVec>
+            template<class Seed0HashOfEntry, class SeedTestTable, class TestedHashVec>
             bool
-            TestBucketSelfCollision(const Bucket &testing_bucket, SeedTestTable &seed2_test_table,
-                                    TestedHashVec &tested_hash_vec, size_t seed) {
+            TestBucketSelfCollision(const BucketType &testing_bucket, const Seed0HashOfEntry &seed0_hash_of_entry,
+                                    SeedTestTable &seed2_test_table, TestedHashVec &tested_hash_vec,
+                                    size_t seed) {
                 bool test_pass_flag = true;
                 assert(tested_hash_vec.empty());
-                for (const key_type *key_ptr: testing_bucket.key_array) {
+                const auto *entry_begin = BucketEntryBegin(testing_bucket);
+                for (size_t i = 0; i < testing_bucket.entry_cnt; ++i) {
                     // TODO: test whether test optional bit will accelerate the construction
 //                    auto temp_hash_value = hash_(*key_ptr, seed) & item_num_mask_;
-                    auto temp_hash_value = slot_index_policy_.MapToIndex(CompleteHash(*key_ptr, seed));
+                    auto temp_hash_value = slot_index_policy_.MapToIndex(
+                            MidHash(seed0_hash_of_entry(entry_begin[i]), seed));
 //                    auto temp_hash_value = slot_index_policy_.MapToIndex(hash_(*key_ptr, seed));
                     if FPH_UNLIKELY(seed2_test_table[temp_hash_value]) {
                         test_pass_flag = false;
@@ -2532,6 +3348,94 @@ namespace fph {
                 return test_pass_flag;
             }
 
+            /**
+             * Test whether there is collision in this bucket by sorting the positions instead of
+             * using the shared test table, so that several threads can test the buckets at once
+             * @tparam Seed0HashOfEntry
+             * @tparam PosVec
+             * @param testing_bucket
+             * @param seed0_hash_of_entry returns the seed0 hash of the key of an entry of the bucket
+             * @param pos_vec buffer of the slot positions of the bucket
+             * @param seed
+             * @return true if pass the test
+             */
+            template<class Seed0HashOfEntry, class PosVec>
+            bool TestBucketSelfCollisionBySort(const BucketType &testing_bucket, const Seed0HashOfEntry &seed0_hash_of_entry,
+                                               PosVec &pos_vec, size_t seed) const {
+                if (testing_bucket.entry_cnt < 2U) {
+                    return true;
+                }
+                pos_vec.clear();
+                const auto *entry_begin = BucketEntryBegin(testing_bucket);
+                for (size_t i = 0; i < testing_bucket.entry_cnt; ++i) {
+                    pos_vec.push_back(slot_index_policy_.MapToIndex(MidHash(seed0_hash_of_entry(entry_begin[i]), seed)));
+                }
+                std::sort(pos_vec.begin(), pos_vec.end());
+                return std::adjacent_find(pos_vec.begin(), pos_vec.end()) == pos_vec.end();
+            }
+
+            /**
+             * Find seed2 which makes no collision in every bucket by testing build_concurrency_
+             * candidates at once, with the buckets of each candidate split into chunks. The
+             * candidates are drawn from a copy of random_engine, and random_engine is advanced as if
+             * the candidates were tested one by one, so a serial build finds the same seed2 and
+             * draws the same random numbers after it
+             * @param sorted_index_array the indices of the buckets, larger buckets first
+             * @param seed0_hash_of_entry returns the seed0 hash of the key of an entry of a bucket
+             * @param random_engine
+             * @param random_dis
+             * @param max_reseed2_time the max number of candidates to test
+             * @return true if found, and seed2_ is set to the found seed
+             */
+            template<class SortedIndexArray, class Seed0HashOfEntry, class RandomEngine, class RandomDis>
+            bool ParallelFindSeed2(const SortedIndexArray &sorted_index_array, const Seed0HashOfEntry &seed0_hash_of_entry,
+                                   RandomEngine &random_engine, RandomDis &random_dis, size_t max_reseed2_time) {
+                const size_t concurrency = param_->build_concurrency_;
+                const size_t chunk_num = std::max(size_t(1U), std::min(concurrency * PARALLEL_BUILD_CHUNKS_PER_TASK,
+                                                                       param_->bucket_num_));
+                SizeTVector candidate_vec(concurrency);
+                std::vector<std::atomic<bool>> candidate_failed_vec(concurrency);
+                for (size_t tested_num = 0; tested_num < max_reseed2_time; ) {
+                    size_t batch_size = std::min(concurrency, max_reseed2_time - tested_num);
+                    auto batch_engine = random_engine;
+                    for (size_t i = 0; i < batch_size; ++i) {
+                        candidate_vec[i] = random_dis(batch_engine) | size_t(1ULL);
+                        candidate_failed_vec[i].store(false, std::memory_order_relaxed);
+                    }
+                    // chunk c of a candidate tests the buckets c, c + chunk_num, ... so that each
+                    // chunk starts with the large buckets, which fail more often
+                    parallel_detail::RunBuildTasks(param_->build_executor_, batch_size * chunk_num,
+                            [&](size_t task_index) {
+                        size_t candidate_index = task_index / chunk_num;
+                        auto &failed_flag = candidate_failed_vec[candidate_index];
+                        size_t candidate_seed = candidate_vec[candidate_index];
+                        SizeTVector pos_vec;
+                        for (size_t i = task_index % chunk_num; i < param_->bucket_num_; i += chunk_num) {
+                            if (failed_flag.load(std::memory_order_relaxed)) {
+                                return;
+                            }
+                            if (!TestBucketSelfCollisionBySort(param_->bucket_array_[sorted_index_array[i]],
+                                                               seed0_hash_of_entry, pos_vec, candidate_seed)) {
+                                failed_flag.store(true, std::memory_order_relaxed);
+                                return;
+                            }
+                        }
+                    });
+                    for (size_t i = 0; i < batch_size; ++i) {
+                        if (!candidate_failed_vec[i].load(std::memory_order_relaxed)) {
+                            for (size_t k = 0; k <= i; ++k) {
+                                seed2_ = random_dis(random_engine) | size_t(1ULL);
+                            }
+                            assert(seed2_ == candidate_vec[i]);
+                            return true;
+                        }
+                    }
+                    random_engine = batch_engine;
+                    tested_num += batch_size;
+                }
+                return false;
+            }
+
             /**
              * Test whether there is collision in this hash value vector
              * @tparam HashVec
@@ -2563,6 +3467,212 @@ namespace fph {
                 return test_pass_flag;
             }
 
+            // move the free slot pos to the filled part of random_table_
+            void AddFilledSlot(size_t pos) {
+                auto y_pos = param_->map_table_[pos];
+                assert(y_pos >= param_->filled_count_);
+                std::swap(param_->random_table_[param_->filled_count_], param_->random_table_[y_pos]);
+                std::swap(param_->map_table_[param_->random_table_[param_->filled_count_]],
+                          param_->map_table_[param_->random_table_[y_pos]]);
+                ++param_->filled_count_;
+                param_->slot_occupancy_.Occupy(pos);
+            }
+
+            // move the filled slot pos to the free part of random_table_
+            void RemoveFilledSlot(size_t pos) {
+                auto y_pos = param_->map_table_[pos];
+                assert(y_pos < param_->filled_count_);
+                std::swap(param_->random_table_[param_->filled_count_ - 1U], param_->random_table_[y_pos]);
+                std::swap(param_->map_table_[param_->random_table_[param_->filled_count_ - 1U]],
+                          param_->map_table_[param_->random_table_[y_pos]]);
+                --param_->filled_count_;
+                param_->slot_occupancy_.Release(pos);
+            }
+
+            /**
+             * Find a free offset for a pattern. The offsets tested put the first key of the pattern
+             * in one of the first max_anchor_num free slots of random_table_, or 63 slots after it
+             * @param pattern_pos the slot positions of the pattern at offset 0
+             * @param max_anchor_num
+             * @return the offset, or NO_SLOT_POS if none of the offsets tested is free
+             */
+            template<class PosVec>
+            size_t FindFreeOffset(const PosVec &pattern_pos, size_t max_anchor_num) const {
+                const size_t item_num_mask = param_->item_num_ceil_ - 1U;
+                const size_t search_pos_end = param_->item_num_ceil_ - param_->filled_count_ > max_anchor_num ?
+                        param_->filled_count_ + max_anchor_num : param_->item_num_ceil_;
+                for (size_t search_pos_begin = param_->filled_count_;
+                     search_pos_begin < search_pos_end; ++search_pos_begin) {
+                    size_t temp_offset = (param_->item_num_ceil_ + param_->random_table_[search_pos_begin]
+                                          - pattern_pos[0]) & item_num_mask;
+                    uint64_t free_offset_mask = param_->slot_occupancy_.FreeOffsetMask(pattern_pos, temp_offset);
+                    if (free_offset_mask != 0) {
+                        return (temp_offset + occupancy_detail::CountTrailingZero64(free_offset_mask))
+                               & item_num_mask;
+                    }
+                }
+                return NO_SLOT_POS;
+            }
+
+            /**
+             * Free an offset for a bucket whose pattern fits no free offset, by moving at most
+             * MAX_REPAIR_MOVED_BUCKET_NUM other buckets that fill the slots of the offset to other
+             * free offsets. Only the bucket params and the slot occupancy are changed, the caller
+             * moves the elements of the moved buckets.
+             * @param bucket_index the bucket, whose slots should have been released
+             * @param bucket_seed0_hash_vec the seed0 hashes of the keys of the bucket
+             * @param moved_entry_index_vec output, the indices in bucket_entry_array_ of the keys of
+             * the moved buckets
+             * @param moved_seed0_hash_vec output, the seed0 hashes of these keys
+             * @return whether the bucket is placed
+             */
+            template<class HashVec>
+            bool TryRepairBucket(size_t bucket_index, const HashVec &bucket_seed0_hash_vec,
+                                 SizeTVector &moved_entry_index_vec, SizeTVector &moved_seed0_hash_vec) {
+                const size_t item_num_mask = param_->item_num_ceil_ - 1U;
+                if (param_->item_num_ceil_ - param_->filled_count_ < bucket_seed0_hash_vec.size()) {
+                    return false;
+                }
+                SizeTVector pattern_hash, pattern_pos, moved_pattern_pos;
+                // the moved buckets, their new params and the slots taken by them
+                SizeTVector moved_bucket_vec, new_bucket_param_vec, taken_pos_vec;
+                // the slot positions at offset 0 of the pattern of the seed0 hashes in [first, last),
+                // false if two of them collide
+                auto get_pattern_pos = [&](auto first, auto last, size_t try_bit, SizeTVector &pos_vec) {
+                    auto try_seed = MixSeedAndBit(seed2_, try_bit);
+                    pattern_hash.clear();
+                    for (; first != last; ++first) {
+                        pattern_hash.push_back(MidHash(*first, try_seed));
+                    }
+                    if (!TestHashVecSelfCollision(pattern_hash, param_->seed2_test_table_, param_->tested_hash_vec_)) {
+                        return false;
+                    }
+                    pos_vec.clear();
+                    for (auto temp_hash: pattern_hash) {
+                        pos_vec.push_back(slot_index_policy_.MapToIndex(temp_hash));
+                    }
+                    return true;
+                };
+                std::mt19937_64 random_engine(seed2_ ^ param_->item_num_);
+
+                for (size_t repair_try = 0; repair_try < MAX_REPAIR_TRY_NUM; ++repair_try) {
+                    const size_t try_bit = repair_try & 1U;
+                    if (!get_pattern_pos(bucket_seed0_hash_vec.begin(), bucket_seed0_hash_vec.end(),
+                                         try_bit, pattern_pos)) {
+                        continue;
+                    }
+                    // of the 64 offsets from a random one, take the one with the fewest filled slots
+                    const size_t base_offset = random_engine() & item_num_mask;
+                    size_t filled_cnt_array[64] = {};
+                    for (auto temp_pattern_pos: pattern_pos) {
+                        uint64_t filled_window = ~param_->slot_occupancy_.FreeWindow(temp_pattern_pos + base_offset);
+                        for (size_t j = 0; j < 64U; ++j) {
+                            filled_cnt_array[j] += (filled_window >> j) & 1U;
+                        }
+                    }
+                    const size_t offset = (base_offset + size_t(std::min_element(filled_cnt_array, filled_cnt_array + 64)
+                                                                - filled_cnt_array)) & item_num_mask;
+
+                    moved_bucket_vec.clear();
+                    bool can_move_flag = true;
+                    for (auto temp_pattern_pos: pattern_pos) {
+                        size_t temp_pos = (temp_pattern_pos + offset) & item_num_mask;
+                        if (!param_->slot_occupancy_.IsOccupied(temp_pos)) {
+                            continue;
+                        }
+                        size_t temp_bucket_index = GetBucketIndex(SlotSeed0Hash(temp_pos));
+                        // the slot of the default fill key depends on the param of its bucket
+                        if (temp_bucket_index == param_->default_fill_key_bucket_index_) {
+                            can_move_flag = false;
+                            break;
+                        }
+                        if (std::find(moved_bucket_vec.begin(), moved_bucket_vec.end(), temp_bucket_index)
+                            == moved_bucket_vec.end()) {
+                            if (moved_bucket_vec.size() == MAX_REPAIR_MOVED_BUCKET_NUM) {
+                                can_move_flag = false;
+                                break;
+                            }
+                            moved_bucket_vec.push_back(temp_bucket_index);
+                        }
+                    }
+                    if (!can_move_flag) {
+                        continue;
+                    }
+
+                    for (auto moved_bucket_index: moved_bucket_vec) {
+                        const auto &moved_bucket = param_->bucket_array_[moved_bucket_index];
+                        const auto *moved_entries = BucketEntryBegin(moved_bucket);
+                        for (size_t i = 0; i < moved_bucket.entry_cnt; ++i) {
+                            RemoveFilledSlot(moved_entries[i]);
+                        }
+                    }
+                    for (auto temp_pattern_pos: pattern_pos) {
+                        AddFilledSlot((temp_pattern_pos + offset) & item_num_mask);
+                    }
+
+                    moved_entry_index_vec.clear();
+                    moved_seed0_hash_vec.clear();
+                    new_bucket_param_vec.clear();
+                    taken_pos_vec.clear();
+                    for (auto moved_bucket_index: moved_bucket_vec) {
+                        const auto &moved_bucket = param_->bucket_array_[moved_bucket_index];
+                        const auto *moved_entries = BucketEntryBegin(moved_bucket);
+                        const size_t hash_begin = moved_seed0_hash_vec.size();
+                        for (size_t i = 0; i < moved_bucket.entry_cnt; ++i) {
+                            moved_entry_index_vec.push_back(moved_bucket.entry_begin + i);
+                            moved_seed0_hash_vec.push_back(SlotSeed0Hash(moved_entries[i]));
+                        }
+                        size_t new_bucket_param = NO_SLOT_POS;
+                        for (size_t moved_try_bit = 0; moved_try_bit < 2U; ++moved_try_bit) {
+                            if (!get_pattern_pos(moved_seed0_hash_vec.begin() + hash_begin, moved_seed0_hash_vec.end(),
+                                                 moved_try_bit, moved_pattern_pos)) {
+                                continue;
+                            }
+                            size_t moved_offset = FindFreeOffset(moved_pattern_pos, REPAIR_SEARCH_ANCHOR_NUM);
+                            if (moved_offset != NO_SLOT_POS) {
+                                for (auto temp_pattern_pos: moved_pattern_pos) {
+                                    size_t temp_pos = (temp_pattern_pos + moved_offset) & item_num_mask;
+                                    AddFilledSlot(temp_pos);
+                                    taken_pos_vec.push_back(temp_pos);
+                                }
+                                new_bucket_param = (moved_offset << 1U) | moved_try_bit;
+                                break;
+                            }
+                        }
+                        if (new_bucket_param == NO_SLOT_POS) {
+                            break;
+                        }
+                        new_bucket_param_vec.push_back(new_bucket_param);
+                    }
+
+                    if (new_bucket_param_vec.size() == moved_bucket_vec.size()) {
+                        for (size_t i = 0; i < moved_bucket_vec.size(); ++i) {
+                            bucket_p_array_[moved_bucket_vec[i]] = new_bucket_param_vec[i];
+                        }
+                        bucket_p_array_[bucket_index] = (offset << 1U) | try_bit;
+                        return true;
+                    }
+
+                    // undo, the moved buckets go back to their slots
+                    for (auto temp_pos: taken_pos_vec) {
+                        RemoveFilledSlot(temp_pos);
+                    }
+                    for (auto temp_pattern_pos: pattern_pos) {
+                        RemoveFilledSlot((temp_pattern_pos + offset) & item_num_mask);
+                    }
+                    for (auto moved_bucket_index: moved_bucket_vec) {
+                        const auto &moved_bucket = param_->bucket_array_[moved_bucket_index];
+                        const auto *moved_entries = BucketEntryBegin(moved_bucket);
+                        for (size_t i = 0; i < moved_bucket.entry_cnt; ++i) {
+                            AddFilledSlot(moved_entries[i]);
+                        }
+                    }
+                }
+                moved_entry_index_vec.clear();
+                moved_seed0_hash_vec.clear();
+                return false;
+            }
+
             template<class RandomTable, class MapTable>
             static bool
             IsRandomTableValid(const RandomTable &random_table, const MapTable &map_table) {
@@ -2581,9 +3691,9 @@ namespace fph {
                 std::fill(test_table.begin(), test_table.end(), false);
                 for (auto bucket_it = bucket_begin; bucket_it != bucket_end; ++bucket_it) {
                     auto &test_bucket = *bucket_it;
-                    for (const auto *key_ptr: test_bucket.key_array) {
-                        const auto &temp_key = *key_ptr;
-                        auto slot_pos = GetSlotPos(temp_key);
+                    const auto *entry_begin = BucketEntryBegin(test_bucket);
+                    for (size_t i = 0; i < test_bucket.entry_cnt; ++i) {
+                        auto slot_pos = GetSlotPos(slot_[entry_begin[i]].key);
                         if (test_table[slot_pos]) {
                             test_passed_flag = false;
                             break;
@@ -2602,8 +3712,7 @@ namespace fph {
             std::pair<iterator, bool> TryEmplaceImp(K&& key, Args&&... args) {
                 auto [slot_address, alloc_happen] = FindOrAlloc(key);
                 if (alloc_happen) {
-                    KeyAllocator key_alloc{};
-                    std::allocator_traits<KeyAllocator>::destroy(key_alloc, std::addressof(slot_address->key));
+                    DestroyFillKey(slot_address);
                     std::allocator_traits<Allocator>::construct(param_->alloc_,
                                                                 std::addressof(slot_address->mutable_value),
                                                                 std::piecewise_construct,
@@ -2648,8 +3757,7 @@ namespace fph {
             std::pair<iterator, bool> EmplaceImp(Args&&... args) {
                 auto [slot_address, alloc_happen] = FindOrAlloc(std::get<0>(std::forward_as_tuple(args...)));
                 if (alloc_happen) {
-                    KeyAllocator key_alloc{};
-                    std::allocator_traits<KeyAllocator>::destroy(key_alloc, std::addressof(slot_address->key));
+                    DestroyFillKey(slot_address);
                     std::allocator_traits<Allocator>::construct(param_->alloc_, std::addressof(slot_address->mutable_value), std::forward<Args>(args)...);
                 }
                 return {iterator{slot_address, this}, alloc_happen};
@@ -2662,8 +3770,7 @@ namespace fph {
                 std::allocator_traits<Allocator>::construct(param_->alloc_, std::addressof(slot_ptr->mutable_value), std::forward<Args>(args)...);
                 auto [slot_address, alloc_happen] = FindOrAlloc(slot_ptr->key);
                 if (alloc_happen) {
-                    KeyAllocator key_alloc{};
-                    std::allocator_traits<KeyAllocator>::destroy(key_alloc, std::addressof(slot_address->key));
+                    DestroyFillKey(slot_address);
                     std::allocator_traits<Allocator>::construct(param_->alloc_, std::addressof(slot_address->mutable_value), std::move(slot_ptr->mutable_value));
                 }
                 std::allocator_traits<Allocator>::destroy(param_->alloc_, std::addressof(slot_ptr->mutable_value));
@@ -2674,8 +3781,7 @@ namespace fph {
                 const slot_type& src_slot = *slot_type::GetSlotAddressByValueAddress(&value);
                 auto [slot_address, alloc_happen] = FindOrAlloc(src_slot.key);
                 if (alloc_happen) {
-                    KeyAllocator key_alloc{};
-                    std::allocator_traits<KeyAllocator>::destroy(key_alloc, std::addressof(slot_address->key));
+                    DestroyFillKey(slot_address);
                     std::allocator_traits<Allocator>::construct(param_->alloc_, std::addressof(slot_address->mutable_value), value);
                 }
                 return {iterator(slot_address, this), alloc_happen};
@@ -2685,8 +3791,7 @@ namespace fph {
                 const slot_type& src_slot = *slot_type::GetSlotAddressByValueAddress(&value);
                 auto [slot_address, alloc_happen] = FindOrAlloc(src_slot.key);
                 if (alloc_happen) {
-                    KeyAllocator key_alloc{};
-                    std::allocator_traits<KeyAllocator>::destroy(key_alloc, std::addressof(slot_address->key));
+                    DestroyFillKey(slot_address);
                     std::allocator_traits<Allocator>::construct(param_->alloc_,
                                                                 std::addressof(slot_address->mutable_value), std::move(value));
                 }
@@ -2694,26 +3799,30 @@ namespace fph {
             }
 
             iterator EraseImp(iterator iter) {
+                if FPH_UNLIKELY(param_->frozen_) {
+                    // Thaw() moves the elements, find the element again by its key
+                    key_type key = iter.value_ptr()->key;
+                    Thaw();
+                    iter = find(key);
+                }
                 auto *slot_ptr = iter.value_ptr();
-                size_t bucket_index = CompleteGetBucketIndex(slot_ptr->key);
-                auto &temp_bucket = param_->bucket_array_[bucket_index];
-#ifndef NDEBUG
-                bool find_key_flag = false;
-#endif
-                for (size_t i = 0; i < temp_bucket.key_array.size(); ++i) {
-                    if FPH_UNLIKELY(temp_bucket.key_array[i] == std::addressof(slot_ptr->key)) {
-                        temp_bucket.key_array.erase(temp_bucket.key_array.begin() + i);
-#ifndef NDEBUG
-                        find_key_flag = true;
-#endif
-                        break;
-                    }
+                if FPH_UNLIKELY(IsStashSlot(slot_ptr)) {
+                    return EraseStashImp(slot_ptr);
                 }
-#ifndef NDEBUG
-                assert(find_key_flag);
-#endif
-                --temp_bucket.entry_cnt;
+                EraseSlotImp(slot_ptr);
+                auto *next_slot_ptr = GetNextSlotAddress(slot_ptr);
+
+//                if (param_->begin_it_.value_ptr() == slot_ptr) {
+                AddNewIterator(next_slot_ptr);
+//                }
+                return iterator(next_slot_ptr, this);
+            }
+
+            // erase the element in the slot, without changing begin()
+            void EraseSlotImp(slot_type *slot_ptr) {
                 auto slot_pos = slot_ptr - slot_;
+                size_t bucket_index = GetBucketIndex(SlotSeed0Hash(slot_pos));
+                EraseBucketEntry(bucket_index, slot_pos);
                 assert(slot_pos >= 0 && size_t(slot_pos) < (param_->item_num_ceil_));
                 auto y_pos = param_->map_table_[slot_pos];
                 assert(y_pos < param_->filled_count_);
@@ -2722,19 +3831,15 @@ namespace fph {
                 std::swap(param_->map_table_[param_->random_table_[param_->filled_count_ - 1]],
                           param_->map_table_[param_->random_table_[y_pos]]);
                 --param_->filled_count_;
+                param_->slot_occupancy_.Release(slot_pos);
 
 
                 std::allocator_traits<Allocator>::destroy(param_->alloc_, std::addressof(slot_ptr->mutable_value));
-                KeyAllocator key_alloc{};
                 if FPH_LIKELY(size_t(slot_ptr - slot_) != GetSlotPos(*param_->default_fill_key_)) {
-                    std::allocator_traits<KeyAllocator>::construct(key_alloc,
-                                                                   std::addressof(slot_ptr->key),
-                                                                   *param_->default_fill_key_);
+                    ConstructFillKey(slot_ptr, *param_->default_fill_key_);
                 }
                 else {
-                    std::allocator_traits<KeyAllocator>::construct(key_alloc,
-                                                                   std::addressof(slot_ptr->key),
-                                                                   *param_->second_default_key_);
+                    ConstructFillKey(slot_ptr, *param_->second_default_key_);
                 }
 
                 --param_->item_num_;
@@ -2743,11 +3848,26 @@ namespace fph {
                     fprintf(stderr, "Error, slot not empty after erase\n");
                 }
 #endif
-                auto *next_slot_ptr = GetNextSlotAddress(slot_ptr);
+            }
 
-//                if (param_->begin_it_.value_ptr() == slot_ptr) {
-                param_->begin_it_ = iterator(next_slot_ptr, this);
-//                }
+            // erase an element of the stash by moving the last element of the stash in its place
+            iterator EraseStashImp(slot_type *slot_ptr) {
+                const size_t stash_index = slot_ptr - param_->stash_slot_;
+                const size_t last_index = param_->stash_num_ - 1U;
+                std::allocator_traits<Allocator>::destroy(param_->alloc_, std::addressof(slot_ptr->mutable_value));
+                if (stash_index != last_index) {
+                    slot_type *last_slot_ptr = param_->stash_slot_ + last_index;
+                    std::allocator_traits<Allocator>::construct(param_->alloc_,
+                            std::addressof(slot_ptr->mutable_value), std::move(last_slot_ptr->mutable_value));
+                    std::allocator_traits<Allocator>::destroy(param_->alloc_,
+                            std::addressof(last_slot_ptr->mutable_value));
+                    param_->stash_seed0_hash_[stash_index] = param_->stash_seed0_hash_[last_index];
+                }
+                param_->stash_seed0_hash_.pop_back();
+                --param_->stash_num_;
+                --param_->item_num_;
+                slot_type *next_slot_ptr = stash_index < param_->stash_num_ ? slot_ptr : GetSlotAddressAfterStash();
+                AddNewIterator(next_slot_ptr);
                 return iterator(next_slot_ptr, this);
             }
 
@@ -2760,54 +3880,76 @@ namespace fph {
             }
 
             size_type EraseImp(const key_type& key) {
+                if FPH_UNLIKELY(param_->frozen_) {
+                    Thaw();
+                }
                 size_t ret = 0U;
                 auto pos = GetSlotPos(key);
                 auto *slot_ptr = slot_ + pos;
-                if (key_equal_(slot_ptr->key, key)) {
+                if (SlotHoldsKey(pos, key)) {
                     ret = 1U;
-                    this->EraseImp(iterator(slot_ptr, this));
+                    // no iterator is returned, so the next element is only needed if it was begin()
+                    EraseSlotImp(slot_ptr);
+                    if FPH_UNLIKELY(param_->begin_it_.value_ptr() == slot_ptr) {
+                        AddNewIterator(GetNextSlotAddress(slot_ptr));
+                    }
 #if FPH_DEBUG_ERROR
                     if FPH_UNLIKELY(!IsSlotEmpty(slot_ptr)) {
                         fprintf(stderr, "Error, slot not empty after erase const key&\n");
                     }
 #endif
                 }
+                else if FPH_UNLIKELY(param_->stash_num_ != 0) {
+                    auto *stash_address = FindInStash<key_type>(key, hash_(key, seed0_));
+                    if (stash_address != nullptr) {
+                        ret = 1U;
+                        EraseStashImp(stash_address);
+                    }
+                }
                 return ret;
             }
 
 
+            // whether inserting a new key will rehash the table to a larger capacity first
+            bool ShouldExpandBeforeInsert() const noexcept {
+                return param_->item_num_ + 1U > param_->should_expand_item_num_ &&
+                       dynamic::detail::Ceil2(param_->item_num_ceil_ + 1U) <= MAX_ITEM_NUM_CEIL_LIMIT;
+            }
+
             std::pair<slot_type*, bool> FindOrAlloc(const key_type& key) {
+                if FPH_UNLIKELY(param_->frozen_) {
+                    Thaw();
+                }
 
-                if FPH_UNLIKELY(param_->item_num_ + 1U > param_->should_expand_item_num_ &&
-                                dynamic::detail::Ceil2(param_->item_num_ceil_ + 1U) <=
-                                MAX_ITEM_NUM_CEIL_LIMIT) {
+                if FPH_UNLIKELY(ShouldExpandBeforeInsert()) {
                     rehash(param_->item_num_ceil_ + 1U);
+                    ++param_->insert_path_stats_.expand_num;
                 }
                 auto k_seed0_hash = hash_(key, seed0_);
                 auto possible_pos = GetSlotPosBySeed0Hash(k_seed0_hash);
 //                auto possible_pos = GetSlotPos(key);
                 auto *insert_address = slot_ + possible_pos;
                 bool insert_flag;
-                if (key_equal_(insert_address->key, key)) {
+                if (SlotHoldsKey(possible_pos, key)) {
                     insert_flag = false;
                 }
                 else {
 
-
+                    if FPH_UNLIKELY(param_->stash_num_ != 0) {
+                        auto *stash_address = FindInStash<key_type>(key, k_seed0_hash);
+                        if (stash_address != nullptr) {
+                            return {stash_address, false};
+                        }
+                    }
 
 
                     if (IsSlotEmpty(possible_pos)) {
-                        auto y_pos = param_->map_table_[possible_pos];
-                        assert(y_pos >= param_->filled_count_);
-                        std::swap(param_->random_table_[param_->filled_count_], param_->random_table_[y_pos]);
-                        std::swap(param_->map_table_[param_->random_table_[param_->filled_count_]],
-                                  param_->map_table_[param_->random_table_[y_pos]]);
-                        ++param_->filled_count_;
+                        AddFilledSlot(possible_pos);
+                        ++param_->insert_path_stats_.free_slot_num;
+                        StoreSeed0Hash(possible_pos, k_seed0_hash);
                         auto bucket_index = GetBucketIndex(k_seed0_hash);
 //                        auto bucket_index = GetBucketIndex(key);
-                        auto &temp_bucket = param_->bucket_array_[bucket_index];
-                        temp_bucket.key_array.push_back(&(insert_address->key));
-                        ++temp_bucket.entry_cnt;
+                        AddBucketEntry(bucket_index, possible_pos);
                         insert_flag = true;
                         AddNewIterator(insert_address);
                         ++param_->item_num_;
@@ -2829,12 +3971,23 @@ namespace fph {
 
                         bool pattern_matched_flag = false;
 
-                        auto &temp_bucket = param_->bucket_array_[bucket_index];
-
-                        temp_bucket.key_array.push_back(&key);
+                        // the slot positions of the keys in the bucket, the new key is added
+                        // after the pattern is matched
+                        const size_t old_entry_cnt = param_->bucket_array_[bucket_index].entry_cnt;
+                        BucketParamType *bucket_entries = BucketEntryBegin(param_->bucket_array_[bucket_index]);
                         bool is_first_try = true;
 
+                        // the seed0 hashes of the keys in the bucket and then of the new key
+                        std::vector<size_t, SizeTAllocator> bucket_seed0_hash_vec;
+                        bucket_seed0_hash_vec.reserve(old_entry_cnt + 1U);
+                        for (size_t i = 0; i < old_entry_cnt; ++i) {
+                            bucket_seed0_hash_vec.push_back(SlotSeed0Hash(bucket_entries[i]));
+                        }
+                        bucket_seed0_hash_vec.push_back(k_seed0_hash);
+
                         std::vector<size_t, SizeTAllocator> bucket_pattern;
+                        // the slot positions of the pattern at offset 0
+                        std::vector<size_t, SizeTAllocator> bucket_pattern_pos;
 
                         for (auto bucket_try_bit = optional_bit; bucket_try_bit < 2U; ++bucket_try_bit) {
 
@@ -2843,8 +3996,8 @@ namespace fph {
 
                             bucket_pattern.clear();
 
-                            for (const auto *key_ptr: temp_bucket.key_array) {
-                                size_t temp_hash = CompleteHash(*key_ptr, try_seed);
+                            for (auto temp_seed0_hash: bucket_seed0_hash_vec) {
+                                size_t temp_hash = MidHash(temp_seed0_hash, try_seed);
 //                                size_t temp_hash = hash_(*key_ptr, try_seed);
 //                                size_t temp_hash = hash_(*key_ptr, try_seed) & item_num_mask_;
                                 bucket_pattern.push_back(temp_hash);
@@ -2861,13 +4014,7 @@ namespace fph {
                                     auto temp_pos = slot_index_policy_.MapToIndex(original_hash + slot_index_policy_.ReverseMap(bucket_offset));
 //                                    auto temp_pos =
 //                                            (original_hash + bucket_offset) & item_num_mask_;
-                                    auto y_pos = param_->map_table_[temp_pos];
-                                    assert(y_pos < param_->filled_count_);
-                                    std::swap(param_->random_table_[param_->filled_count_ - 1],
-                                              param_->random_table_[y_pos]);
-                                    std::swap(param_->map_table_[param_->random_table_[param_->filled_count_ - 1]],
-                                              param_->map_table_[param_->random_table_[y_pos]]);
-                                    --param_->filled_count_;
+                                    RemoveFilledSlot(temp_pos);
                                 }
                             }
                             is_first_try = false;
@@ -2883,53 +4030,54 @@ namespace fph {
 
                             size_t item_num_mask = param_->item_num_ceil_ - size_t(1ULL);
 
-                            for (size_t search_pos_begin = param_->filled_count_;
-                                 search_pos_begin < param_->item_num_ceil_; ++search_pos_begin) {
-//                                size_t temp_offset =
-//                                        (param_->item_num_ceil_ + param_->random_table_[search_pos_begin]
-//                                         - bucket_pattern[0]) & item_num_mask_;
-                                size_t temp_offset = (param_->item_num_ceil_ + param_->random_table_[search_pos_begin]
-                                                      - slot_index_policy_.MapToIndex(bucket_pattern[0])) & item_num_mask;
-
-                                bool this_offset_passed_flag = true;
-                                for (auto temp_hash_value: bucket_pattern) {
-                                    auto temp_pos = slot_index_policy_.MapToIndex(temp_hash_value +
-                                                                                  slot_index_policy_.ReverseMap(temp_offset));
-//                                    auto temp_pos =
-//                                            (temp_hash_value + temp_offset) & item_num_mask_;
-                                    if (param_->map_table_[temp_pos] < param_->filled_count_) {
-                                        this_offset_passed_flag = false;
-                                        break;
-                                    }
-                                }
-                                if (this_offset_passed_flag) {
-                                    pattern_matched_flag = true;
-                                    for (auto temp_hash_value: bucket_pattern) {
-                                        auto temp_pos = slot_index_policy_.MapToIndex(temp_hash_value +
-                                                                                      slot_index_policy_.ReverseMap(temp_offset));
-//                                        auto temp_pos =
-//                                                (temp_hash_value + temp_offset) & item_num_mask_;
-                                        auto y_pos = param_->map_table_[temp_pos];
-                                        std::swap(param_->random_table_[param_->filled_count_],
-                                                  param_->random_table_[y_pos]);
-                                        std::swap(param_->map_table_[param_->random_table_[param_->filled_count_]],
-                                                  param_->map_table_[param_->random_table_[y_pos]]);
-                                        ++param_->filled_count_;
-                                    }
-                                    bucket_p_array_[temp_bucket.index] =
-                                            (temp_offset << 1) | bucket_try_bit;
-
-                                    break;
-                                }
+                            bucket_pattern_pos.clear();
+                            for (auto temp_hash_value: bucket_pattern) {
+                                bucket_pattern_pos.push_back(slot_index_policy_.MapToIndex(temp_hash_value));
                             }
 
-                            if (pattern_matched_flag) {
+                            // test all the offsets
+                            size_t temp_offset = FindFreeOffset(bucket_pattern_pos, param_->item_num_ceil_);
+                            if (temp_offset != NO_SLOT_POS) {
+                                pattern_matched_flag = true;
+                                for (auto pattern_pos: bucket_pattern_pos) {
+                                    AddFilledSlot((pattern_pos + temp_offset) & item_num_mask);
+                                }
+                                bucket_p_array_[bucket_index] =
+                                        (temp_offset << 1U) | bucket_try_bit;
                                 break;
                             }
 
                         } // for bucket_try_bit
 
+                        // the keys of the other buckets moved by TryRepairBucket(), they are moved
+                        // together with the keys of this bucket
+                        std::vector<size_t, SizeTAllocator> moved_entry_index_vec, moved_seed0_hash_vec;
+                        if (pattern_matched_flag) {
+                            ++param_->insert_path_stats_.bucket_move_num;
+                        }
+                        else if (TryRepairBucket(bucket_index, bucket_seed0_hash_vec,
+                                                 moved_entry_index_vec, moved_seed0_hash_vec)) {
+                            pattern_matched_flag = true;
+                            ++param_->insert_path_stats_.local_repair_num;
+                        }
+                        else if (CanStashNewKey()) {
+                            // the bucket stays at its offset, and the new key is put in the stash
+                            for (size_t i = 0; i < old_entry_cnt; ++i) {
+                                AddFilledSlot(bucket_entries[i]);
+                            }
+                            ++param_->insert_path_stats_.stash_num;
+                            insert_address = AllocStashSlot(k_seed0_hash);
+                            AddNewIterator(insert_address);
+                            ++param_->item_num_;
+                            return {insert_address, true};
+                        }
+
                         if (!pattern_matched_flag) {
+                            // the iteration below skips the slots by the occupancy bits
+                            for (size_t i = 0; i < old_entry_cnt; ++i) {
+                                AddFilledSlot(bucket_entries[i]);
+                            }
+                            ++param_->insert_path_stats_.full_rebuild_num;
                             assert(param_->item_num_ < param_->item_num_ceil_);
                             param_->temp_pair_buf_.resize((param_->item_num_ + 1) * sizeof(value_type));
                             value_type *temp_value_buf_start =
@@ -2937,10 +4085,23 @@ namespace fph {
                             value_type *temp_value_buf = temp_value_buf_start;
                             KeyAllocator key_alloc;
                             for (auto it = begin(); it != end(); ) {
+                                if constexpr (Policy::TRACK_SLOT_RELOCATION) {
+                                    param_->slot_relocation_log_.emplace_back(size_t(it.value_ptr() - slot_), NO_SLOT_POS);
+                                }
+                                if (slot_seed0_hash_ != nullptr) {
+                                    param_->temp_seed0_hash_buf_.push_back(StoredSeed0Hash(it.value_ptr()));
+                                }
                                 std::allocator_traits<Allocator>::construct(param_->alloc_,
                                                                             temp_value_buf++, std::move(*it));
                                 ++it;
                             }
+                            if (slot_seed0_hash_ != nullptr) {
+                                param_->temp_seed0_hash_buf_.push_back(k_seed0_hash);
+                            }
+                            if constexpr (Policy::TRACK_SLOT_RELOCATION) {
+                                // the new key has no previous slot
+                                param_->slot_relocation_log_.emplace_back(NO_SLOT_POS, NO_SLOT_POS);
+                            }
 
                             slot_type* temp_slot_ptr =
                                     slot_type::GetSlotAddressByValueAddress(temp_value_buf);
@@ -2976,13 +4137,31 @@ namespace fph {
                             }
                             param_->temp_pair_buf_.clear();
                             param_->temp_pair_buf_.shrink_to_fit();
+                            param_->temp_seed0_hash_buf_.clear();
                             auto temp_pos = GetSlotPos(key);
                             insert_address = slot_ + temp_pos;
+                            if constexpr (EMPTY_SLOTS_UNCONSTRUCTED) {
+                                // The build constructed the key in the new slot, but the callers
+                                // expect an empty slot there, which holds no key in this mode
+                                KeyAllocator key_alloc{};
+                                std::allocator_traits<KeyAllocator>::destroy(key_alloc,
+                                        std::addressof(insert_address->key));
+                            }
                         }
                         else {
 
+                            // the old keys of this bucket, then the keys of the moved buckets
+                            const size_t moved_cnt = old_entry_cnt + moved_entry_index_vec.size();
+                            auto moved_entry = [&](size_t i) -> BucketParamType& {
+                                return i < old_entry_cnt ? bucket_entries[i] :
+                                       param_->bucket_entry_array_[moved_entry_index_vec[i - old_entry_cnt]];
+                            };
+                            auto moved_seed0_hash = [&](size_t i) {
+                                return i < old_entry_cnt ? bucket_seed0_hash_vec[i] :
+                                       moved_seed0_hash_vec[i - old_entry_cnt];
+                            };
                             param_->temp_byte_buf_vec_.resize(
-                                    sizeof(slot_type) * temp_bucket.key_array.size());
+                                    sizeof(slot_type) * moved_cnt);
                             auto *temp_pair_buf = reinterpret_cast<slot_type *>(param_->temp_byte_buf_vec_.data());
                             bool contain_default_fill_key_flag = false, contain_second_fill_key_flag = false;
                             const auto temp_new_default_fill_key_pos = GetSlotPos(
@@ -2990,12 +4169,17 @@ namespace fph {
                             KeyAllocator key_alloc;
 
                             bool fill_new_default_key_pos_with_second_key_flag = false;
+                            const size_t relocation_log_base = param_->slot_relocation_log_.size();
+                            (void)relocation_log_base;
 
                             // prevent overlap from elements in the same bucket in slots
-                            for (size_t i = 0; i + 1U < temp_bucket.key_array.size(); ++i) {
-                                const key_type *key_ptr = temp_bucket.key_array[i];
-                                auto original_slot_pos = GetSlotPos(*key_ptr, bucket_offset,
-                                                                    optional_bit);
+                            for (size_t i = 0; i < moved_cnt; ++i) {
+                                size_t original_slot_pos = moved_entry(i);
+                                const key_type *key_ptr = std::addressof(slot_[original_slot_pos].key);
+                                assert(i >= old_entry_cnt || original_slot_pos == GetSlotPos(*key_ptr, bucket_offset, optional_bit));
+                                if constexpr (Policy::TRACK_SLOT_RELOCATION) {
+                                    param_->slot_relocation_log_.emplace_back(original_slot_pos, NO_SLOT_POS);
+                                }
                                 slot_type *temp_pair_ptr = temp_pair_buf + i;
                                 if FPH_UNLIKELY(key_equal_(*key_ptr, *param_->default_fill_key_)) {
                                     contain_default_fill_key_flag = true;
@@ -3012,11 +4196,9 @@ namespace fph {
                                 std::allocator_traits<Allocator>::destroy(param_->alloc_,
                                                                           std::addressof(original_slot_address->mutable_value));
                                 if FPH_LIKELY(original_slot_pos != temp_new_default_fill_key_pos) {
-                                    std::allocator_traits<KeyAllocator>::construct(key_alloc,
-                                                                                   std::addressof(original_slot_address->key), *param_->default_fill_key_);
+                                    ConstructFillKey(original_slot_address, *param_->default_fill_key_);
                                 } else {
-                                    std::allocator_traits<KeyAllocator>::construct(key_alloc,
-                                                                                   std::addressof(original_slot_address->key), *param_->second_default_key_);
+                                    ConstructFillKey(original_slot_address, *param_->second_default_key_);
                                     fill_new_default_key_pos_with_second_key_flag = true;
                                     if FPH_UNLIKELY(original_slot_pos == original_default_key_pos) {
                                         original_default_key_pos_empty_status = 1;
@@ -3024,15 +4206,19 @@ namespace fph {
                                 }
 
                             }
-                            for (size_t i = 0; i + 1U < temp_bucket.key_array.size(); ++i) {
+                            for (size_t i = 0; i < moved_cnt; ++i) {
                                 slot_type *src_pair_ptr = temp_pair_buf + i;
-                                auto new_slot_pos = GetSlotPos(src_pair_ptr->key);
-                                std::allocator_traits<KeyAllocator>::destroy(key_alloc, std::addressof(slot_[new_slot_pos].key));
+                                auto new_slot_pos = GetSlotPosBySeed0Hash(moved_seed0_hash(i));
+                                DestroyFillKey(slot_ + new_slot_pos);
                                 std::allocator_traits<Allocator>::construct(param_->alloc_,
                                                                             std::addressof(slot_[new_slot_pos].mutable_value),
                                                                             std::move(src_pair_ptr->mutable_value));
                                 std::allocator_traits<Allocator>::destroy(param_->alloc_, std::addressof(src_pair_ptr->mutable_value));
-                                temp_bucket.key_array[i] = &slot_[new_slot_pos].key;
+                                moved_entry(i) = new_slot_pos;
+                                StoreSeed0Hash(new_slot_pos, moved_seed0_hash(i));
+                                if constexpr (Policy::TRACK_SLOT_RELOCATION) {
+                                    param_->slot_relocation_log_[relocation_log_base + i].second = new_slot_pos;
+                                }
                                 if FPH_UNLIKELY(new_slot_pos == original_default_key_pos) {
                                     original_default_key_pos_empty_status = 0;
                                 }
@@ -3044,8 +4230,11 @@ namespace fph {
                             // position, then need to re generate second_default_key
 
 
+                            // the empty slots hold no fill key in EMPTY_SLOTS_UNCONSTRUCTED mode, so
+                            // the position of the fill keys does not matter
                             size_t cur_default_fill_key_pos = GetSlotPos(*param_->default_fill_key_);
-                            if (cur_default_fill_key_pos == GetSlotPos(*param_->second_default_key_)) {
+                            if (!EMPTY_SLOTS_UNCONSTRUCTED &&
+                                    cur_default_fill_key_pos == GetSlotPos(*param_->second_default_key_)) {
                                 auto new_second_fill_key = (*param_->key_gen_)();
 
                                 size_t try_gen_second_key_cnt = 0;
@@ -3067,17 +4256,21 @@ namespace fph {
                                                           "cannot generate enough different keys");
                                     }
                                 }
+                                const bool refill_cur_default_key_pos = !contain_second_fill_key_flag &&
+                                        fill_new_default_key_pos_with_second_key_flag &&
+                                        key_equal_(slot_[cur_default_fill_key_pos].key, *param_->second_default_key_);
+                                // the empty slots may share the bytes of the second default key,
+                                // so refill them after the key is replaced
+                                std::allocator_traits<KeyAllocator>::destroy(key_alloc, param_->second_default_key_);
+                                std::allocator_traits<KeyAllocator>::construct(key_alloc, param_->second_default_key_, new_second_fill_key);
                                 if (original_default_key_pos_empty_status) {
-                                    std::allocator_traits<KeyAllocator>::destroy(key_alloc, std::addressof(param_->default_fill_key_address_->key));
-                                    std::allocator_traits<KeyAllocator>::construct(key_alloc, std::addressof(param_->default_fill_key_address_->key), new_second_fill_key);
+                                    DestroyFillKey(param_->default_fill_key_address_);
+                                    ConstructFillKey(param_->default_fill_key_address_, *param_->second_default_key_);
                                 }
-                                if (!contain_second_fill_key_flag && fill_new_default_key_pos_with_second_key_flag
-                                    && key_equal_(slot_[cur_default_fill_key_pos].key, *param_->second_default_key_)) {
-                                    std::allocator_traits<KeyAllocator>::destroy(key_alloc, std::addressof(slot_[cur_default_fill_key_pos].key));
-                                    std::allocator_traits<KeyAllocator>::construct(key_alloc, std::addressof(slot_[cur_default_fill_key_pos].key), new_second_fill_key);
+                                if (refill_cur_default_key_pos) {
+                                    DestroyFillKey(slot_ + cur_default_fill_key_pos);
+                                    ConstructFillKey(slot_ + cur_default_fill_key_pos, *param_->second_default_key_);
                                 }
-                                std::allocator_traits<KeyAllocator>::destroy(key_alloc, param_->second_default_key_);
-                                std::allocator_traits<KeyAllocator>::construct(key_alloc, param_->second_default_key_, new_second_fill_key);
                             }
 
                             if (bucket_index == param_->default_fill_key_bucket_index_) {
@@ -3085,11 +4278,11 @@ namespace fph {
                                 if (new_bucket_param != bucket_param) {
                                     auto new_default_key_pos = GetSlotPos(*param_->default_fill_key_);
                                     auto new_default_key_address = slot_ + new_default_key_pos;
-                                    if (!contain_default_fill_key_flag) {
+                                    if (!EMPTY_SLOTS_UNCONSTRUCTED && !contain_default_fill_key_flag) {
                                         if (key_equal_(slot_[new_default_key_pos].key,
                                                        *param_->default_fill_key_)) {
-                                            std::allocator_traits<KeyAllocator>::destroy(key_alloc, std::addressof(slot_[new_default_key_pos].key));
-                                            std::allocator_traits<KeyAllocator>::construct(key_alloc, std::addressof(slot_[new_default_key_pos].key), *param_->second_default_key_);
+                                            DestroyFillKey(slot_ + new_default_key_pos);
+                                            ConstructFillKey(slot_ + new_default_key_pos, *param_->second_default_key_);
                                         }
 
                                         auto second_default_key_pos = GetSlotPos(*param_->second_default_key_);
@@ -3100,8 +4293,8 @@ namespace fph {
                                                        *param_->second_default_key_) &&
                                             !(contain_second_fill_key_flag && param_->default_fill_key_address_ ==
                                                                               second_default_key_address)) {
-                                            std::allocator_traits<KeyAllocator>::destroy(key_alloc, std::addressof(param_->default_fill_key_address_->key));
-                                            std::allocator_traits<KeyAllocator>::construct(key_alloc, std::addressof(param_->default_fill_key_address_->key), *param_->default_fill_key_);
+                                            DestroyFillKey(param_->default_fill_key_address_);
+                                            ConstructFillKey(param_->default_fill_key_address_, *param_->default_fill_key_);
                                         }
                                     }
 
@@ -3117,14 +4310,15 @@ namespace fph {
                             }
 
 
-                            auto temp_pos = GetSlotPos(key);
+                            auto temp_pos = GetSlotPosBySeed0Hash(k_seed0_hash);
                             insert_address = slot_ + temp_pos;
 #ifndef NDEBUG
-                            assert(IsSlotEmpty(temp_pos));
+                            // the slot is already marked as occupied
+                            assert(EMPTY_SLOTS_UNCONSTRUCTED || IsSlotEmpty(temp_pos));
 #endif
 
-                            temp_bucket.key_array.back() = std::addressof(insert_address->key);
-                            ++temp_bucket.entry_cnt;
+                            AddBucketEntry(bucket_index, temp_pos);
+                            StoreSeed0Hash(temp_pos, k_seed0_hash);
                             AddNewIterator(insert_address);
                             ++param_->item_num_;
                         } // else of if (!pattern_matched_flag)
@@ -3139,44 +4333,230 @@ namespace fph {
                 return std::make_pair(insert_address, insert_flag);
             }
 
-            void DestroySlots() {
-                if (slot_ != nullptr) {
+            // The empty slots hold no key, and are told by the occupancy bits
+            constexpr static bool EMPTY_SLOTS_UNCONSTRUCTED = FPH_DY_UNCONSTRUCTED_EMPTY_SLOTS &&
+                    dynamic::UnconstructedEmptySlots<key_type>::value;
+
+            // Fill an empty slot with fill_key, which must be *param_->default_fill_key_ or
+            // *param_->second_default_key_
+            FPH_ALWAYS_INLINE void ConstructFillKey(slot_type *slot_ptr, const key_type &fill_key) {
+                if constexpr (!EMPTY_SLOTS_UNCONSTRUCTED) {
                     KeyAllocator key_alloc{};
-                    for (size_t i = 0; i < param_->item_num_ceil_; ++i) {
-                        if (IsSlotEmpty(i)) {
-                            std::allocator_traits<KeyAllocator>::destroy(key_alloc, std::addressof(slot_[i].key));
-                        }
-                        else {
-                            std::allocator_traits<Allocator>::destroy(param_->alloc_, std::addressof(slot_[i].mutable_value));
-                        }
-                    }
+                    std::allocator_traits<KeyAllocator>::construct(key_alloc,
+                                                                   std::addressof(slot_ptr->key), fill_key);
+                }
+                else {
+                    (void)slot_ptr;
+                    (void)fill_key;
                 }
             }
 
-
-            template<bool is_rehash, bool called_by_rehash, bool use_move,
-                    bool last_element_only_has_key=false,
-                    class InputIt>
-            void BuildImp(InputIt pair_begin, InputIt pair_end, uint64_t seed = 0,
-                          bool verbose = false, double c = 3.0,
-                          double keys_first_part_ratio = 0.6, double buckets_first_part_ratio = 0.3,
-                          size_t max_try_seed0_time = 10,
-                          size_t max_try_seed1_time = 10, size_t max_try_seed2_time = 1000,
-                          size_t max_reseed2_time = 1000) {
-
-
-                auto build_start_time = std::chrono::high_resolution_clock::now();
-
-                if FPH_UNLIKELY(c < 1.45) {
-                    ThrowRuntimeError("c must be no less than 1.45");
+            // Destroy the fill key of an empty slot before the slot is filled with an element
+            FPH_ALWAYS_INLINE void DestroyFillKey(slot_type *slot_ptr) {
+                if constexpr (!EMPTY_SLOTS_UNCONSTRUCTED) {
+                    KeyAllocator key_alloc{};
+                    std::allocator_traits<KeyAllocator>::destroy(key_alloc, std::addressof(slot_ptr->key));
+                }
+                else {
+                    (void)slot_ptr;
                 }
+            }
 
-                if FPH_UNLIKELY(keys_first_part_ratio < 0.0 || keys_first_part_ratio > 1.0) {
-                    ThrowRuntimeError("keys_first_part_ratio must be in [0.0, 1.0]");
+            // build the table from the value_num elements moved to temp_pair_buf_, then destroy them
+            void BuildFromTempBuf(value_type *temp_value_buf_start, size_t value_num) {
+                Build<true, true, true>(temp_value_buf_start, temp_value_buf_start + value_num, seed1_,
+#if FPH_DEBUG_FLAG
+                        true,
+#else
+                                  false,
+#endif
+                                  param_->bits_per_key_,
+#if FPH_DY_DUAL_BUCKET_SET
+                        keys_first_part_ratio_, buckets_first_part_ratio_
+#else
+                                  DEFAULT_KEYS_FIRST_PART_RATIO, DEFAULT_BUCKETS_FIRST_PART_RATIO
+#endif
+                );
+                for (auto *temp_buf_ptr = temp_value_buf_start; temp_buf_ptr != temp_value_buf_start + value_num; temp_buf_ptr++) {
+                    std::allocator_traits<Allocator>::destroy(param_->alloc_, temp_buf_ptr);
                 }
+                param_->temp_pair_buf_.clear();
+                param_->temp_pair_buf_.shrink_to_fit();
+                param_->temp_seed0_hash_buf_.clear();
+            }
 
-                if FPH_UNLIKELY(buckets_first_part_ratio < 0.0 || buckets_first_part_ratio > 1.0) {
-                    ThrowInvalidArgument("buckets_first_part_ratio must be in [0.0, 1.0]");
+            // the bytes of n elements of Vector, std::vector<bool> packs 8 of them in a byte
+            template<class Vector>
+            static size_t VectorBytes(size_t n) noexcept {
+                if constexpr (std::is_same_v<typename Vector::value_type, bool>) {
+                    return (n + 7U) / 8U;
+                }
+                else {
+                    return n * sizeof(typename Vector::value_type);
+                }
+            }
+
+            // free the memory of vec, @return the number of bytes freed
+            template<class Vector>
+            static size_t ReleaseVector(Vector &vec) {
+                size_t released_bytes = VectorBytes<Vector>(vec.capacity());
+                Vector(vec.get_allocator()).swap(vec);
+                return released_bytes;
+            }
+
+            static const key_type &KeyOfValue(const value_type &value) noexcept {
+                return slot_type::GetSlotAddressByValueAddress(std::addressof(value))->key;
+            }
+
+            template<class InsertIt, class EraseIt>
+            void BulkUpdateImp(InsertIt insert_first, InsertIt insert_last, EraseIt erase_first, EraseIt erase_last) {
+                using InsertTraits = std::iterator_traits<InsertIt>;
+                if constexpr (!std::is_base_of_v<std::forward_iterator_tag, typename InsertTraits::iterator_category>
+                              || !std::is_reference_v<typename InsertTraits::reference>
+                              || !std::is_same_v<std::remove_cv_t<std::remove_reference_t<
+                                      typename InsertTraits::reference>>, value_type>) {
+                    // the new values are read twice, so keep them in a buffer first
+                    std::vector<value_type> insert_buf(insert_first, insert_last);
+                    BulkUpdateImp(std::make_move_iterator(insert_buf.begin()),
+                                  std::make_move_iterator(insert_buf.end()), erase_first, erase_last);
+                }
+                else {
+                    // the elements to erase are skipped when the elements are moved out of the slots,
+                    // the ones in the stash are erased at once
+                    std::vector<bool> erased_flags;
+                    size_t erased_num = 0;
+                    for (; erase_first != erase_last; ++erase_first) {
+                        auto it = find(*erase_first);
+                        if (it == end()) {
+                            continue;
+                        }
+                        slot_type *slot_ptr = it.value_ptr();
+                        if (IsStashSlot(slot_ptr)) {
+                            EraseStashImp(slot_ptr);
+                            continue;
+                        }
+                        if (erased_flags.empty()) {
+                            erased_flags.resize(param_->item_num_ceil_, false);
+                        }
+                        if (!erased_flags[slot_ptr - slot_]) {
+                            erased_flags[slot_ptr - slot_] = true;
+                            ++erased_num;
+                        }
+                    }
+                    auto is_erased = [&](const slot_type *slot_ptr) {
+                        return !erased_flags.empty() && !IsStashSlot(slot_ptr) && erased_flags[slot_ptr - slot_];
+                    };
+
+                    // (seed0 hash, index in new_its) of the new values whose keys are not in the table
+                    std::vector<std::pair<size_t, size_t>> new_entries;
+                    std::vector<InsertIt> new_its;
+                    for (auto it = insert_first; it != insert_last; ++it) {
+                        const key_type &key = KeyOfValue(*it);
+                        const size_t k_seed0_hash = hash_(key, seed0_);
+                        const auto *value_ptr = GetPointerBySlotPos(GetSlotPosBySeed0Hash(k_seed0_hash),
+                                                                    k_seed0_hash, key);
+                        if (value_ptr != nullptr && !is_erased(slot_type::GetSlotAddressByValueAddress(value_ptr))) {
+                            continue;
+                        }
+                        new_entries.emplace_back(k_seed0_hash, new_its.size());
+                        new_its.push_back(it);
+                    }
+                    // the repeated keys have the same hash, keep the first of them
+                    std::stable_sort(new_entries.begin(), new_entries.end(),
+                                     [](const auto &a, const auto &b) { return a.first < b.first; });
+                    size_t new_num = 0, hash_group_begin = 0;
+                    for (size_t i = 0; i < new_entries.size(); ++i) {
+                        if (new_num == 0 || new_entries[new_num - 1U].first != new_entries[i].first) {
+                            hash_group_begin = new_num;
+                        }
+                        const key_type &key = KeyOfValue(*new_its[new_entries[i].second]);
+                        bool repeated = false;
+                        for (size_t j = hash_group_begin; j < new_num && !repeated; ++j) {
+                            repeated = key_equal_(KeyOfValue(*new_its[new_entries[j].second]), key);
+                        }
+                        if (!repeated) {
+                            new_entries[new_num++] = new_entries[i];
+                        }
+                    }
+                    new_entries.resize(new_num);
+
+                    if (new_num == 0 && erased_num == 0) {
+                        return;
+                    }
+                    const size_t total_num = param_->item_num_ - erased_num + new_num;
+                    if (total_num == 0) {
+                        clear();
+                        return;
+                    }
+                    size_type new_item_ceil_num = dynamic::detail::Ceil2(
+                            size_t(std::ceil(total_num / param_->max_load_factor_)));
+                    new_item_ceil_num = std::max(new_item_ceil_num, param_->item_num_ceil_);
+                    new_item_ceil_num = std::min(new_item_ceil_num, MAX_ITEM_NUM_CEIL_LIMIT);
+                    new_item_ceil_num = std::max(new_item_ceil_num, DEFAULT_INIT_ITEM_NUM_CEIL);
+                    slot_index_policy_.UpdateBySlotNum(new_item_ceil_num);
+                    param_->temp_pair_buf_.resize(total_num * sizeof(value_type));
+                    value_type *temp_value_buf_start = reinterpret_cast<value_type*>(param_->temp_pair_buf_.data());
+                    value_type *temp_value_buf = temp_value_buf_start;
+                    for (auto it = begin(); it != end(); ++it) {
+                        if (is_erased(it.value_ptr())) {
+                            continue;
+                        }
+                        if (slot_seed0_hash_ != nullptr) {
+                            param_->temp_seed0_hash_buf_.push_back(StoredSeed0Hash(it.value_ptr()));
+                        }
+                        std::allocator_traits<Allocator>::construct(param_->alloc_,
+                                                                    temp_value_buf++, std::move(*it));
+                    }
+                    for (const auto &entry: new_entries) {
+                        if (slot_seed0_hash_ != nullptr) {
+                            param_->temp_seed0_hash_buf_.push_back(entry.first);
+                        }
+                        std::allocator_traits<Allocator>::construct(param_->alloc_,
+                                                                    temp_value_buf++, *new_its[entry.second]);
+                    }
+                    param_->item_num_ = total_num;
+                    BuildFromTempBuf(temp_value_buf_start, total_num);
+                }
+            }
+
+            void DestroySlots() {
+                if (slot_ != nullptr) {
+                    DestroyStash();
+                    for (size_t i = 0; i < param_->item_num_ceil_; ++i) {
+                        if (IsSlotEmpty(i)) {
+                            DestroyFillKey(slot_ + i);
+                        }
+                        else {
+                            std::allocator_traits<Allocator>::destroy(param_->alloc_, std::addressof(slot_[i].mutable_value));
+                        }
+                    }
+                }
+            }
+
+
+            template<bool is_rehash, bool called_by_rehash, bool use_move,
+                    bool last_element_only_has_key=false,
+                    class InputIt>
+            void BuildImp(InputIt pair_begin, InputIt pair_end, uint64_t seed = 0,
+                          bool verbose = false, double c = 3.0,
+                          double keys_first_part_ratio = 0.6, double buckets_first_part_ratio = 0.3,
+                          size_t max_try_seed0_time = 10,
+                          size_t max_try_seed1_time = 10, size_t max_try_seed2_time = 1000,
+                          size_t max_reseed2_time = 1000) {
+
+
+                auto build_start_time = std::chrono::high_resolution_clock::now();
+
+                if FPH_UNLIKELY(c < 1.45) {
+                    ThrowRuntimeError("c must be no less than 1.45");
+                }
+
+                if FPH_UNLIKELY(keys_first_part_ratio < 0.0 || keys_first_part_ratio > 1.0) {
+                    ThrowRuntimeError("keys_first_part_ratio must be in [0.0, 1.0]");
+                }
+
+                if FPH_UNLIKELY(buckets_first_part_ratio < 0.0 || buckets_first_part_ratio > 1.0) {
+                    ThrowInvalidArgument("buckets_first_part_ratio must be in [0.0, 1.0]");
                 }
 
 
@@ -3211,6 +4591,8 @@ namespace fph {
                 DestroySlots();
 
                 param_->item_num_ = key_num;
+                // the build recreates the state released by Freeze()
+                param_->frozen_ = false;
 
                 if (key_num != 0) {
 //                    size_t temp_slot_num = size_t((double)key_num / MAX_LOAD_FACTOR_UPPER_LIMIT);
@@ -3332,6 +4714,42 @@ namespace fph {
 
 
 
+                constexpr bool random_access_input = std::is_base_of<std::random_access_iterator_tag,
+                        typename std::iterator_traits<InputIt>::iterator_category>::value;
+                const bool parallel_build = param_->build_concurrency_ > 1U && key_num >= PARALLEL_BUILD_MIN_KEY_NUM;
+                const size_t build_chunk_num = parallel_build ?
+                                               param_->build_concurrency_ * PARALLEL_BUILD_CHUNKS_PER_TASK : 1U;
+                using input_difference_type = typename std::iterator_traits<InputIt>::difference_type;
+                auto input_value_address = [&](size_t index) {
+                    return std::addressof(*std::next(pair_begin, static_cast<input_difference_type>(index)));
+                };
+                (void)input_value_address;
+                // the entries of the buckets are the indices of the input keys until the slots are
+                // constructed
+                std::vector<const key_type *, KeyPointerAllocator> input_key_ptr_vec;
+                input_key_ptr_vec.reserve(key_num);
+                for (auto it = pair_begin; it != pair_end; ++it) {
+                    input_key_ptr_vec.push_back(std::addressof(
+                            slot_type::GetSlotAddressByValueAddress(std::addressof(*it))->key));
+                }
+                // the seed0 hash of every input key, computed once for each seed0 and reused by all
+                // the tries of seed1 and seed2
+                SizeTVector input_seed0_hash_vec;
+                // a rehash of a table storing the hashes tries the current seed0 first, with the
+                // stored hashes of the elements
+                const bool keep_seed0 = is_rehash && param_->temp_seed0_hash_buf_.size() == key_num;
+                if (keep_seed0) {
+                    input_seed0_hash_vec.swap(param_->temp_seed0_hash_buf_);
+                }
+                else {
+                    input_seed0_hash_vec.resize(key_num);
+                }
+                auto input_seed0_hash_of_entry = [&](size_t input_index) {
+                    return input_seed0_hash_vec[input_index];
+                };
+                // the bucket index of every input key
+                BucketParamVector key_bucket_index_vec(key_num);
+
                 std::mt19937_64 random_engine(seed);
                 std::uniform_int_distribution<size_t> random_dis;
 
@@ -3339,8 +4757,19 @@ namespace fph {
 
                 for (size_t try_seed0_time = 0; try_seed0_time < max_try_seed0_time; ++ try_seed0_time) {
 
-                    seed0_ = random_dis(random_engine);
-                    seed0_ |= size_t(1ULL);
+                    if (!keep_seed0 || try_seed0_time > 0) {
+                        seed0_ = random_dis(random_engine);
+                        seed0_ |= size_t(1ULL);
+
+                        parallel_detail::RunBuildTasks(param_->build_executor_, build_chunk_num,
+                                                       [&](size_t chunk_index) {
+                            auto [chunk_begin, chunk_end] = parallel_detail::ChunkRange(
+                                    key_num, build_chunk_num, chunk_index);
+                            for (size_t i = chunk_begin; i < chunk_end; ++i) {
+                                input_seed0_hash_vec[i] = hash_(*input_key_ptr_vec[i], seed0_);
+                            }
+                        });
+                    }
 
                     for (size_t try_seed1_time = 0; try_seed1_time < max_try_seed1_time; ++try_seed1_time) {
 
@@ -3356,30 +4785,15 @@ namespace fph {
                         // ordering
 
 
-                        size_t max_bucket_size = 0;
-
-
-                        param_->bucket_array_.resize(0);
-                        for (size_t i = 0; i < param_->bucket_num_; ++i) {
-                            param_->bucket_array_.emplace_back(i);
-                        }
-
-                        auto update_bucket_func = [&](const auto *value_ptr) {
-                            const auto *slot_ptr = reinterpret_cast<const slot_type *>(value_ptr);
-//                            size_t hash_value = GetBucketIndex(slot_ptr->key);
-                            size_t hash_value = CompleteGetBucketIndex(slot_ptr->key);
-                            assert(hash_value < param_->bucket_num_);
-                            auto &temp_bucket = param_->bucket_array_[hash_value];
-                            ++temp_bucket.entry_cnt;
-                            max_bucket_size =
-                                    temp_bucket.entry_cnt > max_bucket_size ? temp_bucket.entry_cnt
-                                                                            : max_bucket_size;
-                            temp_bucket.AddKey(&(slot_ptr->key));
-                        };
-
-                        for (auto it = pair_begin; it != pair_end; ++it) {
-                            update_bucket_func(std::addressof(*it));
-                        }
+                        parallel_detail::RunBuildTasks(param_->build_executor_, build_chunk_num,
+                                                       [&](size_t chunk_index) {
+                            auto [chunk_begin, chunk_end] = parallel_detail::ChunkRange(
+                                    key_num, build_chunk_num, chunk_index);
+                            for (size_t i = chunk_begin; i < chunk_end; ++i) {
+                                key_bucket_index_vec[i] = GetBucketIndex(input_seed0_hash_vec[i]);
+                            }
+                        });
+                        size_t max_bucket_size = AssignBucketEntries(key_bucket_index_vec);
 
                         std::vector<size_t, SizeTAllocator> sorted_index_array;
                         sorted_index_array.resize(param_->bucket_num_);
@@ -3410,26 +4824,33 @@ namespace fph {
                         for (size_t try_seed2_time = 0; try_seed2_time < max_try_seed2_time; ++try_seed2_time) {
 
                             bool found_useful_seed2 = false;
-                            for (size_t seed_time = 0; seed_time < max_reseed2_time; ++seed_time) {
-                                seed2_ = random_dis(random_engine);
-                                seed2_ |= size_t(1ULL);
-
-                                bool pass_test_flag = true;
-                                for (size_t i = 0; i < param_->bucket_num_; ++i) {
-                                    auto &testing_bucket = param_->bucket_array_[sorted_index_array[i]];
-                                    pass_test_flag &= TestBucketSelfCollision(testing_bucket,
-                                                                              param_->seed2_test_table_,
-                                                                              param_->tested_hash_vec_, seed2_);
-
-                                    if (!pass_test_flag) {
+                            if (parallel_build) {
+                                found_useful_seed2 = ParallelFindSeed2(sorted_index_array, input_seed0_hash_of_entry,
+                                                                       random_engine, random_dis, max_reseed2_time);
+                            }
+                            else {
+                                for (size_t seed_time = 0; seed_time < max_reseed2_time; ++seed_time) {
+                                    seed2_ = random_dis(random_engine);
+                                    seed2_ |= size_t(1ULL);
+
+                                    bool pass_test_flag = true;
+                                    for (size_t i = 0; i < param_->bucket_num_; ++i) {
+                                        auto &testing_bucket = param_->bucket_array_[sorted_index_array[i]];
+                                        pass_test_flag &= TestBucketSelfCollision(testing_bucket,
+                                                                                  input_seed0_hash_of_entry,
+                                                                                  param_->seed2_test_table_,
+                                                                                  param_->tested_hash_vec_, seed2_);
+
+                                        if (!pass_test_flag) {
+                                            break;
+                                        }
+                                    }
+                                    if (pass_test_flag) {
+                                        found_useful_seed2 = true;
                                         break;
                                     }
-                                }
-                                if (pass_test_flag) {
-                                    found_useful_seed2 = true;
-                                    break;
-                                }
 
+                                }
                             }
                             if (!found_useful_seed2) {
                                 continue;
@@ -3446,9 +4867,13 @@ namespace fph {
 
                             //                        assert(IsRandomTableValid(param_->random_table_, param_->map_table_));
                             param_->filled_count_ = 0;
+                            param_->slot_occupancy_.Reset(param_->item_num_ceil_);
 
                             std::vector<size_t, SizeTAllocator> bucket_pattern;
                             bucket_pattern.reserve(max_bucket_size);
+                            // the slot positions of the pattern at offset 0
+                            std::vector<size_t, SizeTAllocator> bucket_pattern_pos;
+                            bucket_pattern_pos.reserve(max_bucket_size);
 
                             bool this_try_seed2_succeed_flag = true;
 
@@ -3466,8 +4891,9 @@ namespace fph {
 
                                     bucket_pattern.clear();
 
-                                    for (const auto *key_ptr: temp_bucket.key_array) {
-                                        size_t temp_hash = CompleteHash(*key_ptr, try_seed);
+                                    const auto *entry_begin = BucketEntryBegin(temp_bucket);
+                                    for (size_t i = 0; i < temp_bucket.entry_cnt; ++i) {
+                                        size_t temp_hash = MidHash(input_seed0_hash_of_entry(entry_begin[i]), try_seed);
 //                                        size_t temp_hash = hash_(*key_ptr, try_seed);
                                         //                                    size_t temp_hash = hash_(*key_ptr, try_seed) & item_num_mask_;
                                         bucket_pattern.push_back(temp_hash);
@@ -3487,37 +4913,35 @@ namespace fph {
 
                                     size_t item_num_mask = slot_index_policy_.slot_num() - size_t(1ULL);
 
+                                    bucket_pattern_pos.clear();
+                                    for (auto temp_hash_value: bucket_pattern) {
+                                        bucket_pattern_pos.push_back(slot_index_policy_.MapToIndex(temp_hash_value));
+                                    }
+
                                     for (size_t search_pos_begin = param_->filled_count_;
                                          search_pos_begin < param_->item_num_ceil_; ++search_pos_begin) {
-                                        //                                    size_t temp_offset =
-                                        //                                            (param_->item_num_ceil_ + param_->random_table_[search_pos_begin]
-                                        //                                             - bucket_pattern[0]) & item_num_mask_;
+                                        // the first offset puts the first key in the free slot random_table_[search_pos_begin],
+                                        // and the next 63 offsets are tested with it at once
                                         size_t temp_offset = (param_->item_num_ceil_ + param_->random_table_[search_pos_begin]
-                                                              - slot_index_policy_.MapToIndex(bucket_pattern[0]) ) & item_num_mask;
-                                        bool this_offset_passed_flag = true;
-                                        for (auto temp_hash_value: bucket_pattern) {
-                                            auto temp_pos = slot_index_policy_.MapToIndex(temp_hash_value + slot_index_policy_.ReverseMap(temp_offset));
-                                            //                                        auto temp_pos =
-                                            //                                                (temp_hash_value + temp_offset) & item_num_mask_;
-                                            if (param_->map_table_[temp_pos] < param_->filled_count_) {
-                                                this_offset_passed_flag = false;
-                                                break;
-                                            }
-                                        }
-                                        if (this_offset_passed_flag) {
+                                                              - bucket_pattern_pos[0]) & item_num_mask;
+                                        uint64_t free_offset_mask = param_->slot_occupancy_.FreeOffsetMask(bucket_pattern_pos,
+                                                                                                           temp_offset);
+                                        if (free_offset_mask != 0) {
                                             pattern_matched_flag = true;
-                                            for (auto temp_hash_value: bucket_pattern) {
-                                                auto temp_pos = slot_index_policy_.MapToIndex(temp_hash_value + slot_index_policy_.ReverseMap(temp_offset));
-                                                //                                            auto temp_pos =
-                                                //                                                    (temp_hash_value + temp_offset) & item_num_mask_;
+                                            temp_offset = (temp_offset + occupancy_detail::CountTrailingZero64(free_offset_mask))
+                                                          & item_num_mask;
+                                            for (auto pattern_pos: bucket_pattern_pos) {
+                                                auto temp_pos = (pattern_pos + temp_offset) & item_num_mask;
                                                 auto y_pos = param_->map_table_[temp_pos];
+                                                assert(y_pos >= param_->filled_count_);
                                                 std::swap(param_->random_table_[param_->filled_count_],
                                                           param_->random_table_[y_pos]);
                                                 std::swap(param_->map_table_[param_->random_table_[param_->filled_count_]],
                                                           param_->map_table_[param_->random_table_[y_pos]]);
                                                 ++param_->filled_count_;
+                                                param_->slot_occupancy_.Occupy(temp_pos);
                                             }
-                                            bucket_p_array_[temp_bucket.index] =
+                                            bucket_p_array_[sorted_index_array[bucket_index]] =
                                                     (temp_offset << 1U) | bucket_try_bit;
 
                                             break;
@@ -3580,6 +5004,11 @@ namespace fph {
 
                     slot_ = SlotAllocator().allocate(param_->slot_capacity_);
 
+                    if (slot_seed0_hash_ != nullptr) {
+                        SizeTAllocator{}.deallocate(slot_seed0_hash_, old_slot_capacity);
+                        slot_seed0_hash_ = SizeTAllocator{}.allocate(param_->slot_capacity_);
+                    }
+
                 }
 
 
@@ -3590,10 +5019,6 @@ namespace fph {
                     auto default_key = (*param_->key_gen_)();
 
                     KeyAllocator key_alloc;
-                    for (size_t i = 0; i < param_->item_num_ceil_; ++i) {
-                        std::allocator_traits<KeyAllocator>::construct(key_alloc,
-                                                                       std::addressof(slot_[i].key), default_key);
-                    }
 
                     auto default_key_slot_index = GetSlotPos(default_key);
 
@@ -3632,10 +5057,16 @@ namespace fph {
                     std::allocator_traits<KeyAllocator>::construct(
                             key_alloc, param_->second_default_key_, fill_key);
 
-                    std::allocator_traits<KeyAllocator>::destroy(key_alloc, std::addressof(slot_[default_key_slot_index].key));
-                    std::allocator_traits<KeyAllocator>::construct(
-                            key_alloc, std::addressof(slot_[default_key_slot_index].key),
-                            *param_->second_default_key_);
+                    // fill the slots after the default keys are constructed, the empty slots may
+                    // share their bytes
+                    for (size_t i = 0; i < param_->item_num_ceil_; ++i) {
+                        if FPH_LIKELY(i != default_key_slot_index) {
+                            ConstructFillKey(slot_ + i, *param_->default_fill_key_);
+                        }
+                        else {
+                            ConstructFillKey(slot_ + i, *param_->second_default_key_);
+                        }
+                    }
 
                     param_->default_fill_key_address_ = slot_ + default_key_slot_index;
                     param_->default_fill_key_bucket_index_ = CompleteGetBucketIndex(default_key);
@@ -3644,13 +5075,20 @@ namespace fph {
 
 
 
+                // the relocation log entries of the input elements are pushed by the caller before a rehash
+                const size_t relocation_log_base = is_rehash && Policy::TRACK_SLOT_RELOCATION ?
+                        param_->slot_relocation_log_.size() - key_num : 0;
+                (void)relocation_log_base;
+                // the slot position of every input key
+                auto &input_slot_pos_vec = key_bucket_index_vec;
+
                 if constexpr (use_move || (is_rehash && std::is_move_constructible<value_type>::value)) {
-                    auto construct_pair_func_move = [&](value_type &&value, bool only_key) {
+                    auto construct_pair_func_move = [&](value_type &&value, bool only_key, size_t k_seed0_hash) {
                         slot_type* slot_ptr = slot_type::GetSlotAddressByValueAddress(std::addressof(value));
-                        auto slot_pos = GetSlotPos(slot_ptr->key);
+                        auto slot_pos = GetSlotPosBySeed0Hash(k_seed0_hash);
                         auto *insert_address = slot_ + slot_pos;
+                        DestroyFillKey(insert_address);
                         KeyAllocator key_alloc{};
-                        std::allocator_traits<KeyAllocator>::destroy(key_alloc, std::addressof(insert_address->key));
                         if (only_key) {
                             std::allocator_traits<KeyAllocator>::construct(key_alloc, std::addressof(insert_address->key), std::move(slot_ptr->key));
                         }
@@ -3659,14 +5097,43 @@ namespace fph {
                                                                         std::addressof(insert_address->mutable_value),
                                                                         std::move(value));
                         }
+                        return slot_pos;
                     };
-                    if constexpr (is_rehash) {
+                    // the keys map to distinct slots, so the slots can be constructed in parallel
+                    // as long as the construction does not throw
+                    constexpr bool parallel_construct = random_access_input
+                            && std::is_nothrow_move_constructible<value_type>::value
+                            && std::is_nothrow_move_constructible<key_type>::value;
+                    if (parallel_construct && parallel_build) {
+                        if constexpr (parallel_construct) {
+                            parallel_detail::RunBuildTasks(param_->build_executor_, build_chunk_num,
+                                                           [&](size_t chunk_index) {
+                                auto [chunk_begin, chunk_end] = parallel_detail::ChunkRange(
+                                        key_num, build_chunk_num, chunk_index);
+                                for (size_t i = chunk_begin; i < chunk_end; ++i) {
+                                    bool only_key = last_element_only_has_key && (i + 1U == key_num);
+                                    auto slot_pos = construct_pair_func_move(std::move(*input_value_address(i)),
+                                                                             only_key, input_seed0_hash_vec[i]);
+                                    input_slot_pos_vec[i] = slot_pos;
+                                    if constexpr (is_rehash && Policy::TRACK_SLOT_RELOCATION) {
+                                        param_->slot_relocation_log_[relocation_log_base + i].second = slot_pos;
+                                    }
+                                }
+                            });
+                        }
+                    }
+                    else if constexpr (is_rehash) {
                         size_t temp_key_cnt = 0;
                         for (auto it = pair_begin; it != pair_end; ++it) {
                             ++temp_key_cnt;
                             bool only_key = last_element_only_has_key && (temp_key_cnt == key_num);
                             static_assert(std::is_move_constructible<value_type>::value);
-                            construct_pair_func_move(std::move(*it), only_key);
+                            auto slot_pos = construct_pair_func_move(std::move(*it), only_key,
+                                    input_seed0_hash_vec[temp_key_cnt - 1U]);
+                            input_slot_pos_vec[temp_key_cnt - 1U] = slot_pos;
+                            if constexpr (Policy::TRACK_SLOT_RELOCATION) {
+                                param_->slot_relocation_log_[relocation_log_base + temp_key_cnt - 1U].second = slot_pos;
+                            }
 
                         }
                     }
@@ -3676,17 +5143,18 @@ namespace fph {
                         for (auto it = pair_begin; it != pair_end; ++it) {
                             ++temp_key_cnt;
                             bool only_key = last_element_only_has_key && (temp_key_cnt == key_num);
-                            construct_pair_func_move(std::move(*it), only_key);
+                            input_slot_pos_vec[temp_key_cnt - 1U] = construct_pair_func_move(std::move(*it), only_key,
+                                    input_seed0_hash_vec[temp_key_cnt - 1U]);
                         }
                     }
                 }
                 else {
-                    auto construct_pair_func = [&](InputIt it, bool only_key) {
+                    auto construct_pair_func = [&](InputIt it, bool only_key, size_t k_seed0_hash) {
                         const slot_type* slot_ptr = slot_type::GetSlotAddressByValueAddress(std::addressof(*it));
-                        auto slot_pos = GetSlotPos(slot_ptr->key);
+                        auto slot_pos = GetSlotPosBySeed0Hash(k_seed0_hash);
                         auto *insert_address = slot_ + slot_pos;
+                        DestroyFillKey(insert_address);
                         KeyAllocator key_alloc{};
-                        std::allocator_traits<KeyAllocator>::destroy(key_alloc, std::addressof(insert_address->key));
                         if (only_key) {
                             std::allocator_traits<KeyAllocator>::construct(key_alloc, std::addressof(insert_address->key), slot_ptr->key);
                         }
@@ -3695,14 +5163,38 @@ namespace fph {
                                                                         std::addressof(insert_address->mutable_value),
                                                                         *it);
                         }
+                        return slot_pos;
                     };
 
-                    if constexpr (!is_rehash) {
+                    constexpr bool parallel_construct = random_access_input
+                            && std::is_nothrow_constructible<value_type,
+                                    typename std::iterator_traits<InputIt>::reference>::value
+                            && std::is_nothrow_copy_constructible<key_type>::value;
+                    if (parallel_construct && parallel_build) {
+                        if constexpr (parallel_construct) {
+                            parallel_detail::RunBuildTasks(param_->build_executor_, build_chunk_num,
+                                                           [&](size_t chunk_index) {
+                                auto [chunk_begin, chunk_end] = parallel_detail::ChunkRange(
+                                        key_num, build_chunk_num, chunk_index);
+                                for (size_t i = chunk_begin; i < chunk_end; ++i) {
+                                    bool only_key = last_element_only_has_key && (i + 1U == key_num);
+                                    auto slot_pos = construct_pair_func(
+                                            std::next(pair_begin, static_cast<input_difference_type>(i)),
+                                            only_key, input_seed0_hash_vec[i]);
+                                    input_slot_pos_vec[i] = slot_pos;
+                                    if constexpr (is_rehash && Policy::TRACK_SLOT_RELOCATION) {
+                                        param_->slot_relocation_log_[relocation_log_base + i].second = slot_pos;
+                                    }
+                                }
+                            });
+                        }
+                    }
+                    else if constexpr (!is_rehash) {
                         size_t temp_key_cnt = 0;
                         for (auto it = pair_begin; it != pair_end; ++it) {
                             ++temp_key_cnt;
                             bool only_key = last_element_only_has_key && (temp_key_cnt == key_num);
-                            construct_pair_func(it, only_key);
+                            input_slot_pos_vec[temp_key_cnt - 1U] = construct_pair_func(it, only_key, input_seed0_hash_vec[temp_key_cnt - 1U]);
                         }
                     }
                     else {
@@ -3711,13 +5203,30 @@ namespace fph {
                             ++temp_key_cnt;
                             bool only_key = last_element_only_has_key && (temp_key_cnt == key_num);
                             assert(!std::is_move_constructible<value_type>::value);
-                            construct_pair_func(it, only_key);
+                            auto slot_pos = construct_pair_func(it, only_key, input_seed0_hash_vec[temp_key_cnt - 1U]);
+                            input_slot_pos_vec[temp_key_cnt - 1U] = slot_pos;
+                            if constexpr (Policy::TRACK_SLOT_RELOCATION) {
+                                param_->slot_relocation_log_[relocation_log_base + temp_key_cnt - 1U].second = slot_pos;
+                            }
                         }
                     }
                 }
 
 
 
+                // the entries of the buckets become the slot positions of the keys
+                parallel_detail::RunBuildTasks(param_->build_executor_, build_chunk_num,
+                                               [&](size_t chunk_index) {
+                    auto [chunk_begin, chunk_end] = parallel_detail::ChunkRange(
+                            key_num, build_chunk_num, chunk_index);
+                    for (size_t i = chunk_begin; i < chunk_end; ++i) {
+                        param_->bucket_entry_array_[i] = input_slot_pos_vec[param_->bucket_entry_array_[i]];
+                        if (slot_seed0_hash_ != nullptr) {
+                            slot_seed0_hash_[input_slot_pos_vec[i]] = input_seed0_hash_vec[i];
+                        }
+                    }
+                });
+
 #if FPH_ENABLE_ITERATOR
                 if (param_->item_num_ > 0) {
                     auto begin_it_pos = param_->random_table_[0];
@@ -3728,17 +5237,6 @@ namespace fph {
                 } else {
                     param_->begin_it_ = iterator(nullptr, nullptr);
                 }
-
-                for (auto &bucket_param: param_->bucket_array_) {
-                    bucket_param.key_array.clear();
-                }
-                for (auto it = begin(); it != end(); ++it) {
-                    const auto* slot_address = slot_type::GetSlotAddressByValueAddress(std::addressof(*it));
-                    auto bucket_index = CompleteGetBucketIndex(slot_address->key);
-//                    auto bucket_index = this->GetBucketIndex(slot_address->key);
-                    auto &key_array = param_->bucket_array_[bucket_index].key_array;
-                    key_array.push_back(&(slot_address->key));
-                }
 #endif
 
                 if (verbose) {
@@ -3802,6 +5300,10 @@ namespace fph {
                 return size_t(1UL) << (std::numeric_limits<size_t>::digits - shift_bits_);
             }
 
+            uint32_t shift_bits() const noexcept {
+                return shift_bits_;
+            }
+
             void UpdateBySlotNum(size_t element_num) {
                 size_t round_up_log2_slot_num = dynamic::detail::RoundUpLog2(element_num);
                 shift_bits_ = std::numeric_limits<size_t>::digits - round_up_log2_slot_num;
@@ -3848,6 +5350,7 @@ namespace fph {
             using slot_type = DynamicSetSlotType<T>;
             using index_map_policy = HighBitsIndexMapPolicy;
 //            using index_map_policy = LowBitsIndexMapPolicy;
+            constexpr static bool TRACK_SLOT_RELOCATION = false;
         };
 
     } // namespace dynamic::detail
@@ -3986,102 +5489,1343 @@ namespace fph {
             using slot_type = DynamicMapSlotType<K, V>;
 //            using index_map_policy = LowBitsIndexMapPolicy;
             using index_map_policy = HighBitsIndexMapPolicy;
+            constexpr static bool TRACK_SLOT_RELOCATION = false;
         };
 
-    } // namespace dynamic detail
-
-    /**
-     * The dynamic perfect hash map container
-     * @tparam Key
-     * @tparam T
-     * @tparam SeedHash the operator() takes two arguments: key and a size_t seed
-     * @tparam KeyEqual
-     * @tparam Allocator
-     * @tparam BucketParamType
-     * @tparam RandomKeyGenerator the operator() returns a random key
-     */
-    template <class Key, class T,
-            class SeedHash = SimpleSeedHash<Key>,
-            class KeyEqual = std::equal_to<Key>,
-            class Allocator = std::allocator<std::pair<const Key, T>>,
-            class BucketParamType = uint32_t,
-            class RandomKeyGenerator = fph::dynamic::RandomGenerator<Key>
-    >
-    class DynamicFphMap : public dynamic::detail::DynamicRawSet<
-        dynamic::detail::DynamicFphMapPolicy<Key, T>,
-        SeedHash, KeyEqual, Allocator, BucketParamType, RandomKeyGenerator> {
-        using Base = typename DynamicFphMap::DynamicRawSet;
+        // The raw set of the keys of DynamicFphSoaMap. The mapped values are stored outside the
+        // slots, so the raw set records where the keys are moved to let the mapped values follow.
         template<class K>
-        using key_arg = typename Base::template key_arg<K>;
-    public:
+        class DynamicFphSoaKeyPolicy {
+        public:
+            using key_type = K;
+            using value_type = K;
+            using slot_type = DynamicSetSlotType<K>;
+            using index_map_policy = HighBitsIndexMapPolicy;
+            constexpr static bool TRACK_SLOT_RELOCATION = true;
+        };
 
-        using mapped_type = T;
+        // operator-> of an iterator whose reference is not a real reference
+        template<class Reference>
+        class ArrowProxy {
+        public:
+            explicit ArrowProxy(Reference ref) noexcept: ref_(ref) {}
 
-        using Base::Base;
+            Reference* operator->() noexcept {
+                return std::addressof(ref_);
+            }
 
-        using iterator = typename Base::iterator;
-        using key_type = typename Base::key_type;
+        protected:
+            Reference ref_;
+        };
 
-        using Base::find;
+        /**
+         * Iterator of DynamicFphSoaMap, dereference to a pair of the references to the key in the
+         * key slot and the mapped value at the same position of the mapped array
+         * @tparam KeyIterator iterator of the raw set of keys
+         * @tparam SlotType
+         * @tparam Key
+         * @tparam MappedType T or const T
+         */
+        template<class KeyIterator, class SlotType, class Key, class MappedType>
+        class SoaMapIterator {
+        public:
+            using iterator_category = std::forward_iterator_tag;
+            using value_type = std::pair<const Key, typename std::remove_const<MappedType>::type>;
+            using difference_type = std::ptrdiff_t;
+            using reference = std::pair<const Key&, MappedType&>;
+            using pointer = ArrowProxy<reference>;
 
-        using Base::emplace;
+            SoaMapIterator() noexcept: key_it_(), slot_base_(nullptr), mapped_base_(nullptr) {}
 
-        using Base::insert;
+            SoaMapIterator(KeyIterator key_it, const SlotType *slot_base, MappedType *mapped_base) noexcept:
+                    key_it_(key_it), slot_base_(slot_base), mapped_base_(mapped_base) {}
 
+            // iterator to const_iterator
+            template<class OtherMappedType, typename std::enable_if<
+                    std::is_same<const OtherMappedType, MappedType>::value
+                    && !std::is_same<OtherMappedType, MappedType>::value, int>::type = 0>
+            SoaMapIterator(const SoaMapIterator<KeyIterator, SlotType, Key, OtherMappedType> &other) noexcept:
+                    key_it_(other.key_iterator()), slot_base_(other.slot_base()),
+                    mapped_base_(other.mapped_base()) {}
 
-        template<class... Args>
-        std::pair<iterator, bool> try_emplace(const key_type& k, Args&&... args) {
-            return this-> template TryEmplaceImp<>(k, std::forward<Args>(args)...);
-        }
+            reference operator*() const {
+                auto *slot_ptr = key_it_.value_ptr();
+                return reference(slot_ptr->key, mapped_base_[slot_ptr - slot_base_]);
+            }
 
-        template<class... Args>
-        std::pair<iterator, bool> try_emplace(key_type&& k, Args&&... args) {
-            return this-> template TryEmplaceImp<>(std::move(k),
-                    std::forward<Args>(args)...);
-        }
+            pointer operator->() const {
+                return pointer(**this);
+            }
 
-        T& operator[] (const key_type &key) {
-            return this->try_emplace(key).first->second;
-        }
+            SoaMapIterator& operator++() {
+                ++key_it_;
+                return *this;
+            }
 
-        T& operator[] (key_type&& key) {
-            return this->try_emplace(std::move(key)).first->second;
-        }
+            SoaMapIterator operator++(int) {
+                auto ret = *this;
+                ++key_it_;
+                return ret;
+            }
 
-        template<class K = key_type>
-        const T& operator[] (const key_arg<K> &key) const noexcept {
-            return this->GetPointerNoCheck(key)->second;
-        }
+            friend bool operator==(const SoaMapIterator &a, const SoaMapIterator &b) noexcept {
+                return a.key_it_.value_ptr() == b.key_it_.value_ptr();
+            }
 
-        template<class K = key_type>
-        T& at (const key_arg<K> &key) {
-            auto *pair_ptr = this->GetPointerNoCheck(key);
-            if FPH_UNLIKELY(!this->key_equal_(pair_ptr->first, key)) {
-                dynamic::detail::ThrowOutOfRange("Can not find key in at");
+            friend bool operator!=(const SoaMapIterator &a, const SoaMapIterator &b) noexcept {
+                return a.key_it_.value_ptr() != b.key_it_.value_ptr();
             }
-            return pair_ptr->second;
-        }
 
-        template<class K = key_type>
-        const T& at (const key_arg<K>& key) const {
-            const auto *pair_ptr = this->GetPointerNoCheck(key);
-            if FPH_UNLIKELY(!this->key_equal_(pair_ptr->first, key)) {
-                dynamic::detail::ThrowOutOfRange("Can not find key in at");
+            const KeyIterator& key_iterator() const noexcept {
+                return key_it_;
             }
-            return pair_ptr->second;
-        }
 
-    protected:
-    };
+            const SlotType* slot_base() const noexcept {
+                return slot_base_;
+            }
 
-    template <class Key, class T,
-            class SeedHash = SimpleSeedHash<Key>,
-            class KeyEqual = std::equal_to<Key>,
-            class Allocator = std::allocator<std::pair<const Key, T>>,
-            class BucketParamType = uint32_t,
-            class RandomKeyGenerator = fph::dynamic::RandomGenerator<Key> >
-    using dynamic_fph_map = DynamicFphMap<Key, T, SeedHash, KeyEqual, Allocator,
-                            BucketParamType, RandomKeyGenerator>;
+            MappedType* mapped_base() const noexcept {
+                return mapped_base_;
+            }
+
+        protected:
+            KeyIterator key_it_;
+            const SlotType *slot_base_;
+            MappedType *mapped_base_;
+        };
+
+        /**
+         * Iterator of DynamicFphDenseMap, walks the dense array of the elements and dereferences to
+         * a pair of the references to the key and the mapped value of the element
+         * @tparam Key
+         * @tparam MappedType T or const T
+         */
+        template<class Key, class MappedType>
+        class DenseMapIterator {
+        public:
+            using iterator_category = std::forward_iterator_tag;
+            using value_type = std::pair<const Key, typename std::remove_const<MappedType>::type>;
+            using difference_type = std::ptrdiff_t;
+            using reference = std::pair<const Key&, MappedType&>;
+            using pointer = ArrowProxy<reference>;
+            using entry_type = typename std::conditional<std::is_const<MappedType>::value,
+                    const std::pair<Key, typename std::remove_const<MappedType>::type>,
+                    std::pair<Key, MappedType>>::type;
+
+            DenseMapIterator() noexcept: entry_ptr_(nullptr) {}
+
+            explicit DenseMapIterator(entry_type *entry_ptr) noexcept: entry_ptr_(entry_ptr) {}
+
+            // iterator to const_iterator
+            template<class OtherMappedType, typename std::enable_if<
+                    std::is_same<const OtherMappedType, MappedType>::value
+                    && !std::is_same<OtherMappedType, MappedType>::value, int>::type = 0>
+            DenseMapIterator(const DenseMapIterator<Key, OtherMappedType> &other) noexcept:
+                    entry_ptr_(other.entry_ptr()) {}
+
+            reference operator*() const {
+                return reference(entry_ptr_->first, entry_ptr_->second);
+            }
+
+            pointer operator->() const {
+                return pointer(**this);
+            }
+
+            DenseMapIterator& operator++() {
+                ++entry_ptr_;
+                return *this;
+            }
+
+            DenseMapIterator operator++(int) {
+                auto ret = *this;
+                ++entry_ptr_;
+                return ret;
+            }
+
+            friend bool operator==(const DenseMapIterator &a, const DenseMapIterator &b) noexcept {
+                return a.entry_ptr_ == b.entry_ptr_;
+            }
+
+            friend bool operator!=(const DenseMapIterator &a, const DenseMapIterator &b) noexcept {
+                return a.entry_ptr_ != b.entry_ptr_;
+            }
+
+            entry_type* entry_ptr() const noexcept {
+                return entry_ptr_;
+            }
+
+        protected:
+            entry_type *entry_ptr_;
+        };
+
+    } // namespace dynamic detail
+
+    namespace dynamic::detail {
+
+        enum GatherKernelIsa: int {
+            GATHER_KERNEL_SCALAR = 0,
+            GATHER_KERNEL_AVX2,
+            GATHER_KERNEL_AVX512,
+        };
+
+        // the number of keys processed by one round of the vectorized gather kernels
+        constexpr size_t GATHER_KERNEL_BLOCK_SIZE = 16;
+
+        /**
+         * The part of a DynamicFphMap with 64-bit integer keys, 32-bit bucket params and
+         * HighBitsIndexMapPolicy that the vectorized gather kernels read
+         */
+        struct U64GatherTableView {
+            const uint32_t *bucket_p_array;
+            const char *slot_base;
+            uint64_t slot_size;
+            uint64_t value_offset;
+            uint64_t seed1;
+            uint64_t seed2;
+            uint32_t bucket_shift_bits;
+            uint32_t slot_shift_bits;
+        };
+
+        inline int DetectGatherKernelIsa() {
+#if FPH_X86_RUNTIME_DISPATCH
+            __builtin_cpu_init();
+            if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512dq")) {
+                return GATHER_KERNEL_AVX512;
+            }
+            if (__builtin_cpu_supports("avx2")) {
+                return GATHER_KERNEL_AVX2;
+            }
+#endif
+            return GATHER_KERNEL_SCALAR;
+        }
+
+        inline int& GatherKernelIsaRef() {
+            static int isa = DetectGatherKernelIsa();
+            return isa;
+        }
+
+        inline int GetGatherKernelIsa() {
+            return GatherKernelIsaRef();
+        }
+
+        /**
+         * Limit the kernels of GatherValues to isa and the ones below it, e.g. to test the AVX2
+         * kernel on a cpu with AVX-512. Not thread safe with the running GatherValues.
+         * @param isa one of GatherKernelIsa, capped by the features of the cpu
+         */
+        inline void LimitGatherKernelIsa(int isa) {
+            GatherKernelIsaRef() = std::min(isa, DetectGatherKernelIsa());
+        }
+
+#if FPH_X86_RUNTIME_DISPATCH
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+// some versions of gcc warn about the undefined vectors used inside the avx512 intrinsics
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+
+        // The seed0 hash of the kernels has to stay the same as ChosenSimpleSeedHash64
+        // (mix_hash = false) and ChosenMixSeedHash64 (mix_hash = true)
+
+        __attribute__((target("avx2"))) inline __m256i Mul64Avx2(__m256i a, __m256i b) {
+            __m256i lo = _mm256_mul_epu32(a, b);
+            __m256i cross = _mm256_add_epi64(_mm256_mul_epu32(_mm256_srli_epi64(a, 32), b),
+                                             _mm256_mul_epu32(a, _mm256_srli_epi64(b, 32)));
+            return _mm256_add_epi64(lo, _mm256_slli_epi64(cross, 32));
+        }
+
+        /**
+         * Look up keys 4 at a time with AVX2. n must be a multiple of GATHER_KERNEL_BLOCK_SIZE.
+         * The bits of the found keys are or-ed into out_found_mask.
+         * @return the number of found keys
+         */
+        template<bool mix_hash, class V>
+        __attribute__((target("avx2")))
+        size_t GatherU64Avx2(const U64GatherTableView &view, const uint64_t* FPH_RESTRICT keys,
+                             size_t n, V* FPH_RESTRICT out_values,
+                             uint64_t* FPH_RESTRICT out_found_mask) {
+            static_assert(sizeof(V) == 8 || sizeof(V) == 4);
+            constexpr size_t LANE_NUM = 4;
+            constexpr size_t VEC_NUM = GATHER_KERNEL_BLOCK_SIZE / LANE_NUM;
+            const __m128i bucket_shift = _mm_cvtsi32_si128(static_cast<int>(view.bucket_shift_bits));
+            const __m128i slot_shift = _mm_cvtsi32_si128(static_cast<int>(view.slot_shift_bits));
+            const __m256i seed1 = _mm256_set1_epi64x(static_cast<long long>(view.seed1));
+            const __m256i seed2 = _mm256_set1_epi64x(static_cast<long long>(view.seed2));
+            const __m256i one = _mm256_set1_epi64x(1);
+            const __m256i slot_size = _mm256_set1_epi64x(static_cast<long long>(view.slot_size));
+            const auto *bucket_base = reinterpret_cast<const int*>(view.bucket_p_array);
+            const auto *key_base = reinterpret_cast<const long long*>(view.slot_base);
+            const char *value_base = view.slot_base + view.value_offset;
+            alignas(32) uint64_t index_buf[GATHER_KERNEL_BLOCK_SIZE];
+            __m256i key_vec[VEC_NUM];
+            __m256i hash_vec[VEC_NUM];
+            size_t found_cnt = 0;
+            for (size_t block_begin = 0; block_begin < n; block_begin += GATHER_KERNEL_BLOCK_SIZE) {
+                for (size_t v = 0; v < VEC_NUM; ++v) {
+                    __m256i k = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(keys + block_begin + v * LANE_NUM));
+                    key_vec[v] = k;
+                    __m256i h = mix_hash ? _mm256_xor_si256(k, _mm256_srli_epi64(k, 32)) : k;
+                    hash_vec[v] = h;
+                    __m256i bucket_index = _mm256_srl_epi64(Mul64Avx2(h, seed1), bucket_shift);
+                    _mm256_store_si256(reinterpret_cast<__m256i*>(index_buf + v * LANE_NUM), bucket_index);
+                }
+                for (size_t i = 0; i < GATHER_KERNEL_BLOCK_SIZE; ++i) {
+                    FPH_PREFETCH(view.bucket_p_array + index_buf[i], 0, 3);
+                }
+                for (size_t v = 0; v < VEC_NUM; ++v) {
+                    __m256i bucket_index = _mm256_load_si256(reinterpret_cast<const __m256i*>(index_buf + v * LANE_NUM));
+                    __m256i bucket_param = _mm256_cvtepu32_epi64(
+                            _mm256_i64gather_epi32(bucket_base, bucket_index, 4));
+                    __m256i offset = _mm256_srli_epi64(bucket_param, 1);
+                    __m256i optional_bit = _mm256_and_si256(bucket_param, one);
+                    __m256i slot_hash = _mm256_add_epi64(
+                            Mul64Avx2(hash_vec[v], _mm256_add_epi64(seed2, optional_bit)),
+                            _mm256_sll_epi64(offset, slot_shift));
+                    // the slot index fits in 32 bits, so one 32x32 multiply gives the byte offset
+                    __m256i byte_offset = _mm256_mul_epu32(_mm256_srl_epi64(slot_hash, slot_shift), slot_size);
+                    _mm256_store_si256(reinterpret_cast<__m256i*>(index_buf + v * LANE_NUM), byte_offset);
+                }
+                for (size_t i = 0; i < GATHER_KERNEL_BLOCK_SIZE; ++i) {
+                    FPH_PREFETCH(view.slot_base + index_buf[i], 0, 3);
+                }
+                for (size_t v = 0; v < VEC_NUM; ++v) {
+                    const size_t key_index = block_begin + v * LANE_NUM;
+                    __m256i byte_offset = _mm256_load_si256(reinterpret_cast<const __m256i*>(index_buf + v * LANE_NUM));
+                    __m256i slot_key = _mm256_i64gather_epi64(key_base, byte_offset, 1);
+                    __m256i eq = _mm256_cmpeq_epi64(slot_key, key_vec[v]);
+                    if constexpr (sizeof(V) == 8) {
+                        __m256i value = _mm256_mask_i64gather_epi64(_mm256_setzero_si256(),
+                                reinterpret_cast<const long long*>(value_base), byte_offset, eq, 1);
+                        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out_values + key_index), value);
+                    }
+                    else {
+                        __m128i eq32 = _mm256_castsi256_si128(_mm256_permutevar8x32_epi32(eq,
+                                _mm256_setr_epi32(0, 2, 4, 6, 0, 0, 0, 0)));
+                        __m128i value = _mm256_mask_i64gather_epi32(_mm_setzero_si128(),
+                                reinterpret_cast<const int*>(value_base), byte_offset, eq32, 1);
+                        _mm_storeu_si128(reinterpret_cast<__m128i*>(out_values + key_index), value);
+                    }
+                    auto found_bits = static_cast<uint32_t>(_mm256_movemask_pd(_mm256_castsi256_pd(eq)));
+                    out_found_mask[key_index / 64U] |= uint64_t(found_bits) << (key_index % 64U);
+                    found_cnt += __builtin_popcount(found_bits);
+                }
+            }
+            return found_cnt;
+        }
+
+        /**
+         * The AVX-512 version of GatherU64Avx2, 8 keys at a time
+         */
+        template<bool mix_hash, class V>
+        __attribute__((target("avx512f,avx512dq")))
+        size_t GatherU64Avx512(const U64GatherTableView &view, const uint64_t* FPH_RESTRICT keys,
+                               size_t n, V* FPH_RESTRICT out_values,
+                               uint64_t* FPH_RESTRICT out_found_mask) {
+            static_assert(sizeof(V) == 8 || sizeof(V) == 4);
+            constexpr size_t LANE_NUM = 8;
+            constexpr size_t VEC_NUM = GATHER_KERNEL_BLOCK_SIZE / LANE_NUM;
+            const __m128i bucket_shift = _mm_cvtsi32_si128(static_cast<int>(view.bucket_shift_bits));
+            const __m128i slot_shift = _mm_cvtsi32_si128(static_cast<int>(view.slot_shift_bits));
+            const __m512i seed1 = _mm512_set1_epi64(static_cast<long long>(view.seed1));
+            const __m512i seed2 = _mm512_set1_epi64(static_cast<long long>(view.seed2));
+            const __m512i one = _mm512_set1_epi64(1);
+            const __m512i slot_size = _mm512_set1_epi64(static_cast<long long>(view.slot_size));
+            const char *value_base = view.slot_base + view.value_offset;
+            alignas(64) uint64_t index_buf[GATHER_KERNEL_BLOCK_SIZE];
+            __m512i key_vec[VEC_NUM];
+            __m512i hash_vec[VEC_NUM];
+            size_t found_cnt = 0;
+            for (size_t block_begin = 0; block_begin < n; block_begin += GATHER_KERNEL_BLOCK_SIZE) {
+                for (size_t v = 0; v < VEC_NUM; ++v) {
+                    __m512i k = _mm512_loadu_si512(keys + block_begin + v * LANE_NUM);
+                    key_vec[v] = k;
+                    __m512i h = mix_hash ? _mm512_xor_si512(k, _mm512_srli_epi64(k, 32)) : k;
+                    hash_vec[v] = h;
+                    __m512i bucket_index = _mm512_srl_epi64(_mm512_mullo_epi64(h, seed1), bucket_shift);
+                    _mm512_store_si512(index_buf + v * LANE_NUM, bucket_index);
+                }
+                for (size_t i = 0; i < GATHER_KERNEL_BLOCK_SIZE; ++i) {
+                    FPH_PREFETCH(view.bucket_p_array + index_buf[i], 0, 3);
+                }
+                for (size_t v = 0; v < VEC_NUM; ++v) {
+                    __m512i bucket_index = _mm512_load_si512(index_buf + v * LANE_NUM);
+                    __m512i bucket_param = _mm512_cvtepu32_epi64(
+                            _mm512_i64gather_epi32(bucket_index, view.bucket_p_array, 4));
+                    __m512i offset = _mm512_srli_epi64(bucket_param, 1);
+                    __m512i optional_bit = _mm512_and_si512(bucket_param, one);
+                    __m512i slot_hash = _mm512_add_epi64(
+                            _mm512_mullo_epi64(hash_vec[v], _mm512_add_epi64(seed2, optional_bit)),
+                            _mm512_sll_epi64(offset, slot_shift));
+                    __m512i byte_offset = _mm512_mul_epu32(_mm512_srl_epi64(slot_hash, slot_shift), slot_size);
+                    _mm512_store_si512(index_buf + v * LANE_NUM, byte_offset);
+                }
+                for (size_t i = 0; i < GATHER_KERNEL_BLOCK_SIZE; ++i) {
+                    FPH_PREFETCH(view.slot_base + index_buf[i], 0, 3);
+                }
+                for (size_t v = 0; v < VEC_NUM; ++v) {
+                    const size_t key_index = block_begin + v * LANE_NUM;
+                    __m512i byte_offset = _mm512_load_si512(index_buf + v * LANE_NUM);
+                    __m512i slot_key = _mm512_i64gather_epi64(byte_offset, view.slot_base, 1);
+                    __mmask8 eq = _mm512_cmpeq_epi64_mask(slot_key, key_vec[v]);
+                    if constexpr (sizeof(V) == 8) {
+                        __m512i value = _mm512_mask_i64gather_epi64(_mm512_setzero_si512(), eq,
+                                                                    byte_offset, value_base, 1);
+                        _mm512_storeu_si512(out_values + key_index, value);
+                    }
+                    else {
+                        __m256i value = _mm512_mask_i64gather_epi32(_mm256_setzero_si256(), eq,
+                                                                    byte_offset, value_base, 1);
+                        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out_values + key_index), value);
+                    }
+                    auto found_bits = static_cast<uint32_t>(eq);
+                    out_found_mask[key_index / 64U] |= uint64_t(found_bits) << (key_index % 64U);
+                    found_cnt += __builtin_popcount(found_bits);
+                }
+            }
+            return found_cnt;
+        }
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
+#endif
+
+    } // namespace dynamic::detail
+
+    /**
+     * The dynamic perfect hash map container
+     * @tparam Key
+     * @tparam T
+     * @tparam SeedHash the operator() takes two arguments: key and a size_t seed
+     * @tparam KeyEqual
+     * @tparam Allocator
+     * @tparam BucketParamType
+     * @tparam RandomKeyGenerator the operator() returns a random key
+     */
+    template <class Key, class T,
+            class SeedHash = SimpleSeedHash<Key>,
+            class KeyEqual = std::equal_to<Key>,
+            class Allocator = std::allocator<std::pair<const Key, T>>,
+            class BucketParamType = uint32_t,
+            class RandomKeyGenerator = fph::dynamic::RandomGenerator<Key>
+    >
+    class DynamicFphMap : public dynamic::detail::DynamicRawSet<
+        dynamic::detail::DynamicFphMapPolicy<Key, T>,
+        SeedHash, KeyEqual, Allocator, BucketParamType, RandomKeyGenerator> {
+        using Base = typename DynamicFphMap::DynamicRawSet;
+        template<class K>
+        using key_arg = typename Base::template key_arg<K>;
+    public:
+
+        using mapped_type = T;
+
+        using Base::Base;
+
+        using iterator = typename Base::iterator;
+        using key_type = typename Base::key_type;
+
+        using Base::find;
+
+        using Base::emplace;
+
+        using Base::insert;
+
+
+        template<class... Args>
+        std::pair<iterator, bool> try_emplace(const key_type& k, Args&&... args) {
+            return this-> template TryEmplaceImp<>(k, std::forward<Args>(args)...);
+        }
+
+        template<class... Args>
+        std::pair<iterator, bool> try_emplace(key_type&& k, Args&&... args) {
+            return this-> template TryEmplaceImp<>(std::move(k),
+                    std::forward<Args>(args)...);
+        }
+
+        T& operator[] (const key_type &key) {
+            return this->try_emplace(key).first->second;
+        }
+
+        T& operator[] (key_type&& key) {
+            return this->try_emplace(std::move(key)).first->second;
+        }
+
+        template<class K = key_type>
+        const T& operator[] (const key_arg<K> &key) const noexcept {
+            return this->GetPointerNoCheck(key)->second;
+        }
+
+        template<class K = key_type>
+        T& at (const key_arg<K> &key) {
+            size_t slot_pos = this->GetSlotPos(key);
+            if FPH_UNLIKELY(!this->template SlotHoldsKey<K>(slot_pos, key)) {
+                auto *stash_address = this->template FindInStash<K>(key, this->GetSeed0Hash(key));
+                if (stash_address == nullptr) {
+                    dynamic::detail::ThrowOutOfRange("Can not find key in at");
+                }
+                return stash_address->value.second;
+            }
+            return this->slot_[slot_pos].value.second;
+        }
+
+        template<class K = key_type>
+        const T& at (const key_arg<K>& key) const {
+            size_t slot_pos = this->GetSlotPos(key);
+            if FPH_UNLIKELY(!this->template SlotHoldsKey<K>(slot_pos, key)) {
+                const auto *stash_address = this->template FindInStash<K>(key, this->GetSeed0Hash(key));
+                if (stash_address == nullptr) {
+                    dynamic::detail::ThrowOutOfRange("Can not find key in at");
+                }
+                return stash_address->value.second;
+            }
+            return this->slot_[slot_pos].value.second;
+        }
+
+        /**
+         * Look up n keys and copy out their mapped values. For 64-bit integer keys hashed by
+         * SimpleSeedHash or MixSeedHash, 32-bit bucket params and 4 or 8-byte trivially copyable
+         * mapped values, the keys are looked up by AVX2 or AVX-512 kernels picked at run time by
+         * the cpu features; otherwise, and for the tail of keys, the pipeline of FindBatch is used.
+         * @param keys pointer to the n keys to look up
+         * @param n number of keys
+         * @param out_values out_values[i] is set to the value of keys[i], or to a value-initialized
+         * T if keys[i] is not in the table
+         * @param out_found_mask bitmap with at least (n + 63) / 64 words; bit (i % 64) of
+         * out_found_mask[i / 64] is set iff keys[i] is in the table
+         * @return the number of keys found in the table
+         */
+        size_t GatherValues(const key_type* FPH_RESTRICT keys, size_t n, mapped_type* FPH_RESTRICT out_values,
+                            uint64_t* FPH_RESTRICT out_found_mask) const {
+            size_t word_num = (n + 63U) / 64U;
+            for (size_t i = 0; i < word_num; ++i) {
+                out_found_mask[i] = 0;
+            }
+            size_t vector_n = 0;
+            size_t found_cnt = 0;
+#if FPH_X86_RUNTIME_DISPATCH
+            if constexpr (USE_U64_GATHER_KERNEL) {
+                constexpr bool mix_hash = std::is_same<SeedHash, MixSeedHash<Key>>::value;
+                int isa = dynamic::detail::GetGatherKernelIsa();
+                if (isa != dynamic::detail::GATHER_KERNEL_SCALAR) {
+                    vector_n = n - n % dynamic::detail::GATHER_KERNEL_BLOCK_SIZE;
+                    const auto *slot_base = reinterpret_cast<const char*>(this->slot_);
+                    dynamic::detail::U64GatherTableView view{
+                        reinterpret_cast<const uint32_t*>(this->bucket_p_array_),
+                        slot_base,
+                        sizeof(*this->slot_),
+                        static_cast<uint64_t>(reinterpret_cast<const char*>(
+                                std::addressof(this->slot_->value.second)) - slot_base),
+                        this->seed1_,
+                        this->seed2_,
+                        this->bucket_index_policy_.shift_bits(),
+                        this->slot_index_policy_.shift_bits()};
+                    const auto *u64_keys = reinterpret_cast<const uint64_t*>(keys);
+                    if (isa == dynamic::detail::GATHER_KERNEL_AVX512) {
+                        found_cnt = dynamic::detail::GatherU64Avx512<mix_hash>(view, u64_keys, vector_n,
+                                out_values, out_found_mask);
+                    }
+                    else {
+                        found_cnt = dynamic::detail::GatherU64Avx2<mix_hash>(view, u64_keys, vector_n,
+                                out_values, out_found_mask);
+                    }
+                    // the kernels only look in the slots
+                    for (size_t i = 0; this->param_->stash_num_ != 0 && i < vector_n; ++i) {
+                        if (!((out_found_mask[i / 64U] >> (i % 64U)) & 1U)) {
+                            const auto *stash_address = this->FindInStash(keys[i], this->GetSeed0Hash(keys[i]));
+                            if (stash_address != nullptr) {
+                                out_values[i] = stash_address->value.second;
+                                out_found_mask[i / 64U] |= uint64_t(1U) << (i % 64U);
+                                ++found_cnt;
+                            }
+                        }
+                    }
+                }
+            }
+#endif
+            this->template BatchLookupImp<key_type>(keys + vector_n, n - vector_n,
+                    [&](size_t i, const auto *slot_address, bool found) {
+                size_t key_index = vector_n + i;
+                out_values[key_index] = found ? slot_address->value.second : mapped_type();
+                out_found_mask[key_index / 64U] |= uint64_t(found) << (key_index % 64U);
+                found_cnt += found;
+            });
+            return found_cnt;
+        }
+
+    protected:
+        // whether GatherValues can use the vectorized kernels for 64-bit integer keys
+        constexpr static bool USE_U64_GATHER_KERNEL = std::is_integral<Key>::value && sizeof(Key) == 8
+                && (std::is_same<SeedHash, SimpleSeedHash<Key>>::value
+                    || std::is_same<SeedHash, MixSeedHash<Key>>::value)
+                && (std::is_same<KeyEqual, std::equal_to<Key>>::value
+                    || std::is_same<KeyEqual, std::equal_to<>>::value)
+                && sizeof(BucketParamType) == 4
+                && std::is_trivially_copyable<T>::value && (sizeof(T) == 4 || sizeof(T) == 8)
+                && !FPH_DY_DUAL_BUCKET_SET;
+    };
+
+    template <class Key, class T,
+            class SeedHash = SimpleSeedHash<Key>,
+            class KeyEqual = std::equal_to<Key>,
+            class Allocator = std::allocator<std::pair<const Key, T>>,
+            class BucketParamType = uint32_t,
+            class RandomKeyGenerator = fph::dynamic::RandomGenerator<Key> >
+    using dynamic_fph_map = DynamicFphMap<Key, T, SeedHash, KeyEqual, Allocator,
+                            BucketParamType, RandomKeyGenerator>;
+
+    /**
+     * The dynamic perfect hash map container that stores the keys and the mapped values in two
+     * parallel arrays indexed by the same slot position, instead of storing std::pair<const Key, T>
+     * in the slots like DynamicFphMap. A lookup compares the key in the dense key array and only
+     * reads the mapped value if the key is found, so large mapped values do not waste the cache
+     * lines of the lookups of keys not in the table.
+     * The iterators dereference to std::pair<const Key&, T&> (std::pair<const Key&, const T&> for
+     * const_iterator) instead of a reference to std::pair<const Key, T>.
+     * @tparam Key
+     * @tparam T
+     * @tparam SeedHash the operator() takes two arguments: key and a size_t seed
+     * @tparam KeyEqual
+     * @tparam Allocator
+     * @tparam BucketParamType
+     * @tparam RandomKeyGenerator the operator() returns a random key
+     */
+    template <class Key, class T,
+            class SeedHash = SimpleSeedHash<Key>,
+            class KeyEqual = std::equal_to<Key>,
+            class Allocator = std::allocator<std::pair<const Key, T>>,
+            class BucketParamType = uint32_t,
+            class RandomKeyGenerator = dynamic::RandomGenerator<Key> >
+    class DynamicFphSoaMap : protected dynamic::detail::DynamicRawSet<
+            dynamic::detail::DynamicFphSoaKeyPolicy<Key>, SeedHash, KeyEqual,
+            typename std::allocator_traits<Allocator>::template rebind_alloc<Key>,
+            BucketParamType, RandomKeyGenerator> {
+        using Base = typename DynamicFphSoaMap::DynamicRawSet;
+        using KeyIterator = typename Base::iterator;
+        using slot_type = typename Base::slot_type;
+        using KeyAllocator = typename Base::KeyAllocator;
+        using MappedAllocator = typename std::allocator_traits<Allocator>::template rebind_alloc<T>;
+        template<class K>
+        using key_arg = typename Base::template key_arg<K>;
+    public:
+        using key_type = Key;
+        using mapped_type = T;
+        using value_type = std::pair<const Key, T>;
+        using size_type = std::size_t;
+        using difference_type = std::ptrdiff_t;
+        using hasher = SeedHash;
+        using key_equal = KeyEqual;
+        using allocator_type = Allocator;
+        using reference = std::pair<const Key&, T&>;
+        using const_reference = std::pair<const Key&, const T&>;
+        using iterator = dynamic::detail::SoaMapIterator<KeyIterator, slot_type, Key, T>;
+        using const_iterator = dynamic::detail::SoaMapIterator<KeyIterator, slot_type, Key, const T>;
+
+        DynamicFphSoaMap(): DynamicFphSoaMap(Base::DEFAULT_INIT_ITEM_NUM_CEIL) {}
+
+        explicit DynamicFphSoaMap(size_type bucket_count): Base(bucket_count),
+                mapped_(nullptr), mapped_capacity_(0) {
+            mapped_capacity_ = this->param_->slot_capacity_;
+            mapped_ = MappedAllocator{}.allocate(mapped_capacity_);
+        }
+
+        template<class InputIt>
+        DynamicFphSoaMap(InputIt first, InputIt last,
+                         size_type bucket_count = Base::DEFAULT_INIT_ITEM_NUM_CEIL):
+                DynamicFphSoaMap(bucket_count) {
+            insert(first, last);
+        }
+
+        DynamicFphSoaMap(std::initializer_list<value_type> init,
+                         size_type bucket_count = Base::DEFAULT_INIT_ITEM_NUM_CEIL):
+                DynamicFphSoaMap(init.begin(), init.end(), bucket_count) {}
+
+        DynamicFphSoaMap(const DynamicFphSoaMap &other): Base(other), mapped_(nullptr), mapped_capacity_(0) {
+            if (this->param_ != nullptr) {
+                mapped_capacity_ = this->param_->slot_capacity_;
+                mapped_ = MappedAllocator{}.allocate(mapped_capacity_);
+                MappedAllocator mapped_alloc{};
+                for (auto it = Base::begin(); it != Base::end(); ++it) {
+                    size_t slot_pos = it.value_ptr() - this->slot_;
+                    std::allocator_traits<MappedAllocator>::construct(mapped_alloc, mapped_ + slot_pos,
+                                                                      other.mapped_[slot_pos]);
+                }
+            }
+        }
+
+        DynamicFphSoaMap(DynamicFphSoaMap &&other) noexcept: Base(std::move(other)),
+                mapped_(std::exchange(other.mapped_, nullptr)),
+                mapped_capacity_(std::exchange(other.mapped_capacity_, 0)) {}
+
+        DynamicFphSoaMap& operator=(const DynamicFphSoaMap &other) {
+            if (this != &other) {
+                DynamicFphSoaMap tmp(other);
+                swap(tmp);
+            }
+            return *this;
+        }
+
+        DynamicFphSoaMap& operator=(DynamicFphSoaMap &&other) noexcept {
+            swap(other);
+            return *this;
+        }
+
+        ~DynamicFphSoaMap() {
+            if (mapped_ != nullptr) {
+                DestroyMapped();
+                MappedAllocator{}.deallocate(mapped_, mapped_capacity_);
+                mapped_ = nullptr;
+            }
+        }
+
+        allocator_type get_allocator() const noexcept {
+            return allocator_type(Base::get_allocator());
+        }
+
+        void swap(DynamicFphSoaMap &other) noexcept {
+            Base::swap(other);
+            std::swap(mapped_, other.mapped_);
+            std::swap(mapped_capacity_, other.mapped_capacity_);
+        }
+
+        friend void swap(DynamicFphSoaMap &a, DynamicFphSoaMap &b) noexcept {
+            a.swap(b);
+        }
+
+        iterator begin() noexcept {
+            return iterator(KeyBegin(), this->slot_, mapped_);
+        }
+
+        const_iterator begin() const noexcept {
+            return const_iterator(KeyBegin(), this->slot_, mapped_);
+        }
+
+        const_iterator cbegin() const noexcept {
+            return begin();
+        }
+
+        iterator end() noexcept {
+            return iterator(KeyIterator(nullptr, nullptr), this->slot_, mapped_);
+        }
+
+        const_iterator end() const noexcept {
+            return const_iterator(KeyIterator(nullptr, nullptr), this->slot_, mapped_);
+        }
+
+        const_iterator cend() const noexcept {
+            return end();
+        }
+
+        using Base::size;
+        using Base::empty;
+        using Base::max_size;
+        using Base::bucket_count;
+        using Base::max_bucket_count;
+        using Base::load_factor;
+        using Base::max_load_factor;
+        using Base::max_load_factor_upper_limit;
+        using Base::hash_function;
+        using Base::key_eq;
+        using Base::count;
+        using Base::contains;
+        using Base::Prefetch;
+
+        void clear() noexcept {
+            DestroyMapped();
+            Base::clear();
+        }
+
+        void rehash(size_type count) {
+            Base::rehash(count);
+            ApplySlotRelocation();
+        }
+
+        void reserve(size_type count) {
+            rehash(std::ceil(count / this->max_load_factor()));
+        }
+
+        template<class K = key_type>
+        FPH_ALWAYS_INLINE iterator find(const key_arg<K> &key) noexcept {
+            size_t slot_pos = this->GetSlotPos(key);
+            if FPH_LIKELY(this->template SlotHoldsKey<K>(slot_pos, key)) {
+                return iterator(KeyIterator(this->slot_ + slot_pos, this), this->slot_, mapped_);
+            }
+            return end();
+        }
+
+        template<class K = key_type>
+        FPH_ALWAYS_INLINE const_iterator find(const key_arg<K> &key) const noexcept {
+            size_t slot_pos = this->GetSlotPos(key);
+            if FPH_LIKELY(this->template SlotHoldsKey<K>(slot_pos, key)) {
+                return const_iterator(KeyIterator(this->slot_ + slot_pos, this), this->slot_, mapped_);
+            }
+            return end();
+        }
+
+        /**
+         * Get the address of the mapped value of key without checking whether key is in the table
+         * @param key must be in the table
+         * @return the address of the mapped value of key
+         */
+        template<class K = key_type>
+        FPH_ALWAYS_INLINE T* GetPointerNoCheck(const key_arg<K> &key) noexcept {
+            return mapped_ + this->GetSlotPos(key);
+        }
+
+        template<class K = key_type>
+        FPH_ALWAYS_INLINE const T* GetPointerNoCheck(const key_arg<K> &key) const noexcept {
+            return mapped_ + this->GetSlotPos(key);
+        }
+
+        std::pair<iterator, bool> insert(const value_type &value) {
+            return TryEmplaceImp(value.first, value.second);
+        }
+
+        std::pair<iterator, bool> insert(value_type &&value) {
+            return TryEmplaceImp(value.first, std::move(value.second));
+        }
+
+        template<class InputIt>
+        void insert(InputIt first, InputIt last) {
+            for (; first != last; ++first) {
+                TryEmplaceImp((*first).first, (*first).second);
+            }
+        }
+
+        void insert(std::initializer_list<value_type> ilist) {
+            insert(ilist.begin(), ilist.end());
+        }
+
+        template<class... Args>
+        std::pair<iterator, bool> emplace(Args&&... args) {
+            std::pair<Key, T> temp_pair(std::forward<Args>(args)...);
+            return TryEmplaceImp(std::move(temp_pair.first), std::move(temp_pair.second));
+        }
+
+        template<class... Args>
+        std::pair<iterator, bool> try_emplace(const key_type &key, Args&&... args) {
+            return TryEmplaceImp(key, std::forward<Args>(args)...);
+        }
+
+        template<class... Args>
+        std::pair<iterator, bool> try_emplace(key_type &&key, Args&&... args) {
+            return TryEmplaceImp(std::move(key), std::forward<Args>(args)...);
+        }
+
+        template<class M>
+        std::pair<iterator, bool> insert_or_assign(const key_type &key, M &&obj) {
+            auto ret = TryEmplaceImp(key, std::forward<M>(obj));
+            if (!ret.second) {
+                ret.first->second = std::forward<M>(obj);
+            }
+            return ret;
+        }
+
+        T& operator[](const key_type &key) {
+            return try_emplace(key).first->second;
+        }
+
+        T& operator[](key_type &&key) {
+            return try_emplace(std::move(key)).first->second;
+        }
+
+        template<class K = key_type>
+        T& at(const key_arg<K> &key) {
+            size_t slot_pos = this->GetSlotPos(key);
+            if FPH_UNLIKELY(!this->template SlotHoldsKey<K>(slot_pos, key)) {
+                dynamic::detail::ThrowOutOfRange("Can not find key in at");
+            }
+            return mapped_[slot_pos];
+        }
+
+        template<class K = key_type>
+        const T& at(const key_arg<K> &key) const {
+            size_t slot_pos = this->GetSlotPos(key);
+            if FPH_UNLIKELY(!this->template SlotHoldsKey<K>(slot_pos, key)) {
+                dynamic::detail::ThrowOutOfRange("Can not find key in at");
+            }
+            return mapped_[slot_pos];
+        }
+
+        size_type erase(const key_type &key) {
+            size_t slot_pos = this->GetSlotPos(key);
+            if (!this->SlotHoldsKey(slot_pos, key)) {
+                return 0;
+            }
+            EraseImp(KeyIterator(this->slot_ + slot_pos, this));
+            return 1;
+        }
+
+        iterator erase(iterator pos) {
+            return EraseImp(pos.key_iterator());
+        }
+
+        iterator erase(const_iterator pos) {
+            return EraseImp(pos.key_iterator());
+        }
+
+    protected:
+        KeyIterator KeyBegin() const noexcept {
+            if FPH_UNLIKELY(this->param_ == nullptr) {
+                return KeyIterator(nullptr, nullptr);
+            }
+            return KeyIterator(this->param_->begin_it_.value_ptr(), this);
+        }
+
+        template<class K, class... Args>
+        std::pair<iterator, bool> TryEmplaceImp(K &&key, Args&&... args) {
+            if FPH_UNLIKELY(this->ShouldExpandBeforeInsert()) {
+                // expand before FindOrAlloc, so that one call of FindOrAlloc moves the keys at most once
+                rehash(this->param_->item_num_ceil_ + 1U);
+            }
+            auto [slot_address, alloc_happen] = this->FindOrAlloc(key);
+            ApplySlotRelocation();
+            if (alloc_happen) {
+                KeyAllocator key_alloc{};
+                MappedAllocator mapped_alloc{};
+                this->DestroyFillKey(slot_address);
+                std::allocator_traits<KeyAllocator>::construct(key_alloc, std::addressof(slot_address->key),
+                                                               std::forward<K>(key));
+#ifdef FPH_HAVE_EXCEPTIONS
+                try {
+#endif
+                    std::allocator_traits<MappedAllocator>::construct(mapped_alloc,
+                            mapped_ + (slot_address - this->slot_), std::forward<Args>(args)...);
+#ifdef FPH_HAVE_EXCEPTIONS
+                }
+                catch (...) {
+                    // erase the key again, so that every key in the slots has its mapped value
+                    Base::EraseImp(KeyIterator(slot_address, this));
+                    throw;
+                }
+#endif
+            }
+            return {iterator(KeyIterator(slot_address, this), this->slot_, mapped_), alloc_happen};
+        }
+
+        iterator EraseImp(KeyIterator key_it) {
+            MappedAllocator mapped_alloc{};
+            std::allocator_traits<MappedAllocator>::destroy(mapped_alloc,
+                    mapped_ + (key_it.value_ptr() - this->slot_));
+            auto next_key_it = Base::EraseImp(key_it);
+            return iterator(next_key_it, this->slot_, mapped_);
+        }
+
+        void DestroyMapped() noexcept {
+            if (this->param_ == nullptr || mapped_ == nullptr) {
+                return;
+            }
+            MappedAllocator mapped_alloc{};
+            for (auto it = KeyBegin(); it != Base::end(); ++it) {
+                std::allocator_traits<MappedAllocator>::destroy(mapped_alloc,
+                        mapped_ + (it.value_ptr() - this->slot_));
+            }
+        }
+
+        // Move the mapped values to the new positions of their keys after the raw set of keys
+        // moved them, and reallocate the mapped array if the capacity of slots changed. Every value
+        // is moved once.
+        void ApplySlotRelocation() {
+            auto &relocation_log = this->param_->slot_relocation_log_;
+            const size_t slot_capacity = this->param_->slot_capacity_;
+            if FPH_LIKELY(relocation_log.empty() && slot_capacity == mapped_capacity_) {
+                return;
+            }
+            MappedAllocator mapped_alloc{};
+            auto move_value = [&](T *dst, size_t prev_pos) {
+                std::allocator_traits<MappedAllocator>::construct(mapped_alloc, dst, std::move(mapped_[prev_pos]));
+                std::allocator_traits<MappedAllocator>::destroy(mapped_alloc, mapped_ + prev_pos);
+            };
+            if (slot_capacity != mapped_capacity_) {
+                // the slots are only reallocated by a rehash, which moves all the keys
+                T *new_mapped = mapped_alloc.allocate(slot_capacity);
+                for (const auto &[prev_pos, new_pos]: relocation_log) {
+                    if (prev_pos != Base::NO_SLOT_POS) {
+                        move_value(new_mapped + new_pos, prev_pos);
+                    }
+                }
+                mapped_alloc.deallocate(mapped_, mapped_capacity_);
+                mapped_ = new_mapped;
+                mapped_capacity_ = slot_capacity;
+                relocation_log.clear();
+                return;
+            }
+            // In the same array, the previous position of one value may be the new position of
+            // another. Each position is left by at most one value and taken by at most one, so the
+            // moves form chains, which end at a free position, and cycles. A chain is moved from its
+            // end, and a cycle through one temporary value.
+            std::sort(relocation_log.begin(), relocation_log.end());
+            while (!relocation_log.empty() && relocation_log.back().first == Base::NO_SLOT_POS) {
+                relocation_log.pop_back();
+            }
+            // the moves done are marked with the new position NO_SLOT_POS
+            auto find_move_from = [&](size_t pos) -> size_t {
+                auto it = std::lower_bound(relocation_log.begin(), relocation_log.end(),
+                                           std::make_pair(pos, size_t(0)));
+                if (it == relocation_log.end() || it->first != pos || it->second == Base::NO_SLOT_POS) {
+                    return Base::NO_SLOT_POS;
+                }
+                return size_t(it - relocation_log.begin());
+            };
+            std::vector<size_t> path;
+            for (size_t i = 0; i < relocation_log.size(); ++i) {
+                if (relocation_log[i].second == Base::NO_SLOT_POS) {
+                    continue;
+                }
+                if (relocation_log[i].first == relocation_log[i].second) {
+                    relocation_log[i].second = Base::NO_SLOT_POS;
+                    continue;
+                }
+                path.clear();
+                path.push_back(i);
+                size_t next = find_move_from(relocation_log[i].second);
+                while (next != Base::NO_SLOT_POS && next != i) {
+                    path.push_back(next);
+                    next = find_move_from(relocation_log[next].second);
+                }
+                const bool is_cycle = next == i;
+                std::optional<T> cycle_value;
+                if (is_cycle) {
+                    cycle_value.emplace(std::move(mapped_[relocation_log[i].first]));
+                    std::allocator_traits<MappedAllocator>::destroy(mapped_alloc, mapped_ + relocation_log[i].first);
+                }
+                for (size_t k = path.size(); k-- > (is_cycle ? 1U : 0U);) {
+                    auto &[prev_pos, new_pos] = relocation_log[path[k]];
+                    move_value(mapped_ + new_pos, prev_pos);
+                    new_pos = Base::NO_SLOT_POS;
+                }
+                if (is_cycle) {
+                    std::allocator_traits<MappedAllocator>::construct(mapped_alloc,
+                            mapped_ + relocation_log[i].second, std::move(*cycle_value));
+                    relocation_log[i].second = Base::NO_SLOT_POS;
+                }
+            }
+            relocation_log.clear();
+        }
+
+        T *mapped_;
+        size_t mapped_capacity_;
+    };
+
+    /**
+     * The dynamic perfect hash map container that stores the elements in a dense array, and only
+     * the key and the 32-bit index of the element in that array in the slots. The slots stay small
+     * whatever the size of T, so a rehash or a rebuild only moves the keys and the indices, and
+     * iterating is a scan of the dense array. erase() moves the last element of the dense array in
+     * place of the erased one, so it invalidates the iterators to the last element, and the order
+     * of iteration is the order of insertion until the first erase.
+     * The iterators dereference to std::pair<const Key&, T&> (std::pair<const Key&, const T&> for
+     * const_iterator) instead of a reference to std::pair<const Key, T>. The table holds at most
+     * 2^32 - 1 elements.
+     * @tparam Key
+     * @tparam T
+     * @tparam SeedHash the operator() takes two arguments: key and a size_t seed
+     * @tparam KeyEqual
+     * @tparam Allocator
+     * @tparam BucketParamType
+     * @tparam RandomKeyGenerator the operator() returns a random key
+     */
+    template <class Key, class T,
+            class SeedHash = SimpleSeedHash<Key>,
+            class KeyEqual = std::equal_to<Key>,
+            class Allocator = std::allocator<std::pair<const Key, T>>,
+            class BucketParamType = uint32_t,
+            class RandomKeyGenerator = dynamic::RandomGenerator<Key> >
+    class DynamicFphDenseMap : protected dynamic::detail::DynamicRawSet<
+            dynamic::detail::DynamicFphMapPolicy<Key, uint32_t>, SeedHash, KeyEqual,
+            typename std::allocator_traits<Allocator>::template rebind_alloc<std::pair<const Key, uint32_t>>,
+            BucketParamType, RandomKeyGenerator> {
+        using Base = typename DynamicFphDenseMap::DynamicRawSet;
+        using IndexIterator = typename Base::iterator;
+        using DenseEntry = std::pair<Key, T>;
+        using DenseAllocator = typename std::allocator_traits<Allocator>::template rebind_alloc<DenseEntry>;
+        template<class K>
+        using key_arg = typename Base::template key_arg<K>;
+    public:
+        using key_type = Key;
+        using mapped_type = T;
+        using value_type = std::pair<const Key, T>;
+        using size_type = std::size_t;
+        using difference_type = std::ptrdiff_t;
+        using hasher = SeedHash;
+        using key_equal = KeyEqual;
+        using allocator_type = Allocator;
+        using reference = std::pair<const Key&, T&>;
+        using const_reference = std::pair<const Key&, const T&>;
+        using iterator = dynamic::detail::DenseMapIterator<Key, T>;
+        using const_iterator = dynamic::detail::DenseMapIterator<Key, const T>;
+
+        DynamicFphDenseMap(): DynamicFphDenseMap(Base::DEFAULT_INIT_ITEM_NUM_CEIL) {}
+
+        explicit DynamicFphDenseMap(size_type bucket_count): Base(bucket_count) {}
+
+        template<class InputIt>
+        DynamicFphDenseMap(InputIt first, InputIt last,
+                           size_type bucket_count = Base::DEFAULT_INIT_ITEM_NUM_CEIL):
+                DynamicFphDenseMap(bucket_count) {
+            insert(first, last);
+        }
+
+        DynamicFphDenseMap(std::initializer_list<value_type> init,
+                           size_type bucket_count = Base::DEFAULT_INIT_ITEM_NUM_CEIL):
+                DynamicFphDenseMap(init.begin(), init.end(), bucket_count) {}
+
+        DynamicFphDenseMap(const DynamicFphDenseMap &other): Base(other), dense_(other.dense_) {}
+
+        DynamicFphDenseMap(DynamicFphDenseMap &&other) noexcept: Base(std::move(other)),
+                dense_(std::move(other.dense_)) {}
+
+        DynamicFphDenseMap& operator=(const DynamicFphDenseMap &other) {
+            if (this != &other) {
+                DynamicFphDenseMap tmp(other);
+                swap(tmp);
+            }
+            return *this;
+        }
+
+        DynamicFphDenseMap& operator=(DynamicFphDenseMap &&other) noexcept {
+            swap(other);
+            return *this;
+        }
+
+        allocator_type get_allocator() const noexcept {
+            return allocator_type(Base::get_allocator());
+        }
+
+        void swap(DynamicFphDenseMap &other) noexcept {
+            Base::swap(other);
+            dense_.swap(other.dense_);
+        }
+
+        friend void swap(DynamicFphDenseMap &a, DynamicFphDenseMap &b) noexcept {
+            a.swap(b);
+        }
+
+        iterator begin() noexcept {
+            return iterator(dense_.data());
+        }
+
+        const_iterator begin() const noexcept {
+            return const_iterator(dense_.data());
+        }
+
+        const_iterator cbegin() const noexcept {
+            return begin();
+        }
+
+        iterator end() noexcept {
+            return iterator(dense_.data() + dense_.size());
+        }
+
+        const_iterator end() const noexcept {
+            return const_iterator(dense_.data() + dense_.size());
+        }
+
+        const_iterator cend() const noexcept {
+            return end();
+        }
+
+        using Base::size;
+        using Base::empty;
+        using Base::bucket_count;
+        using Base::max_bucket_count;
+        using Base::load_factor;
+        using Base::max_load_factor;
+        using Base::max_load_factor_upper_limit;
+        using Base::hash_function;
+        using Base::key_eq;
+        using Base::count;
+        using Base::contains;
+        using Base::Prefetch;
+        using Base::set_store_hash;
+        using Base::set_build_thread_num;
+        using Base::max_stash_ratio;
+        using Base::stash_size;
+        using Base::Freeze;
+        using Base::Thaw;
+        using Base::is_frozen;
+
+        size_type max_size() const noexcept {
+            return std::min<size_type>(Base::max_size(), MAX_DENSE_SIZE);
+        }
+
+        void clear() noexcept {
+            Base::clear();
+            dense_.clear();
+        }
+
+        // only the keys and the indices in the slots are moved
+        void rehash(size_type count) {
+            Base::rehash(count);
+        }
+
+        void reserve(size_type count) {
+            Base::reserve(count);
+            dense_.reserve(count);
+        }
+
+        template<class K = key_type>
+        FPH_ALWAYS_INLINE iterator find(const key_arg<K> &key) noexcept {
+            auto index_it = Base::find(key);
+            if FPH_LIKELY(index_it != Base::end()) {
+                return iterator(dense_.data() + index_it->second);
+            }
+            return end();
+        }
+
+        template<class K = key_type>
+        FPH_ALWAYS_INLINE const_iterator find(const key_arg<K> &key) const noexcept {
+            auto index_it = Base::find(key);
+            if FPH_LIKELY(index_it != Base::end()) {
+                return const_iterator(dense_.data() + index_it->second);
+            }
+            return end();
+        }
+
+        /**
+         * Get the address of the mapped value of key without checking whether key is in the table.
+         * The keys in the stash are not found, see max_stash_ratio().
+         * @param key must be in the table
+         * @return the address of the mapped value of key
+         */
+        template<class K = key_type>
+        FPH_ALWAYS_INLINE T* GetPointerNoCheck(const key_arg<K> &key) noexcept {
+            return std::addressof(dense_[Base::GetPointerNoCheck(key)->second].second);
+        }
+
+        template<class K = key_type>
+        FPH_ALWAYS_INLINE const T* GetPointerNoCheck(const key_arg<K> &key) const noexcept {
+            return std::addressof(dense_[Base::GetPointerNoCheck(key)->second].second);
+        }
+
+        std::pair<iterator, bool> insert(const value_type &value) {
+            return TryEmplaceImp(value.first, value.second);
+        }
+
+        std::pair<iterator, bool> insert(value_type &&value) {
+            return TryEmplaceImp(value.first, std::move(value.second));
+        }
+
+        template<class InputIt>
+        void insert(InputIt first, InputIt last) {
+            for (; first != last; ++first) {
+                TryEmplaceImp((*first).first, (*first).second);
+            }
+        }
+
+        void insert(std::initializer_list<value_type> ilist) {
+            insert(ilist.begin(), ilist.end());
+        }
+
+        template<class... Args>
+        std::pair<iterator, bool> emplace(Args&&... args) {
+            std::pair<Key, T> temp_pair(std::forward<Args>(args)...);
+            return TryEmplaceImp(std::move(temp_pair.first), std::move(temp_pair.second));
+        }
+
+        template<class... Args>
+        std::pair<iterator, bool> try_emplace(const key_type &key, Args&&... args) {
+            return TryEmplaceImp(key, std::forward<Args>(args)...);
+        }
+
+        template<class... Args>
+        std::pair<iterator, bool> try_emplace(key_type &&key, Args&&... args) {
+            return TryEmplaceImp(std::move(key), std::forward<Args>(args)...);
+        }
+
+        template<class M>
+        std::pair<iterator, bool> insert_or_assign(const key_type &key, M &&obj) {
+            auto ret = TryEmplaceImp(key, std::forward<M>(obj));
+            if (!ret.second) {
+                ret.first->second = std::forward<M>(obj);
+            }
+            return ret;
+        }
+
+        T& operator[](const key_type &key) {
+            return try_emplace(key).first->second;
+        }
+
+        T& operator[](key_type &&key) {
+            return try_emplace(std::move(key)).first->second;
+        }
+
+        template<class K = key_type>
+        T& at(const key_arg<K> &key) {
+            auto it = find(key);
+            if FPH_UNLIKELY(it == end()) {
+                dynamic::detail::ThrowOutOfRange("Can not find key in at");
+            }
+            return it->second;
+        }
+
+        template<class K = key_type>
+        const T& at(const key_arg<K> &key) const {
+            auto it = find(key);
+            if FPH_UNLIKELY(it == end()) {
+                dynamic::detail::ThrowOutOfRange("Can not find key in at");
+            }
+            return it->second;
+        }
+
+        size_type erase(const key_type &key) {
+            auto index_it = Base::find(key);
+            if (index_it == Base::end()) {
+                return 0;
+            }
+            EraseImp(index_it);
+            return 1;
+        }
+
+        // @return the iterator to the element moved in place of the erased one, or end()
+        iterator erase(iterator pos) {
+            return EraseImp(Base::find(pos->first));
+        }
+
+        iterator erase(const_iterator pos) {
+            return EraseImp(Base::find(pos->first));
+        }
+
+    protected:
+        // the indices in the slots are 32-bit
+        constexpr static size_t MAX_DENSE_SIZE = std::numeric_limits<uint32_t>::max();
+
+        template<class K, class... Args>
+        std::pair<iterator, bool> TryEmplaceImp(K &&key, Args&&... args) {
+            if FPH_UNLIKELY(dense_.size() >= MAX_DENSE_SIZE && !Base::contains(key)) {
+                dynamic::detail::ThrowRuntimeError("Too many elements for the 32-bit indices");
+            }
+            auto [slot_address, alloc_happen] = this->FindOrAlloc(key);
+            if (!alloc_happen) {
+                return {iterator(dense_.data() + slot_address->value.second), false};
+            }
+            const auto index = static_cast<uint32_t>(dense_.size());
+            dense_.emplace_back(std::piecewise_construct, std::forward_as_tuple(key),
+                                std::forward_as_tuple(std::forward<Args>(args)...));
+            this->DestroyFillKey(slot_address);
+            std::allocator_traits<typename Base::allocator_type>::construct(this->param_->alloc_,
+                    std::addressof(slot_address->mutable_value),
+                    std::piecewise_construct, std::forward_as_tuple(std::forward<K>(key)),
+                    std::forward_as_tuple(index));
+            return {iterator(dense_.data() + index), true};
+        }
+
+        // erase the slot, then move the last element of the dense array to the hole and update
+        // the index in its slot
+        iterator EraseImp(IndexIterator index_it) {
+            const uint32_t index = index_it->second;
+            Base::erase(index_it);
+            if (index + 1U != dense_.size()) {
+                dense_[index] = std::move(dense_.back());
+                Base::find(dense_[index].first)->second = index;
+            }
+            dense_.pop_back();
+            return iterator(dense_.data() + index);
+        }
+
+        std::vector<DenseEntry, DenseAllocator> dense_;
+    };
 
 
 } // namespace fph
@@ -0,0 +1,207 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2022 renzibei
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * An allocator that backs large allocations with huge pages, to reduce the TLB misses of lookups
+ * in large tables.
+ *
+ * The fph tables get the memory of the slots, the bucket params and the metadata (of the meta
+ * table) from the rebound Allocator template parameter, so passing fph::HugePageAllocator as the
+ * Allocator puts all of them on huge pages:
+ *
+ * using Map = fph::DynamicFphMap<uint64_t, uint64_t, fph::SimpleSeedHash<uint64_t>,
+ *         std::equal_to<>, fph::HugePageAllocator<std::pair<const uint64_t, uint64_t>>>;
+ *
+ * Allocations no smaller than FPH_HUGE_PAGE_MIN_ALLOC_SIZE are aligned to FPH_HUGE_PAGE_SIZE.
+ * On Linux, they are mapped with mmap and advised with MADV_HUGEPAGE, so that the transparent
+ * huge pages are used when THP is in "madvise" or "always" mode. If FPH_HUGE_PAGE_USE_HUGETLB is
+ * set to 1, MAP_HUGETLB is tried first, which needs huge pages reserved in
+ * /proc/sys/vm/nr_hugepages, and the THP path is the fallback. On other platforms, the allocations
+ * are only aligned. Smaller allocations use the operator new.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <limits>
+#include <type_traits>
+
+#if defined(__linux__)
+#include <sys/mman.h>
+#endif
+
+#ifndef FPH_HAVE_EXCEPTIONS
+
+#if !(defined(__GNUC__) && !defined(__cpp_exceptions)) && \
+    !(defined(__GNUC__) && defined(__cpp_exceptions) && __cpp_exceptions == 0 ) && \
+    !(defined(_MSC_VER) && !defined(_CPPUNWIND))
+#define FPH_HAVE_EXCEPTIONS 1
+#endif
+
+#endif
+
+#ifndef FPH_HUGE_PAGE_SIZE
+#define FPH_HUGE_PAGE_SIZE (size_t(1) << 21U)
+#endif
+
+#ifndef FPH_HUGE_PAGE_MIN_ALLOC_SIZE
+#define FPH_HUGE_PAGE_MIN_ALLOC_SIZE FPH_HUGE_PAGE_SIZE
+#endif
+
+#ifndef FPH_HUGE_PAGE_USE_HUGETLB
+#define FPH_HUGE_PAGE_USE_HUGETLB 0
+#endif
+
+namespace fph {
+
+    /**
+     * A stateless allocator that places the allocations no smaller than FPH_HUGE_PAGE_MIN_ALLOC_SIZE
+     * on huge pages.
+     * @tparam T
+     */
+    template<class T>
+    class HugePageAllocator {
+    public:
+        using value_type = T;
+        using size_type = size_t;
+        using difference_type = ptrdiff_t;
+        using propagate_on_container_move_assignment = std::true_type;
+        using is_always_equal = std::true_type;
+
+        static_assert((FPH_HUGE_PAGE_SIZE & (FPH_HUGE_PAGE_SIZE - 1U)) == 0,
+                "FPH_HUGE_PAGE_SIZE must be a power of 2");
+
+        HugePageAllocator() noexcept = default;
+
+        template<class U>
+        HugePageAllocator(const HugePageAllocator<U>&) noexcept {}
+
+        T* allocate(size_t n) {
+            if (n > std::numeric_limits<size_t>::max() / sizeof(T)) {
+                ThrowBadAlloc();
+            }
+            return static_cast<T*>(AllocateBytes(n * sizeof(T), alignof(T)));
+        }
+
+        void deallocate(T* p, size_t n) noexcept {
+            DeallocateBytes(p, n * sizeof(T), alignof(T));
+        }
+
+        /**
+         * @param bytes
+         * @param alignment
+         * @return the address of at least bytes bytes of memory, aligned to alignment. If bytes is
+         * no smaller than FPH_HUGE_PAGE_MIN_ALLOC_SIZE, the address is aligned to FPH_HUGE_PAGE_SIZE
+         */
+        static void* AllocateBytes(size_t bytes, size_t alignment) {
+            if (bytes < FPH_HUGE_PAGE_MIN_ALLOC_SIZE || alignment > FPH_HUGE_PAGE_SIZE) {
+                if (alignment > __STDCPP_DEFAULT_NEW_ALIGNMENT__) {
+                    return ::operator new(bytes, std::align_val_t(alignment));
+                }
+                return ::operator new(bytes);
+            }
+            if (bytes > std::numeric_limits<size_t>::max() - 2U * FPH_HUGE_PAGE_SIZE) {
+                ThrowBadAlloc();
+            }
+            size_t map_size = RoundUpToHugePage(bytes);
+#if defined(__linux__)
+#if FPH_HUGE_PAGE_USE_HUGETLB && defined(MAP_HUGETLB)
+            void *huge_tlb_ptr = mmap(nullptr, map_size, PROT_READ | PROT_WRITE,
+                                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+            if (huge_tlb_ptr != MAP_FAILED) {
+                return huge_tlb_ptr;
+            }
+#endif
+            // map one more huge page and unmap the unaligned head and tail
+            void *raw_ptr = mmap(nullptr, map_size + FPH_HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+                                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (raw_ptr == MAP_FAILED) {
+                ThrowBadAlloc();
+            }
+            uintptr_t raw_addr = reinterpret_cast<uintptr_t>(raw_ptr);
+            uintptr_t aligned_addr = (raw_addr + FPH_HUGE_PAGE_SIZE - 1U) & ~uintptr_t(FPH_HUGE_PAGE_SIZE - 1U);
+            size_t head_size = aligned_addr - raw_addr;
+            size_t tail_size = FPH_HUGE_PAGE_SIZE - head_size;
+            if (head_size > 0) {
+                munmap(raw_ptr, head_size);
+            }
+            if (tail_size > 0) {
+                munmap(reinterpret_cast<void*>(aligned_addr + map_size), tail_size);
+            }
+            void *aligned_ptr = reinterpret_cast<void*>(aligned_addr);
+#ifdef MADV_HUGEPAGE
+            // the advice is only a hint, the memory is still usable if it fails
+            madvise(aligned_ptr, map_size, MADV_HUGEPAGE);
+#endif
+            return aligned_ptr;
+#else
+            return ::operator new(map_size, std::align_val_t(FPH_HUGE_PAGE_SIZE));
+#endif
+        }
+
+        static void DeallocateBytes(void *p, size_t bytes, size_t alignment) noexcept {
+            if (bytes < FPH_HUGE_PAGE_MIN_ALLOC_SIZE || alignment > FPH_HUGE_PAGE_SIZE) {
+                if (alignment > __STDCPP_DEFAULT_NEW_ALIGNMENT__) {
+                    ::operator delete(p, std::align_val_t(alignment));
+                }
+                else {
+                    ::operator delete(p);
+                }
+                return;
+            }
+#if defined(__linux__)
+            munmap(p, RoundUpToHugePage(bytes));
+#else
+            ::operator delete(p, std::align_val_t(FPH_HUGE_PAGE_SIZE));
+#endif
+        }
+
+    protected:
+        static constexpr size_t RoundUpToHugePage(size_t bytes) noexcept {
+            return (bytes + FPH_HUGE_PAGE_SIZE - 1U) & ~size_t(FPH_HUGE_PAGE_SIZE - 1U);
+        }
+
+        [[noreturn]] static void ThrowBadAlloc() {
+#ifdef FPH_HAVE_EXCEPTIONS
+            throw std::bad_alloc();
+#else
+            std::abort();
+#endif
+        }
+    };
+
+    template<class T, class U>
+    constexpr bool operator==(const HugePageAllocator<T>&, const HugePageAllocator<U>&) noexcept {
+        return true;
+    }
+
+    template<class T, class U>
+    constexpr bool operator!=(const HugePageAllocator<T>&, const HugePageAllocator<U>&) noexcept {
+        return false;
+    }
+
+} // namespace fph
@@ -0,0 +1,58 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2022 renzibei
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * The counters of the paths taken by the inserts of new keys into the fph tables.
+ *
+ * A new key whose slot is free is put there directly. Otherwise the keys of its bucket are moved
+ * to another offset of the slots. If no offset is free, the table tries to move a few other
+ * buckets out of the way of the bucket, then puts the new key in the stash if the table has one,
+ * before it falls back to rebuilding the whole table.
+ */
+
+#pragma once
+
+#include <cstddef>
+
+namespace fph {
+
+    /**
+     * The numbers of the inserts of new keys that took each path, see table.insert_path_stats()
+     */
+    struct InsertPathStats {
+        // the slot of the new key was free
+        size_t free_slot_num = 0;
+        // the bucket of the new key was moved to a free offset
+        size_t bucket_move_num = 0;
+        // a few other buckets were moved to free an offset for the bucket of the new key
+        size_t local_repair_num = 0;
+        // the new key was put in the stash, see table.max_stash_ratio()
+        size_t stash_num = 0;
+        // the whole table was rebuilt with the new key
+        size_t full_rebuild_num = 0;
+        // the table was rehashed to a larger capacity before the insert
+        size_t expand_num = 0;
+    };
+
+} // namespace fph
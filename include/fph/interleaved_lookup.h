@@ -0,0 +1,294 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2022 renzibei
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Coroutine-interleaved lookup for the fph tables, only available with C++20.
+ *
+ * A lookup request is written as a coroutine returning fph::LookupTask. Inside it,
+ * `co_await fph::AsyncFind(table, key)` gives the address of the value of the key, or nullptr if
+ * the key is not in the table. fph::InterleavedLookup runs many such requests on one thread:
+ * while one request waits for its bucket param or its slot to be prefetched, the other requests
+ * run, so the cache misses of different requests overlap.
+ * Note that the reference parameters of a coroutine are stored as references, the referenced
+ * objects must outlive the coroutine.
+ *
+ * fph::LookupTask HandleRequest(const Map &map, const Request &req, uint64_t &sum) {
+ *     const auto *pair_ptr = co_await fph::AsyncFind(map, req.key);
+ *     if (pair_ptr != nullptr) {
+ *         sum += pair_ptr->second;
+ *     }
+ * }
+ *
+ * fph::InterleavedLookup executor(16);
+ * executor.Run(requests.begin(), requests.end(), [&](const Request &req) {
+ *     return HandleRequest(map, req, sum);
+ * });
+ */
+
+#pragma once
+
+#include "dynamic_fph_table.h"
+#include "meta_fph_table.h"
+
+#ifndef FPH_HAVE_COROUTINE
+#   if (defined(_MSVC_LANG) && _MSVC_LANG >= 202002L) || __cplusplus >= 202002L
+#       if defined(__has_include)
+#           if __has_include(<coroutine>)
+#               define FPH_HAVE_COROUTINE 1
+#           endif
+#       endif
+#   endif
+#endif
+
+#ifndef FPH_HAVE_COROUTINE
+#define FPH_HAVE_COROUTINE 0
+#endif
+
+#if FPH_HAVE_COROUTINE
+
+#include <coroutine>
+#include <exception>
+
+namespace fph {
+
+    /**
+     * The return type of a lookup request coroutine run by fph::InterleavedLookup
+     */
+    class LookupTask {
+    public:
+        struct promise_type {
+            LookupTask get_return_object() noexcept {
+                return LookupTask(std::coroutine_handle<promise_type>::from_promise(*this));
+            }
+
+            // the request does not start until the executor resumes it
+            std::suspend_always initial_suspend() noexcept { return {}; }
+
+            std::suspend_always final_suspend() noexcept { return {}; }
+
+            void return_void() noexcept {}
+
+            void unhandled_exception() noexcept {
+#ifdef FPH_HAVE_EXCEPTIONS
+                exception_ = std::current_exception();
+#else
+                std::terminate();
+#endif
+            }
+
+            // The lookup the coroutine is suspended on, nullptr if it is suspended on something else.
+            // advance_lookup_ runs the next stage of the lookup and returns true if the result is ready.
+            void *pending_lookup_ = nullptr;
+            bool (*advance_lookup_)(void*) = nullptr;
+            std::exception_ptr exception_;
+        };
+
+        using handle_type = std::coroutine_handle<promise_type>;
+
+        LookupTask() noexcept: handle_(nullptr) {}
+
+        LookupTask(const LookupTask&) = delete;
+        LookupTask& operator=(const LookupTask&) = delete;
+
+        LookupTask(LookupTask &&o) noexcept: handle_(o.handle_) {
+            o.handle_ = nullptr;
+        }
+
+        LookupTask& operator=(LookupTask &&o) noexcept {
+            if (this != &o) {
+                Destroy();
+                handle_ = o.handle_;
+                o.handle_ = nullptr;
+            }
+            return *this;
+        }
+
+        ~LookupTask() {
+            Destroy();
+        }
+
+        bool done() const noexcept {
+            return handle_ == nullptr || handle_.done();
+        }
+
+        /**
+         * Run the next stage of the pending lookup, and resume the coroutine if the coroutine is
+         * not waiting for the memory of a lookup anymore
+         */
+        void Step() {
+            auto &promise = handle_.promise();
+            if (promise.pending_lookup_ != nullptr) {
+                if (!promise.advance_lookup_(promise.pending_lookup_)) {
+                    return;
+                }
+                promise.pending_lookup_ = nullptr;
+            }
+            handle_.resume();
+            if (handle_.done() && promise.exception_) {
+                std::rethrow_exception(promise.exception_);
+            }
+        }
+
+    protected:
+        explicit LookupTask(handle_type handle) noexcept: handle_(handle) {}
+
+        void Destroy() noexcept {
+            if (handle_ != nullptr) {
+                handle_.destroy();
+                handle_ = nullptr;
+            }
+        }
+
+        handle_type handle_;
+    };
+
+    /**
+     * The awaitable returned by fph::AsyncFind. It prefetches the bucket param when the coroutine
+     * suspends, prefetches the slot in the next step, and compares the key in the step after.
+     * @tparam Table DynamicFphSet/Map or MetaFphSet/Map, may be const qualified
+     * @tparam K the type of the key used to look up
+     */
+    template<class Table, class K>
+    class AsyncFindAwaiter {
+    public:
+        using result_type = decltype(std::declval<Table&>().template GetPointerBySlotPos<K>(
+                size_t(0), size_t(0), std::declval<const K&>()));
+
+        AsyncFindAwaiter(Table &table, const K &key) noexcept: table_(table), key_(key),
+                seed0_hash_(0), slot_pos_(0), result_(nullptr) {}
+
+        bool await_ready() const noexcept {
+            return false;
+        }
+
+        void await_suspend(LookupTask::handle_type handle) noexcept {
+            seed0_hash_ = table_.template GetSeed0Hash<K>(key_);
+            table_.PrefetchBucketParamBySeed0Hash(seed0_hash_);
+            handle.promise().pending_lookup_ = this;
+            handle.promise().advance_lookup_ = &AsyncFindAwaiter::Advance;
+        }
+
+        result_type await_resume() const noexcept {
+            return result_;
+        }
+
+    protected:
+        static bool Advance(void *awaiter_ptr) {
+            auto *awaiter = static_cast<AsyncFindAwaiter*>(awaiter_ptr);
+            if (!awaiter->slot_prefetched_) {
+                // the bucket param should be in cache now
+                awaiter->slot_pos_ = awaiter->table_.GetSlotPosBySeed0Hash(awaiter->seed0_hash_);
+                awaiter->table_.PrefetchSlot(awaiter->slot_pos_);
+                awaiter->slot_prefetched_ = true;
+                return false;
+            }
+            awaiter->result_ = awaiter->table_.template GetPointerBySlotPos<K>(awaiter->slot_pos_,
+                    awaiter->seed0_hash_, awaiter->key_);
+            return true;
+        }
+
+        Table &table_;
+        const K &key_;
+        size_t seed0_hash_;
+        size_t slot_pos_;
+        result_type result_;
+        bool slot_prefetched_ = false;
+    };
+
+    /**
+     * Look up a key inside a fph::LookupTask coroutine. The coroutine is suspended while the
+     * memory of the lookup is being prefetched; co_await gives the address of the value of key,
+     * or nullptr if key is not in the table.
+     * The table and the key must stay alive until the co_await expression completes.
+     */
+    template<class Table, class K>
+    AsyncFindAwaiter<Table, K> AsyncFind(Table &table, const K &key) noexcept {
+        return AsyncFindAwaiter<Table, K>(table, key);
+    }
+
+    /**
+     * Run lookup request coroutines on the calling thread, at most max_in_flight of them at the
+     * same time. The running requests are stepped round-robin, so a request that waits for the
+     * memory of a lookup lets the others run.
+     */
+    class InterleavedLookup {
+    public:
+        static constexpr size_t DEFAULT_MAX_IN_FLIGHT = 16;
+
+        explicit InterleavedLookup(size_t max_in_flight = DEFAULT_MAX_IN_FLIGHT):
+                max_in_flight_(max_in_flight == 0 ? 1 : max_in_flight) {}
+
+        /**
+         * Run make_task(*it) for every it in [first, last) and wait for all of them to finish.
+         * If a request throws, the exception is rethrown here and the unfinished requests are
+         * destroyed.
+         * @param make_task returns the fph::LookupTask of one request
+         */
+        template<class InputIt, class TaskFactory>
+        void Run(InputIt first, InputIt last, TaskFactory &&make_task) {
+            std::vector<LookupTask> running_tasks;
+            running_tasks.reserve(max_in_flight_);
+            // start the next request that does not finish immediately, return false if no request left
+            auto start_next = [&](LookupTask &task) -> bool {
+                while (first != last) {
+                    task = make_task(*first);
+                    ++first;
+                    task.Step();
+                    if (!task.done()) {
+                        return true;
+                    }
+                }
+                return false;
+            };
+            while (running_tasks.size() < max_in_flight_) {
+                LookupTask task;
+                if (!start_next(task)) {
+                    break;
+                }
+                running_tasks.push_back(std::move(task));
+            }
+            while (!running_tasks.empty()) {
+                for (size_t i = 0; i < running_tasks.size();) {
+                    running_tasks[i].Step();
+                    if (running_tasks[i].done() && !start_next(running_tasks[i])) {
+                        running_tasks[i] = std::move(running_tasks.back());
+                        running_tasks.pop_back();
+                        continue;
+                    }
+                    ++i;
+                }
+            }
+        }
+
+        size_t max_in_flight() const noexcept {
+            return max_in_flight_;
+        }
+
+    protected:
+        size_t max_in_flight_;
+    };
+
+} // namespace fph
+
+#endif
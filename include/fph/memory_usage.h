@@ -0,0 +1,103 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2022 renzibei
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * The memory used by an fph table, split into the hot part read by the lookups and the cold part
+ * only used to insert, erase, iterate and rebuild the table.
+ *
+ * The bytes are the allocated capacities, not the sizes in use. The part of the capacities that
+ * holds no element or entry is counted again in unused_bytes.
+ */
+
+#pragma once
+
+#include <cstddef>
+
+namespace fph {
+
+    /**
+     * The bytes allocated by a table, see table.MemoryUsage()
+     */
+    struct TableMemoryUsage {
+        // hot, read by the lookups
+
+        // the slots holding the elements and the fill keys
+        size_t slot_bytes = 0;
+        // the param of every bucket
+        size_t bucket_param_bytes = 0;
+        // the metadata byte of every slot of the meta tables, or the occupancy bits of the dynamic
+        // tables whose empty slots hold no key, see fph::dynamic::UnconstructedEmptySlots
+        size_t meta_data_bytes = 0;
+        // the stored seed0 hash of every slot, see table.set_store_hash()
+        size_t stored_hash_bytes = 0;
+        // the slots and the hashes of the stash, see table.max_stash_ratio()
+        size_t stash_bytes = 0;
+
+        // cold, released by table.Freeze() except the occupancy bits and the table objects
+
+        // the buckets and the entries of their keys
+        size_t bucket_bytes = 0;
+        // the tables of the free slots and the occupancy bits of the slots
+        size_t free_slot_bytes = 0;
+        // the tables testing the collisions of seed2
+        size_t seed_test_bytes = 0;
+        // the buffers of the rebuilds and the rehashes
+        size_t temp_buffer_bytes = 0;
+        // the table object, its param, and the random key generator and the default fill keys of
+        // the dynamic tables
+        size_t object_bytes = 0;
+
+        // the number of elements
+        size_t element_num = 0;
+        // the number of slots in use and allocated
+        size_t slot_num = 0;
+        size_t slot_capacity = 0;
+        // the number of buckets in use and allocated
+        size_t bucket_num = 0;
+        size_t bucket_capacity = 0;
+        // the bytes of all the above that hold no element or entry: the empty slots, the slots and
+        // the buckets allocated but not in use, the free capacity of the containers and the
+        // entries left behind by the buckets that grew
+        size_t unused_bytes = 0;
+
+        size_t hot_bytes() const noexcept {
+            return slot_bytes + bucket_param_bytes + meta_data_bytes + stored_hash_bytes + stash_bytes;
+        }
+
+        size_t cold_bytes() const noexcept {
+            return bucket_bytes + free_slot_bytes + seed_test_bytes + temp_buffer_bytes + object_bytes;
+        }
+
+        size_t total_bytes() const noexcept {
+            return hot_bytes() + cold_bytes();
+        }
+
+        // the ratio of unused_bytes to total_bytes()
+        double fragmentation() const noexcept {
+            const size_t total = total_bytes();
+            return total == 0 ? 0.0 : static_cast<double>(unused_bytes) / static_cast<double>(total);
+        }
+    };
+
+} // namespace fph
@@ -79,6 +79,43 @@
 #include <utility>
 #include <algorithm>
 
+#include "build_executor.h"
+#include "insert_path_stats.h"
+#include "memory_usage.h"
+#include "slot_occupancy.h"
+
+#ifndef FPH_HAVE_SSE2
+#   if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#       define FPH_HAVE_SSE2 1
+#   else
+#       define FPH_HAVE_SSE2 0
+#   endif
+#endif
+
+#ifndef FPH_HAVE_AVX2
+#   if defined(__AVX2__)
+#       define FPH_HAVE_AVX2 1
+#   else
+#       define FPH_HAVE_AVX2 0
+#   endif
+#endif
+
+#ifndef FPH_HAVE_NEON
+#   if defined(__ARM_NEON) && defined(__aarch64__)
+#       define FPH_HAVE_NEON 1
+#   else
+#       define FPH_HAVE_NEON 0
+#   endif
+#endif
+
+#if FPH_HAVE_SSE2 || FPH_HAVE_AVX2
+#include <immintrin.h>
+#endif
+
+#if FPH_HAVE_NEON
+#include <arm_neon.h>
+#endif
+
 
 // flash perfect map
 namespace fph {
@@ -118,6 +155,9 @@ namespace fph {
 #ifndef FPH_PREFETCH
 #   if FPH_HAS_BUILTIN_OR_GCC_CLANG(__builtin_prefetch)
 #       define FPH_PREFETCH(addr, rw, level) __builtin_prefetch((addr), rw, level)
+#   elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#       include <xmmintrin.h>
+#       define FPH_PREFETCH(addr, rw, level) _mm_prefetch(reinterpret_cast<const char*>(addr), _MM_HINT_T0)
 #   else
 #       define FPH_PREFETCH(addr, rw, level) {}
 #   endif
@@ -227,6 +267,12 @@ namespace fph {
                 return 63 - result;
             }
             return 64;
+#else
+            int result = 64;
+            for (; x != 0; x >>= 1U) {
+                --result;
+            }
+            return result;
 #endif
         }
 
@@ -239,6 +285,49 @@ namespace fph {
                 return 31 - result;
             }
             return 32;
+#else
+            int result = 32;
+            for (; x != 0; x >>= 1U) {
+                --result;
+            }
+            return result;
+#endif
+        }
+
+        // x should not be zero
+        inline int CountTrailingZero32(uint32_t x) {
+#if FPH_HAS_BUILTIN_OR_GCC_CLANG(__builtin_ctz)
+            return __builtin_ctz(x);
+#elif defined(_MSC_VER)
+            unsigned long result = 0;  // NOLINT(runtime/int)
+            _BitScanForward(&result, x);
+            return static_cast<int>(result);
+#else
+            int result = 0;
+            for (; !(x & 1U); x >>= 1U) {
+                ++result;
+            }
+            return result;
+#endif
+        }
+
+        // x should not be zero
+        inline int CountTrailingZero64(uint64_t x) {
+#if FPH_HAS_BUILTIN_OR_GCC_CLANG(__builtin_ctzll)
+            return __builtin_ctzll(x);
+#elif defined(_MSC_VER)
+            unsigned long result = 0;  // NOLINT(runtime/int)
+            if (_BitScanForward(&result, static_cast<unsigned long>(x))) {
+                return static_cast<int>(result);
+            }
+            _BitScanForward(&result, static_cast<unsigned long>(x >> 32));
+            return static_cast<int>(result) + 32;
+#else
+            int result = 0;
+            for (; !(x & 1U); x >>= 1U) {
+                ++result;
+            }
+            return result;
 #endif
         }
 
@@ -427,6 +516,68 @@ namespace fph {
             }
         }; // class BitArrayView
 
+        // the number of metadata bytes compared by one MatchMetaGroup call
+#if FPH_HAVE_AVX2
+        constexpr size_t META_MATCH_GROUP_SIZE = 32;
+#else
+        constexpr size_t META_MATCH_GROUP_SIZE = 16;
+#endif
+
+        /**
+         * Compare META_MATCH_GROUP_SIZE bytes of a and b lane by lane
+         * @return a mask whose i-th bit is set iff a[i] == b[i]
+         */
+        FPH_ALWAYS_INLINE uint32_t MatchMetaGroup(const uint8_t* a, const uint8_t* b) {
+#if FPH_HAVE_AVX2
+            __m256i va = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a));
+            __m256i vb = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b));
+            return static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(va, vb)));
+#elif FPH_HAVE_SSE2
+            __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a));
+            __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b));
+            return static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)));
+#elif FPH_HAVE_NEON
+            static constexpr uint8_t lane_bits[16] = {1, 2, 4, 8, 16, 32, 64, 128,
+                                                      1, 2, 4, 8, 16, 32, 64, 128};
+            uint8x16_t masked = vandq_u8(vceqq_u8(vld1q_u8(a), vld1q_u8(b)), vld1q_u8(lane_bits));
+            return static_cast<uint32_t>(vaddv_u8(vget_low_u8(masked)))
+                    | (static_cast<uint32_t>(vaddv_u8(vget_high_u8(masked))) << 8U);
+#else
+            uint32_t mask = 0;
+            for (size_t i = 0; i < META_MATCH_GROUP_SIZE; ++i) {
+                mask |= static_cast<uint32_t>(a[i] == b[i]) << i;
+            }
+            return mask;
+#endif
+        }
+
+        /**
+         * Test the top bit of META_MATCH_GROUP_SIZE bytes, which is the occupancy bit of the
+         * metadata of a slot
+         * @return a mask whose i-th bit is set iff the top bit of a[i] is set
+         */
+        FPH_ALWAYS_INLINE uint32_t MatchFullMetaGroup(const uint8_t* a) {
+#if FPH_HAVE_AVX2
+            return static_cast<uint32_t>(_mm256_movemask_epi8(
+                    _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a))));
+#elif FPH_HAVE_SSE2
+            return static_cast<uint32_t>(_mm_movemask_epi8(
+                    _mm_loadu_si128(reinterpret_cast<const __m128i*>(a))));
+#elif FPH_HAVE_NEON
+            static constexpr uint8_t lane_bits[16] = {1, 2, 4, 8, 16, 32, 64, 128,
+                                                      1, 2, 4, 8, 16, 32, 64, 128};
+            uint8x16_t masked = vandq_u8(vtstq_u8(vld1q_u8(a), vdupq_n_u8(0x80U)), vld1q_u8(lane_bits));
+            return static_cast<uint32_t>(vaddv_u8(vget_low_u8(masked)))
+                    | (static_cast<uint32_t>(vaddv_u8(vget_high_u8(masked))) << 8U);
+#else
+            uint32_t mask = 0;
+            for (size_t i = 0; i < META_MATCH_GROUP_SIZE; ++i) {
+                mask |= static_cast<uint32_t>(a[i] >> 7U) << i;
+            }
+            return mask;
+#endif
+        }
+
 
     } // namespace meta::detail
 
@@ -992,24 +1143,20 @@ namespace fph {
 
     namespace meta::detail {
 
-        template<class Key,
-                class KeyPointerAllocator=std::allocator<const Key *>,
-                class BucketParamType = uint32_t>
+        /**
+         * A bucket of keys. The keys of all the buckets are stored in one flat entry array, and
+         * the keys of this bucket are the entries [entry_begin, entry_begin + entry_cnt). An entry is
+         * the index of the key in the input during a build, and the position of the slot of the key
+         * after the build. There is room for entry_capacity entries before the next bucket
+         */
+        template<class BucketParamType = uint32_t>
         struct FphBucket {
         public:
             BucketParamType entry_cnt;
-            BucketParamType index;
-            std::vector<const Key *, KeyPointerAllocator> key_array;
-
-            explicit FphBucket(size_t index) noexcept: entry_cnt(0), index(index) {}
-
-            FphBucket() noexcept: entry_cnt(0), index(0) {}
+            BucketParamType entry_capacity;
+            size_t entry_begin;
 
-            void AddKey(const Key *key_ptr) {
-                key_array.push_back(key_ptr);
-            }
-
-        protected:
+            FphBucket() noexcept: entry_cnt(0), entry_capacity(0), entry_begin(0) {}
 
         };
     } // namespace meta::detail
@@ -1330,6 +1477,7 @@ namespace fph {
                     bucket_p_array_{nullptr},
                     meta_data_(nullptr),
                     slot_(nullptr),
+                    slot_seed0_hash_(nullptr),
                     param_(nullptr) {
 
                 TableParamAllocator  param_alloc{};
@@ -1399,6 +1547,7 @@ namespace fph {
                     bucket_p_array_(nullptr),
                     meta_data_(nullptr),
                     slot_(nullptr),
+                    slot_seed0_hash_(nullptr),
                     param_(nullptr)
             {
                 if (other.param_ != nullptr) {
@@ -1413,36 +1562,40 @@ namespace fph {
                             MetaUnderAllocator{}.allocate(param_->meta_under_entry_capacity_));
                     memcpy(meta_data_.data(), other.meta_data_.data(), param_->meta_under_entry_capacity_);
 
+                    if (other.slot_seed0_hash_ != nullptr) {
+                        slot_seed0_hash_ = SizeTAllocator{}.allocate(param_->slot_capacity_);
+                        memcpy(slot_seed0_hash_, other.slot_seed0_hash_,
+                               sizeof(size_t) * param_->item_num_ceil_);
+                    }
+
 
                     bucket_p_array_ = BucketParamAllocator{}.allocate(param_->bucket_capacity_);
                     memcpy(bucket_p_array_, other.bucket_p_array_,
                            sizeof(BucketParamType) * param_->bucket_num_);
 
-//                    KeyAllocator key_alloc;
-                    for (size_t i = 0; i < param_->item_num_ceil_; ++i) {
-                        if (!other.IsSlotEmpty(i)) {
+                    other.VisitFilledSlots([&](size_t pos) {
+                        std::allocator_traits<Allocator>::construct(param_->alloc_,
+                                                                    std::addressof(
+                                                                            slot_[pos].mutable_value),
+                                                                    other.slot_[pos].mutable_value);
+                        return true;
+                    });
+                    if (other.param_->stash_num_ != 0) {
+                        param_->stash_slot_ = SlotAllocator{}.allocate(other.param_->stash_num_);
+                        param_->stash_capacity_ = other.param_->stash_num_;
+                        for (size_t i = 0; i < other.param_->stash_num_; ++i) {
                             std::allocator_traits<Allocator>::construct(param_->alloc_,
-                                                                        std::addressof(
-                                                                                slot_[i].mutable_value),
-                                                                        other.slot_[i].mutable_value);
-                        } else {
-//                            std::allocator_traits<KeyAllocator>::construct(key_alloc,
-//                                                                           std::addressof(
-//                                                                                   slot_[i].key),
-//                                                                           other.slot_[i].key);
+                                    std::addressof(param_->stash_slot_[i].mutable_value),
+                                    other.param_->stash_slot_[i].mutable_value);
+                            ++param_->stash_num_;
                         }
+                        // the stash is iterated first
+                        param_->begin_it_ = iterator(param_->stash_slot_, this);
                     }
-                    if (other.param_->begin_it_.value_ptr() != nullptr) {
+                    else if (other.param_->begin_it_.value_ptr() != nullptr) {
                         param_->begin_it_ = iterator(
                                 slot_ + (other.param_->begin_it_.value_ptr() - other.slot_), this);
                     }
-                    for (size_t k = 0; k < param_->bucket_num_; ++k) {
-                        auto &temp_bucket = param_->bucket_array_[k];
-                        for (size_t i = 0; i < temp_bucket.key_array.size(); ++i) {
-                            temp_bucket.key_array[i] = std::addressof(slot_[GetSlotPos(
-                                    *(other.param_->bucket_array_[k].key_array[i]))].key);
-                        }
-                    }
                 }
             }
 
@@ -1473,6 +1626,7 @@ namespace fph {
                     bucket_p_array_(std::exchange(other.bucket_p_array_, nullptr)),
                     meta_data_(std::exchange(other.meta_data_, MetaDataView(nullptr))),
                     slot_(std::exchange(other.slot_, nullptr)),
+                    slot_seed0_hash_(std::exchange(other.slot_seed0_hash_, nullptr)),
                     param_(std::exchange(other.param_, nullptr))
 
             {
@@ -1505,6 +1659,7 @@ namespace fph {
 
                     meta_data_(std::exchange(other.meta_data_, MetaDataView(nullptr))),
                     slot_(std::exchange(other.slot_, nullptr)),
+                    slot_seed0_hash_(std::exchange(other.slot_seed0_hash_, nullptr)),
                     param_(std::exchange(other.param_, nullptr))
 
 
@@ -1580,35 +1735,23 @@ namespace fph {
                 }
                 new_item_ceil_num = std::min(new_item_ceil_num, MAX_ITEM_NUM_CEIL_LIMIT);
                 new_item_ceil_num = std::max(new_item_ceil_num, DEFAULT_INIT_ITEM_NUM_CEIL);
-                if (new_item_ceil_num != param_->item_num_ceil_) {
+                // the same capacity is rebuilt to merge the stash
+                if (new_item_ceil_num != param_->item_num_ceil_ || param_->stash_num_ != 0
+                    || param_->frozen_) {
                     slot_index_policy_.UpdateBySlotNum(new_item_ceil_num);
 //                    item_num_mask_ = new_item_ceil_num - 1;
                     param_->temp_pair_buf_.resize(param_->item_num_ * sizeof(value_type));
                     value_type *temp_value_buf_start = reinterpret_cast<value_type*>(param_->temp_pair_buf_.data());
                     value_type *temp_value_buf = temp_value_buf_start;
                     for (auto it = begin(); it != end(); ++it) {
+                        if (slot_seed0_hash_ != nullptr) {
+                            param_->temp_seed0_hash_buf_.push_back(StoredSeed0Hash(it.value_ptr()));
+                        }
                         std::allocator_traits<Allocator>::construct(param_->alloc_,
                                                                     temp_value_buf++, std::move(*it));
                     }
 
-                    Build<true, true, true>(temp_value_buf_start, temp_value_buf_start + param_->item_num_, seed1_,
-#if FPH_DEBUG_FLAG
-                            true,
-#else
-                                      false,
-#endif
-                                      param_->bits_per_key_,
-#if FPH_DY_DUAL_BUCKET_SET
-                            keys_first_part_ratio_, buckets_first_part_ratio_
-#else
-                                      DEFAULT_KEYS_FIRST_PART_RATIO, DEFAULT_BUCKETS_FIRST_PART_RATIO
-#endif
-                    );
-                    for (auto *temp_buf_ptr = temp_value_buf_start; temp_buf_ptr != temp_value_buf_start + param_->item_num_; temp_buf_ptr++) {
-                        std::allocator_traits<Allocator>::destroy(param_->alloc_, temp_buf_ptr);
-                    }
-                    param_->temp_pair_buf_.clear();
-                    param_->temp_pair_buf_.shrink_to_fit();
+                    BuildFromTempBuf(temp_value_buf_start, param_->item_num_);
                 }
 
 
@@ -1633,6 +1776,198 @@ namespace fph {
                 return MAX_LOAD_FACTOR_UPPER_LIMIT;
             }
 
+            /**
+             * Run the parallel parts of the following builds and rehashes of this table on
+             * thread_num threads. The table built does not depend on the number of threads
+             * @param thread_num 0 or 1 to build on the calling thread only
+             */
+            void set_build_thread_num(size_t thread_num) {
+                set_build_executor(thread_num > 1 ? MakeThreadBuildExecutor(thread_num) : BuildExecutor{},
+                                   thread_num);
+            }
+
+            /**
+             * Run the parallel parts of the following builds and rehashes of this table with executor.
+             * The construction of the values and keys only runs in parallel if it does not throw,
+             * and the allocator must be usable from several threads at the same time
+             * @param executor see fph::BuildExecutor, the builds are serial if it is empty
+             * @param concurrency the number of tasks the executor can run at the same time
+             */
+            void set_build_executor(BuildExecutor executor, size_t concurrency) {
+                param_->build_concurrency_ = executor && concurrency > 1 ? concurrency : 1;
+                param_->build_executor_ = std::move(executor);
+            }
+
+            /**
+             * Store the seed0 hash of the key in every slot, which takes sizeof(size_t) more bytes
+             * per slot. Then the rehashes and the rebuilds caused by insert keep seed0 and reuse the
+             * stored hashes instead of calling the hash function, unless no build is found with that
+             * seed0. The lookups also compare the stored hash after the metadata and before the
+             * keys. Useful when the keys are expensive to hash or compare, e.g. long strings
+             * @param store_hash
+             */
+            void set_store_hash(bool store_hash) {
+                if (store_hash == (slot_seed0_hash_ != nullptr) || slot_ == nullptr) {
+                    return;
+                }
+                if (store_hash) {
+                    slot_seed0_hash_ = SizeTAllocator{}.allocate(param_->slot_capacity_);
+                    for (size_t i = 0; i < param_->item_num_ceil_; ++i) {
+                        if (param_->slot_occupancy_.IsOccupied(i)) {
+                            slot_seed0_hash_[i] = hash_(slot_[i].key, seed0_);
+                        }
+                    }
+                }
+                else {
+                    SizeTAllocator{}.deallocate(slot_seed0_hash_, param_->slot_capacity_);
+                    slot_seed0_hash_ = nullptr;
+                }
+            }
+
+            bool store_hash() const noexcept {
+                return slot_seed0_hash_ != nullptr;
+            }
+
+            /**
+             * @return the numbers of the inserts of new keys that found their slots free, moved
+             * their buckets, moved a few other buckets or rebuilt the table, since the table was
+             * constructed or reset_insert_path_stats() was called
+             */
+            InsertPathStats insert_path_stats() const noexcept {
+                return param_->insert_path_stats_;
+            }
+
+            void reset_insert_path_stats() noexcept {
+                param_->insert_path_stats_ = InsertPathStats{};
+            }
+
+            /**
+             * Let an insert whose bucket cannot be re-placed put the new key in a small stash
+             * instead of rebuilding the whole table, while the stash holds no more than
+             * ratio * size() keys. The stash is merged into the slots by the next rehash. A
+             * lookup only searches the stash after missing the slot of the key, so the lookups of
+             * the keys in the slots are as fast as before. While the stash is not empty,
+             * GetPointerNoCheck() compares the key in the slot to know whether to search the stash.
+             * Erasing a key in the stash moves the last key of the stash in its place.
+             * @param ratio in [0, 1), 0 means the table has no stash, which is the default
+             */
+            void max_stash_ratio(float ratio) {
+                if (ratio >= 0.0 && ratio < 1.0) {
+                    param_->max_stash_ratio_ = ratio;
+                }
+            }
+
+            float max_stash_ratio() const {
+                return param_->max_stash_ratio_;
+            }
+
+            /**
+             * Release the state that is only needed to insert and erase: the buckets and their
+             * entries, the tables of the free slots, the tables testing seed2 and the temporary
+             * buffers. The frozen table can still be looked up, iterated and copied. An insert,
+             * erase or clear of a frozen table calls Thaw() first.
+             * @return the number of bytes released
+             */
+            size_t Freeze() {
+                if (param_ == nullptr || param_->frozen_) {
+                    return 0;
+                }
+                size_t released_bytes = ReleaseVector(param_->seed2_test_table_)
+                        + ReleaseVector(param_->tested_hash_vec_)
+                        + ReleaseVector(param_->random_table_)
+                        + ReleaseVector(param_->map_table_)
+                        + ReleaseVector(param_->bucket_array_)
+                        + ReleaseVector(param_->bucket_entry_array_)
+                        + ReleaseVector(param_->temp_byte_buf_vec_)
+                        + ReleaseVector(param_->temp_pair_buf_)
+                        + ReleaseVector(param_->temp_seed0_hash_buf_);
+                param_->bucket_entry_garbage_num_ = 0;
+                param_->frozen_ = true;
+                return released_bytes;
+            }
+
+            /**
+             * Rebuild the state released by Freeze() with a rehash to the same bucket count, which
+             * invalidates the iterators. Does nothing if the table is not frozen.
+             */
+            void Thaw() {
+                if (param_ != nullptr && param_->frozen_) {
+                    rehash(param_->item_num_ceil_);
+                }
+            }
+
+            bool is_frozen() const noexcept {
+                return param_ != nullptr && param_->frozen_;
+            }
+
+            /**
+             * @return the bytes allocated by the table, split into the hot part read by the lookups
+             * and the cold part used to modify and rebuild the table, see fph::TableMemoryUsage
+             */
+            TableMemoryUsage MemoryUsage() const {
+                TableMemoryUsage usage;
+                usage.object_bytes = sizeof(*this);
+                if (param_ == nullptr) {
+                    return usage;
+                }
+                const auto &param = *param_;
+                usage.element_num = param.item_num_;
+                usage.slot_num = param.item_num_ceil_;
+                usage.slot_capacity = param.slot_capacity_;
+                usage.bucket_num = param.bucket_num_;
+                usage.bucket_capacity = param.bucket_capacity_;
+                auto add_vector = [&usage](size_t &bytes, const auto &vec) {
+                    using Vector = std::decay_t<decltype(vec)>;
+                    bytes += VectorBytes<Vector>(vec.capacity());
+                    usage.unused_bytes += VectorBytes<Vector>(vec.capacity() - vec.size());
+                };
+
+                // the elements in the stash are not in the slots
+                const size_t empty_slot_num = param.slot_capacity_ - (param.item_num_ - param.stash_num_);
+                if (slot_ != nullptr) {
+                    usage.slot_bytes = param.slot_capacity_ * sizeof(slot_type);
+                    usage.unused_bytes += empty_slot_num * sizeof(slot_type);
+                }
+                if (bucket_p_array_ != nullptr) {
+                    usage.bucket_param_bytes = param.bucket_capacity_ * sizeof(BucketParamType);
+                    usage.unused_bytes += (param.bucket_capacity_ - param.bucket_num_) * sizeof(BucketParamType);
+                }
+                if (meta_data_.data() != nullptr) {
+                    usage.meta_data_bytes = param.meta_under_entry_capacity_ * sizeof(MetaUnderEntry);
+                    usage.unused_bytes += (param.meta_under_entry_capacity_
+                            - MetaDataView::GetUnderlyingEntryNum(param.item_num_ceil_)) * sizeof(MetaUnderEntry);
+                }
+                if (slot_seed0_hash_ != nullptr) {
+                    usage.stored_hash_bytes = param.slot_capacity_ * sizeof(size_t);
+                    usage.unused_bytes += empty_slot_num * sizeof(size_t);
+                }
+                usage.stash_bytes = param.stash_capacity_ * sizeof(slot_type);
+                usage.unused_bytes += (param.stash_capacity_ - param.stash_num_) * sizeof(slot_type);
+                add_vector(usage.stash_bytes, param.stash_seed0_hash_);
+
+                add_vector(usage.bucket_bytes, param.bucket_array_);
+                add_vector(usage.bucket_bytes, param.bucket_entry_array_);
+                usage.unused_bytes += param.bucket_entry_garbage_num_ * sizeof(BucketParamType);
+                add_vector(usage.free_slot_bytes, param.random_table_);
+                add_vector(usage.free_slot_bytes, param.map_table_);
+                usage.free_slot_bytes += param.slot_occupancy_.capacity_bytes();
+                add_vector(usage.seed_test_bytes, param.seed2_test_table_);
+                add_vector(usage.seed_test_bytes, param.tested_hash_vec_);
+                add_vector(usage.temp_buffer_bytes, param.temp_byte_buf_vec_);
+                add_vector(usage.temp_buffer_bytes, param.temp_pair_buf_);
+                add_vector(usage.temp_buffer_bytes, param.temp_seed0_hash_buf_);
+                usage.object_bytes += sizeof(FphTableParam);
+                return usage;
+            }
+
+            // the number of keys in the stash
+            size_type stash_size() const noexcept {
+                if FPH_UNLIKELY(param_ == nullptr) {
+                    return 0;
+                }
+                return param_->stash_num_;
+            }
+
             float load_factor() const {
                 return static_cast<double>(param_->item_num_) / param_->item_num_ceil_;
             }
@@ -1680,6 +2015,59 @@ namespace fph {
                 }
             }
 
+            /**
+             * Insert the values in [first, last) whose keys are not in the table with a single
+             * rebuild of the table. If a key is repeated in [first, last), only its first value is
+             * inserted. The elements of the table and the new values are moved to one buffer and
+             * built once, instead of triggering a rebuild or a rehash for every few inserts.
+             */
+            template<class InputIt>
+            void InsertBulk(InputIt first, InputIt last) {
+                const key_type *no_erase_key = nullptr;
+                BulkUpdateImp(first, last, no_erase_key, no_erase_key);
+            }
+
+            /**
+             * Erase the keys in [erase_first, erase_last), then insert the values in
+             * [insert_first, insert_last) like InsertBulk(), with a single rebuild of the table.
+             * To replace the value of a key, erase the key and insert it again.
+             */
+            template<class InsertIt, class EraseIt>
+            void ApplyDelta(InsertIt insert_first, InsertIt insert_last, EraseIt erase_first, EraseIt erase_last) {
+                BulkUpdateImp(insert_first, insert_last, erase_first, erase_last);
+            }
+
+            /**
+             * Move the elements of source whose keys are not in this table to this table with a
+             * single rebuild. Like std::unordered_map::merge(), the other elements are left in source.
+             */
+            void merge(MetaRawSet &source) {
+                if (&source == this || source.empty()) {
+                    return;
+                }
+                // the keys left in the slots of source are moved from and can not be erased by
+                // key, so the elements kept in source are moved out too and source is rebuilt
+                std::vector<value_type> moved_values, left_values;
+                moved_values.reserve(source.size());
+                for (auto it = source.begin(); it != source.end(); ++it) {
+                    if (contains(KeyOfValue(*it))) {
+                        left_values.push_back(std::move(*it));
+                    }
+                    else {
+                        moved_values.push_back(std::move(*it));
+                    }
+                }
+                source.clear();
+                if (!left_values.empty()) {
+                    source.InsertNoDuplicated(left_values.begin(), left_values.end());
+                }
+                InsertBulk(std::make_move_iterator(moved_values.begin()), std::make_move_iterator(moved_values.end()));
+            }
+
+            void merge(MetaRawSet &&source) {
+                merge(source);
+            }
+
             void insert(std::initializer_list<value_type> ilist) {
                 insert(ilist.begin(), ilist.end());
             }
@@ -1756,11 +2144,14 @@ namespace fph {
                 // according to benchmark, Apple Silicon chips can probably benefit from prefetch
                 FPH_PREFETCH(pair_address, 0, 1);
 #endif
-                if (MayEqual(slot_pos, seed1_hash)) {
+                if (MayEqual(slot_pos, seed1_hash) && StoredSeed0HashMayEqual(slot_pos, seed0_hash)) {
                     if FPH_LIKELY(key_equal_(pair_address->key, key)) {
                         return iterator(pair_address, this);
                     }
                 }
+                if FPH_UNLIKELY(param_->stash_num_ != 0) {
+                    return iterator(FindInStash<K>(key, seed0_hash), this);
+                }
                 return end();
             }
 
@@ -1775,11 +2166,14 @@ namespace fph {
                 // according to benchmark, Apple Silicon chips can probably benefit from prefetch
                 FPH_PREFETCH(pair_address, 0, 1);
 #endif
-                if (MayEqual(slot_pos, seed1_hash)) {
+                if (MayEqual(slot_pos, seed1_hash) && StoredSeed0HashMayEqual(slot_pos, seed0_hash)) {
                     if FPH_LIKELY(key_equal_(pair_address->key, key)) {
                         return const_iterator(pair_address, this);
                     }
                 }
+                if FPH_UNLIKELY(param_->stash_num_ != 0) {
+                    return const_iterator(FindInStash<K>(key, seed0_hash), this);
+                }
                 return end();
             }
 
@@ -1839,10 +2233,14 @@ namespace fph {
                 }
 
                 param_->filled_count_ = 0;
+                param_->slot_occupancy_.Reset(param_->item_num_ceil_);
+                if FPH_UNLIKELY(param_->frozen_) {
+                    // the rebuild of an empty table only recreates the released state
+                    Thaw();
+                    return;
+                }
                 for (size_t i = 0; i < param_->bucket_num_; ++i ) {
-                    auto &temp_bucket = param_->bucket_array_[i];
-                    temp_bucket.key_array.clear();
-                    temp_bucket.entry_cnt = 0;
+                    param_->bucket_array_[i].entry_cnt = 0;
                 }
             }
 
@@ -1854,6 +2252,9 @@ namespace fph {
                 if (MayEqual(slot_pos, seed1_hash) && key_equal_(slot_[slot_pos].key, key)) {
                     return 1U;
                 }
+                if FPH_UNLIKELY(param_->stash_num_ != 0) {
+                    return FindInStash<K>(key, seed0_hash) != nullptr ? 1U : 0U;
+                }
                 return 0;
             }
 
@@ -1890,20 +2291,56 @@ namespace fph {
                 return MAX_ITEM_NUM_CEIL_LIMIT;
             }
 
+            /**
+             * Call func(value) for every element. Faster than iterating with begin() and end() in
+             * a sparse table because the empty slots are skipped a metadata group at a time.
+             * func should not insert or erase elements.
+             */
+            template<class Func>
+            void for_each(Func &&func) {
+                if (param_ == nullptr) {
+                    return;
+                }
+                for (size_t i = 0; i < param_->stash_num_; ++i) {
+                    func(param_->stash_slot_[i].value);
+                }
+                VisitFilledSlots([&](size_t pos) {
+                    func(slot_[pos].value);
+                    return true;
+                });
+            }
+
+            template<class Func>
+            void for_each(Func &&func) const {
+                if (param_ == nullptr) {
+                    return;
+                }
+                for (size_t i = 0; i < param_->stash_num_; ++i) {
+                    func(static_cast<const value_type&>(param_->stash_slot_[i].value));
+                }
+                VisitFilledSlots([&](size_t pos) {
+                    func(static_cast<const value_type&>(slot_[pos].value));
+                    return true;
+                });
+            }
+
             friend bool operator==(const MetaRawSet&a, const MetaRawSet&b) {
                 if (a.size() != b.size()) return false;
+                if (a.size() == 0) return true;
                 const auto* a_ptr = &a;
                 const auto* b_ptr = &b;
                 // small capacity is faster in iterating
-                if (a_ptr->capacity() > b_ptr->capacity()) {
+                if (a_ptr->bucket_count() > b_ptr->bucket_count()) {
                     std::swap(a_ptr, b_ptr);
                 }
-                for (const auto& ele: *a_ptr) {
-                    if (!b_ptr->HasElement(ele)) {
+                for (size_t i = 0; i < a_ptr->param_->stash_num_; ++i) {
+                    if (!b_ptr->HasElement(a_ptr->param_->stash_slot_[i].value)) {
                         return false;
                     }
                 }
-                return true;
+                return a_ptr->VisitFilledSlots([&](size_t pos) {
+                    return b_ptr->HasElement(a_ptr->slot_[pos].value);
+                });
             }
 
             friend bool operator!=(const MetaRawSet&a, const MetaRawSet&b) {
@@ -1917,7 +2354,8 @@ namespace fph {
             /**
              * Get the pointer of the value without checking whether the two keys are equal.
              * Only use this function when you are sure that the key is in the table and you don't
-             * want to waste cpu cycles in comparing the keys.
+             * want to waste cpu cycles in comparing the keys. The keys are only compared while the
+             * stash is not empty, to find the keys in the stash, see max_stash_ratio().
              * @param key
              * @return
              */
@@ -1925,7 +2363,12 @@ namespace fph {
             FPH_ALWAYS_INLINE pointer GetPointerNoCheck(const key_arg<K>&
                     FPH_RESTRICT key)
             FPH_FUNC_RESTRICT noexcept {
-                size_t pos = GetSlotPos(key);
+                auto seed0_hash = hash_(key, seed0_);
+                size_t pos = GetSlotPosBySeed0Hash(seed0_hash);
+                if FPH_UNLIKELY(param_->stash_num_ != 0 &&
+                                !(MayEqual(pos, MidHash(seed0_hash, seed1_)) && key_equal_(slot_[pos].key, key))) {
+                    return std::addressof(FindInStash<K>(key, seed0_hash)->value);
+                }
                 return std::addressof(slot_[pos].value);
             }
 
@@ -1933,10 +2376,67 @@ namespace fph {
             FPH_ALWAYS_INLINE const_pointer GetPointerNoCheck(const key_arg<K>&
                     FPH_RESTRICT key)
             const FPH_FUNC_RESTRICT noexcept {
-                size_t pos = GetSlotPos(key);
+                auto seed0_hash = hash_(key, seed0_);
+                size_t pos = GetSlotPosBySeed0Hash(seed0_hash);
+                if FPH_UNLIKELY(param_->stash_num_ != 0 &&
+                                !(MayEqual(pos, MidHash(seed0_hash, seed1_)) && key_equal_(slot_[pos].key, key))) {
+                    return std::addressof(FindInStash<K>(key, seed0_hash)->value);
+                }
                 return std::addressof(slot_[pos].value);
             }
 
+            /**
+             * Look up n keys at once. The keys are processed in groups: the bucket params of a
+             * group are prefetched first, then the metadata bytes of all the slot positions are
+             * gathered and compared against the hash tags with SIMD, and only the slots whose
+             * metadata matches are prefetched and compared. A key that is not in the table
+             * usually never touches the slot array.
+             * @param keys pointer to the n keys to look up
+             * @param n number of keys
+             * @param out out[i] is set to the address of the value of keys[i], or nullptr if
+             * keys[i] is not in the table
+             */
+            template<class K = key_type>
+            void FindBatch(const key_arg<K>* FPH_RESTRICT keys, size_t n,
+                           pointer* FPH_RESTRICT out) FPH_FUNC_RESTRICT noexcept {
+                BatchLookupImp<K>(keys, n, [out](size_t i, slot_type *slot_address, bool found) {
+                    out[i] = found ? std::addressof(slot_address->value) : nullptr;
+                });
+            }
+
+            template<class K = key_type>
+            void FindBatch(const key_arg<K>* FPH_RESTRICT keys, size_t n,
+                           const_pointer* FPH_RESTRICT out) const FPH_FUNC_RESTRICT noexcept {
+                BatchLookupImp<K>(keys, n, [out](size_t i, slot_type *slot_address, bool found) {
+                    out[i] = found ? std::addressof(slot_address->value) : nullptr;
+                });
+            }
+
+            /**
+             * Check whether each of the n keys is in the table, in the same metadata-first way
+             * as FindBatch.
+             * @param keys pointer to the n keys to look up
+             * @param n number of keys
+             * @param out_bitmap bitmap with at least (n + 63) / 64 words; bit (i % 64) of
+             * out_bitmap[i / 64] is set iff keys[i] is in the table. Unused high bits of the last
+             * word are cleared.
+             * @return the number of keys found in the table
+             */
+            template<class K = key_type>
+            size_t ContainsBatch(const key_arg<K>* FPH_RESTRICT keys, size_t n,
+                                 uint64_t* FPH_RESTRICT out_bitmap) const FPH_FUNC_RESTRICT noexcept {
+                size_t word_num = (n + 63U) / 64U;
+                for (size_t i = 0; i < word_num; ++i) {
+                    out_bitmap[i] = 0;
+                }
+                size_t found_cnt = 0;
+                BatchLookupImp<K>(keys, n, [out_bitmap, &found_cnt](size_t i, slot_type *, bool found) {
+                    out_bitmap[i / 64U] |= uint64_t(found) << (i % 64U);
+                    found_cnt += found;
+                });
+                return found_cnt;
+            }
+
 
             /**
              * Get the position in the underlying slot of one key
@@ -1979,6 +2479,93 @@ namespace fph {
                 return slot_pos;
             }
 
+            /*
+             * The following functions split a lookup into stages, so that the caller can do other
+             * work while the memory of each stage is being prefetched:
+             * GetSeed0Hash -> PrefetchBucketParamBySeed0Hash -> GetSlotPosBySeed0Hash
+             * -> PrefetchSlot -> GetPointerBySlotPos
+             * GetSlotPosBySeed0Hash reads the bucket param, so the slot can only be prefetched after
+             * the bucket param is loaded. Call it some work after PrefetchBucketParamBySeed0Hash, e.g.
+             * bucket params D keys ahead and slots D / 2 keys ahead in a loop over keys, or it waits
+             * for the memory just like find().
+             */
+
+            template<class K = key_type>
+            FPH_ALWAYS_INLINE size_t GetSeed0Hash(const key_arg<K> &key) const FPH_FUNC_RESTRICT noexcept {
+                return hash_(key, seed0_);
+            }
+
+            FPH_ALWAYS_INLINE void PrefetchBucketParamBySeed0Hash(size_t k_seed0_hash) const FPH_FUNC_RESTRICT noexcept {
+                FPH_PREFETCH(bucket_p_array_ + GetBucketIndex(k_seed0_hash), 0, 3);
+            }
+
+            // prefetch both the metadata and the slot
+            FPH_ALWAYS_INLINE void PrefetchSlot(size_t slot_pos) const FPH_FUNC_RESTRICT noexcept {
+                FPH_PREFETCH(meta_data_.data() + slot_pos, 0, 3);
+                FPH_PREFETCH(std::addressof(slot_[slot_pos].key), 0, 3);
+            }
+
+            /**
+             * Prefetch the memory needed to look up a key, so that a later find of the key will be
+             * faster. The bucket param is prefetched and then read to prefetch the slot, this read
+             * may wait for the memory if the bucket param is not in the cache. Use
+             * PrefetchBucketParamBySeed0Hash and PrefetchSlot for finer control of prefetch distance.
+             * @param key
+             */
+            template<class K = key_type>
+            FPH_ALWAYS_INLINE void Prefetch(const key_arg<K> &key) const FPH_FUNC_RESTRICT noexcept {
+                PrefetchBySeed0Hash(hash_(key, seed0_));
+            }
+
+            /**
+             * Same as Prefetch(key)
+             * @param k_seed0_hash the seed0 hash of key, get from GetSeed0Hash(key)
+             */
+            FPH_ALWAYS_INLINE void PrefetchBySeed0Hash(size_t k_seed0_hash) const FPH_FUNC_RESTRICT noexcept {
+                PrefetchBucketParamBySeed0Hash(k_seed0_hash);
+                PrefetchSlot(GetSlotPosBySeed0Hash(k_seed0_hash));
+            }
+
+            /**
+             * @param slot_pos the slot position of key
+             * @param k_seed0_hash the seed0 hash of key, used to check the metadata and to search the stash
+             * @param key
+             * @return the address of the value in the slot if the slot holds key, otherwise nullptr
+             */
+            template<class K = key_type>
+            FPH_ALWAYS_INLINE pointer GetPointerBySlotPos(size_t slot_pos, size_t k_seed0_hash,
+                    const key_arg<K> &key) FPH_FUNC_RESTRICT noexcept {
+                slot_type *pair_address = slot_ + slot_pos;
+                if (MayEqual(slot_pos, MidHash(k_seed0_hash, seed1_))
+                        && key_equal_(pair_address->key, key)) {
+                    return std::addressof(pair_address->value);
+                }
+                if FPH_UNLIKELY(param_->stash_num_ != 0) {
+                    pair_address = FindInStash<K>(key, k_seed0_hash);
+                    if (pair_address != nullptr) {
+                        return std::addressof(pair_address->value);
+                    }
+                }
+                return nullptr;
+            }
+
+            template<class K = key_type>
+            FPH_ALWAYS_INLINE const_pointer GetPointerBySlotPos(size_t slot_pos, size_t k_seed0_hash,
+                    const key_arg<K> &key) const FPH_FUNC_RESTRICT noexcept {
+                const slot_type *pair_address = slot_ + slot_pos;
+                if (MayEqual(slot_pos, MidHash(k_seed0_hash, seed1_))
+                        && key_equal_(pair_address->key, key)) {
+                    return std::addressof(pair_address->value);
+                }
+                if FPH_UNLIKELY(param_->stash_num_ != 0) {
+                    pair_address = FindInStash<K>(key, k_seed0_hash);
+                    if (pair_address != nullptr) {
+                        return std::addressof(pair_address->value);
+                    }
+                }
+                return nullptr;
+            }
+
             FPH_ALWAYS_INLINE size_t GetSlotPosBySeed0And1Hash(size_t k_seed0_hash, size_t k_seed1_hash)
                 const FPH_FUNC_RESTRICT noexcept {
                 size_t bucket_index = GetBucketIndexBySeed1Hash(k_seed1_hash);
@@ -2016,6 +2603,11 @@ namespace fph {
                     meta_data_.SetUnderlyingArray(nullptr);
                 }
 
+                if (slot_seed0_hash_ != nullptr) {
+                    SizeTAllocator{}.deallocate(slot_seed0_hash_, param_->slot_capacity_);
+                    slot_seed0_hash_ = nullptr;
+                }
+
                 if (bucket_p_array_ != nullptr) {
                     BucketParamAllocator{}.deallocate(bucket_p_array_, param_->bucket_capacity_);
                     bucket_p_array_ = nullptr;
@@ -2088,16 +2680,20 @@ namespace fph {
             using slot_type = typename Policy::slot_type;
             slot_type *slot_ = nullptr; // direct
 
+            // the seed0 hash of the key in every filled slot, nullptr if the table does not store
+            // the hashes, see set_store_hash()
+            size_t *slot_seed0_hash_ = nullptr; // direct
+
             using SlotAllocator = typename std::allocator_traits<Allocator>::template rebind_alloc<slot_type>;
             using KeyPointerAllocator = typename std::allocator_traits<Allocator>::template rebind_alloc<const key_type *>;
 
             using BoolAllocator = typename std::allocator_traits<Allocator>::template rebind_alloc<bool>;
             using SizeTAllocator = typename std::allocator_traits<Allocator>::template rebind_alloc<size_t>;
+            using OccupancyWordAllocator = typename std::allocator_traits<Allocator>::template rebind_alloc<uint64_t>;
             using KeyAllocator = typename std::allocator_traits<Allocator>::template rebind_alloc<key_type>;
             using CharAllocator = typename std::allocator_traits<Allocator>::template rebind_alloc<char>;
 
-            using BucketType = detail::FphBucket<key_type, KeyPointerAllocator,
-                    BucketParamType>;
+            using BucketType = detail::FphBucket<BucketParamType>;
             using BucketAllocator = typename std::allocator_traits<Allocator>::template rebind_alloc<BucketType>;
 
             using SizeTVector = std::vector<size_t, SizeTAllocator>;
@@ -2131,9 +2727,22 @@ namespace fph {
                    tested_hash_vec_{},
                    random_table_{},
                    map_table_{},
+                   slot_occupancy_{},
                    bucket_array_{},
+                   bucket_entry_array_{},
+                   bucket_entry_garbage_num_(0),
                    temp_byte_buf_vec_{},
-                   temp_pair_buf_{}
+                   temp_pair_buf_{},
+                   temp_seed0_hash_buf_{},
+                   build_executor_{},
+                   build_concurrency_(1),
+                   insert_path_stats_{},
+                   stash_slot_(nullptr),
+                   stash_num_(0),
+                   stash_capacity_(0),
+                   stash_seed0_hash_{},
+                   max_stash_ratio_(0),
+                   frozen_(false)
                 {}
 
                 FphTableParam(const FphTableParam& o, const Allocator& alloc) : item_num_(o.item_num_),
@@ -2156,9 +2765,22 @@ namespace fph {
                                                                                 tested_hash_vec_(o.tested_hash_vec_),
                                                                                 random_table_(o.random_table_),
                                                                                 map_table_(o.map_table_),
+                                                                                slot_occupancy_(o.slot_occupancy_),
                                                                                 bucket_array_(o.bucket_array_),
+                                                                                bucket_entry_array_(o.bucket_entry_array_),
+                                                                                bucket_entry_garbage_num_(o.bucket_entry_garbage_num_),
                                                                                 temp_byte_buf_vec_(o.temp_byte_buf_vec_),
-                                                                                temp_pair_buf_(o.temp_pair_buf_) {
+                                                                                temp_pair_buf_(o.temp_pair_buf_),
+                                                                                temp_seed0_hash_buf_{},
+                                                                                build_executor_(o.build_executor_),
+                                                                                build_concurrency_(o.build_concurrency_),
+                                                                                insert_path_stats_(o.insert_path_stats_),
+                                                                                stash_slot_(nullptr),
+                                                                                stash_num_(0),
+                                                                                stash_capacity_(0),
+                                                                                stash_seed0_hash_(o.stash_seed0_hash_),
+                                                                                max_stash_ratio_(o.max_stash_ratio_),
+                                                                                frozen_(o.frozen_) {
                 }
 
                 FphTableParam(const FphTableParam& o):
@@ -2167,6 +2789,11 @@ namespace fph {
 
                 ~FphTableParam() {
 //                    KeyAllocator key_alloc{};
+                    // the elements of the stash are destroyed with the slots
+                    if (stash_slot_ != nullptr) {
+                        SlotAllocator{}.deallocate(stash_slot_, stash_capacity_);
+                        stash_slot_ = nullptr;
+                    }
                 }
 
 
@@ -2207,13 +2834,42 @@ namespace fph {
 
                 BucketParamVector random_table_;
                 BucketParamVector map_table_;
+                // one bit per slot, set if the slot is filled, i.e. map_table_[pos] < filled_count_
+                occupancy_detail::SlotOccupancyBits<OccupancyWordAllocator> slot_occupancy_;
                 std::vector<BucketType, BucketAllocator> bucket_array_;
 //                BucketType *bucket_array_;
+                // the entries of all the buckets, see FphBucket
+                BucketParamVector bucket_entry_array_;
+                // the number of entries in bucket_entry_array_ left behind by the buckets that grew
+                size_t bucket_entry_garbage_num_;
                 // TODO: may use pointer to replace vector to save space
 
                 CharVector temp_byte_buf_vec_;
                 // buffer for rehash
                 CharVector temp_pair_buf_;
+                // the stored seed0 hashes of the elements in temp_pair_buf_, empty if the table
+                // does not store the hashes
+                SizeTVector temp_seed0_hash_buf_;
+
+                // runs the parallel parts of the builds, the builds are serial if it is empty
+                BuildExecutor build_executor_;
+                // the number of tasks build_executor_ can run at the same time
+                size_t build_concurrency_;
+
+                // how the inserts of new keys were done
+                InsertPathStats insert_path_stats_;
+
+                // the elements whose buckets could not be re-placed by an insert are kept in
+                // stash_slot_[0, stash_num_) until the next build, see max_stash_ratio()
+                slot_type *stash_slot_;
+                size_t stash_num_;
+                size_t stash_capacity_;
+                // the seed0 hashes of the keys in the stash
+                SizeTVector stash_seed0_hash_;
+                // the max ratio of stash_num_ to item_num_, 0 if the table has no stash
+                float max_stash_ratio_;
+                // whether the state only needed to insert and erase is released, see Freeze()
+                bool frozen_;
 
             }; // struct FphTableParam
 
@@ -2246,16 +2902,92 @@ namespace fph {
             static_assert(BUCKET_PARAM_MASK + 1U == MAX_ITEM_NUM_CEIL_LIMIT);
             static_assert(DEFAULT_INIT_ITEM_NUM_CEIL <= MAX_ITEM_NUM_CEIL_LIMIT);
 
+            // number of keys whose memory accesses are overlapped in the batch lookup functions,
+            // equal to the width of one SIMD metadata compare
+            constexpr static size_t BATCH_LOOKUP_BLOCK_SIZE = META_MATCH_GROUP_SIZE;
+
+            // the builds of fewer keys are always serial
+            constexpr static size_t PARALLEL_BUILD_MIN_KEY_NUM = size_t(1U) << 15U;
+            // number of chunks of the keys or buckets per concurrent task in a parallel build
+            constexpr static size_t PARALLEL_BUILD_CHUNKS_PER_TASK = 4;
+
+            constexpr static size_t NO_SLOT_POS = std::numeric_limits<size_t>::max();
+
+            // the max number of other buckets moved to free an offset for the bucket of a new key
+            constexpr static size_t MAX_REPAIR_MOVED_BUCKET_NUM = 4;
+            // the number of offsets tried for the bucket of a new key before the table is rebuilt
+            constexpr static size_t MAX_REPAIR_TRY_NUM = 64;
+            // the number of free slots used as the anchors of the offsets tried for a moved bucket
+            constexpr static size_t REPAIR_SEARCH_ANCHOR_NUM = 256;
+
             iterator ConstIteratorToIterator(const_iterator const_it) {
                 return iterator(const_it.value_ptr(), this);
             }
 
+            /**
+             * The pipeline shared by the batch lookup functions. For every key, visitor is called
+             * with (index of the key, address of the slot the key maps to, whether the key is in
+             * that slot), in the order of the keys.
+             */
+            template<class K, class Visitor>
+            FPH_ALWAYS_INLINE void BatchLookupImp(const key_arg<K>* FPH_RESTRICT keys, size_t n,
+                                                  Visitor &&visitor) const FPH_FUNC_RESTRICT noexcept {
+                constexpr uint32_t keep_bit_offset = META_ITEM_BIT_SIZE - 1U;
+                size_t seed0_hash_buf[BATCH_LOOKUP_BLOCK_SIZE];
+                size_t seed1_hash_buf[BATCH_LOOKUP_BLOCK_SIZE];
+                size_t slot_pos_buf[BATCH_LOOKUP_BLOCK_SIZE];
+                MetaUnderEntry meta_buf[BATCH_LOOKUP_BLOCK_SIZE] = {};
+                MetaUnderEntry tag_buf[BATCH_LOOKUP_BLOCK_SIZE] = {};
+                const bool search_stash = param_->stash_num_ != 0;
+                for (size_t block_begin = 0; block_begin < n; block_begin += BATCH_LOOKUP_BLOCK_SIZE) {
+                    const size_t block_size = std::min(BATCH_LOOKUP_BLOCK_SIZE, n - block_begin);
+                    const key_arg<K> *block_keys = keys + block_begin;
+                    for (size_t i = 0; i < block_size; ++i) {
+                        size_t k_seed0_hash = hash_(block_keys[i], seed0_);
+                        size_t k_seed1_hash = MidHash(k_seed0_hash, seed1_);
+                        seed0_hash_buf[i] = k_seed0_hash;
+                        seed1_hash_buf[i] = k_seed1_hash;
+                        FPH_PREFETCH(bucket_p_array_ + GetBucketIndexBySeed1Hash(k_seed1_hash), 0, 3);
+                    }
+                    for (size_t i = 0; i < block_size; ++i) {
+                        size_t slot_pos = GetSlotPosBySeed0And1Hash(seed0_hash_buf[i], seed1_hash_buf[i]);
+                        slot_pos_buf[i] = slot_pos;
+                        FPH_PREFETCH(meta_data_.data() + slot_pos, 0, 3);
+                    }
+                    for (size_t i = 0; i < block_size; ++i) {
+                        meta_buf[i] = meta_data_.get(slot_pos_buf[i]);
+                        tag_buf[i] = static_cast<MetaUnderEntry>((1U << keep_bit_offset)
+                                | PartHash(seed1_hash_buf[i]));
+                    }
+                    // lanes past block_size are masked off, so stale bytes there are harmless
+                    uint32_t may_equal_mask = MatchMetaGroup(meta_buf, tag_buf)
+                            & GenBitMask<uint32_t>(block_size);
+                    for (uint32_t mask = may_equal_mask; mask != 0; mask &= mask - 1U) {
+                        FPH_PREFETCH(std::addressof(slot_[slot_pos_buf[CountTrailingZero32(mask)]].key), 0, 3);
+                    }
+                    for (size_t i = 0; i < block_size; ++i) {
+                        slot_type *slot_address = slot_ + slot_pos_buf[i];
+                        bool found = ((may_equal_mask >> i) & 0x1U)
+                                && key_equal_(slot_address->key, block_keys[i]);
+                        if FPH_UNLIKELY(!found && search_stash) {
+                            slot_type *stash_address = FindInStash<K>(block_keys[i], seed0_hash_buf[i]);
+                            if (stash_address != nullptr) {
+                                slot_address = stash_address;
+                                found = true;
+                            }
+                        }
+                        visitor(block_begin + i, slot_address, found);
+                    }
+                }
+            }
+
 
             void SwapImp(MetaRawSet &o) noexcept {
                 using std::swap;
                 swap(slot_index_policy_, o.slot_index_policy_);
                 swap(meta_data_, o.meta_data_);
                 swap(slot_, o.slot_);
+                swap(slot_seed0_hash_, o.slot_seed0_hash_);
                 swap(param_, o.param_);
 #if FPH_DY_DUAL_BUCKET_SET
                 swap(p1_, o.p1_); swap(p2_, o.p2_);
@@ -2334,36 +3066,95 @@ namespace fph {
             }
 
 
-            slot_type *GetNextSlotAddress(const slot_type* FPH_RESTRICT pair_ptr) const FPH_FUNC_RESTRICT {
-                const auto *slot_end = slot_ + param_->item_num_ceil_;
-                for (size_t slot_dis = 1; slot_dis < param_->item_num_ceil_; ++slot_dis) {
-                    // TODO: test whether using branch-less will be faster
-//                    pair_ptr = slot_ + (++pair_ptr - slot_) & item_num_ceil_;
-                    if FPH_UNLIKELY(++pair_ptr >= slot_end) {
-                        pair_ptr = slot_;
+            // the first filled slot not before pos, or item_num_ceil_ if there is none
+            size_t FindFilledSlot(size_t pos) const FPH_FUNC_RESTRICT {
+                const size_t slot_num = param_->item_num_ceil_;
+                const auto *meta_ptr = meta_data_.data();
+                // the metadata after item_num_ceil_ is not initialized, so the tail is tested by byte
+                for (; pos + META_MATCH_GROUP_SIZE <= slot_num; pos += META_MATCH_GROUP_SIZE) {
+                    uint32_t full_mask = MatchFullMetaGroup(meta_ptr + pos);
+                    if (full_mask != 0) {
+                        return pos + CountTrailingZero32(full_mask);
                     }
-                    if (!IsSlotEmpty(pair_ptr)) {
-                        return const_cast<slot_type*>(pair_ptr);
+                }
+                for (; pos < slot_num; ++pos) {
+                    if (!IsSlotEmpty(pos)) {
+                        return pos;
                     }
                 }
-                return nullptr;
+                return slot_num;
             }
 
-            size_t GetNextSlotPos(size_t now_pos) const FPH_FUNC_RESTRICT {
+            /**
+             * Call func(slot_pos) for every filled slot in the order of the positions, testing the
+             * metadata a group at a time. Stop if func returns false.
+             * @return false if func returned false
+             */
+            template<class Func>
+            bool VisitFilledSlots(Func &&func) const FPH_FUNC_RESTRICT {
+                const size_t slot_num = param_->item_num_ceil_;
+                const auto *meta_ptr = meta_data_.data();
+                size_t pos = 0;
+                for (; pos + META_MATCH_GROUP_SIZE <= slot_num; pos += META_MATCH_GROUP_SIZE) {
+                    uint32_t full_mask = MatchFullMetaGroup(meta_ptr + pos);
+                    while (full_mask != 0) {
+                        if (!func(pos + CountTrailingZero32(full_mask))) {
+                            return false;
+                        }
+                        full_mask &= full_mask - 1U;
+                    }
+                }
+                for (; pos < slot_num; ++pos) {
+                    if (!IsSlotEmpty(pos) && !func(pos)) {
+                        return false;
+                    }
+                }
+                return true;
+            }
 
-                size_t new_pos = now_pos;
-                for (size_t slot_dis = 1; slot_dis < param_->item_num_ceil_; ++slot_dis) {
-//                    new_pos = (++new_pos) & item_num_mask_;
-                    ++new_pos;
-                    if FPH_UNLIKELY(new_pos >= param_->item_num_ceil_) {
-                        new_pos = 0;
+            // If the stash is not empty, the elements are iterated in the cycle of the stash and
+            // then the filled slots from position 0
+            slot_type *GetNextSlotAddress(const slot_type* FPH_RESTRICT pair_ptr) const FPH_FUNC_RESTRICT {
+                if FPH_UNLIKELY(IsStashSlot(pair_ptr)) {
+                    if (pair_ptr + 1 < param_->stash_slot_ + param_->stash_num_) {
+                        return const_cast<slot_type*>(pair_ptr + 1);
+                    }
+                    return GetSlotAddressAfterStash();
+                }
+                const size_t now_pos = pair_ptr - slot_;
+                size_t next_pos = FindFilledSlot(now_pos + 1U);
+                if FPH_UNLIKELY(next_pos >= param_->item_num_ceil_) {
+                    if FPH_UNLIKELY(param_->stash_num_ != 0) {
+                        return param_->stash_slot_;
+                    }
+                    next_pos = FindFilledSlot(0);
+                    if (next_pos >= now_pos) {
+                        return nullptr;
                     }
-                    if (!IsSlotEmpty(new_pos)) {
-                        return new_pos;
+                }
+                return slot_ + next_pos;
+            }
+
+            // the first filled slot from position 0, or the stash if all the slots are empty
+            slot_type *GetSlotAddressAfterStash() const FPH_FUNC_RESTRICT {
+                if (param_->filled_count_ != 0) {
+                    size_t first_pos = FindFilledSlot(0);
+                    if (first_pos < param_->item_num_ceil_) {
+                        return slot_ + first_pos;
                     }
                 }
-                return std::numeric_limits<size_t>::max();
+                return param_->stash_num_ != 0 ? param_->stash_slot_ : nullptr;
+            }
 
+            size_t GetNextSlotPos(size_t now_pos) const FPH_FUNC_RESTRICT {
+                size_t next_pos = FindFilledSlot(now_pos + 1U);
+                if (next_pos >= param_->item_num_ceil_) {
+                    next_pos = FindFilledSlot(0);
+                    if (next_pos >= now_pos) {
+                        return std::numeric_limits<size_t>::max();
+                    }
+                }
+                return next_pos;
             }
 
             FPH_ALWAYS_INLINE static size_t MixSeedAndBit(size_t seed, uint32_t optional_bit) {
@@ -2383,37 +3174,223 @@ namespace fph {
                 return MixValue(hash_k_seed0, seed);
             }
 
+            // the seed0 hash of the key in a filled slot, read from the stored hashes if there are
+            FPH_ALWAYS_INLINE size_t SlotSeed0Hash(size_t slot_pos) const FPH_FUNC_RESTRICT noexcept {
+                if (slot_seed0_hash_ != nullptr) {
+                    return slot_seed0_hash_[slot_pos];
+                }
+                return hash_(slot_[slot_pos].key, seed0_);
+            }
+
+            // record the seed0 hash of the key put in a slot if the table stores the hashes
+            FPH_ALWAYS_INLINE void StoreSeed0Hash(size_t slot_pos, size_t k_seed0_hash) FPH_FUNC_RESTRICT noexcept {
+                if (slot_seed0_hash_ != nullptr) {
+                    slot_seed0_hash_[slot_pos] = k_seed0_hash;
+                }
+            }
+
+            // false if the table stores the hashes and the key in the slot has another seed0 hash,
+            // the stored hashes of the empty slots are arbitrary
+            FPH_ALWAYS_INLINE bool StoredSeed0HashMayEqual(size_t slot_pos, size_t k_seed0_hash)
+            const FPH_FUNC_RESTRICT noexcept {
+                return slot_seed0_hash_ == nullptr || slot_seed0_hash_[slot_pos] == k_seed0_hash;
+            }
+
+            // the stored seed0 hash of an element in the slots or in the stash
+            size_t StoredSeed0Hash(const slot_type *slot_ptr) const {
+                if FPH_UNLIKELY(IsStashSlot(slot_ptr)) {
+                    return param_->stash_seed0_hash_[slot_ptr - param_->stash_slot_];
+                }
+                assert(slot_seed0_hash_ != nullptr);
+                return slot_seed0_hash_[slot_ptr - slot_];
+            }
+
+            FPH_ALWAYS_INLINE bool IsStashSlot(const slot_type *slot_ptr) const noexcept {
+                return param_->stash_num_ != 0 && slot_ptr >= param_->stash_slot_
+                       && slot_ptr < param_->stash_slot_ + param_->stash_num_;
+            }
+
+            // the element of the stash with the key, nullptr if the key is not in the stash
+            template<class K = key_type>
+            slot_type *FindInStash(const key_arg<K> &key, size_t k_seed0_hash) const noexcept {
+                const size_t *stash_seed0_hash = param_->stash_seed0_hash_.data();
+                for (size_t i = 0; i < param_->stash_num_; ++i) {
+                    if (stash_seed0_hash[i] == k_seed0_hash && key_equal_(param_->stash_slot_[i].key, key)) {
+                        return param_->stash_slot_ + i;
+                    }
+                }
+                return nullptr;
+            }
+
+            // whether an insert that cannot re-place its bucket can put the new key in the stash
+            bool CanStashNewKey() const noexcept {
+                return param_->stash_num_ + 1U <= param_->max_stash_ratio_ * (param_->item_num_ + 1U);
+            }
+
+            /**
+             * Append a slot to the stash for a new key, the stash grows like a vector
+             * @param k_seed0_hash
+             * @return the slot, which is not constructed like an empty slot
+             */
+            slot_type *AllocStashSlot(size_t k_seed0_hash) {
+                if (param_->stash_num_ == param_->stash_capacity_) {
+                    size_t new_capacity = std::max(size_t(4U), param_->stash_capacity_ * 2U);
+                    slot_type *new_stash_slot = SlotAllocator{}.allocate(new_capacity);
+                    for (size_t i = 0; i < param_->stash_num_; ++i) {
+                        std::allocator_traits<Allocator>::construct(param_->alloc_,
+                                std::addressof(new_stash_slot[i].mutable_value),
+                                std::move(param_->stash_slot_[i].mutable_value));
+                        std::allocator_traits<Allocator>::destroy(param_->alloc_,
+                                std::addressof(param_->stash_slot_[i].mutable_value));
+                    }
+                    if (param_->stash_slot_ != nullptr) {
+                        SlotAllocator{}.deallocate(param_->stash_slot_, param_->stash_capacity_);
+                    }
+                    param_->stash_slot_ = new_stash_slot;
+                    param_->stash_capacity_ = new_capacity;
+                }
+                param_->stash_seed0_hash_.push_back(k_seed0_hash);
+                return param_->stash_slot_ + param_->stash_num_++;
+            }
+
+            // destroy the elements of the stash, the memory of the stash is kept
+            void DestroyStash() {
+                for (size_t i = 0; i < param_->stash_num_; ++i) {
+                    std::allocator_traits<Allocator>::destroy(param_->alloc_,
+                            std::addressof(param_->stash_slot_[i].mutable_value));
+                }
+                param_->stash_num_ = 0;
+                param_->stash_seed0_hash_.clear();
+            }
+
 #if FPH_ENABLE_ITERATOR
 
-            // change begin()
+            // change begin(), which is the first element of the stash if the stash is not empty
             void AddNewIterator(slot_type *address) {
-                param_->begin_it_ = iterator(address, this);
+                param_->begin_it_ = iterator(param_->stash_num_ != 0 ? param_->stash_slot_ : address, this);
             }
 
 #endif
 
 
+            // the first entry of the bucket in the entry array
+            FPH_ALWAYS_INLINE BucketParamType* BucketEntryBegin(const BucketType &bucket) {
+                return param_->bucket_entry_array_.data() + bucket.entry_begin;
+            }
+
+            FPH_ALWAYS_INLINE const BucketParamType* BucketEntryBegin(const BucketType &bucket) const {
+                return param_->bucket_entry_array_.data() + bucket.entry_begin;
+            }
+
+            /**
+             * Set the buckets and their entries from the bucket index of every input key, the
+             * entries are the indices of the input keys and are in the input order in every bucket
+             * @param key_bucket_index_vec the bucket index of every input key
+             * @return the max number of keys in a bucket
+             */
+            size_t AssignBucketEntries(const BucketParamVector &key_bucket_index_vec) {
+                auto &bucket_array = param_->bucket_array_;
+                bucket_array.assign(param_->bucket_num_, BucketType{});
+                for (auto bucket_index: key_bucket_index_vec) {
+                    ++bucket_array[bucket_index].entry_capacity;
+                }
+                size_t max_bucket_size = 0, entry_begin = 0;
+                for (auto &bucket: bucket_array) {
+                    bucket.entry_begin = entry_begin;
+                    entry_begin += bucket.entry_capacity;
+                    max_bucket_size = std::max(max_bucket_size, size_t(bucket.entry_capacity));
+                }
+                param_->bucket_entry_array_.resize(key_bucket_index_vec.size());
+                param_->bucket_entry_garbage_num_ = 0;
+                for (size_t i = 0; i < key_bucket_index_vec.size(); ++i) {
+                    auto &bucket = bucket_array[key_bucket_index_vec[i]];
+                    param_->bucket_entry_array_[bucket.entry_begin + bucket.entry_cnt++] = i;
+                }
+                return max_bucket_size;
+            }
+
+            /**
+             * Append the slot position of a new key to the entries of the bucket. A full bucket
+             * is moved to the end of the entry array with twice the capacity, and the entry array
+             * is compacted when more than half of it is left behind by the moved buckets
+             * @param bucket_index
+             * @param slot_pos
+             */
+            void AddBucketEntry(size_t bucket_index, size_t slot_pos) {
+                auto &entry_array = param_->bucket_entry_array_;
+                if FPH_UNLIKELY(param_->bucket_array_[bucket_index].entry_cnt
+                                == param_->bucket_array_[bucket_index].entry_capacity) {
+                    if (param_->bucket_entry_garbage_num_ > entry_array.size() / 2U) {
+                        CompactBucketEntries();
+                    }
+                    auto &bucket = param_->bucket_array_[bucket_index];
+                    size_t new_capacity = std::min(std::max(size_t(2U), size_t(bucket.entry_capacity) * 2U),
+                                                   size_t(std::numeric_limits<BucketParamType>::max()));
+                    size_t new_entry_begin = entry_array.size();
+                    entry_array.resize(new_entry_begin + new_capacity);
+                    std::copy_n(entry_array.begin() + bucket.entry_begin, bucket.entry_cnt,
+                                entry_array.begin() + new_entry_begin);
+                    param_->bucket_entry_garbage_num_ += bucket.entry_capacity;
+                    bucket.entry_begin = new_entry_begin;
+                    bucket.entry_capacity = new_capacity;
+                }
+                auto &bucket = param_->bucket_array_[bucket_index];
+                entry_array[bucket.entry_begin + bucket.entry_cnt] = slot_pos;
+                ++bucket.entry_cnt;
+            }
+
+            // Remove the slot position of a key from the entries of the bucket, keeping the order
+            // of the others
+            void EraseBucketEntry(size_t bucket_index, size_t slot_pos) {
+                auto &bucket = param_->bucket_array_[bucket_index];
+                auto *entry_begin = BucketEntryBegin(bucket);
+                auto *entry_end = entry_begin + bucket.entry_cnt;
+                auto *entry_ptr = std::find(entry_begin, entry_end, static_cast<BucketParamType>(slot_pos));
+                assert(entry_ptr != entry_end);
+                std::copy(entry_ptr + 1, entry_end, entry_ptr);
+                --bucket.entry_cnt;
+            }
+
+            // Pack the entries of the buckets without gaps
+            void CompactBucketEntries() {
+                BucketParamVector new_entry_array;
+                new_entry_array.reserve(param_->item_num_);
+                for (auto &bucket: param_->bucket_array_) {
+                    const auto *entry_begin = BucketEntryBegin(bucket);
+                    size_t new_entry_begin = new_entry_array.size();
+                    new_entry_array.insert(new_entry_array.end(), entry_begin, entry_begin + bucket.entry_cnt);
+                    bucket.entry_begin = new_entry_begin;
+                    bucket.entry_capacity = bucket.entry_cnt;
+                }
+                param_->bucket_entry_array_.swap(new_entry_array);
+                param_->bucket_entry_garbage_num_ = 0;
+            }
+
             /**
              * Test whether there is collision in this bucket
-             * @tparam Bucket
+             * @tparam Seed0HashOfEntry
              * @tparam SeedTestTable make sure this is all zero, this will still be all zero after call
              * @tparam TestedHashVec make sure this is empty, this will still be empty after call
              * @param testing_bucket
+             * @param seed0_hash_of_entry returns the seed0 hash of the key of an entry of the bucket
              * @param seed2_test_table
              * @param tested_hash_vec
              * @param seed
              * @return true if pass the test
              */
-            template<class Bucket, class SeedTestTable, class TestedHashVec>
+            template<class Seed0HashOfEntry, class SeedTestTable, class TestedHashVec>
             bool
-            TestBucketSelfCollision(const Bucket &testing_bucket, SeedTestTable &seed2_test_table,
-                                    TestedHashVec &tested_hash_vec, size_t seed) {
+            TestBucketSelfCollision(const BucketType &testing_bucket, const Seed0HashOfEntry &seed0_hash_of_entry,
+                                    SeedTestTable &seed2_test_table, TestedHashVec &tested_hash_vec,
+                                    size_t seed) {
                 bool test_pass_flag = true;
                 assert(tested_hash_vec.empty());
-                for (const key_type *key_ptr: testing_bucket.key_array) {
+                const auto *entry_begin = BucketEntryBegin(testing_bucket);
+                for (size_t i = 0; i < testing_bucket.entry_cnt; ++i) {
                     // TODO: test whether test optional bit will accelerate the construction
 //                    auto temp_hash_value = hash_(*key_ptr, seed) & item_num_mask_;
-                    auto temp_hash_value = slot_index_policy_.MapToIndex(CompleteHash(*key_ptr, seed));
+                    auto temp_hash_value = slot_index_policy_.MapToIndex(
+                            MidHash(seed0_hash_of_entry(entry_begin[i]), seed));
 //                    auto temp_hash_value = slot_index_policy_.MapToIndex(hash_(*key_ptr, seed));
                     if FPH_UNLIKELY(seed2_test_table[temp_hash_value]) {
                         test_pass_flag = false;
@@ -2429,6 +3406,94 @@ namespace fph {
                 return test_pass_flag;
             }
 
+            /**
+             * Test whether there is collision in this bucket by sorting the positions instead of
+             * using the shared test table, so that several threads can test the buckets at once
+             * @tparam Seed0HashOfEntry
+             * @tparam PosVec
+             * @param testing_bucket
+             * @param seed0_hash_of_entry returns the seed0 hash of the key of an entry of the bucket
+             * @param pos_vec buffer of the slot positions of the bucket
+             * @param seed
+             * @return true if pass the test
+             */
+            template<class Seed0HashOfEntry, class PosVec>
+            bool TestBucketSelfCollisionBySort(const BucketType &testing_bucket, const Seed0HashOfEntry &seed0_hash_of_entry,
+                                               PosVec &pos_vec, size_t seed) const {
+                if (testing_bucket.entry_cnt < 2U) {
+                    return true;
+                }
+                pos_vec.clear();
+                const auto *entry_begin = BucketEntryBegin(testing_bucket);
+                for (size_t i = 0; i < testing_bucket.entry_cnt; ++i) {
+                    pos_vec.push_back(slot_index_policy_.MapToIndex(MidHash(seed0_hash_of_entry(entry_begin[i]), seed)));
+                }
+                std::sort(pos_vec.begin(), pos_vec.end());
+                return std::adjacent_find(pos_vec.begin(), pos_vec.end()) == pos_vec.end();
+            }
+
+            /**
+             * Find seed2 which makes no collision in every bucket by testing build_concurrency_
+             * candidates at once, with the buckets of each candidate split into chunks. The
+             * candidates are drawn from a copy of random_engine, and random_engine is advanced as if
+             * the candidates were tested one by one, so a serial build finds the same seed2 and
+             * draws the same random numbers after it
+             * @param sorted_index_array the indices of the buckets, larger buckets first
+             * @param seed0_hash_of_entry returns the seed0 hash of the key of an entry of a bucket
+             * @param random_engine
+             * @param random_dis
+             * @param max_reseed2_time the max number of candidates to test
+             * @return true if found, and seed2_ is set to the found seed
+             */
+            template<class SortedIndexArray, class Seed0HashOfEntry, class RandomEngine, class RandomDis>
+            bool ParallelFindSeed2(const SortedIndexArray &sorted_index_array, const Seed0HashOfEntry &seed0_hash_of_entry,
+                                   RandomEngine &random_engine, RandomDis &random_dis, size_t max_reseed2_time) {
+                const size_t concurrency = param_->build_concurrency_;
+                const size_t chunk_num = std::max(size_t(1U), std::min(concurrency * PARALLEL_BUILD_CHUNKS_PER_TASK,
+                                                                       param_->bucket_num_));
+                SizeTVector candidate_vec(concurrency);
+                std::vector<std::atomic<bool>> candidate_failed_vec(concurrency);
+                for (size_t tested_num = 0; tested_num < max_reseed2_time; ) {
+                    size_t batch_size = std::min(concurrency, max_reseed2_time - tested_num);
+                    auto batch_engine = random_engine;
+                    for (size_t i = 0; i < batch_size; ++i) {
+                        candidate_vec[i] = random_dis(batch_engine) | size_t(1ULL);
+                        candidate_failed_vec[i].store(false, std::memory_order_relaxed);
+                    }
+                    // chunk c of a candidate tests the buckets c, c + chunk_num, ... so that each
+                    // chunk starts with the large buckets, which fail more often
+                    parallel_detail::RunBuildTasks(param_->build_executor_, batch_size * chunk_num,
+                            [&](size_t task_index) {
+                        size_t candidate_index = task_index / chunk_num;
+                        auto &failed_flag = candidate_failed_vec[candidate_index];
+                        size_t candidate_seed = candidate_vec[candidate_index];
+                        SizeTVector pos_vec;
+                        for (size_t i = task_index % chunk_num; i < param_->bucket_num_; i += chunk_num) {
+                            if (failed_flag.load(std::memory_order_relaxed)) {
+                                return;
+                            }
+                            if (!TestBucketSelfCollisionBySort(param_->bucket_array_[sorted_index_array[i]],
+                                                               seed0_hash_of_entry, pos_vec, candidate_seed)) {
+                                failed_flag.store(true, std::memory_order_relaxed);
+                                return;
+                            }
+                        }
+                    });
+                    for (size_t i = 0; i < batch_size; ++i) {
+                        if (!candidate_failed_vec[i].load(std::memory_order_relaxed)) {
+                            for (size_t k = 0; k <= i; ++k) {
+                                seed2_ = random_dis(random_engine) | size_t(1ULL);
+                            }
+                            assert(seed2_ == candidate_vec[i]);
+                            return true;
+                        }
+                    }
+                    random_engine = batch_engine;
+                    tested_num += batch_size;
+                }
+                return false;
+            }
+
             /**
              * Test whether there is collision in this hash value vector
              * @tparam HashVec
@@ -2460,6 +3525,207 @@ namespace fph {
                 return test_pass_flag;
             }
 
+            // move the free slot pos to the filled part of random_table_
+            void AddFilledSlot(size_t pos) {
+                auto y_pos = param_->map_table_[pos];
+                assert(y_pos >= param_->filled_count_);
+                std::swap(param_->random_table_[param_->filled_count_], param_->random_table_[y_pos]);
+                std::swap(param_->map_table_[param_->random_table_[param_->filled_count_]],
+                          param_->map_table_[param_->random_table_[y_pos]]);
+                ++param_->filled_count_;
+                param_->slot_occupancy_.Occupy(pos);
+            }
+
+            // move the filled slot pos to the free part of random_table_
+            void RemoveFilledSlot(size_t pos) {
+                auto y_pos = param_->map_table_[pos];
+                assert(y_pos < param_->filled_count_);
+                std::swap(param_->random_table_[param_->filled_count_ - 1U], param_->random_table_[y_pos]);
+                std::swap(param_->map_table_[param_->random_table_[param_->filled_count_ - 1U]],
+                          param_->map_table_[param_->random_table_[y_pos]]);
+                --param_->filled_count_;
+                param_->slot_occupancy_.Release(pos);
+            }
+
+            /**
+             * Find a free offset for a pattern. The offsets tested put the first key of the pattern
+             * in one of the first max_anchor_num free slots of random_table_, or 63 slots after it
+             * @param pattern_pos the slot positions of the pattern at offset 0
+             * @param max_anchor_num
+             * @return the offset, or NO_SLOT_POS if none of the offsets tested is free
+             */
+            template<class PosVec>
+            size_t FindFreeOffset(const PosVec &pattern_pos, size_t max_anchor_num) const {
+                const size_t item_num_mask = param_->item_num_ceil_ - 1U;
+                const size_t search_pos_end = param_->item_num_ceil_ - param_->filled_count_ > max_anchor_num ?
+                        param_->filled_count_ + max_anchor_num : param_->item_num_ceil_;
+                for (size_t search_pos_begin = param_->filled_count_;
+                     search_pos_begin < search_pos_end; ++search_pos_begin) {
+                    size_t temp_offset = (param_->item_num_ceil_ + param_->random_table_[search_pos_begin]
+                                          - pattern_pos[0]) & item_num_mask;
+                    uint64_t free_offset_mask = param_->slot_occupancy_.FreeOffsetMask(pattern_pos, temp_offset);
+                    if (free_offset_mask != 0) {
+                        return (temp_offset + occupancy_detail::CountTrailingZero64(free_offset_mask))
+                               & item_num_mask;
+                    }
+                }
+                return NO_SLOT_POS;
+            }
+
+            /**
+             * Free an offset for a bucket whose pattern fits no free offset, by moving at most
+             * MAX_REPAIR_MOVED_BUCKET_NUM other buckets that fill the slots of the offset to other
+             * free offsets. Only the bucket params and the slot occupancy are changed, the caller
+             * moves the elements of the moved buckets.
+             * @param bucket_index the bucket, whose slots should have been released
+             * @param bucket_seed0_hash_vec the seed0 hashes of the keys of the bucket
+             * @param moved_entry_index_vec output, the indices in bucket_entry_array_ of the keys of
+             * the moved buckets
+             * @param moved_seed0_hash_vec output, the seed0 hashes of these keys
+             * @return whether the bucket is placed
+             */
+            template<class HashVec>
+            bool TryRepairBucket(size_t bucket_index, const HashVec &bucket_seed0_hash_vec,
+                                 SizeTVector &moved_entry_index_vec, SizeTVector &moved_seed0_hash_vec) {
+                const size_t item_num_mask = param_->item_num_ceil_ - 1U;
+                if (param_->item_num_ceil_ - param_->filled_count_ < bucket_seed0_hash_vec.size()) {
+                    return false;
+                }
+                SizeTVector pattern_hash, pattern_pos, moved_pattern_pos;
+                // the moved buckets, their new params and the slots taken by them
+                SizeTVector moved_bucket_vec, new_bucket_param_vec, taken_pos_vec;
+                // the slot positions at offset 0 of the pattern of the seed0 hashes in [first, last),
+                // false if two of them collide
+                auto get_pattern_pos = [&](auto first, auto last, size_t try_bit, SizeTVector &pos_vec) {
+                    auto try_seed = MixSeedAndBit(seed2_, try_bit);
+                    pattern_hash.clear();
+                    for (; first != last; ++first) {
+                        pattern_hash.push_back(MidHash(*first, try_seed));
+                    }
+                    if (!TestHashVecSelfCollision(pattern_hash, param_->seed2_test_table_, param_->tested_hash_vec_)) {
+                        return false;
+                    }
+                    pos_vec.clear();
+                    for (auto temp_hash: pattern_hash) {
+                        pos_vec.push_back(slot_index_policy_.MapToIndex(temp_hash));
+                    }
+                    return true;
+                };
+                std::mt19937_64 random_engine(seed2_ ^ param_->item_num_);
+
+                for (size_t repair_try = 0; repair_try < MAX_REPAIR_TRY_NUM; ++repair_try) {
+                    const size_t try_bit = repair_try & 1U;
+                    if (!get_pattern_pos(bucket_seed0_hash_vec.begin(), bucket_seed0_hash_vec.end(),
+                                         try_bit, pattern_pos)) {
+                        continue;
+                    }
+                    // of the 64 offsets from a random one, take the one with the fewest filled slots
+                    const size_t base_offset = random_engine() & item_num_mask;
+                    size_t filled_cnt_array[64] = {};
+                    for (auto temp_pattern_pos: pattern_pos) {
+                        uint64_t filled_window = ~param_->slot_occupancy_.FreeWindow(temp_pattern_pos + base_offset);
+                        for (size_t j = 0; j < 64U; ++j) {
+                            filled_cnt_array[j] += (filled_window >> j) & 1U;
+                        }
+                    }
+                    const size_t offset = (base_offset + size_t(std::min_element(filled_cnt_array, filled_cnt_array + 64)
+                                                                - filled_cnt_array)) & item_num_mask;
+
+                    moved_bucket_vec.clear();
+                    bool can_move_flag = true;
+                    for (auto temp_pattern_pos: pattern_pos) {
+                        size_t temp_pos = (temp_pattern_pos + offset) & item_num_mask;
+                        if (!param_->slot_occupancy_.IsOccupied(temp_pos)) {
+                            continue;
+                        }
+                        size_t temp_bucket_index = GetBucketIndex(SlotSeed0Hash(temp_pos));
+                        if (std::find(moved_bucket_vec.begin(), moved_bucket_vec.end(), temp_bucket_index)
+                            == moved_bucket_vec.end()) {
+                            if (moved_bucket_vec.size() == MAX_REPAIR_MOVED_BUCKET_NUM) {
+                                can_move_flag = false;
+                                break;
+                            }
+                            moved_bucket_vec.push_back(temp_bucket_index);
+                        }
+                    }
+                    if (!can_move_flag) {
+                        continue;
+                    }
+
+                    for (auto moved_bucket_index: moved_bucket_vec) {
+                        const auto &moved_bucket = param_->bucket_array_[moved_bucket_index];
+                        const auto *moved_entries = BucketEntryBegin(moved_bucket);
+                        for (size_t i = 0; i < moved_bucket.entry_cnt; ++i) {
+                            RemoveFilledSlot(moved_entries[i]);
+                        }
+                    }
+                    for (auto temp_pattern_pos: pattern_pos) {
+                        AddFilledSlot((temp_pattern_pos + offset) & item_num_mask);
+                    }
+
+                    moved_entry_index_vec.clear();
+                    moved_seed0_hash_vec.clear();
+                    new_bucket_param_vec.clear();
+                    taken_pos_vec.clear();
+                    for (auto moved_bucket_index: moved_bucket_vec) {
+                        const auto &moved_bucket = param_->bucket_array_[moved_bucket_index];
+                        const auto *moved_entries = BucketEntryBegin(moved_bucket);
+                        const size_t hash_begin = moved_seed0_hash_vec.size();
+                        for (size_t i = 0; i < moved_bucket.entry_cnt; ++i) {
+                            moved_entry_index_vec.push_back(moved_bucket.entry_begin + i);
+                            moved_seed0_hash_vec.push_back(SlotSeed0Hash(moved_entries[i]));
+                        }
+                        size_t new_bucket_param = NO_SLOT_POS;
+                        for (size_t moved_try_bit = 0; moved_try_bit < 2U; ++moved_try_bit) {
+                            if (!get_pattern_pos(moved_seed0_hash_vec.begin() + hash_begin, moved_seed0_hash_vec.end(),
+                                                 moved_try_bit, moved_pattern_pos)) {
+                                continue;
+                            }
+                            size_t moved_offset = FindFreeOffset(moved_pattern_pos, REPAIR_SEARCH_ANCHOR_NUM);
+                            if (moved_offset != NO_SLOT_POS) {
+                                for (auto temp_pattern_pos: moved_pattern_pos) {
+                                    size_t temp_pos = (temp_pattern_pos + moved_offset) & item_num_mask;
+                                    AddFilledSlot(temp_pos);
+                                    taken_pos_vec.push_back(temp_pos);
+                                }
+                                new_bucket_param = (moved_offset << 1U) | moved_try_bit;
+                                break;
+                            }
+                        }
+                        if (new_bucket_param == NO_SLOT_POS) {
+                            break;
+                        }
+                        new_bucket_param_vec.push_back(new_bucket_param);
+                    }
+
+                    if (new_bucket_param_vec.size() == moved_bucket_vec.size()) {
+                        for (size_t i = 0; i < moved_bucket_vec.size(); ++i) {
+                            bucket_p_array_[moved_bucket_vec[i]] = new_bucket_param_vec[i];
+                        }
+                        bucket_p_array_[bucket_index] = (offset << 1U) | try_bit;
+                        return true;
+                    }
+
+                    // undo, the moved buckets go back to their slots
+                    for (auto temp_pos: taken_pos_vec) {
+                        RemoveFilledSlot(temp_pos);
+                    }
+                    for (auto temp_pattern_pos: pattern_pos) {
+                        RemoveFilledSlot((temp_pattern_pos + offset) & item_num_mask);
+                    }
+                    for (auto moved_bucket_index: moved_bucket_vec) {
+                        const auto &moved_bucket = param_->bucket_array_[moved_bucket_index];
+                        const auto *moved_entries = BucketEntryBegin(moved_bucket);
+                        for (size_t i = 0; i < moved_bucket.entry_cnt; ++i) {
+                            AddFilledSlot(moved_entries[i]);
+                        }
+                    }
+                }
+                moved_entry_index_vec.clear();
+                moved_seed0_hash_vec.clear();
+                return false;
+            }
+
             template<class RandomTable, class MapTable>
             static bool
             IsRandomTableValid(const RandomTable &random_table, const MapTable &map_table) {
@@ -2478,9 +3744,9 @@ namespace fph {
                 std::fill(test_table.begin(), test_table.end(), false);
                 for (auto bucket_it = bucket_begin; bucket_it != bucket_end; ++bucket_it) {
                     auto &test_bucket = *bucket_it;
-                    for (const auto *key_ptr: test_bucket.key_array) {
-                        const auto &temp_key = *key_ptr;
-                        auto slot_pos = GetSlotPos(temp_key);
+                    const auto *entry_begin = BucketEntryBegin(test_bucket);
+                    for (size_t i = 0; i < test_bucket.entry_cnt; ++i) {
+                        auto slot_pos = GetSlotPos(slot_[entry_begin[i]].key);
                         if (test_table[slot_pos]) {
                             test_passed_flag = false;
                             break;
@@ -2581,26 +3847,19 @@ namespace fph {
             }
 
             iterator EraseImp(iterator iter) {
+                if FPH_UNLIKELY(param_->frozen_) {
+                    // Thaw() moves the elements, find the element again by its key
+                    key_type key = iter.value_ptr()->key;
+                    Thaw();
+                    iter = find(key);
+                }
                 auto *slot_ptr = iter.value_ptr();
-                size_t bucket_index = CompleteGetBucketIndex(slot_ptr->key);
-                auto &temp_bucket = param_->bucket_array_[bucket_index];
-#ifndef NDEBUG
-                bool find_key_flag = false;
-#endif
-                for (size_t i = 0; i < temp_bucket.key_array.size(); ++i) {
-                    if FPH_UNLIKELY(temp_bucket.key_array[i] == std::addressof(slot_ptr->key)) {
-                        temp_bucket.key_array.erase(temp_bucket.key_array.begin() + i);
-#ifndef NDEBUG
-                        find_key_flag = true;
-#endif
-                        break;
-                    }
+                if FPH_UNLIKELY(IsStashSlot(slot_ptr)) {
+                    return EraseStashImp(slot_ptr);
                 }
-#ifndef NDEBUG
-                assert(find_key_flag);
-#endif
-                --temp_bucket.entry_cnt;
                 auto slot_pos = slot_ptr - slot_;
+                size_t bucket_index = GetBucketIndex(SlotSeed0Hash(slot_pos));
+                EraseBucketEntry(bucket_index, slot_pos);
                 assert(slot_pos >= 0 && size_t(slot_pos) < (param_->item_num_ceil_));
                 auto y_pos = param_->map_table_[slot_pos];
                 assert(y_pos < param_->filled_count_);
@@ -2609,6 +3868,7 @@ namespace fph {
                 std::swap(param_->map_table_[param_->random_table_[param_->filled_count_ - 1]],
                           param_->map_table_[param_->random_table_[y_pos]]);
                 --param_->filled_count_;
+                param_->slot_occupancy_.Release(slot_pos);
 
                 MarkSlotEmpty(slot_pos);
 
@@ -2622,11 +3882,32 @@ namespace fph {
 #endif
                 auto *next_slot_ptr = GetNextSlotAddress(slot_ptr);
 
-                param_->begin_it_ = iterator(next_slot_ptr, this);
+                AddNewIterator(next_slot_ptr);
 
                 return iterator(next_slot_ptr, this);
             }
 
+            // erase an element of the stash by moving the last element of the stash in its place
+            iterator EraseStashImp(slot_type *slot_ptr) {
+                const size_t stash_index = slot_ptr - param_->stash_slot_;
+                const size_t last_index = param_->stash_num_ - 1U;
+                std::allocator_traits<Allocator>::destroy(param_->alloc_, std::addressof(slot_ptr->mutable_value));
+                if (stash_index != last_index) {
+                    slot_type *last_slot_ptr = param_->stash_slot_ + last_index;
+                    std::allocator_traits<Allocator>::construct(param_->alloc_,
+                            std::addressof(slot_ptr->mutable_value), std::move(last_slot_ptr->mutable_value));
+                    std::allocator_traits<Allocator>::destroy(param_->alloc_,
+                            std::addressof(last_slot_ptr->mutable_value));
+                    param_->stash_seed0_hash_[stash_index] = param_->stash_seed0_hash_[last_index];
+                }
+                param_->stash_seed0_hash_.pop_back();
+                --param_->stash_num_;
+                --param_->item_num_;
+                slot_type *next_slot_ptr = stash_index < param_->stash_num_ ? slot_ptr : GetSlotAddressAfterStash();
+                AddNewIterator(next_slot_ptr);
+                return iterator(next_slot_ptr, this);
+            }
+
             iterator EraseImp(const_iterator first, const_iterator last) {
                 const_iterator it = first;
                 for (; it != last; ) {
@@ -2636,6 +3917,9 @@ namespace fph {
             }
 
             size_type EraseImp(const key_type& key) {
+                if FPH_UNLIKELY(param_->frozen_) {
+                    Thaw();
+                }
                 size_t ret = 0U;
                 auto pos = GetSlotPos(key);
                 auto *slot_ptr = slot_ + pos;
@@ -2648,17 +3932,28 @@ namespace fph {
                     }
 #endif
                 }
+                else if FPH_UNLIKELY(param_->stash_num_ != 0) {
+                    auto *stash_address = FindInStash<key_type>(key, hash_(key, seed0_));
+                    if (stash_address != nullptr) {
+                        ret = 1U;
+                        EraseStashImp(stash_address);
+                    }
+                }
                 return ret;
             }
 
 
 
             std::pair<slot_type*, bool> FindOrAlloc(const key_type& key) {
+                if FPH_UNLIKELY(param_->frozen_) {
+                    Thaw();
+                }
 
                 if FPH_UNLIKELY(param_->item_num_ + 1U > param_->should_expand_item_num_ &&
                                 meta::detail::Ceil2(param_->item_num_ceil_ + 1U) <=
                                 MAX_ITEM_NUM_CEIL_LIMIT) {
                     rehash(param_->item_num_ceil_ + 1U);
+                    ++param_->insert_path_stats_.expand_num;
                 }
                 const auto k_seed0_hash = hash_(key, seed0_);
                 const auto k_seed1_hash = MidHash(k_seed0_hash, seed1_);
@@ -2670,21 +3965,21 @@ namespace fph {
                 }
                 else {
 
-
+                    if FPH_UNLIKELY(param_->stash_num_ != 0) {
+                        auto *stash_address = FindInStash<key_type>(key, k_seed0_hash);
+                        if (stash_address != nullptr) {
+                            return {stash_address, false};
+                        }
+                    }
 
 
                     if (IsSlotEmpty(possible_pos)) {
-                        auto y_pos = param_->map_table_[possible_pos];
-                        assert(y_pos >= param_->filled_count_);
-                        std::swap(param_->random_table_[param_->filled_count_], param_->random_table_[y_pos]);
-                        std::swap(param_->map_table_[param_->random_table_[param_->filled_count_]],
-                                  param_->map_table_[param_->random_table_[y_pos]]);
-                        ++param_->filled_count_;
+                        AddFilledSlot(possible_pos);
+                        ++param_->insert_path_stats_.free_slot_num;
+                        StoreSeed0Hash(possible_pos, k_seed0_hash);
                         auto bucket_index = GetBucketIndex(k_seed0_hash);
 //                        auto bucket_index = GetBucketIndex(key);
-                        auto &temp_bucket = param_->bucket_array_[bucket_index];
-                        temp_bucket.key_array.push_back(&(insert_address->key));
-                        ++temp_bucket.entry_cnt;
+                        AddBucketEntry(bucket_index, possible_pos);
 
                         OccupyMetaDataSlot(possible_pos, k_seed1_hash);
 
@@ -2703,12 +3998,23 @@ namespace fph {
 
                         bool pattern_matched_flag = false;
 
-                        auto &temp_bucket = param_->bucket_array_[bucket_index];
-
-                        temp_bucket.key_array.push_back(&key);
+                        // the slot positions of the keys in the bucket, the new key is added
+                        // after the pattern is matched
+                        const size_t old_entry_cnt = param_->bucket_array_[bucket_index].entry_cnt;
+                        BucketParamType *bucket_entries = BucketEntryBegin(param_->bucket_array_[bucket_index]);
                         bool is_first_try = true;
 
+                        // the seed0 hashes of the keys in the bucket and then of the new key
+                        std::vector<size_t, SizeTAllocator> bucket_seed0_hash_vec;
+                        bucket_seed0_hash_vec.reserve(old_entry_cnt + 1U);
+                        for (size_t i = 0; i < old_entry_cnt; ++i) {
+                            bucket_seed0_hash_vec.push_back(SlotSeed0Hash(bucket_entries[i]));
+                        }
+                        bucket_seed0_hash_vec.push_back(k_seed0_hash);
+
                         std::vector<size_t, SizeTAllocator> bucket_pattern;
+                        // the slot positions of the pattern at offset 0
+                        std::vector<size_t, SizeTAllocator> bucket_pattern_pos;
 
                         for (auto bucket_try_bit = optional_bit; bucket_try_bit < 2U; ++bucket_try_bit) {
 
@@ -2716,8 +4022,8 @@ namespace fph {
 
                             bucket_pattern.clear();
 
-                            for (const auto *key_ptr: temp_bucket.key_array) {
-                                size_t temp_hash = CompleteHash(*key_ptr, try_seed);
+                            for (auto temp_seed0_hash: bucket_seed0_hash_vec) {
+                                size_t temp_hash = MidHash(temp_seed0_hash, try_seed);
 //                                size_t temp_hash = hash_(*key_ptr, try_seed);
 //                                size_t temp_hash = hash_(*key_ptr, try_seed) & item_num_mask_;
                                 bucket_pattern.push_back(temp_hash);
@@ -2734,13 +4040,7 @@ namespace fph {
                                     auto temp_pos = slot_index_policy_.MapToIndex(original_hash + slot_index_policy_.ReverseMap(bucket_offset));
 //                                    auto temp_pos =
 //                                            (original_hash + bucket_offset) & item_num_mask_;
-                                    auto y_pos = param_->map_table_[temp_pos];
-                                    assert(y_pos < param_->filled_count_);
-                                    std::swap(param_->random_table_[param_->filled_count_ - 1],
-                                              param_->random_table_[y_pos]);
-                                    std::swap(param_->map_table_[param_->random_table_[param_->filled_count_ - 1]],
-                                              param_->map_table_[param_->random_table_[y_pos]]);
-                                    --param_->filled_count_;
+                                    RemoveFilledSlot(temp_pos);
                                 }
                             }
                             is_first_try = false;
@@ -2756,53 +4056,50 @@ namespace fph {
 
                             size_t item_num_mask = param_->item_num_ceil_ - size_t(1ULL);
 
-                            for (size_t search_pos_begin = param_->filled_count_;
-                                 search_pos_begin < param_->item_num_ceil_; ++search_pos_begin) {
-//                                size_t temp_offset =
-//                                        (param_->item_num_ceil_ + param_->random_table_[search_pos_begin]
-//                                         - bucket_pattern[0]) & item_num_mask_;
-                                size_t temp_offset = (param_->item_num_ceil_ + param_->random_table_[search_pos_begin]
-                                                      - slot_index_policy_.MapToIndex(bucket_pattern[0])) & item_num_mask;
-
-                                bool this_offset_passed_flag = true;
-                                for (auto temp_hash_value: bucket_pattern) {
-                                    auto temp_pos = slot_index_policy_.MapToIndex(temp_hash_value +
-                                                                                  slot_index_policy_.ReverseMap(temp_offset));
-//                                    auto temp_pos =
-//                                            (temp_hash_value + temp_offset) & item_num_mask_;
-                                    if (param_->map_table_[temp_pos] < param_->filled_count_) {
-                                        this_offset_passed_flag = false;
-                                        break;
-                                    }
-                                }
-                                if (this_offset_passed_flag) {
-                                    pattern_matched_flag = true;
-                                    for (auto temp_hash_value: bucket_pattern) {
-                                        auto temp_pos = slot_index_policy_.MapToIndex(temp_hash_value +
-                                                                                      slot_index_policy_.ReverseMap(temp_offset));
-//                                        auto temp_pos =
-//                                                (temp_hash_value + temp_offset) & item_num_mask_;
-                                        auto y_pos = param_->map_table_[temp_pos];
-                                        std::swap(param_->random_table_[param_->filled_count_],
-                                                  param_->random_table_[y_pos]);
-                                        std::swap(param_->map_table_[param_->random_table_[param_->filled_count_]],
-                                                  param_->map_table_[param_->random_table_[y_pos]]);
-                                        ++param_->filled_count_;
-                                    }
-                                    bucket_p_array_[temp_bucket.index] =
-                                            (temp_offset << 1) | bucket_try_bit;
-
-                                    break;
-                                }
+                            bucket_pattern_pos.clear();
+                            for (auto temp_hash_value: bucket_pattern) {
+                                bucket_pattern_pos.push_back(slot_index_policy_.MapToIndex(temp_hash_value));
                             }
 
-                            if (pattern_matched_flag) {
+                            // test all the offsets
+                            size_t temp_offset = FindFreeOffset(bucket_pattern_pos, param_->item_num_ceil_);
+                            if (temp_offset != NO_SLOT_POS) {
+                                pattern_matched_flag = true;
+                                for (auto pattern_pos: bucket_pattern_pos) {
+                                    AddFilledSlot((pattern_pos + temp_offset) & item_num_mask);
+                                }
+                                bucket_p_array_[bucket_index] =
+                                        (temp_offset << 1U) | bucket_try_bit;
                                 break;
                             }
 
                         } // for bucket_try_bit
 
+                        // the keys of the other buckets moved by TryRepairBucket(), they are moved
+                        // together with the keys of this bucket
+                        std::vector<size_t, SizeTAllocator> moved_entry_index_vec, moved_seed0_hash_vec;
+                        if (pattern_matched_flag) {
+                            ++param_->insert_path_stats_.bucket_move_num;
+                        }
+                        else if (TryRepairBucket(bucket_index, bucket_seed0_hash_vec,
+                                                 moved_entry_index_vec, moved_seed0_hash_vec)) {
+                            pattern_matched_flag = true;
+                            ++param_->insert_path_stats_.local_repair_num;
+                        }
+                        else if (CanStashNewKey()) {
+                            // the bucket stays at its offset, and the new key is put in the stash
+                            for (size_t i = 0; i < old_entry_cnt; ++i) {
+                                AddFilledSlot(bucket_entries[i]);
+                            }
+                            ++param_->insert_path_stats_.stash_num;
+                            insert_address = AllocStashSlot(k_seed0_hash);
+                            AddNewIterator(insert_address);
+                            ++param_->item_num_;
+                            return {insert_address, true};
+                        }
+
                         if (!pattern_matched_flag) {
+                            ++param_->insert_path_stats_.full_rebuild_num;
                             assert(param_->item_num_ < param_->item_num_ceil_);
                             param_->temp_pair_buf_.resize((param_->item_num_ + 1) * sizeof(value_type));
                             value_type *temp_value_buf_start =
@@ -2810,10 +4107,16 @@ namespace fph {
                             value_type *temp_value_buf = temp_value_buf_start;
                             KeyAllocator key_alloc;
                             for (auto it = begin(); it != end(); ) {
+                                if (slot_seed0_hash_ != nullptr) {
+                                    param_->temp_seed0_hash_buf_.push_back(StoredSeed0Hash(it.value_ptr()));
+                                }
                                 std::allocator_traits<Allocator>::construct(param_->alloc_,
                                                                             temp_value_buf++, std::move(*it));
                                 ++it;
                             }
+                            if (slot_seed0_hash_ != nullptr) {
+                                param_->temp_seed0_hash_buf_.push_back(k_seed0_hash);
+                            }
 
                             slot_type* temp_slot_ptr =
                                     slot_type::GetSlotAddressByValueAddress(temp_value_buf);
@@ -2850,22 +4153,37 @@ namespace fph {
                             }
                             param_->temp_pair_buf_.clear();
                             param_->temp_pair_buf_.shrink_to_fit();
+                            param_->temp_seed0_hash_buf_.clear();
 
                             auto temp_pos = GetSlotPos(key);
                             insert_address = slot_ + temp_pos;
+                            // the build constructed the key in the new slot, but the callers
+                            // construct the whole value there
+                            std::allocator_traits<KeyAllocator>::destroy(key_alloc,
+                                    std::addressof(insert_address->key));
                         }
                         else {
 
+                            // the old keys of this bucket, then the keys of the moved buckets
+                            const size_t moved_cnt = old_entry_cnt + moved_entry_index_vec.size();
+                            auto moved_entry = [&](size_t i) -> BucketParamType& {
+                                return i < old_entry_cnt ? bucket_entries[i] :
+                                       param_->bucket_entry_array_[moved_entry_index_vec[i - old_entry_cnt]];
+                            };
+                            auto moved_seed0_hash = [&](size_t i) {
+                                return i < old_entry_cnt ? bucket_seed0_hash_vec[i] :
+                                       moved_seed0_hash_vec[i - old_entry_cnt];
+                            };
                             param_->temp_byte_buf_vec_.resize(
-                                    sizeof(slot_type) * temp_bucket.key_array.size());
+                                    sizeof(slot_type) * moved_cnt);
                             auto *temp_pair_buf = reinterpret_cast<slot_type *>(param_->temp_byte_buf_vec_.data());
 
 
                             // prevent overlap from elements in the same bucket in slots
-                            for (size_t i = 0; i + 1U < temp_bucket.key_array.size(); ++i) {
-                                const key_type *key_ptr = temp_bucket.key_array[i];
-                                auto original_slot_pos = GetSlotPos(*key_ptr, bucket_offset,
-                                                                    optional_bit);
+                            for (size_t i = 0; i < moved_cnt; ++i) {
+                                size_t original_slot_pos = moved_entry(i);
+                                assert(i >= old_entry_cnt || original_slot_pos == GetSlotPos(slot_[original_slot_pos].key,
+                                                                                            bucket_offset, optional_bit));
                                 slot_type *temp_pair_ptr = temp_pair_buf + i;
 
                                 auto *original_slot_address = slot_ + original_slot_pos;
@@ -2879,18 +4197,19 @@ namespace fph {
                                 MarkSlotEmpty(original_slot_pos);
 
                             }
-                            for (size_t i = 0; i + 1U < temp_bucket.key_array.size(); ++i) {
+                            for (size_t i = 0; i < moved_cnt; ++i) {
                                 slot_type *src_pair_ptr = temp_pair_buf + i;
-                                auto new_seed0_hash = hash_(src_pair_ptr->key, seed0_);
+                                auto new_seed0_hash = moved_seed0_hash(i);
                                 auto new_seed1_hash = MidHash(new_seed0_hash, seed1_);
                                 auto new_slot_pos = GetSlotPosBySeed0And1Hash(new_seed0_hash, new_seed1_hash);
                                 std::allocator_traits<Allocator>::construct(param_->alloc_,
                                                                             std::addressof(slot_[new_slot_pos].mutable_value),
                                                                             std::move(src_pair_ptr->mutable_value));
                                 OccupyMetaDataSlot(new_slot_pos, new_seed1_hash);
+                                StoreSeed0Hash(new_slot_pos, new_seed0_hash);
                                 std::allocator_traits<Allocator>::destroy(param_->alloc_, std::addressof(src_pair_ptr->mutable_value));
 
-                                temp_bucket.key_array[i] = &slot_[new_slot_pos].key;
+                                moved_entry(i) = new_slot_pos;
 
                             }
 
@@ -2901,9 +4220,9 @@ namespace fph {
                             assert(IsSlotEmpty(temp_pos));
 #endif
                             OccupyMetaDataSlot(temp_pos, k_seed1_hash);
+                            StoreSeed0Hash(temp_pos, k_seed0_hash);
 
-                            temp_bucket.key_array.back() = std::addressof(insert_address->key);
-                            ++temp_bucket.entry_cnt;
+                            AddBucketEntry(bucket_index, temp_pos);
                             AddNewIterator(insert_address);
                             ++param_->item_num_;
                         } // else of if (!pattern_matched_flag)
@@ -2918,13 +4237,172 @@ namespace fph {
                 return std::make_pair(insert_address, insert_flag);
             }
 
+            // build the table from the value_num elements moved to temp_pair_buf_, then destroy them
+            void BuildFromTempBuf(value_type *temp_value_buf_start, size_t value_num) {
+                Build<true, true, true>(temp_value_buf_start, temp_value_buf_start + value_num, seed1_,
+#if FPH_DEBUG_FLAG
+                        true,
+#else
+                                  false,
+#endif
+                                  param_->bits_per_key_,
+#if FPH_DY_DUAL_BUCKET_SET
+                        keys_first_part_ratio_, buckets_first_part_ratio_
+#else
+                                  DEFAULT_KEYS_FIRST_PART_RATIO, DEFAULT_BUCKETS_FIRST_PART_RATIO
+#endif
+                );
+                for (auto *temp_buf_ptr = temp_value_buf_start; temp_buf_ptr != temp_value_buf_start + value_num; temp_buf_ptr++) {
+                    std::allocator_traits<Allocator>::destroy(param_->alloc_, temp_buf_ptr);
+                }
+                param_->temp_pair_buf_.clear();
+                param_->temp_pair_buf_.shrink_to_fit();
+                param_->temp_seed0_hash_buf_.clear();
+            }
+
+            // the bytes of n elements of Vector, std::vector<bool> packs 8 of them in a byte
+            template<class Vector>
+            static size_t VectorBytes(size_t n) noexcept {
+                if constexpr (std::is_same_v<typename Vector::value_type, bool>) {
+                    return (n + 7U) / 8U;
+                }
+                else {
+                    return n * sizeof(typename Vector::value_type);
+                }
+            }
+
+            // free the memory of vec, @return the number of bytes freed
+            template<class Vector>
+            static size_t ReleaseVector(Vector &vec) {
+                size_t released_bytes = VectorBytes<Vector>(vec.capacity());
+                Vector(vec.get_allocator()).swap(vec);
+                return released_bytes;
+            }
+
+            static const key_type &KeyOfValue(const value_type &value) noexcept {
+                return slot_type::GetSlotAddressByValueAddress(std::addressof(value))->key;
+            }
+
+            template<class InsertIt, class EraseIt>
+            void BulkUpdateImp(InsertIt insert_first, InsertIt insert_last, EraseIt erase_first, EraseIt erase_last) {
+                using InsertTraits = std::iterator_traits<InsertIt>;
+                if constexpr (!std::is_base_of_v<std::forward_iterator_tag, typename InsertTraits::iterator_category>
+                              || !std::is_reference_v<typename InsertTraits::reference>
+                              || !std::is_same_v<std::remove_cv_t<std::remove_reference_t<
+                                      typename InsertTraits::reference>>, value_type>) {
+                    // the new values are read twice, so keep them in a buffer first
+                    std::vector<value_type> insert_buf(insert_first, insert_last);
+                    BulkUpdateImp(std::make_move_iterator(insert_buf.begin()),
+                                  std::make_move_iterator(insert_buf.end()), erase_first, erase_last);
+                }
+                else {
+                    // the elements to erase are skipped when the elements are moved out of the slots,
+                    // the ones in the stash are erased at once
+                    std::vector<bool> erased_flags;
+                    size_t erased_num = 0;
+                    for (; erase_first != erase_last; ++erase_first) {
+                        auto it = find(*erase_first);
+                        if (it == end()) {
+                            continue;
+                        }
+                        slot_type *slot_ptr = it.value_ptr();
+                        if (IsStashSlot(slot_ptr)) {
+                            EraseStashImp(slot_ptr);
+                            continue;
+                        }
+                        if (erased_flags.empty()) {
+                            erased_flags.resize(param_->item_num_ceil_, false);
+                        }
+                        if (!erased_flags[slot_ptr - slot_]) {
+                            erased_flags[slot_ptr - slot_] = true;
+                            ++erased_num;
+                        }
+                    }
+                    auto is_erased = [&](const slot_type *slot_ptr) {
+                        return !erased_flags.empty() && !IsStashSlot(slot_ptr) && erased_flags[slot_ptr - slot_];
+                    };
+
+                    // (seed0 hash, index in new_its) of the new values whose keys are not in the table
+                    std::vector<std::pair<size_t, size_t>> new_entries;
+                    std::vector<InsertIt> new_its;
+                    for (auto it = insert_first; it != insert_last; ++it) {
+                        const key_type &key = KeyOfValue(*it);
+                        const size_t k_seed0_hash = hash_(key, seed0_);
+                        const auto *value_ptr = GetPointerBySlotPos(GetSlotPosBySeed0Hash(k_seed0_hash),
+                                                                    k_seed0_hash, key);
+                        if (value_ptr != nullptr && !is_erased(slot_type::GetSlotAddressByValueAddress(value_ptr))) {
+                            continue;
+                        }
+                        new_entries.emplace_back(k_seed0_hash, new_its.size());
+                        new_its.push_back(it);
+                    }
+                    // the repeated keys have the same hash, keep the first of them
+                    std::stable_sort(new_entries.begin(), new_entries.end(),
+                                     [](const auto &a, const auto &b) { return a.first < b.first; });
+                    size_t new_num = 0, hash_group_begin = 0;
+                    for (size_t i = 0; i < new_entries.size(); ++i) {
+                        if (new_num == 0 || new_entries[new_num - 1U].first != new_entries[i].first) {
+                            hash_group_begin = new_num;
+                        }
+                        const key_type &key = KeyOfValue(*new_its[new_entries[i].second]);
+                        bool repeated = false;
+                        for (size_t j = hash_group_begin; j < new_num && !repeated; ++j) {
+                            repeated = key_equal_(KeyOfValue(*new_its[new_entries[j].second]), key);
+                        }
+                        if (!repeated) {
+                            new_entries[new_num++] = new_entries[i];
+                        }
+                    }
+                    new_entries.resize(new_num);
+
+                    if (new_num == 0 && erased_num == 0) {
+                        return;
+                    }
+                    const size_t total_num = param_->item_num_ - erased_num + new_num;
+                    if (total_num == 0) {
+                        clear();
+                        return;
+                    }
+                    size_type new_item_ceil_num = meta::detail::Ceil2(
+                            size_t(std::ceil(total_num / param_->max_load_factor_)));
+                    new_item_ceil_num = std::max(new_item_ceil_num, param_->item_num_ceil_);
+                    new_item_ceil_num = std::min(new_item_ceil_num, MAX_ITEM_NUM_CEIL_LIMIT);
+                    new_item_ceil_num = std::max(new_item_ceil_num, DEFAULT_INIT_ITEM_NUM_CEIL);
+                    slot_index_policy_.UpdateBySlotNum(new_item_ceil_num);
+                    param_->temp_pair_buf_.resize(total_num * sizeof(value_type));
+                    value_type *temp_value_buf_start = reinterpret_cast<value_type*>(param_->temp_pair_buf_.data());
+                    value_type *temp_value_buf = temp_value_buf_start;
+                    for (auto it = begin(); it != end(); ++it) {
+                        if (is_erased(it.value_ptr())) {
+                            continue;
+                        }
+                        if (slot_seed0_hash_ != nullptr) {
+                            param_->temp_seed0_hash_buf_.push_back(StoredSeed0Hash(it.value_ptr()));
+                        }
+                        std::allocator_traits<Allocator>::construct(param_->alloc_,
+                                                                    temp_value_buf++, std::move(*it));
+                    }
+                    for (const auto &entry: new_entries) {
+                        if (slot_seed0_hash_ != nullptr) {
+                            param_->temp_seed0_hash_buf_.push_back(entry.first);
+                        }
+                        std::allocator_traits<Allocator>::construct(param_->alloc_,
+                                                                    temp_value_buf++, *new_its[entry.second]);
+                    }
+                    param_->item_num_ = total_num;
+                    BuildFromTempBuf(temp_value_buf_start, total_num);
+                }
+            }
+
             void DestroySlots() {
                 if (slot_ != nullptr) {
-                    for (size_t i = 0; i < param_->item_num_ceil_; ++i) {
-                        if (IsSlotEmpty(i)) {}
-                        else {
-                            std::allocator_traits<Allocator>::destroy(param_->alloc_, std::addressof(slot_[i].mutable_value));
-                        }
+                    DestroyStash();
+                    if constexpr (!std::is_trivially_destructible_v<value_type>) {
+                        VisitFilledSlots([&](size_t pos) {
+                            std::allocator_traits<Allocator>::destroy(param_->alloc_,
+                                    std::addressof(slot_[pos].mutable_value));
+                            return true;
+                        });
                     }
                 }
             }
@@ -2997,6 +4475,8 @@ namespace fph {
                 DestroySlots();
 
                 param_->item_num_ = key_num;
+                // the build recreates the state released by Freeze()
+                param_->frozen_ = false;
 
                 if (key_num != 0) {
 //                    size_t temp_slot_num = size_t((double)key_num / MAX_LOAD_FACTOR_UPPER_LIMIT);
@@ -3115,6 +4595,42 @@ namespace fph {
 
 
 
+                constexpr bool random_access_input = std::is_base_of<std::random_access_iterator_tag,
+                        typename std::iterator_traits<InputIt>::iterator_category>::value;
+                const bool parallel_build = param_->build_concurrency_ > 1U && key_num >= PARALLEL_BUILD_MIN_KEY_NUM;
+                const size_t build_chunk_num = parallel_build ?
+                                               param_->build_concurrency_ * PARALLEL_BUILD_CHUNKS_PER_TASK : 1U;
+                using input_difference_type = typename std::iterator_traits<InputIt>::difference_type;
+                auto input_value_address = [&](size_t index) {
+                    return std::addressof(*std::next(pair_begin, static_cast<input_difference_type>(index)));
+                };
+                (void)input_value_address;
+                // the entries of the buckets are the indices of the input keys until the slots are
+                // constructed
+                std::vector<const key_type *, KeyPointerAllocator> input_key_ptr_vec;
+                input_key_ptr_vec.reserve(key_num);
+                for (auto it = pair_begin; it != pair_end; ++it) {
+                    input_key_ptr_vec.push_back(std::addressof(
+                            slot_type::GetSlotAddressByValueAddress(std::addressof(*it))->key));
+                }
+                // the seed0 hash of every input key, computed once for each seed0 and reused by all
+                // the tries of seed1 and seed2
+                SizeTVector input_seed0_hash_vec;
+                // a rehash of a table storing the hashes tries the current seed0 first, with the
+                // stored hashes of the elements
+                const bool keep_seed0 = is_rehash && param_->temp_seed0_hash_buf_.size() == key_num;
+                if (keep_seed0) {
+                    input_seed0_hash_vec.swap(param_->temp_seed0_hash_buf_);
+                }
+                else {
+                    input_seed0_hash_vec.resize(key_num);
+                }
+                auto input_seed0_hash_of_entry = [&](size_t input_index) {
+                    return input_seed0_hash_vec[input_index];
+                };
+                // the bucket index of every input key
+                BucketParamVector key_bucket_index_vec(key_num);
+
                 std::mt19937_64 random_engine(seed);
                 std::uniform_int_distribution<size_t> random_dis;
 
@@ -3122,8 +4638,19 @@ namespace fph {
 
                 for (size_t try_seed0_time = 0; try_seed0_time < max_try_seed0_time; ++ try_seed0_time) {
 
-                    seed0_ = random_dis(random_engine);
-                    seed0_ |= size_t(1ULL);
+                    if (!keep_seed0 || try_seed0_time > 0) {
+                        seed0_ = random_dis(random_engine);
+                        seed0_ |= size_t(1ULL);
+
+                        parallel_detail::RunBuildTasks(param_->build_executor_, build_chunk_num,
+                                                       [&](size_t chunk_index) {
+                            auto [chunk_begin, chunk_end] = parallel_detail::ChunkRange(
+                                    key_num, build_chunk_num, chunk_index);
+                            for (size_t i = chunk_begin; i < chunk_end; ++i) {
+                                input_seed0_hash_vec[i] = hash_(*input_key_ptr_vec[i], seed0_);
+                            }
+                        });
+                    }
 
                     for (size_t try_seed1_time = 0; try_seed1_time < max_try_seed1_time; ++try_seed1_time) {
 
@@ -3139,30 +4666,15 @@ namespace fph {
                         // ordering
 
 
-                        size_t max_bucket_size = 0;
-
-
-                        param_->bucket_array_.resize(0);
-                        for (size_t i = 0; i < param_->bucket_num_; ++i) {
-                            param_->bucket_array_.emplace_back(i);
-                        }
-
-                        auto update_bucket_func = [&](const auto* value_ptr) {
-                            const auto *slot_ptr = reinterpret_cast<const slot_type *>(value_ptr);
-//                            size_t hash_value = GetBucketIndex(slot_ptr->key);
-                            size_t hash_value = CompleteGetBucketIndex(slot_ptr->key);
-                            assert(hash_value < param_->bucket_num_);
-                            auto &temp_bucket = param_->bucket_array_[hash_value];
-                            ++temp_bucket.entry_cnt;
-                            max_bucket_size =
-                                    temp_bucket.entry_cnt > max_bucket_size ? temp_bucket.entry_cnt
-                                                                            : max_bucket_size;
-                            temp_bucket.AddKey(&(slot_ptr->key));
-                        };
-
-                        for (auto it = pair_begin; it != pair_end; ++it) {
-                            update_bucket_func(std::addressof(*it));
-                        }
+                        parallel_detail::RunBuildTasks(param_->build_executor_, build_chunk_num,
+                                                       [&](size_t chunk_index) {
+                            auto [chunk_begin, chunk_end] = parallel_detail::ChunkRange(
+                                    key_num, build_chunk_num, chunk_index);
+                            for (size_t i = chunk_begin; i < chunk_end; ++i) {
+                                key_bucket_index_vec[i] = GetBucketIndex(input_seed0_hash_vec[i]);
+                            }
+                        });
+                        size_t max_bucket_size = AssignBucketEntries(key_bucket_index_vec);
 
                         std::vector<size_t, SizeTAllocator> sorted_index_array;
                         sorted_index_array.resize(param_->bucket_num_);
@@ -3194,26 +4706,33 @@ namespace fph {
                         for (size_t try_seed2_time = 0; try_seed2_time < max_try_seed2_time; ++try_seed2_time) {
 
                             bool found_useful_seed2 = false;
-                            for (size_t seed_time = 0; seed_time < max_reseed2_time; ++seed_time) {
-                                seed2_ = random_dis(random_engine);
-                                seed2_ |= size_t(1ULL);
-
-                                bool pass_test_flag = true;
-                                for (size_t i = 0; i < param_->bucket_num_; ++i) {
-                                    auto &testing_bucket = param_->bucket_array_[sorted_index_array[i]];
-                                    pass_test_flag &= TestBucketSelfCollision(testing_bucket,
-                                                                              param_->seed2_test_table_,
-                                                                              param_->tested_hash_vec_, seed2_);
-
-                                    if (!pass_test_flag) {
+                            if (parallel_build) {
+                                found_useful_seed2 = ParallelFindSeed2(sorted_index_array, input_seed0_hash_of_entry,
+                                                                       random_engine, random_dis, max_reseed2_time);
+                            }
+                            else {
+                                for (size_t seed_time = 0; seed_time < max_reseed2_time; ++seed_time) {
+                                    seed2_ = random_dis(random_engine);
+                                    seed2_ |= size_t(1ULL);
+
+                                    bool pass_test_flag = true;
+                                    for (size_t i = 0; i < param_->bucket_num_; ++i) {
+                                        auto &testing_bucket = param_->bucket_array_[sorted_index_array[i]];
+                                        pass_test_flag &= TestBucketSelfCollision(testing_bucket,
+                                                                                  input_seed0_hash_of_entry,
+                                                                                  param_->seed2_test_table_,
+                                                                                  param_->tested_hash_vec_, seed2_);
+
+                                        if (!pass_test_flag) {
+                                            break;
+                                        }
+                                    }
+                                    if (pass_test_flag) {
+                                        found_useful_seed2 = true;
                                         break;
                                     }
-                                }
-                                if (pass_test_flag) {
-                                    found_useful_seed2 = true;
-                                    break;
-                                }
 
+                                }
                             }
                             if (!found_useful_seed2) {
                                 continue;
@@ -3230,9 +4749,13 @@ namespace fph {
 
                             //                        assert(IsRandomTableValid(param_->random_table_, param_->map_table_));
                             param_->filled_count_ = 0;
+                            param_->slot_occupancy_.Reset(param_->item_num_ceil_);
 
                             std::vector<size_t, SizeTAllocator> bucket_pattern;
                             bucket_pattern.reserve(max_bucket_size);
+                            // the slot positions of the pattern at offset 0
+                            std::vector<size_t, SizeTAllocator> bucket_pattern_pos;
+                            bucket_pattern_pos.reserve(max_bucket_size);
 
                             bool this_try_seed2_succeed_flag = true;
 
@@ -3250,8 +4773,9 @@ namespace fph {
 
                                     bucket_pattern.clear();
 
-                                    for (const auto *key_ptr: temp_bucket.key_array) {
-                                        size_t temp_hash = CompleteHash(*key_ptr, try_seed);
+                                    const auto *entry_begin = BucketEntryBegin(temp_bucket);
+                                    for (size_t i = 0; i < temp_bucket.entry_cnt; ++i) {
+                                        size_t temp_hash = MidHash(input_seed0_hash_of_entry(entry_begin[i]), try_seed);
                                         bucket_pattern.push_back(temp_hash);
                                     }
 
@@ -3269,30 +4793,35 @@ namespace fph {
 
                                     size_t item_num_mask = slot_index_policy_.slot_num() - size_t(1ULL);
 
+                                    bucket_pattern_pos.clear();
+                                    for (auto temp_hash_value: bucket_pattern) {
+                                        bucket_pattern_pos.push_back(slot_index_policy_.MapToIndex(temp_hash_value));
+                                    }
+
                                     for (size_t search_pos_begin = param_->filled_count_;
                                          search_pos_begin < param_->item_num_ceil_; ++search_pos_begin) {
+                                        // the first offset puts the first key in the free slot random_table_[search_pos_begin],
+                                        // and the next 63 offsets are tested with it at once
                                         size_t temp_offset = (param_->item_num_ceil_ + param_->random_table_[search_pos_begin]
-                                              - slot_index_policy_.MapToIndex(bucket_pattern[0]) ) & item_num_mask;
-                                        bool this_offset_passed_flag = true;
-                                        for (auto temp_hash_value: bucket_pattern) {
-                                            auto temp_pos = slot_index_policy_.MapToIndex(temp_hash_value + slot_index_policy_.ReverseMap(temp_offset));
-                                            if (param_->map_table_[temp_pos] < param_->filled_count_) {
-                                                this_offset_passed_flag = false;
-                                                break;
-                                            }
-                                        }
-                                        if (this_offset_passed_flag) {
+                                                              - bucket_pattern_pos[0]) & item_num_mask;
+                                        uint64_t free_offset_mask = param_->slot_occupancy_.FreeOffsetMask(bucket_pattern_pos,
+                                                                                                           temp_offset);
+                                        if (free_offset_mask != 0) {
                                             pattern_matched_flag = true;
-                                            for (auto temp_hash_value: bucket_pattern) {
-                                                auto temp_pos = slot_index_policy_.MapToIndex(temp_hash_value + slot_index_policy_.ReverseMap(temp_offset));
+                                            temp_offset = (temp_offset + occupancy_detail::CountTrailingZero64(free_offset_mask))
+                                                          & item_num_mask;
+                                            for (auto pattern_pos: bucket_pattern_pos) {
+                                                auto temp_pos = (pattern_pos + temp_offset) & item_num_mask;
                                                 auto y_pos = param_->map_table_[temp_pos];
+                                                assert(y_pos >= param_->filled_count_);
                                                 std::swap(param_->random_table_[param_->filled_count_],
                                                           param_->random_table_[y_pos]);
                                                 std::swap(param_->map_table_[param_->random_table_[param_->filled_count_]],
                                                           param_->map_table_[param_->random_table_[y_pos]]);
                                                 ++param_->filled_count_;
+                                                param_->slot_occupancy_.Occupy(temp_pos);
                                             }
-                                            bucket_p_array_[temp_bucket.index] =
+                                            bucket_p_array_[sorted_index_array[bucket_index]] =
                                                     (temp_offset << 1U) | bucket_try_bit;
 
                                             break;
@@ -3358,18 +4887,25 @@ namespace fph {
                     slot_ = SlotAllocator{}.allocate(param_->slot_capacity_);
                     meta_data_.SetUnderlyingArray(
                             MetaUnderAllocator{}.allocate(param_->meta_under_entry_capacity_));
+
+                    if (slot_seed0_hash_ != nullptr) {
+                        SizeTAllocator{}.deallocate(slot_seed0_hash_, old_slot_capacity);
+                        slot_seed0_hash_ = SizeTAllocator{}.allocate(param_->slot_capacity_);
+                    }
                 }
 
                 // Set all the slot empty
                 size_t meta_under_entry_num = MetaDataView::GetUnderlyingEntryNum(param_->item_num_ceil_);
                 memset(meta_data_.data(), 0, sizeof(MetaUnderEntry) * meta_under_entry_num);
 
+                // the slot position of every input key
+                auto &input_slot_pos_vec = key_bucket_index_vec;
+
                 if constexpr (use_move || (is_rehash && std::is_move_constructible<value_type>::value)) {
-                    auto construct_pair_func_move = [&](value_type &&value, bool only_key) {
+                    auto construct_pair_func_move = [&](value_type &&value, bool only_key, size_t k_seed0_hash) {
                         slot_type* slot_ptr = slot_type::GetSlotAddressByValueAddress(std::addressof(value));
-                        auto temp_seed0_hash = hash_(slot_ptr->key, seed0_);
-                        auto temp_seed1_hash = MidHash(temp_seed0_hash, seed1_);
-                        auto slot_pos = GetSlotPosBySeed0And1Hash(temp_seed0_hash, temp_seed1_hash);
+                        auto temp_seed1_hash = MidHash(k_seed0_hash, seed1_);
+                        auto slot_pos = GetSlotPosBySeed0And1Hash(k_seed0_hash, temp_seed1_hash);
                         OccupyMetaDataSlot(slot_pos, temp_seed1_hash);
                         auto *insert_address = slot_ + slot_pos;
 
@@ -3383,14 +4919,35 @@ namespace fph {
                                     std::addressof(insert_address->mutable_value),
                                     std::move(value));
                         }
+                        return slot_pos;
                     };
-                    if constexpr (is_rehash) {
+                    // the keys map to distinct slots, so the slots can be constructed in parallel
+                    // as long as the construction does not throw
+                    constexpr bool parallel_construct = random_access_input
+                            && std::is_nothrow_move_constructible<value_type>::value
+                            && std::is_nothrow_move_constructible<key_type>::value;
+                    if (parallel_construct && parallel_build) {
+                        if constexpr (parallel_construct) {
+                            parallel_detail::RunBuildTasks(param_->build_executor_, build_chunk_num,
+                                                           [&](size_t chunk_index) {
+                                auto [chunk_begin, chunk_end] = parallel_detail::ChunkRange(
+                                        key_num, build_chunk_num, chunk_index);
+                                for (size_t i = chunk_begin; i < chunk_end; ++i) {
+                                    bool only_key = last_element_only_has_key && (i + 1U == key_num);
+                                    input_slot_pos_vec[i] = construct_pair_func_move(
+                                            std::move(*input_value_address(i)), only_key, input_seed0_hash_vec[i]);
+                                }
+                            });
+                        }
+                    }
+                    else if constexpr (is_rehash) {
                         size_t temp_key_cnt = 0;
                         for (auto it = pair_begin; it != pair_end; ++it) {
                             ++temp_key_cnt;
                             bool only_key = last_element_only_has_key && (temp_key_cnt == key_num);
                             static_assert(std::is_move_constructible<value_type>::value);
-                            construct_pair_func_move(std::move(*it), only_key);
+                            input_slot_pos_vec[temp_key_cnt - 1U] = construct_pair_func_move(std::move(*it), only_key,
+                                    input_seed0_hash_vec[temp_key_cnt - 1U]);
 
                         }
                     }
@@ -3400,16 +4957,16 @@ namespace fph {
                         for (auto it = pair_begin; it != pair_end; ++it) {
                             ++temp_key_cnt;
                             bool only_key = last_element_only_has_key && (temp_key_cnt == key_num);
-                            construct_pair_func_move(std::move(*it), only_key);
+                            input_slot_pos_vec[temp_key_cnt - 1U] = construct_pair_func_move(std::move(*it), only_key,
+                                    input_seed0_hash_vec[temp_key_cnt - 1U]);
                         }
                     }
                 }
                 else {
-                    auto construct_pair_func = [&](InputIt it, bool only_key) {
+                    auto construct_pair_func = [&](InputIt it, bool only_key, size_t k_seed0_hash) {
                         const slot_type* slot_ptr = slot_type::GetSlotAddressByValueAddress(std::addressof(*it));
-                        auto temp_seed0_hash = hash_(slot_ptr->key, seed0_);
-                        auto temp_seed1_hash = MidHash(temp_seed0_hash, seed1_);
-                        auto slot_pos = GetSlotPosBySeed0And1Hash(temp_seed0_hash, temp_seed1_hash);
+                        auto temp_seed1_hash = MidHash(k_seed0_hash, seed1_);
+                        auto slot_pos = GetSlotPosBySeed0And1Hash(k_seed0_hash, temp_seed1_hash);
                         OccupyMetaDataSlot(slot_pos, temp_seed1_hash);
                         auto *insert_address = slot_ + slot_pos;
                         if (only_key) {
@@ -3421,14 +4978,34 @@ namespace fph {
                                                                         std::addressof(insert_address->mutable_value),
                                                                         *it);
                         }
+                        return slot_pos;
                     };
 
-                    if constexpr (!is_rehash) {
+                    constexpr bool parallel_construct = random_access_input
+                            && std::is_nothrow_constructible<value_type,
+                                    typename std::iterator_traits<InputIt>::reference>::value
+                            && std::is_nothrow_copy_constructible<key_type>::value;
+                    if (parallel_construct && parallel_build) {
+                        if constexpr (parallel_construct) {
+                            parallel_detail::RunBuildTasks(param_->build_executor_, build_chunk_num,
+                                                           [&](size_t chunk_index) {
+                                auto [chunk_begin, chunk_end] = parallel_detail::ChunkRange(
+                                        key_num, build_chunk_num, chunk_index);
+                                for (size_t i = chunk_begin; i < chunk_end; ++i) {
+                                    bool only_key = last_element_only_has_key && (i + 1U == key_num);
+                                    input_slot_pos_vec[i] = construct_pair_func(
+                                            std::next(pair_begin, static_cast<input_difference_type>(i)),
+                                            only_key, input_seed0_hash_vec[i]);
+                                }
+                            });
+                        }
+                    }
+                    else if constexpr (!is_rehash) {
                         size_t temp_key_cnt = 0;
                         for (auto it = pair_begin; it != pair_end; ++it) {
                             ++temp_key_cnt;
                             bool only_key = last_element_only_has_key && (temp_key_cnt == key_num);
-                            construct_pair_func(it, only_key);
+                            input_slot_pos_vec[temp_key_cnt - 1U] = construct_pair_func(it, only_key, input_seed0_hash_vec[temp_key_cnt - 1U]);
                         }
                     }
                     else {
@@ -3437,13 +5014,26 @@ namespace fph {
                             ++temp_key_cnt;
                             bool only_key = last_element_only_has_key && (temp_key_cnt == key_num);
                             assert(!std::is_move_constructible<value_type>::value);
-                            construct_pair_func(it, only_key);
+                            input_slot_pos_vec[temp_key_cnt - 1U] = construct_pair_func(it, only_key, input_seed0_hash_vec[temp_key_cnt - 1U]);
                         }
                     }
                 }
 
 
 
+                // the entries of the buckets become the slot positions of the keys
+                parallel_detail::RunBuildTasks(param_->build_executor_, build_chunk_num,
+                                               [&](size_t chunk_index) {
+                    auto [chunk_begin, chunk_end] = parallel_detail::ChunkRange(
+                            key_num, build_chunk_num, chunk_index);
+                    for (size_t i = chunk_begin; i < chunk_end; ++i) {
+                        param_->bucket_entry_array_[i] = input_slot_pos_vec[param_->bucket_entry_array_[i]];
+                        if (slot_seed0_hash_ != nullptr) {
+                            slot_seed0_hash_[input_slot_pos_vec[i]] = input_seed0_hash_vec[i];
+                        }
+                    }
+                });
+
 #if FPH_ENABLE_ITERATOR
                 if (param_->item_num_ > 0) {
                     auto begin_it_pos = param_->random_table_[0];
@@ -3454,17 +5044,6 @@ namespace fph {
                 } else {
                     param_->begin_it_ = iterator(nullptr, nullptr);
                 }
-
-                for (auto &bucket_param: param_->bucket_array_) {
-                    bucket_param.key_array.clear();
-                }
-                for (auto it = begin(); it != end(); ++it) {
-                    const auto* slot_address = slot_type::GetSlotAddressByValueAddress(std::addressof(*it));
-                    auto bucket_index = CompleteGetBucketIndex(slot_address->key);
-//                    auto bucket_index = this->GetBucketIndex(slot_address->key);
-                    auto &key_array = param_->bucket_array_[bucket_index].key_array;
-                    key_array.push_back(&(slot_address->key));
-                }
 #endif
 
                 if (verbose) {
@@ -3778,7 +5357,11 @@ namespace fph {
         T& at (const key_arg<K> &key) {
             auto *pair_ptr = this->GetPointerNoCheck(key);
             if FPH_UNLIKELY(!this->key_equal_(pair_ptr->first, key)) {
-                meta::detail::ThrowOutOfRange("Can not find key in at");
+                auto *stash_address = this->template FindInStash<K>(key, this->GetSeed0Hash(key));
+                if (stash_address == nullptr) {
+                    meta::detail::ThrowOutOfRange("Can not find key in at");
+                }
+                return stash_address->value.second;
             }
             return pair_ptr->second;
         }
@@ -3787,7 +5370,11 @@ namespace fph {
         const T& at (const key_arg<K>& key) const {
             const auto *pair_ptr = this->GetPointerNoCheck(key);
             if FPH_UNLIKELY(!this->key_equal_(pair_ptr->first, key)) {
-                meta::detail::ThrowOutOfRange("Can not find key in at");
+                const auto *stash_address = this->template FindInStash<K>(key, this->GetSeed0Hash(key));
+                if (stash_address == nullptr) {
+                    meta::detail::ThrowOutOfRange("Can not find key in at");
+                }
+                return stash_address->value.second;
             }
             return pair_ptr->second;
         }
@@ -0,0 +1,471 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2022 renzibei
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * A wrapper of the fph tables for many lock-free readers and one writer at a time.
+ *
+ * fph::RcuTable<Table> publishes immutable versions of a table (e.g. fph::DynamicFphMap or
+ * fph::MetaFphMap). A version is a base table plus a small sorted delta of the keys inserted or
+ * erased since the base was built. A write copies the delta with the change and publishes the new
+ * version with an atomic pointer store, so it is visible to the readers as soon as insert() or
+ * erase() returns. When the delta grows larger than sqrt(size()) (or min_delta_num), the writer
+ * applies it to a copy of the base, where all the rebuilds happen, and publishes the copy.
+ *
+ * Writes are not published in place. An insert into a fph table may rebuild it or move the keys
+ * of a bucket to other slots, and a reader running at the same time could miss a key that is in
+ * the table. So every write copies: it copies the whole delta, O(sqrt(n)) entries, and every merge
+ * copies the whole base table. With n keys, a write copies O(sqrt(n)) entries amortized and at most
+ * O(n) when it merges. A merge holds two bases at a time, plus the retired ones that readers still
+ * use. Use fph::DoubleBufferedTable or a sharded table for write-heavy loads.
+ *
+ * The old versions are reclaimed with epochs: a reader counts itself in one of the per-thread
+ * stripes of the current epoch while it holds a ReadGuard, and the writer frees the retired
+ * versions after the readers of the previous epoch are gone. The readers never wait for the writer,
+ * and they do not share a reference count, so many query threads can read the same table.
+ *
+ * fph::RcuTable<fph::DynamicFphMap<uint64_t, uint64_t>> table(pairs.begin(), pairs.end());
+ * // query threads
+ * {
+ *     auto guard = table.Read();
+ *     const auto *pair_ptr = guard.find(key); // valid while the guard is alive
+ * }
+ * // the writer thread
+ * table.insert({new_key, new_value});
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace fph {
+
+    namespace rcu_detail {
+
+        constexpr size_t EPOCH_STRIPE_NUM = 64;
+
+        // the stripe of the reader counters used by this thread
+        inline size_t ThreadStripe() noexcept {
+            static std::atomic<size_t> next_stripe{0};
+            thread_local const size_t stripe = next_stripe.fetch_add(1, std::memory_order_relaxed)
+                    % EPOCH_STRIPE_NUM;
+            return stripe;
+        }
+
+        /*
+         * The readers count themselves in the counter of the parity of the epoch they entered in.
+         * Synchronize() moves to the next epoch, so the new readers use the other parity, and waits
+         * until the counters of the old parity drop to zero.
+         */
+        class EpochDomain {
+        public:
+            EpochDomain() : epoch_(0) {}
+
+            // return the token to pass to Leave()
+            size_t Enter() noexcept {
+                const size_t stripe = ThreadStripe();
+                while (true) {
+                    const uint64_t epoch = epoch_.load(std::memory_order_seq_cst);
+                    auto &count = counters_[epoch & 1U][stripe].count;
+                    count.fetch_add(1, std::memory_order_seq_cst);
+                    // if the writer moved to the next epoch meanwhile, it may not have seen this
+                    // reader, so enter again in the new epoch
+                    if (epoch_.load(std::memory_order_seq_cst) == epoch) {
+                        return (epoch & 1U) * EPOCH_STRIPE_NUM + stripe;
+                    }
+                    count.fetch_sub(1, std::memory_order_release);
+                }
+            }
+
+            void Leave(size_t token) noexcept {
+                counters_[token / EPOCH_STRIPE_NUM][token % EPOCH_STRIPE_NUM].count.fetch_sub(
+                        1, std::memory_order_release);
+            }
+
+            // wait until all the readers that entered before the call have left
+            void Synchronize() noexcept {
+                const uint64_t epoch = epoch_.load(std::memory_order_relaxed);
+                epoch_.store(epoch + 1U, std::memory_order_seq_cst);
+                for (auto &counter: counters_[epoch & 1U]) {
+                    while (counter.count.load(std::memory_order_acquire) != 0) {
+                        std::this_thread::yield();
+                    }
+                }
+            }
+
+        protected:
+            struct alignas(64) StripeCounter {
+                std::atomic<int64_t> count{0};
+            };
+
+            std::atomic<uint64_t> epoch_;
+            StripeCounter counters_[2][EPOCH_STRIPE_NUM];
+        };
+
+    } // namespace rcu_detail
+
+    template<class Table>
+    class RcuTable {
+    public:
+        using table_type = Table;
+        using key_type = typename Table::key_type;
+        using value_type = typename Table::value_type;
+        using key_equal = typename Table::key_equal;
+        using size_type = size_t;
+
+    protected:
+        // a key inserted (value holds the element) or erased (value is empty) after the base was built
+        struct DeltaEntry {
+            size_t seed0_hash;
+            key_type key;
+            std::optional<value_type> value;
+        };
+
+        struct Version {
+            const Table *base;
+            // sorted by seed0_hash, which is the seed0 hash of the key in base
+            std::vector<DeltaEntry> delta;
+            size_t size;
+        };
+
+    public:
+
+        /**
+         * A reader of the table. The published version seen by Read() is kept alive until the
+         * guard is destroyed, so the pointers returned by find() are valid as long as the guard is.
+         * A guard should not be held for a long time because the writer waits for it to reclaim
+         * the memory, and the writer thread must not hold one while it writes.
+         */
+        class ReadGuard {
+        public:
+            ReadGuard(ReadGuard &&o) noexcept: domain_(o.domain_), token_(o.token_), version_(o.version_) {
+                o.domain_ = nullptr;
+            }
+
+            ReadGuard(const ReadGuard&) = delete;
+            ReadGuard& operator=(const ReadGuard&) = delete;
+            ReadGuard& operator=(ReadGuard&&) = delete;
+
+            ~ReadGuard() {
+                if (domain_ != nullptr) {
+                    domain_->Leave(token_);
+                }
+            }
+
+            // the element with the key, nullptr if the key is not in the table
+            template<class K = key_type>
+            const value_type *find(const K &key) const {
+                return FindInVersion(version_, key);
+            }
+
+            template<class K = key_type>
+            bool contains(const K &key) const {
+                return FindInVersion(version_, key) != nullptr;
+            }
+
+            size_type size() const noexcept {
+                return version_->size;
+            }
+
+        protected:
+            friend class RcuTable;
+
+            ReadGuard(rcu_detail::EpochDomain *domain, size_t token, const Version *version) noexcept:
+                    domain_(domain), token_(token), version_(version) {}
+
+            rcu_detail::EpochDomain *domain_;
+            size_t token_;
+            const Version *version_;
+        };
+
+        /**
+         * @param min_delta_num the delta is applied to the base once it has more than
+         * max(min_delta_num, sqrt(size())) keys
+         */
+        explicit RcuTable(size_t min_delta_num = 64U) : RcuTable(std::make_unique<Table>(), min_delta_num) {}
+
+        template<class InputIt>
+        RcuTable(InputIt first, InputIt last, size_t min_delta_num = 64U) :
+                RcuTable(std::make_unique<Table>(first, last), min_delta_num) {}
+
+        RcuTable(const RcuTable&) = delete;
+        RcuTable& operator=(const RcuTable&) = delete;
+
+        // no reader or writer can be running
+        ~RcuTable() {
+            delete current_.load(std::memory_order_relaxed);
+        }
+
+        // thread-safe, never waits for the writer
+        ReadGuard Read() const noexcept {
+            const size_t token = epoch_domain_.Enter();
+            return ReadGuard(&epoch_domain_, token, current_.load(std::memory_order_acquire));
+        }
+
+        template<class K = key_type>
+        bool contains(const K &key) const {
+            return Read().contains(key);
+        }
+
+        /**
+         * Call func(value) if the key is in the table
+         * @return whether the key is found
+         */
+        template<class K, class Func>
+        bool Visit(const K &key, Func &&func) const {
+            auto guard = Read();
+            const value_type *value_ptr = guard.find(key);
+            if (value_ptr == nullptr) {
+                return false;
+            }
+            func(*value_ptr);
+            return true;
+        }
+
+        size_type size() const {
+            return Read().size();
+        }
+
+        /**
+         * Insert the value if its key is not in the table. The writes are serialized by a mutex,
+         * and the insert is visible to the readers when this returns.
+         * @return whether the value is inserted
+         */
+        bool insert(const value_type &value) {
+            return InsertImp(value);
+        }
+
+        bool insert(value_type &&value) {
+            return InsertImp(std::move(value));
+        }
+
+        // erase the key if it is in the table, visible to the readers when this returns
+        size_type erase(const key_type &key) {
+            std::lock_guard<std::mutex> lock(write_mutex_);
+            const Version *version = current_.load(std::memory_order_relaxed);
+            const Table &base = *version->base;
+            const size_t k_seed0_hash = base.GetSeed0Hash(key);
+            auto entry_it = FindDeltaEntry(version->delta, key, k_seed0_hash);
+            std::vector<DeltaEntry> new_delta;
+            if (entry_it != version->delta.end()) {
+                if (!entry_it->value.has_value()) {
+                    return 0;
+                }
+                new_delta.reserve(version->delta.size());
+                AppendEntries(new_delta, version->delta.begin(), entry_it);
+                // a key not in the base does not need a tombstone
+                if (FindInBase(base, key, k_seed0_hash) != nullptr) {
+                    new_delta.push_back(DeltaEntry{k_seed0_hash, key, std::nullopt});
+                }
+                AppendEntries(new_delta, entry_it + 1, version->delta.end());
+            }
+            else {
+                if (FindInBase(base, key, k_seed0_hash) == nullptr) {
+                    return 0;
+                }
+                new_delta = CopyDeltaWithEntry(version->delta, DeltaEntry{k_seed0_hash, key, std::nullopt});
+            }
+            Publish(new Version{version->base, std::move(new_delta), version->size - 1U});
+            return 1U;
+        }
+
+        // apply the delta to the base now and reclaim all the retired versions
+        void Compact() {
+            std::lock_guard<std::mutex> lock(write_mutex_);
+            if (!current_.load(std::memory_order_relaxed)->delta.empty()) {
+                MergeDelta();
+            }
+            Reclaim();
+        }
+
+        // the number of keys inserted or erased since the last build of the base
+        size_type delta_size() const {
+            return Read().version_->delta.size();
+        }
+
+        // the number of the retired versions and bases not freed yet, waits for the writer
+        size_type retired_size() const {
+            std::lock_guard<std::mutex> lock(write_mutex_);
+            return retired_versions_.size() + retired_bases_.size();
+        }
+
+    protected:
+        // the versions retired by the writer are reclaimed in batches of this size
+        constexpr static size_t RECLAIM_BATCH_SIZE = 32;
+
+        RcuTable(std::unique_ptr<Table> base, size_t min_delta_num) :
+                epoch_domain_(), current_(nullptr), base_(std::move(base)), retired_versions_(),
+                retired_bases_(), min_delta_num_(std::max(min_delta_num, size_t(1U))), write_mutex_() {
+            current_.store(new Version{base_.get(), {}, base_->size()}, std::memory_order_release);
+        }
+
+        static const key_type &KeyOf(const value_type &value) noexcept {
+            if constexpr (std::is_same_v<std::remove_cv_t<value_type>, key_type>) {
+                return value;
+            }
+            else {
+                return value.first;
+            }
+        }
+
+        template<class K>
+        static const value_type *FindInBase(const Table &base, const K &key, size_t k_seed0_hash) {
+            return base.GetPointerBySlotPos(base.GetSlotPosBySeed0Hash(k_seed0_hash), k_seed0_hash, key);
+        }
+
+        template<class K>
+        static auto FindDeltaEntry(const std::vector<DeltaEntry> &delta, const K &key, size_t k_seed0_hash) {
+            auto it = std::lower_bound(delta.begin(), delta.end(), k_seed0_hash,
+                    [](const DeltaEntry &entry, size_t hash) { return entry.seed0_hash < hash; });
+            for (; it != delta.end() && it->seed0_hash == k_seed0_hash; ++it) {
+                if (key_equal{}(it->key, key)) {
+                    return it;
+                }
+            }
+            return delta.end();
+        }
+
+        template<class K>
+        static const value_type *FindInVersion(const Version *version, const K &key) {
+            const Table &base = *version->base;
+            const size_t k_seed0_hash = base.GetSeed0Hash(key);
+            if (!version->delta.empty()) {
+                auto entry_it = FindDeltaEntry(version->delta, key, k_seed0_hash);
+                if (entry_it != version->delta.end()) {
+                    return entry_it->value.has_value() ? std::addressof(*entry_it->value) : nullptr;
+                }
+            }
+            return FindInBase(base, key, k_seed0_hash);
+        }
+
+        // vector::insert needs assignable elements, which the entries of maps are not
+        template<class It>
+        static void AppendEntries(std::vector<DeltaEntry> &delta, It first, It last) {
+            for (; first != last; ++first) {
+                delta.push_back(*first);
+            }
+        }
+
+        // a copy of delta with the entry added in the order of seed0_hash, or replacing the entry
+        // of the same key
+        static std::vector<DeltaEntry> CopyDeltaWithEntry(const std::vector<DeltaEntry> &delta,
+                                                          DeltaEntry &&entry) {
+            auto entry_it = FindDeltaEntry(delta, entry.key, entry.seed0_hash);
+            auto insert_it = entry_it;
+            if (entry_it == delta.end()) {
+                insert_it = std::upper_bound(delta.begin(), delta.end(), entry.seed0_hash,
+                        [](size_t hash, const DeltaEntry &e) { return hash < e.seed0_hash; });
+            }
+            std::vector<DeltaEntry> new_delta;
+            new_delta.reserve(delta.size() + 1U);
+            AppendEntries(new_delta, delta.begin(), insert_it);
+            new_delta.push_back(std::move(entry));
+            AppendEntries(new_delta, entry_it == delta.end() ? insert_it : insert_it + 1,
+                             delta.end());
+            return new_delta;
+        }
+
+        template<class V>
+        bool InsertImp(V &&value) {
+            std::lock_guard<std::mutex> lock(write_mutex_);
+            const Version *version = current_.load(std::memory_order_relaxed);
+            const key_type &key = KeyOf(value);
+            if (FindInVersion(version, key) != nullptr) {
+                return false;
+            }
+            const size_t k_seed0_hash = version->base->GetSeed0Hash(key);
+            DeltaEntry entry{k_seed0_hash, key, std::optional<value_type>(std::forward<V>(value))};
+            Publish(new Version{version->base, CopyDeltaWithEntry(version->delta, std::move(entry)),
+                                version->size + 1U});
+            return true;
+        }
+
+        // publish the new version, retire the old one, and apply the delta if it is too large
+        void Publish(Version *new_version) {
+            Version *old_version = current_.load(std::memory_order_relaxed);
+            current_.store(new_version, std::memory_order_release);
+            retired_versions_.emplace_back(old_version);
+            const size_t max_delta_num = std::max(min_delta_num_,
+                    size_t(std::sqrt(static_cast<double>(new_version->size))));
+            if (new_version->delta.size() > max_delta_num) {
+                MergeDelta();
+                Reclaim();
+            }
+            else if (retired_versions_.size() >= RECLAIM_BATCH_SIZE) {
+                Reclaim();
+            }
+        }
+
+        // build a new base with the delta applied, while the readers still use the old base
+        void MergeDelta() {
+            Version *version = current_.load(std::memory_order_relaxed);
+            auto new_base = std::make_unique<Table>(*version->base);
+            size_t insert_num = 0;
+            for (const auto &entry: version->delta) {
+                insert_num += entry.value.has_value();
+            }
+            new_base->reserve(new_base->size() + insert_num);
+            for (const auto &entry: version->delta) {
+                // the key of an insert entry may have been erased from the base and inserted again
+                new_base->erase(entry.key);
+                if (entry.value.has_value()) {
+                    new_base->insert(*entry.value);
+                }
+            }
+            const size_t new_size = new_base->size();
+            retired_bases_.push_back(std::move(base_));
+            base_ = std::move(new_base);
+            current_.store(new Version{base_.get(), {}, new_size}, std::memory_order_release);
+            retired_versions_.emplace_back(version);
+        }
+
+        // wait for the readers that may see the retired versions and free them
+        void Reclaim() {
+            epoch_domain_.Synchronize();
+            retired_versions_.clear();
+            retired_bases_.clear();
+        }
+
+        mutable rcu_detail::EpochDomain epoch_domain_;
+        // the published version, shared with the readers
+        std::atomic<Version*> current_;
+        // the base of the published version
+        std::unique_ptr<Table> base_;
+        std::vector<std::unique_ptr<Version>> retired_versions_;
+        std::vector<std::unique_ptr<Table>> retired_bases_;
+        const size_t min_delta_num_;
+        mutable std::mutex write_mutex_;
+    };
+
+} // namespace fph
@@ -0,0 +1,298 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2022 renzibei
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * A concurrent fph table split into independent shards: fph::ShardedFphTable<Table, ShardNum>,
+ * with the aliases fph::ShardedFphMap (of fph::DynamicFphMap shards) and fph::ShardedMetaFphMap
+ * (of fph::MetaFphMap shards).
+ *
+ * A key is routed to a shard by the high bits of its hash with a fixed seed, and each shard is
+ * guarded by its own reader-writer lock, so the threads working on different shards do not
+ * contend. The rebuild triggered by an insert only rebuilds one shard, which bounds its cost to
+ * about size() / ShardNum elements. InsertNoDuplicated(), rehash() and ForEach() work on the
+ * shards in parallel with the executor set by set_build_thread_num() or set_build_executor().
+ *
+ * fph::ShardedFphMap<uint64_t, uint64_t, 64> table;
+ * table.set_build_thread_num(8);
+ * table.InsertNoDuplicated(pairs.begin(), pairs.end());
+ * // any threads
+ * table.insert({new_key, new_value});
+ * table.Visit(key, [&](const auto &pair) { sum += pair.second; });
+ */
+
+#pragma once
+
+#include "dynamic_fph_table.h"
+#include "meta_fph_table.h"
+#include "build_executor.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <array>
+#include <iterator>
+#include <mutex>
+#include <shared_mutex>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace fph {
+
+    /**
+     * @tparam Table the type of the shards, e.g. fph::DynamicFphMap or fph::MetaFphMap
+     * @tparam ShardNum the number of the shards, a power of 2
+     */
+    template<class Table, size_t ShardNum = 16>
+    class ShardedFphTable {
+        static_assert(ShardNum > 0 && (ShardNum & (ShardNum - 1U)) == 0, "ShardNum should be a power of 2");
+    public:
+        using table_type = Table;
+        using key_type = typename Table::key_type;
+        using value_type = typename Table::value_type;
+        using hasher = typename Table::hasher;
+        using key_equal = typename Table::key_equal;
+        using size_type = size_t;
+
+        constexpr static size_t SHARD_NUM = ShardNum;
+
+        ShardedFphTable() = default;
+
+        ShardedFphTable(const ShardedFphTable&) = delete;
+        ShardedFphTable& operator=(const ShardedFphTable&) = delete;
+
+        // the index of the shard that holds the key
+        template<class K = key_type>
+        static size_t ShardIndex(const K &key) noexcept {
+            if constexpr (ShardNum == 1) {
+                (void)key;
+                return 0;
+            }
+            else {
+                // the high bits of the product depend on all the bits of the hash
+                const uint64_t hash = uint64_t(hasher{}(key, SHARD_HASH_SEED)) * 0x9E3779B97F4A7C15ULL;
+                return size_t(hash >> (64U - SHARD_BITS));
+            }
+        }
+
+        /**
+         * The threads of the parallel operations: InsertNoDuplicated(), rehash(), reserve() and
+         * ForEach(). Not thread-safe, call it before sharing the table.
+         */
+        void set_build_thread_num(size_t thread_num) {
+            executor_ = thread_num > 1 ? MakeThreadBuildExecutor(thread_num) : BuildExecutor{};
+        }
+
+        // run the shards of the parallel operations with executor, see fph::BuildExecutor
+        void set_build_executor(BuildExecutor executor) {
+            executor_ = std::move(executor);
+        }
+
+        /**
+         * Insert the values whose keys are not in the table and not repeated in [first, last).
+         * The values are grouped by shard, and the shards are filled in parallel; an empty shard
+         * is built at once like table.InsertNoDuplicated().
+         */
+        template<class InputIt>
+        void InsertNoDuplicated(InputIt first, InputIt last) {
+            std::array<std::vector<value_type>, ShardNum> shard_values;
+            for (; first != last; ++first) {
+                const value_type &value = *first;
+                shard_values[ShardIndex(KeyOf(value))].push_back(value);
+            }
+            RunShardTasks([&](size_t i) {
+                std::unique_lock<std::shared_mutex> lock(shards_[i].mutex);
+                shards_[i].table.InsertNoDuplicated(shard_values[i].begin(), shard_values[i].end());
+            });
+        }
+
+        // @return whether the value is inserted
+        bool insert(const value_type &value) {
+            auto &shard = shards_[ShardIndex(KeyOf(value))];
+            std::unique_lock<std::shared_mutex> lock(shard.mutex);
+            return shard.table.insert(value).second;
+        }
+
+        bool insert(value_type &&value) {
+            auto &shard = shards_[ShardIndex(KeyOf(value))];
+            std::unique_lock<std::shared_mutex> lock(shard.mutex);
+            return shard.table.insert(std::move(value)).second;
+        }
+
+        size_type erase(const key_type &key) {
+            auto &shard = shards_[ShardIndex(key)];
+            std::unique_lock<std::shared_mutex> lock(shard.mutex);
+            return shard.table.erase(key);
+        }
+
+        template<class K = key_type>
+        bool contains(const K &key) const {
+            const auto &shard = shards_[ShardIndex(key)];
+            std::shared_lock<std::shared_mutex> lock(shard.mutex);
+            return shard.table.contains(key);
+        }
+
+        /**
+         * Call func(value) under the read lock of the shard if the key is in the table
+         * @return whether the key is found
+         */
+        template<class K, class Func>
+        bool Visit(const K &key, Func &&func) const {
+            const auto &shard = shards_[ShardIndex(key)];
+            std::shared_lock<std::shared_mutex> lock(shard.mutex);
+            auto it = shard.table.find(key);
+            if (it == shard.table.end()) {
+                return false;
+            }
+            func(*it);
+            return true;
+        }
+
+        /**
+         * Call func(value) under the write lock of the shard if the key is in the table, func can
+         * modify the mapped value
+         * @return whether the key is found
+         */
+        template<class K, class Func>
+        bool Update(const K &key, Func &&func) {
+            auto &shard = shards_[ShardIndex(key)];
+            std::unique_lock<std::shared_mutex> lock(shard.mutex);
+            auto it = shard.table.find(key);
+            if (it == shard.table.end()) {
+                return false;
+            }
+            func(*it);
+            return true;
+        }
+
+        // the sum of the sizes of the shards, each read at a different time
+        size_type size() const {
+            size_type total_size = 0;
+            for (const auto &shard: shards_) {
+                std::shared_lock<std::shared_mutex> lock(shard.mutex);
+                total_size += shard.table.size();
+            }
+            return total_size;
+        }
+
+        bool empty() const {
+            return size() == 0;
+        }
+
+        void clear() {
+            for (auto &shard: shards_) {
+                std::unique_lock<std::shared_mutex> lock(shard.mutex);
+                shard.table.clear();
+            }
+        }
+
+        // rehash every shard to count / ShardNum slots in parallel
+        void rehash(size_type count) {
+            const size_type shard_count = (count + ShardNum - 1U) / ShardNum;
+            RunShardTasks([&](size_t i) {
+                std::unique_lock<std::shared_mutex> lock(shards_[i].mutex);
+                shards_[i].table.rehash(shard_count);
+            });
+        }
+
+        void reserve(size_type count) {
+            const size_type shard_count = (count + ShardNum - 1U) / ShardNum;
+            RunShardTasks([&](size_t i) {
+                std::unique_lock<std::shared_mutex> lock(shards_[i].mutex);
+                shards_[i].table.reserve(shard_count);
+            });
+        }
+
+        /**
+         * Call func(value) for every element, with the shards iterated in parallel. func is called
+         * under the read lock of the shard, and may be called from several threads at the same
+         * time for the elements of different shards.
+         */
+        template<class Func>
+        void ForEach(Func &&func) const {
+            RunShardTasks([&](size_t i) {
+                std::shared_lock<std::shared_mutex> lock(shards_[i].mutex);
+                for (const auto &value: shards_[i].table) {
+                    func(value);
+                }
+            });
+        }
+
+        /**
+         * Call func(shard_index, table) with the table of each shard under its write lock, with
+         * the shards visited in parallel. Use it to configure the shards, e.g. max_load_factor().
+         */
+        template<class Func>
+        void ForEachShard(Func &&func) {
+            RunShardTasks([&](size_t i) {
+                std::unique_lock<std::shared_mutex> lock(shards_[i].mutex);
+                func(i, shards_[i].table);
+            });
+        }
+
+    protected:
+        constexpr static size_t SHARD_HASH_SEED = 0x5bd1e995c3a5c85cULL;
+
+        constexpr static size_t Log2(size_t x) {
+            return x <= 1 ? 0 : 1U + Log2(x >> 1U);
+        }
+
+        constexpr static size_t SHARD_BITS = Log2(ShardNum);
+
+        // the shards are on different cache lines so their locks do not share one
+        struct alignas(64) Shard {
+            mutable std::shared_mutex mutex;
+            Table table;
+        };
+
+        static const key_type &KeyOf(const value_type &value) noexcept {
+            if constexpr (std::is_same_v<std::remove_cv_t<value_type>, key_type>) {
+                return value;
+            }
+            else {
+                return value.first;
+            }
+        }
+
+        template<class Func>
+        void RunShardTasks(Func &&func) const {
+            parallel_detail::RunBuildTasks(executor_, ShardNum, func);
+        }
+
+        std::array<Shard, ShardNum> shards_;
+        BuildExecutor executor_;
+    };
+
+    template<class Key, class T, size_t ShardNum = 16,
+            class SeedHash = SimpleSeedHash<Key>,
+            class KeyEqual = std::equal_to<Key>,
+            class Allocator = std::allocator<std::pair<const Key, T>>>
+    using ShardedFphMap = ShardedFphTable<DynamicFphMap<Key, T, SeedHash, KeyEqual, Allocator>, ShardNum>;
+
+    template<class Key, class T, size_t ShardNum = 16,
+            class SeedHash = meta::SimpleSeedHash<Key>,
+            class KeyEqual = std::equal_to<Key>,
+            class Allocator = std::allocator<std::pair<const Key, T>>>
+    using ShardedMetaFphMap = ShardedFphTable<MetaFphMap<Key, T, SeedHash, KeyEqual, Allocator>, ShardNum>;
+
+} // namespace fph
@@ -0,0 +1,181 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2022 renzibei
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * The occupancy bits of the slots of the fph tables, used to place the keys of a bucket and to
+ * skip the empty slots when iterating.
+ *
+ * A bucket with pattern positions p_0, ..., p_k - 1 can be placed at offset o if all the slots
+ * (p_i + o) mod slot_num are free. One 64-bit window of the free bits starting at p_i + o tells
+ * which of the offsets o, o + 1, ..., o + 63 are free for p_i, so the AND of the k windows tests
+ * 64 offsets at once with k word operations.
+ */
+
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#endif
+
+namespace fph::occupancy_detail {
+
+    // x should not be zero
+    inline size_t CountTrailingZero64(uint64_t x) {
+#if defined(__GNUC__) || defined(__clang__)
+        return __builtin_ctzll(x);
+#elif defined(_MSC_VER)
+        unsigned long result = 0;  // NOLINT(runtime/int)
+        if (_BitScanForward(&result, static_cast<unsigned long>(x))) {
+            return result;
+        }
+        _BitScanForward(&result, static_cast<unsigned long>(x >> 32));
+        return result + 32U;
+#else
+        size_t result = 0;
+        for (; !(x & 1U); x >>= 1U) {
+            ++result;
+        }
+        return result;
+#endif
+    }
+
+    /**
+     * One bit per slot, set if the slot is occupied. The number of slots is a power of 2
+     * @tparam WordAllocator allocator of uint64_t
+     */
+    template<class WordAllocator = std::allocator<uint64_t>>
+    class SlotOccupancyBits {
+    public:
+
+        SlotOccupancyBits() noexcept: word_array_{}, slot_mask_(0) {}
+
+        /**
+         * Set the number of slots and mark all the slots free
+         * @param slot_num a power of 2
+         */
+        void Reset(size_t slot_num) {
+            assert(slot_num == 0 || (slot_num & (slot_num - 1U)) == 0);
+            word_array_.assign((slot_num + WORD_BITS - 1U) / WORD_BITS, 0);
+            word_array_.shrink_to_fit();
+            slot_mask_ = slot_num > 0 ? slot_num - 1U : 0;
+        }
+
+        size_t slot_num() const noexcept {
+            return word_array_.empty() ? 0 : slot_mask_ + 1U;
+        }
+
+        // the bytes allocated for the bits
+        size_t capacity_bytes() const noexcept {
+            return word_array_.capacity() * sizeof(uint64_t);
+        }
+
+        bool IsOccupied(size_t pos) const noexcept {
+            return (word_array_[pos / WORD_BITS] >> (pos % WORD_BITS)) & 1U;
+        }
+
+        void Occupy(size_t pos) noexcept {
+            word_array_[pos / WORD_BITS] |= uint64_t(1U) << (pos % WORD_BITS);
+        }
+
+        void Release(size_t pos) noexcept {
+            word_array_[pos / WORD_BITS] &= ~(uint64_t(1U) << (pos % WORD_BITS));
+        }
+
+        /**
+         * Skip the free slots a word at a time
+         * @param pos
+         * @return the first occupied position not less than pos, or slot_num() if there is none
+         */
+        size_t FindOccupied(size_t pos) const noexcept {
+            const size_t slot_num = this->slot_num();
+            if (pos >= slot_num) {
+                return slot_num;
+            }
+            size_t word_index = pos / WORD_BITS;
+            uint64_t word = word_array_[word_index] & (~uint64_t(0) << (pos % WORD_BITS));
+            while (word == 0) {
+                if (++word_index >= word_array_.size()) {
+                    return slot_num;
+                }
+                word = word_array_[word_index];
+            }
+            return word_index * WORD_BITS + CountTrailingZero64(word);
+        }
+
+        /**
+         * @param pos
+         * @return bit j is set if the slot (pos + j) mod slot_num is free
+         */
+        uint64_t FreeWindow(size_t pos) const noexcept {
+            if (slot_mask_ + 1U < WORD_BITS) {
+                uint64_t window = 0;
+                for (size_t j = 0; j < WORD_BITS; ++j) {
+                    window |= uint64_t(!IsOccupied((pos + j) & slot_mask_)) << j;
+                }
+                return window;
+            }
+            size_t word_index = (pos & slot_mask_) / WORD_BITS;
+            size_t bit_index = pos % WORD_BITS;
+            uint64_t occupied = word_array_[word_index] >> bit_index;
+            if (bit_index > 0) {
+                size_t next_word_index = (word_index + 1U) & (slot_mask_ / WORD_BITS);
+                occupied |= word_array_[next_word_index] << (WORD_BITS - bit_index);
+            }
+            return ~occupied;
+        }
+
+        /**
+         * Test the offsets offset, offset + 1, ..., offset + 63 for a pattern at once
+         * @tparam PosVec
+         * @param pos_vec the positions of the pattern, less than slot_num
+         * @param offset
+         * @return bit j is set if the slots (pos + offset + j) mod slot_num are free for all pos in
+         * pos_vec
+         */
+        template<class PosVec>
+        uint64_t FreeOffsetMask(const PosVec &pos_vec, size_t offset) const noexcept {
+            uint64_t mask = ~uint64_t(0);
+            for (auto pos: pos_vec) {
+                mask &= FreeWindow(pos + offset);
+                if (mask == 0) {
+                    break;
+                }
+            }
+            return mask;
+        }
+
+    protected:
+        constexpr static size_t WORD_BITS = 64U;
+
+        std::vector<uint64_t, WordAllocator> word_array_;
+        size_t slot_mask_;
+    };
+
+} // namespace fph::occupancy_detail
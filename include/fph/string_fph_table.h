@@ -0,0 +1,771 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2022 renzibei
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * The dynamic perfect hash set and map specialized for string keys: fph::FphStringSet and
+ * fph::FphStringMap.
+ *
+ * The bytes of all the keys are kept in one contiguous arena. A slot holds a 16-byte handle of its
+ * key instead of a std::string: a 64-bit fingerprint (the hash of the key bytes), and the offset
+ * and the length of the key in the arena. The seed hashes of a key are computed from the
+ * fingerprint, so building and rehashing the table only move the handles and never read the key
+ * bytes. A lookup hashes the std::string_view once, and compares the fingerprint and the length
+ * before comparing the bytes in the arena.
+ *
+ * The keys are returned as std::string_view pointing into the arena. These views are invalidated
+ * by any insertion, erase or rehash, like the iterators.
+ * Two different keys with the same fingerprint have the same seed hashes for every seed, so the
+ * build of the table could not separate them. The fingerprints are computed with a seed of the
+ * table; when a new key has the same fingerprint as a key in the table, the table changes its
+ * fingerprint seed, computes the fingerprints of all the keys again from the arena and rebuilds.
+ */
+
+#pragma once
+
+#include "dynamic_fph_table.h"
+
+#include <string_view>
+
+namespace fph {
+
+    namespace dynamic::detail {
+
+        // The handle of a key stored in the slots of FphStringSet and FphStringMap
+        struct ArenaStringKey {
+            // low ARENA_STRING_OFFSET_BITS bits for the offset in the arena, high bits for the length
+            constexpr static size_t ARENA_STRING_OFFSET_BITS = 40;
+            constexpr static uint64_t ARENA_STRING_OFFSET_MASK = (uint64_t(1) << ARENA_STRING_OFFSET_BITS) - 1U;
+            // the keys inserted must be shorter than this
+            constexpr static size_t MAX_KEY_LENGTH = (size_t(1) << (64U - ARENA_STRING_OFFSET_BITS)) - 1U;
+            // the offset_and_length_ of the fill keys of the empty slots, no key inserted has it
+            constexpr static uint64_t FILL_KEY_TAG = std::numeric_limits<uint64_t>::max();
+
+            uint64_t fingerprint_;
+            uint64_t offset_and_length_;
+
+            size_t offset() const noexcept {
+                return offset_and_length_ & ARENA_STRING_OFFSET_MASK;
+            }
+
+            size_t length() const noexcept {
+                return offset_and_length_ >> ARENA_STRING_OFFSET_BITS;
+            }
+        };
+
+        static_assert(sizeof(ArenaStringKey) == 16);
+
+        // The key used to look up an ArenaStringKey table, the fingerprint is computed once
+        struct ArenaStringLookupKey {
+            uint64_t fingerprint_;
+            std::string_view str_;
+        };
+
+        // the fingerprint seed of a new table
+        constexpr uint64_t ARENA_STRING_FINGERPRINT_SEED = 0xe17a1465ULL;
+
+        // The default fingerprint of the key bytes, the seed is changed by the table when two keys
+        // have the same fingerprint
+        struct ArenaStringFingerprintHash {
+            uint64_t operator()(std::string_view str, uint64_t seed) const noexcept {
+                return ChosenMixSeedHash64(HashBytes(str.data(), str.size(), seed), seed);
+            }
+        };
+
+        struct ArenaStringSeedHash {
+            using is_transparent = void;
+
+            FPH_ALWAYS_INLINE size_t operator()(const ArenaStringKey &key, size_t seed) const noexcept {
+                return ChosenMixSeedHash64(key.fingerprint_, seed);
+            }
+
+            FPH_ALWAYS_INLINE size_t operator()(const ArenaStringLookupKey &key, size_t seed) const noexcept {
+                return ChosenMixSeedHash64(key.fingerprint_, seed);
+            }
+        };
+
+        // Compare two handles. Every key inserted has its own bytes in the arena, so two handles
+        // are equal only if they refer to the same key. Comparing with a string needs the arena and
+        // is done by the table.
+        struct ArenaStringKeyEqual {
+            using is_transparent = void;
+
+            FPH_ALWAYS_INLINE bool operator()(const ArenaStringKey &a, const ArenaStringKey &b) const noexcept {
+                return a.fingerprint_ == b.fingerprint_ && a.offset_and_length_ == b.offset_and_length_;
+            }
+        };
+
+        // Generate the fill keys of the empty slots
+        class ArenaStringKeyGenerator: public RandomGenerator<uint64_t> {
+            using BaseType = RandomGenerator<uint64_t>;
+        public:
+            using BaseType::BaseType;
+
+            ArenaStringKey operator()() {
+                return ArenaStringKey{random_gen(random_engine), ArenaStringKey::FILL_KEY_TAG};
+            }
+        };
+
+        template<class K>
+        class ArenaStringSetPolicy {
+        public:
+            using key_type = K;
+            using value_type = K;
+            using slot_type = DynamicSetSlotType<K>;
+            using index_map_policy = HighBitsIndexMapPolicy;
+            constexpr static bool TRACK_SLOT_RELOCATION = false;
+        };
+
+        /**
+         * Iterator of FphStringSet and FphStringMap, dereference to the key as a std::string_view
+         * (and a reference to the mapped value for the map)
+         * @tparam Table the table that creates the reference from a slot
+         * @tparam RawIterator the iterator of the raw set of the handles
+         */
+        template<class Table, class RawIterator, class ValueType, class Reference>
+        class ArenaStringIterator {
+        public:
+            using iterator_category = std::forward_iterator_tag;
+            using value_type = ValueType;
+            using difference_type = std::ptrdiff_t;
+            using reference = Reference;
+            using pointer = ArrowProxy<Reference>;
+
+            ArenaStringIterator() noexcept: raw_it_(), table_(nullptr) {}
+
+            ArenaStringIterator(RawIterator raw_it, const Table *table) noexcept: raw_it_(raw_it),
+                    table_(table) {}
+
+            template<class OtherReference, typename std::enable_if<
+                    !std::is_same<OtherReference, Reference>::value &&
+                    std::is_convertible<OtherReference, Reference>::value, int>::type = 0>
+            ArenaStringIterator(const ArenaStringIterator<Table, RawIterator, ValueType, OtherReference> &other) noexcept:
+                    raw_it_(other.raw_iterator()), table_(other.table()) {}
+
+            reference operator*() const {
+                return table_->template MakeReference<Reference>(raw_it_.value_ptr());
+            }
+
+            pointer operator->() const {
+                return pointer(**this);
+            }
+
+            ArenaStringIterator& operator++() {
+                ++raw_it_;
+                return *this;
+            }
+
+            ArenaStringIterator operator++(int) {
+                auto ret = *this;
+                ++raw_it_;
+                return ret;
+            }
+
+            friend bool operator==(const ArenaStringIterator &a, const ArenaStringIterator &b) noexcept {
+                return a.raw_it_.value_ptr() == b.raw_it_.value_ptr();
+            }
+
+            friend bool operator!=(const ArenaStringIterator &a, const ArenaStringIterator &b) noexcept {
+                return !(a == b);
+            }
+
+            const RawIterator& raw_iterator() const noexcept {
+                return raw_it_;
+            }
+
+            const Table* table() const noexcept {
+                return table_;
+            }
+
+        protected:
+            RawIterator raw_it_;
+            const Table *table_;
+        };
+
+        /**
+         * The common part of FphStringSet and FphStringMap: the raw set of the key handles and the
+         * arena of the key bytes
+         */
+        template<class Policy, class Allocator, class BucketParamType, class FingerprintHash>
+        class ArenaStringRawTable: protected DynamicRawSet<Policy, ArenaStringSeedHash,
+                ArenaStringKeyEqual,
+                typename std::allocator_traits<Allocator>::template rebind_alloc<typename Policy::value_type>,
+                BucketParamType, ArenaStringKeyGenerator> {
+        protected:
+            using Base = typename ArenaStringRawTable::DynamicRawSet;
+            using RawIterator = typename Base::iterator;
+            using slot_type = typename Base::slot_type;
+            using CharAllocator = typename std::allocator_traits<Allocator>::template rebind_alloc<char>;
+            using ArenaVector = std::vector<char, CharAllocator>;
+
+            // do not compact the arena until the erased keys take this many bytes
+            constexpr static size_t MIN_COMPACT_GARBAGE_BYTES = 4096;
+            // give up inserting a key whose fingerprint collides after this many new seeds
+            constexpr static size_t MAX_REFINGERPRINT_TIME = 8;
+
+        public:
+            using size_type = std::size_t;
+
+            ArenaStringRawTable(): Base(), arena_(), garbage_bytes_(0),
+                    fingerprint_seed_(ARENA_STRING_FINGERPRINT_SEED) {}
+
+            explicit ArenaStringRawTable(size_type bucket_count): Base(bucket_count), arena_(),
+                    garbage_bytes_(0), fingerprint_seed_(ARENA_STRING_FINGERPRINT_SEED) {}
+
+            using Base::size;
+            using Base::empty;
+            using Base::max_size;
+            using Base::bucket_count;
+            using Base::max_bucket_count;
+            using Base::load_factor;
+            using Base::max_load_factor;
+            using Base::max_load_factor_upper_limit;
+
+            void clear() noexcept {
+                Base::clear();
+                arena_.clear();
+                garbage_bytes_ = 0;
+            }
+
+            void rehash(size_type count) {
+                Base::rehash(count);
+                if (garbage_bytes_ > 0) {
+                    CompactArena();
+                }
+            }
+
+            void reserve(size_type count) {
+                rehash(std::ceil(count / this->max_load_factor()));
+            }
+
+            bool contains(std::string_view key) const noexcept {
+                return FindSlotPos(MakeLookupKey(key)) != Base::NO_SLOT_POS;
+            }
+
+            size_type count(std::string_view key) const noexcept {
+                return contains(key) ? 1U : 0U;
+            }
+
+            /**
+             * @return the number of bytes in the arena, including the bytes of the erased keys not
+             * compacted yet
+             */
+            size_type arena_size() const noexcept {
+                return arena_.size();
+            }
+
+        protected:
+            ArenaStringLookupKey MakeLookupKey(std::string_view key) const noexcept {
+                return ArenaStringLookupKey{fingerprint_hash_(key, fingerprint_seed_), key};
+            }
+
+            std::string_view KeyView(const ArenaStringKey &key) const noexcept {
+                return std::string_view(arena_.data() + key.offset(), key.length());
+            }
+
+            FPH_ALWAYS_INLINE bool KeyEqual(const ArenaStringKey &key,
+                                            const ArenaStringLookupKey &lookup_key) const noexcept {
+                // the length of a fill key never equals the length of a string
+                return key.fingerprint_ == lookup_key.fingerprint_ &&
+                       key.length() == lookup_key.str_.size() &&
+                       std::memcmp(arena_.data() + key.offset(), lookup_key.str_.data(),
+                                   lookup_key.str_.size()) == 0;
+            }
+
+            /**
+             * @return the slot position of key, or NO_SLOT_POS if key is not in the table
+             */
+            FPH_ALWAYS_INLINE size_t FindSlotPos(const ArenaStringLookupKey &lookup_key) const noexcept {
+                size_t slot_pos = this->GetSlotPos(lookup_key);
+                if FPH_LIKELY(KeyEqual(this->slot_[slot_pos].key, lookup_key)) {
+                    return slot_pos;
+                }
+                return Base::NO_SLOT_POS;
+            }
+
+            RawIterator RawIteratorAt(size_t slot_pos) const noexcept {
+                return RawIterator(this->slot_ + slot_pos, this);
+            }
+
+            RawIterator RawBegin() const noexcept {
+                if FPH_UNLIKELY(this->param_ == nullptr || this->size() == 0) {
+                    return RawIterator(nullptr, nullptr);
+                }
+                return RawIterator(this->param_->begin_it_.value_ptr(), this);
+            }
+
+            static RawIterator RawEnd() noexcept {
+                return RawIterator(nullptr, nullptr);
+            }
+
+            // Copy the bytes of a new key to the end of the arena and return its handle
+            ArenaStringKey AppendToArena(const ArenaStringLookupKey &lookup_key) {
+                const size_t length = lookup_key.str_.size();
+                const size_t offset = arena_.size();
+                if FPH_UNLIKELY(length >= ArenaStringKey::MAX_KEY_LENGTH) {
+                    ThrowInvalidArgument("The key of FphStringSet/Map is too long");
+                }
+                if FPH_UNLIKELY(offset + length > ArenaStringKey::ARENA_STRING_OFFSET_MASK) {
+                    ThrowRuntimeError("The arena of FphStringSet/Map is full");
+                }
+                // the key may be a view of the arena itself, which resize may reallocate
+                const char *arena_begin = arena_.data();
+                bool in_arena = !std::less<const char*>{}(lookup_key.str_.data(), arena_begin) &&
+                        std::less<const char*>{}(lookup_key.str_.data(), arena_begin + offset);
+                size_t src_offset = in_arena ? size_t(lookup_key.str_.data() - arena_begin) : 0;
+                arena_.resize(offset + length);
+                if (length > 0) {
+                    std::memcpy(arena_.data() + offset,
+                                in_arena ? arena_.data() + src_offset : lookup_key.str_.data(), length);
+                }
+                return ArenaStringKey{lookup_key.fingerprint_,
+                                      uint64_t(offset) | (uint64_t(length) << ArenaStringKey::ARENA_STRING_OFFSET_BITS)};
+            }
+
+            /**
+             * Insert a handle of key if key is not in the table
+             * @param construct_slot constructs the slot from the new handle
+             * @return the slot of key, and whether the key is inserted
+             */
+            template<class ConstructSlot>
+            std::pair<slot_type*, bool> FindOrInsertImp(std::string_view key, ConstructSlot &&construct_slot) {
+                auto lookup_key = MakeLookupKey(key);
+                size_t slot_pos = FindSlotPos(lookup_key);
+                if (slot_pos != Base::NO_SLOT_POS) {
+                    return {this->slot_ + slot_pos, false};
+                }
+                for (size_t refingerprint_time = 0; FPH_UNLIKELY(FingerprintCollides(lookup_key));
+                     ++refingerprint_time) {
+                    if FPH_UNLIKELY(refingerprint_time >= MAX_REFINGERPRINT_TIME) {
+                        ThrowRuntimeError("The fingerprint of the key keeps colliding with a key in "
+                                          "FphStringSet/Map, consider using a stronger fingerprint hash");
+                    }
+                    Refingerprint();
+                    lookup_key = MakeLookupKey(key);
+                }
+                // drop the bytes of the new key if the insertion throws
+                struct ArenaTailGuard {
+                    ArenaVector *arena;
+                    size_t size;
+
+                    ~ArenaTailGuard() {
+                        if (arena != nullptr) {
+                            arena->resize(size);
+                        }
+                    }
+                } arena_tail_guard{&arena_, arena_.size()};
+                ArenaStringKey new_key = AppendToArena(lookup_key);
+                auto ret = this->FindOrAlloc(new_key);
+                assert(ret.second);
+                this->DestroyFillKey(ret.first);
+                construct_slot(ret.first, new_key);
+                arena_tail_guard.arena = nullptr;
+                return ret;
+            }
+
+            /**
+             * Whether a key in the table has the fingerprint of lookup_key, which is not in the
+             * table. That key has the same seed hashes, so it is in the slot of lookup_key.
+             */
+            bool FingerprintCollides(const ArenaStringLookupKey &lookup_key) const noexcept {
+                size_t slot_pos = this->GetSlotPos(lookup_key);
+                return !this->IsSlotEmpty(slot_pos) &&
+                       this->slot_[slot_pos].key.fingerprint_ == lookup_key.fingerprint_;
+            }
+
+            // Change the fingerprint seed, compute the fingerprints of the keys again from the
+            // arena and rebuild the table with the new seed hashes
+            void Refingerprint() {
+                fingerprint_seed_ = HashBytes(&fingerprint_seed_, sizeof(fingerprint_seed_),
+                                              ARENA_STRING_FINGERPRINT_SEED);
+                for (auto it = RawBegin(); it != RawEnd(); ++it) {
+                    ArenaStringKey &key = it.value_ptr()->key;
+                    key.fingerprint_ = fingerprint_hash_(KeyView(key), fingerprint_seed_);
+                }
+                this->RebuildImp(this->bucket_count());
+            }
+
+            RawIterator EraseRawImp(RawIterator raw_it) {
+                garbage_bytes_ += raw_it.value_ptr()->key.length();
+                auto next_it = Base::EraseImp(raw_it);
+                if FPH_UNLIKELY(garbage_bytes_ >= MIN_COMPACT_GARBAGE_BYTES &&
+                                garbage_bytes_ * 2U > arena_.size()) {
+                    // the slots are not moved, so the iterators are still valid
+                    CompactArena();
+                }
+                return next_it;
+            }
+
+            size_type EraseKeyImp(std::string_view key) {
+                size_t slot_pos = FindSlotPos(MakeLookupKey(key));
+                if (slot_pos == Base::NO_SLOT_POS) {
+                    return 0;
+                }
+                EraseRawImp(RawIteratorAt(slot_pos));
+                return 1;
+            }
+
+            // Copy the bytes of the keys in the table to a new arena and update the offsets in the
+            // handles. The fingerprints do not change, so the keys stay in their slots.
+            void CompactArena() {
+                ArenaVector new_arena;
+                new_arena.reserve(arena_.size() - garbage_bytes_);
+                for (auto it = RawBegin(); it != RawEnd(); ++it) {
+                    ArenaStringKey &key = it.value_ptr()->key;
+                    size_t new_offset = new_arena.size();
+                    new_arena.insert(new_arena.end(), arena_.data() + key.offset(),
+                                     arena_.data() + key.offset() + key.length());
+                    key.offset_and_length_ = uint64_t(new_offset) |
+                            (uint64_t(key.length()) << ArenaStringKey::ARENA_STRING_OFFSET_BITS);
+                }
+                arena_.swap(new_arena);
+                garbage_bytes_ = 0;
+            }
+
+            void SwapImp(ArenaStringRawTable &other) noexcept {
+                Base::swap(other);
+                arena_.swap(other.arena_);
+                std::swap(garbage_bytes_, other.garbage_bytes_);
+                std::swap(fingerprint_seed_, other.fingerprint_seed_);
+            }
+
+            using KeyAllocator = typename Base::KeyAllocator;
+
+            ArenaVector arena_;
+            size_t garbage_bytes_;
+            uint64_t fingerprint_seed_;
+            FingerprintHash fingerprint_hash_;
+        };
+
+    } // namespace dynamic::detail
+
+    /**
+     * The dynamic perfect hash set of strings whose bytes are stored in one arena.
+     * The keys are accessed as std::string_view, which are invalidated by insertions, erases and
+     * rehashes.
+     * @tparam Allocator
+     * @tparam BucketParamType
+     * @tparam FingerprintHash computes the 64-bit fingerprint of the key bytes with a seed,
+     * uint64_t(std::string_view, uint64_t)
+     */
+    template<class Allocator = std::allocator<std::string_view>,
+            class BucketParamType = uint32_t,
+            class FingerprintHash = dynamic::detail::ArenaStringFingerprintHash>
+    class FphStringSet: public dynamic::detail::ArenaStringRawTable<
+            dynamic::detail::ArenaStringSetPolicy<dynamic::detail::ArenaStringKey>, Allocator, BucketParamType,
+            FingerprintHash> {
+        using TableBase = typename FphStringSet::ArenaStringRawTable;
+        using RawIterator = typename TableBase::RawIterator;
+        using slot_type = typename TableBase::slot_type;
+        template<class, class, class, class>
+        friend class dynamic::detail::ArenaStringIterator;
+    public:
+        using key_type = std::string_view;
+        using value_type = std::string_view;
+        using size_type = std::size_t;
+        using difference_type = std::ptrdiff_t;
+        using allocator_type = Allocator;
+        using reference = std::string_view;
+        using const_reference = std::string_view;
+        using iterator = dynamic::detail::ArenaStringIterator<FphStringSet, RawIterator,
+                value_type, std::string_view>;
+        using const_iterator = iterator;
+
+        FphStringSet(): TableBase() {}
+
+        explicit FphStringSet(size_type bucket_count): TableBase(bucket_count) {}
+
+        template<class InputIt>
+        FphStringSet(InputIt first, InputIt last,
+                     size_type bucket_count = TableBase::DEFAULT_INIT_ITEM_NUM_CEIL):
+                TableBase(bucket_count) {
+            insert(first, last);
+        }
+
+        FphStringSet(std::initializer_list<std::string_view> init,
+                     size_type bucket_count = TableBase::DEFAULT_INIT_ITEM_NUM_CEIL):
+                FphStringSet(init.begin(), init.end(), bucket_count) {}
+
+        void swap(FphStringSet &other) noexcept {
+            this->SwapImp(other);
+        }
+
+        friend void swap(FphStringSet &a, FphStringSet &b) noexcept {
+            a.swap(b);
+        }
+
+        iterator begin() const noexcept {
+            return iterator(this->RawBegin(), this);
+        }
+
+        iterator cbegin() const noexcept {
+            return begin();
+        }
+
+        iterator end() const noexcept {
+            return iterator(TableBase::RawEnd(), this);
+        }
+
+        iterator cend() const noexcept {
+            return end();
+        }
+
+        iterator find(std::string_view key) const noexcept {
+            size_t slot_pos = this->FindSlotPos(this->MakeLookupKey(key));
+            if (slot_pos == TableBase::NO_SLOT_POS) {
+                return end();
+            }
+            return iterator(this->RawIteratorAt(slot_pos), this);
+        }
+
+        std::pair<iterator, bool> insert(std::string_view key) {
+            auto [slot_address, insert_happen] = this->FindOrInsertImp(key,
+                    [](slot_type *slot, const dynamic::detail::ArenaStringKey &new_key) {
+                typename TableBase::KeyAllocator key_alloc{};
+                std::allocator_traits<typename TableBase::KeyAllocator>::construct(key_alloc,
+                        std::addressof(slot->key), new_key);
+            });
+            return {iterator(RawIterator(slot_address, this), this), insert_happen};
+        }
+
+        template<class InputIt>
+        void insert(InputIt first, InputIt last) {
+            for (; first != last; ++first) {
+                insert(std::string_view(*first));
+            }
+        }
+
+        void insert(std::initializer_list<std::string_view> ilist) {
+            insert(ilist.begin(), ilist.end());
+        }
+
+        std::pair<iterator, bool> emplace(std::string_view key) {
+            return insert(key);
+        }
+
+        size_type erase(std::string_view key) {
+            return this->EraseKeyImp(key);
+        }
+
+        iterator erase(iterator pos) {
+            return iterator(this->EraseRawImp(pos.raw_iterator()), this);
+        }
+
+    protected:
+        template<class Reference>
+        Reference MakeReference(const slot_type *slot) const noexcept {
+            return this->KeyView(slot->key);
+        }
+    };
+
+    /**
+     * The dynamic perfect hash map with string keys whose bytes are stored in one arena.
+     * The iterators dereference to std::pair<std::string_view, T&> (std::pair<std::string_view,
+     * const T&> for const_iterator). The keys are invalidated by insertions, erases and rehashes.
+     * @tparam T the mapped type
+     * @tparam Allocator
+     * @tparam BucketParamType
+     * @tparam FingerprintHash computes the 64-bit fingerprint of the key bytes with a seed,
+     * uint64_t(std::string_view, uint64_t)
+     */
+    template<class T,
+            class Allocator = std::allocator<std::pair<const std::string_view, T>>,
+            class BucketParamType = uint32_t,
+            class FingerprintHash = dynamic::detail::ArenaStringFingerprintHash>
+    class FphStringMap: public dynamic::detail::ArenaStringRawTable<
+            dynamic::detail::DynamicFphMapPolicy<dynamic::detail::ArenaStringKey, T>, Allocator, BucketParamType,
+            FingerprintHash> {
+        using TableBase = typename FphStringMap::ArenaStringRawTable;
+        using RawIterator = typename TableBase::RawIterator;
+        using slot_type = typename TableBase::slot_type;
+        template<class, class, class, class>
+        friend class dynamic::detail::ArenaStringIterator;
+    public:
+        using key_type = std::string_view;
+        using mapped_type = T;
+        using value_type = std::pair<const std::string_view, T>;
+        using size_type = std::size_t;
+        using difference_type = std::ptrdiff_t;
+        using allocator_type = Allocator;
+        using reference = std::pair<std::string_view, T&>;
+        using const_reference = std::pair<std::string_view, const T&>;
+        using iterator = dynamic::detail::ArenaStringIterator<FphStringMap, RawIterator,
+                value_type, reference>;
+        using const_iterator = dynamic::detail::ArenaStringIterator<FphStringMap, RawIterator,
+                value_type, const_reference>;
+
+        FphStringMap(): TableBase() {}
+
+        explicit FphStringMap(size_type bucket_count): TableBase(bucket_count) {}
+
+        template<class InputIt>
+        FphStringMap(InputIt first, InputIt last,
+                     size_type bucket_count = TableBase::DEFAULT_INIT_ITEM_NUM_CEIL):
+                TableBase(bucket_count) {
+            insert(first, last);
+        }
+
+        FphStringMap(std::initializer_list<value_type> init,
+                     size_type bucket_count = TableBase::DEFAULT_INIT_ITEM_NUM_CEIL):
+                FphStringMap(init.begin(), init.end(), bucket_count) {}
+
+        void swap(FphStringMap &other) noexcept {
+            this->SwapImp(other);
+        }
+
+        friend void swap(FphStringMap &a, FphStringMap &b) noexcept {
+            a.swap(b);
+        }
+
+        iterator begin() noexcept {
+            return iterator(this->RawBegin(), this);
+        }
+
+        const_iterator begin() const noexcept {
+            return const_iterator(this->RawBegin(), this);
+        }
+
+        const_iterator cbegin() const noexcept {
+            return begin();
+        }
+
+        iterator end() noexcept {
+            return iterator(TableBase::RawEnd(), this);
+        }
+
+        const_iterator end() const noexcept {
+            return const_iterator(TableBase::RawEnd(), this);
+        }
+
+        const_iterator cend() const noexcept {
+            return end();
+        }
+
+        iterator find(std::string_view key) noexcept {
+            size_t slot_pos = this->FindSlotPos(this->MakeLookupKey(key));
+            if (slot_pos == TableBase::NO_SLOT_POS) {
+                return end();
+            }
+            return iterator(this->RawIteratorAt(slot_pos), this);
+        }
+
+        const_iterator find(std::string_view key) const noexcept {
+            size_t slot_pos = this->FindSlotPos(this->MakeLookupKey(key));
+            if (slot_pos == TableBase::NO_SLOT_POS) {
+                return end();
+            }
+            return const_iterator(this->RawIteratorAt(slot_pos), this);
+        }
+
+        /**
+         * Get the address of the mapped value of key without comparing the key
+         * @param key must be in the map
+         * @return the address of the mapped value of key
+         */
+        T* GetPointerNoCheck(std::string_view key) noexcept {
+            return std::addressof(this->slot_[this->GetSlotPos(this->MakeLookupKey(key))].value.second);
+        }
+
+        const T* GetPointerNoCheck(std::string_view key) const noexcept {
+            return std::addressof(this->slot_[this->GetSlotPos(this->MakeLookupKey(key))].value.second);
+        }
+
+        template<class... Args>
+        std::pair<iterator, bool> try_emplace(std::string_view key, Args&&... args) {
+            auto [slot_address, insert_happen] = this->FindOrInsertImp(key,
+                    [&](slot_type *slot, const dynamic::detail::ArenaStringKey &new_key) {
+                std::allocator_traits<typename TableBase::Base::allocator_type>::construct(this->param_->alloc_,
+                        std::addressof(slot->mutable_value), std::piecewise_construct,
+                        std::forward_as_tuple(new_key), std::forward_as_tuple(std::forward<Args>(args)...));
+            });
+            return {iterator(RawIterator(slot_address, this), this), insert_happen};
+        }
+
+        std::pair<iterator, bool> insert(const value_type &value) {
+            return try_emplace(value.first, value.second);
+        }
+
+        std::pair<iterator, bool> insert(value_type &&value) {
+            return try_emplace(value.first, std::move(value.second));
+        }
+
+        template<class InputIt>
+        void insert(InputIt first, InputIt last) {
+            for (; first != last; ++first) {
+                try_emplace(std::string_view((*first).first), (*first).second);
+            }
+        }
+
+        void insert(std::initializer_list<value_type> ilist) {
+            insert(ilist.begin(), ilist.end());
+        }
+
+        template<class M>
+        std::pair<iterator, bool> insert_or_assign(std::string_view key, M &&obj) {
+            auto ret = try_emplace(key, std::forward<M>(obj));
+            if (!ret.second) {
+                ret.first->second = std::forward<M>(obj);
+            }
+            return ret;
+        }
+
+        T& operator[](std::string_view key) {
+            return try_emplace(key).first->second;
+        }
+
+        T& at(std::string_view key) {
+            size_t slot_pos = this->FindSlotPos(this->MakeLookupKey(key));
+            if FPH_UNLIKELY(slot_pos == TableBase::NO_SLOT_POS) {
+                dynamic::detail::ThrowOutOfRange("Can not find key in at");
+            }
+            return this->slot_[slot_pos].value.second;
+        }
+
+        const T& at(std::string_view key) const {
+            size_t slot_pos = this->FindSlotPos(this->MakeLookupKey(key));
+            if FPH_UNLIKELY(slot_pos == TableBase::NO_SLOT_POS) {
+                dynamic::detail::ThrowOutOfRange("Can not find key in at");
+            }
+            return this->slot_[slot_pos].value.second;
+        }
+
+        size_type erase(std::string_view key) {
+            return this->EraseKeyImp(key);
+        }
+
+        iterator erase(iterator pos) {
+            return iterator(this->EraseRawImp(pos.raw_iterator()), this);
+        }
+
+        iterator erase(const_iterator pos) {
+            return iterator(this->EraseRawImp(pos.raw_iterator()), this);
+        }
+
+    protected:
+        template<class Reference>
+        Reference MakeReference(slot_type *slot) const noexcept {
+            return Reference(this->KeyView(slot->key), slot->mutable_value.second);
+        }
+    };
+
+} // namespace fph
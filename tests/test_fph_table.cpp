@@ -1,5 +1,10 @@
 #include "fph/dynamic_fph_table.h"
 #include "fph/meta_fph_table.h"
+#include "fph/huge_page_allocator.h"
+#include "fph/string_fph_table.h"
+#include "fph/double_buffered_table.h"
+#include "fph/rcu_table.h"
+#include "fph/sharded_fph_table.h"
 #include "loghelper.h"
 
 #include <unordered_set>
@@ -9,6 +14,8 @@
 #include <utility>
 #include <vector>
 #include <random>
+#include <thread>
+#include <atomic>
 
 
 
@@ -195,6 +202,47 @@ protected:
 
 
 
+// A key that counts its live objects, to check that the empty slots hold no key
+class CountedKey {
+public:
+    explicit CountedKey(std::string s): data(std::move(s)) { ++live_num; }
+    CountedKey(const CountedKey &o): data(o.data) { ++live_num; }
+    CountedKey(CountedKey &&o) noexcept: data(std::move(o.data)) { ++live_num; }
+    CountedKey& operator=(const CountedKey&) = delete;
+    CountedKey& operator=(CountedKey&&) = delete;
+    ~CountedKey() { --live_num; }
+
+    bool operator==(const CountedKey &o) const {
+        return data == o.data;
+    }
+
+    std::string data;
+    static inline int64_t live_num = 0;
+};
+
+struct CountedKeySeedHash {
+    size_t operator()(const CountedKey &src, size_t seed) const {
+        return fph::MixSeedHash<std::string>{}(src.data, seed);
+    }
+};
+
+class CountedKeyRNG {
+public:
+    CountedKeyRNG(): string_gen(std::random_device{}()) {}
+    explicit CountedKeyRNG(size_t seed): string_gen(seed) {}
+
+    CountedKey operator()() {
+        return CountedKey(string_gen());
+    }
+
+    void seed(size_t seed) {
+        string_gen.seed(seed);
+    }
+
+protected:
+    fph::dynamic::RandomGenerator<std::string> string_gen;
+};
+
 using fph::dynamic::detail::ToString;
 
 std::string ToString(const TestKeyClass &x) {
@@ -529,6 +577,73 @@ void PrintTableKeys(const Table &table) {
     fprintf(stderr, "\n");
 }
 
+template<class Table, typename = void>
+struct HasBatchLookup : std::false_type {};
+
+template<class Table>
+struct HasBatchLookup<Table, std::void_t<decltype(std::declval<const Table&>().ContainsBatch(
+        std::declval<const typename Table::key_type*>(), size_t(0), std::declval<uint64_t*>()))>>
+        : std::true_type {};
+
+template<class Table, typename = void>
+struct HasGatherValues : std::false_type {};
+
+template<class Table>
+struct HasGatherValues<Table, std::void_t<decltype(std::declval<const Table&>().GatherValues(
+        std::declval<const typename Table::key_type*>(), size_t(0),
+        std::declval<typename Table::mapped_type*>(), std::declval<uint64_t*>()))>>
+        : std::true_type {};
+
+template<class Table, class BenchTable, class KeyVec>
+bool TestBatchLookupCorrectness(const Table &table, const BenchTable &bench_table, const KeyVec &key_vec) {
+    size_t key_num = key_vec.size();
+    std::vector<typename Table::const_pointer> ptr_vec(key_num);
+    std::vector<uint64_t> bitmap((key_num + 63U) / 64U);
+    table.FindBatch(key_vec.data(), key_num, ptr_vec.data());
+    size_t found_cnt = table.ContainsBatch(key_vec.data(), key_num, bitmap.data());
+    size_t bench_found_cnt = 0;
+    for (size_t i = 0; i < key_num; ++i) {
+        auto find_it = table.find(key_vec[i]);
+        bool bench_found = bench_table.find(key_vec[i]) != bench_table.end();
+        bool bit_found = (bitmap[i / 64U] >> (i % 64U)) & 0x1U;
+        bench_found_cnt += bench_found;
+        if FPH_UNLIKELY(bit_found != bench_found) {
+            LogHelper::log(Error, "ContainsBatch result of key %s not same, table: %d, bench: %d",
+                           ToString(key_vec[i]).c_str(), bit_found, bench_found);
+            return false;
+        }
+        if FPH_UNLIKELY((ptr_vec[i] != nullptr) != bench_found
+                || (bench_found && ptr_vec[i] != std::addressof(*find_it))) {
+            LogHelper::log(Error, "FindBatch result of key %s not same as find",
+                           ToString(key_vec[i]).c_str());
+            return false;
+        }
+    }
+    if FPH_UNLIKELY(found_cnt != bench_found_cnt) {
+        LogHelper::log(Error, "ContainsBatch found %lu keys, bench found %lu keys", found_cnt, bench_found_cnt);
+        return false;
+    }
+    if constexpr (HasGatherValues<Table>::value) {
+        std::vector<typename Table::mapped_type> value_vec(key_num);
+        if FPH_UNLIKELY(table.GatherValues(key_vec.data(), key_num, value_vec.data(), bitmap.data())
+                != bench_found_cnt) {
+            LogHelper::log(Error, "GatherValues found count not same as bench");
+            return false;
+        }
+        for (size_t i = 0; i < key_num; ++i) {
+            auto bench_it = bench_table.find(key_vec[i]);
+            bool bit_found = (bitmap[i / 64U] >> (i % 64U)) & 0x1U;
+            if FPH_UNLIKELY(bit_found != (bench_it != bench_table.end())
+                    || (bit_found && !(value_vec[i] == bench_it->second))) {
+                LogHelper::log(Error, "GatherValues result of key %s not same as bench",
+                               ToString(key_vec[i]).c_str());
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
 template< class Table, class BenchTable, class PairVec, class GetKey = SimpleGetKey<typename Table::value_type>,
         class ValueEqual = std::equal_to<typename Table::value_type> >
 bool TestEraseCorrectness(Table &table, BenchTable &bench_table, PairVec &pair_vec1, PairVec &pair_vec2, size_t seed) {
@@ -619,6 +734,13 @@ bool TestEraseCorrectness(Table &table, BenchTable &bench_table, PairVec &pair_v
             return false;
         }
 
+        if constexpr (HasBatchLookup<Table>::value) {
+            if (!TestBatchLookupCorrectness(table, bench_table, key_seq_vec)) {
+                LogHelper::log(Error, "batch lookup not same after random erase");
+                return false;
+            }
+        }
+
         for (auto it = bench_table.begin(); it != bench_table.end();) {
             auto temp_key = GetKey{}(*it);
             table.erase(table.find(temp_key));
@@ -1346,6 +1468,53 @@ void TestTablePerformance(size_t element_num, size_t construct_time, size_t look
 
 
 
+// Compare the random lookup latency of the same table with the default allocator and with
+// fph::HugePageAllocator
+template<TableType table_type, class ValueRandomGen, class Table, class HugePageTable, class value_type,
+        class GetKey = SimpleGetKey<value_type>>
+void TestHugePageLookUpPerformance(size_t element_num, size_t lookup_time, size_t seed = 0,
+                                   double c = 2.0, double max_load_factor = 0.9) {
+    using mutable_value_type = typename MutableValue<value_type>::type;
+    using key_type = typename Table::key_type;
+    std::mt19937_64 random_engine(seed);
+    std::uniform_int_distribution<size_t> size_gen;
+    ValueRandomGen value_gen{};
+    value_gen.seed(seed);
+
+    std::unordered_set<key_type> key_set;
+    key_set.reserve(element_num);
+    std::vector<mutable_value_type> src_vec;
+    src_vec.reserve(element_num);
+    for (size_t i = 0; i < element_num; ++i) {
+        auto temp_pair = value_gen();
+        if (key_set.find(GetKey{}(temp_pair)) != key_set.end()) {
+            continue;
+        }
+        src_vec.push_back(temp_pair);
+        key_set.insert(GetKey{}(temp_pair));
+    }
+    key_set = std::unordered_set<key_type>{};
+
+    size_t construct_seed = size_gen(random_engine);
+    uint64_t lookup_ns = 0, huge_page_lookup_ns = 0, useless_sum = 0, huge_page_useless_sum = 0;
+    {
+        Table table;
+        std::tie(lookup_ns, useless_sum) = TestTableLookUp<KEY_IN, table_type, false, Table,
+                std::vector<mutable_value_type>, GetKey>(table, lookup_time, src_vec,
+                src_vec, construct_seed, max_load_factor, c);
+    }
+    {
+        HugePageTable table;
+        std::tie(huge_page_lookup_ns, huge_page_useless_sum) = TestTableLookUp<KEY_IN, table_type, false,
+                HugePageTable, std::vector<mutable_value_type>, GetKey>(table, lookup_time, src_vec,
+                src_vec, construct_seed, max_load_factor, c);
+    }
+    LogHelper::log(Info, "%s %lu elements, look up key in the table use %.3f ns per key with default allocator, "
+                         "%.3f ns per key with huge page allocator, useless_sum: %lu",
+                   GetTableName(table_type).c_str(), element_num, lookup_ns * 1.0 / lookup_time,
+                   huge_page_lookup_ns * 1.0 / lookup_time, useless_sum + huge_page_useless_sum);
+}
+
 void TestSet() {
 #if TEST_TABLE_CORRECT
 //    using KeyType = uint64_t;
@@ -1465,6 +1634,18 @@ void TestSet() {
             return;
         }
 
+        // std::string keys share the bytes of the fill keys in the empty slots
+        using StrDyFphSet15bit = fph::DynamicFphSet<std::string, fph::SimpleSeedHash<std::string>,
+                std::equal_to<>, std::allocator<std::string>, uint16_t>;
+        if (TestCorrectness<fph::dynamic::RandomGenerator<std::string>, StrDyFphSet15bit,
+                std::unordered_set<std::string>>(3000, 100)) {
+            LogHelper::log(Info, "Pass StrDyFphSet15Bit test with %d keys", 3000);
+        }
+        else {
+            LogHelper::log(Error, "Fail in StrDyFphSet15Bit test");
+            return;
+        }
+
 
 
     };
@@ -1485,67 +1666,1511 @@ struct FixSizeStruct {
 
 
 
-void TestFPH() {
-#if TEST_TABLE_CORRECT
-    using KeyType = uint32_t;
-//    using KeyType = TestKeyClass;
-//    using KeyType = std::string;
-//    using KeyType = const uint64_t*;
-//    using KeyType = enum {
-//        Type0,
-//        Type1,
-//        Type2,
-//        Type3,
-//    };
-    using ValueType = uint64_t;
-//    using ValueType = TestValueClass;
-//    using ValueType = std::string;
-//    using ValueType = FixSizeStruct<96>;
-//    using BucketParamType = uint32_t;
+bool TestStringTableCorrectness(size_t max_elem_num, size_t op_num, size_t seed) {
+    std::mt19937_64 random_engine(seed);
+    fph::dynamic::RandomGenerator<std::string> str_gen(seed);
+    std::vector<std::string> key_pool;
+    key_pool.reserve(max_elem_num);
+    key_pool.emplace_back();
+    for (size_t i = 1; i < max_elem_num; ++i) {
+        key_pool.push_back(str_gen(1U + random_engine() % 64U));
+    }
+    fph::FphStringMap<uint64_t> table;
+    fph::FphStringSet<> set_table;
+    std::unordered_map<std::string, uint64_t> bench_table;
+    for (size_t i = 0; i < op_num; ++i) {
+        const std::string &key = key_pool[random_engine() % key_pool.size()];
+        uint64_t value = random_engine();
+        size_t bench_erase_cnt;
+        switch (random_engine() % 4U) {
+            case 0:
+                bench_erase_cnt = bench_table.erase(key);
+                if (table.erase(key) != bench_erase_cnt || set_table.erase(key) != bench_erase_cnt) {
+                    LogHelper::log(Error, "Fail to erase key in string table, seed: %lu", seed);
+                    return false;
+                }
+                break;
+            case 1:
+                if (table.try_emplace(key, value).second != bench_table.try_emplace(key, value).second) {
+                    LogHelper::log(Error, "Fail to try_emplace key in string table, seed: %lu", seed);
+                    return false;
+                }
+                set_table.insert(key);
+                break;
+            default:
+                table[key] = value;
+                bench_table[key] = value;
+                set_table.insert(key);
+                break;
+        }
+        if (table.size() != bench_table.size() || set_table.size() != bench_table.size()) {
+            LogHelper::log(Error, "Size of string table is wrong, seed: %lu", seed);
+            return false;
+        }
+    }
+    for (const auto &key: key_pool) {
+        auto it = table.find(key);
+        auto bench_it = bench_table.find(key);
+        if ((it == table.end()) != (bench_it == bench_table.end()) ||
+            set_table.contains(key) != (bench_it != bench_table.end()) ||
+            (it != table.end() && it->second != bench_it->second)) {
+            LogHelper::log(Error, "Fail to find key in string table, seed: %lu", seed);
+            return false;
+        }
+    }
+    auto copy_table = table;
+    size_t iterate_cnt = 0;
+    for (auto [key, value]: copy_table) {
+        auto bench_it = bench_table.find(std::string(key));
+        if (bench_it == bench_table.end() || bench_it->second != value) {
+            LogHelper::log(Error, "Fail to iterate string table, seed: %lu", seed);
+            return false;
+        }
+        ++iterate_cnt;
+    }
+    if (iterate_cnt != bench_table.size()) {
+        LogHelper::log(Error, "Wrong iterate count of string table, seed: %lu", seed);
+        return false;
+    }
+    return true;
+}
 
-//    using KeyRandomGen = KeyClassRNG;
-    using KeyRandomGen = fph::dynamic::RandomGenerator<KeyType>;
+// A fingerprint that is the same for all the keys with the first seed of the table
+struct FirstSeedCollidingFingerprint {
+    uint64_t operator()(std::string_view str, uint64_t seed) const noexcept {
+        if (seed == fph::dynamic::detail::ARENA_STRING_FINGERPRINT_SEED) {
+            return 0;
+        }
+        return fph::dynamic::detail::ArenaStringFingerprintHash{}(str, seed);
+    }
+};
 
-    using ValueRandomGen = fph::dynamic::RandomGenerator<ValueType>;
-//    using ValueRandomGen = ValueClassRNG;
+// A fingerprint that is the same for all the keys with every seed
+struct AlwaysCollidingFingerprint {
+    uint64_t operator()(std::string_view, uint64_t) const noexcept {
+        return 0;
+    }
+};
 
-    using RandomGenerator = RandomPairGen<KeyType, ValueType, KeyRandomGen , ValueRandomGen>;
+// The string tables should change their fingerprint seed when two keys have the same fingerprint,
+// and keep their keys when the fingerprints can not be separated
+bool TestStringFingerprintCollision(size_t elem_num, size_t seed) {
+    std::mt19937_64 random_engine(seed);
+    fph::dynamic::RandomGenerator<std::string> str_gen(seed);
+    fph::FphStringMap<uint64_t, std::allocator<std::pair<const std::string_view, uint64_t>>, uint32_t,
+            FirstSeedCollidingFingerprint> table;
+    std::unordered_map<std::string, uint64_t> bench_table;
+    while (bench_table.size() < elem_num) {
+        auto key = str_gen(1U + random_engine() % 32U);
+        uint64_t value = random_engine();
+        if (table.try_emplace(key, value).second != bench_table.try_emplace(key, value).second) {
+            LogHelper::log(Error, "Fail to insert key with colliding fingerprint, seed: %lu", seed);
+            return false;
+        }
+    }
+    for (const auto &[key, value]: bench_table) {
+        auto it = table.find(key);
+        if (it == table.end() || it->second != value || it->first != key) {
+            LogHelper::log(Error, "Fail to find key with colliding fingerprint, seed: %lu", seed);
+            return false;
+        }
+    }
+#ifdef FPH_HAVE_EXCEPTIONS
+    fph::FphStringSet<std::allocator<std::string_view>, uint32_t, AlwaysCollidingFingerprint> set_table;
+    set_table.insert("first_key");
+    const size_t arena_size = set_table.arena_size();
+    bool throw_flag = false;
+    try {
+        set_table.insert("second_key");
+    }
+    catch (const std::runtime_error &) {
+        throw_flag = true;
+    }
+    if (!throw_flag || set_table.size() != 1U || !set_table.contains("first_key") ||
+        set_table.contains("second_key") || set_table.arena_size() != arena_size) {
+        LogHelper::log(Error, "String set changed by a key whose fingerprint always collides, seed: %lu", seed);
+        return false;
+    }
+#endif
+    return true;
+}
 
+// A table built on several threads should be the same as the one built on one thread
+template<class Table, class ValueVec>
+bool TestParallelBuild(const ValueVec &src_vec, size_t thread_num, size_t seed) {
+    Table serial_table, parallel_table;
+    parallel_table.set_build_thread_num(thread_num);
+    auto is_same_table = [&]() {
+        if (serial_table.size() != parallel_table.size()) {
+            return false;
+        }
+        auto parallel_it = parallel_table.begin();
+        for (const auto &value: serial_table) {
+            if (!(parallel_it->first == value.first) || !(parallel_it->second == value.second)) {
+                return false;
+            }
+            ++parallel_it;
+        }
+        return true;
+    };
+    serial_table.template Build<false, false>(src_vec.begin(), src_vec.end(), seed);
+    parallel_table.template Build<false, false>(src_vec.begin(), src_vec.end(), seed);
+    if (!is_same_table()) {
+        LogHelper::log(Error, "Parallel build differs from serial build, seed: %lu", seed);
+        return false;
+    }
+    serial_table.rehash(src_vec.size() * 4U);
+    parallel_table.rehash(src_vec.size() * 4U);
+    if (!is_same_table()) {
+        LogHelper::log(Error, "Parallel rehash differs from serial rehash, seed: %lu", seed);
+        return false;
+    }
+    for (const auto &value: src_vec) {
+        auto it = parallel_table.find(value.first);
+        if (it == parallel_table.end() || !(it->second == value.second)) {
+            LogHelper::log(Error, "Fail to find key in parallel built table, seed: %lu", seed);
+            return false;
+        }
+    }
+    // every task runs once, and the exception of a task is rethrown after the others return
+    auto executor = fph::MakeThreadBuildExecutor(thread_num);
+    constexpr size_t task_num = 1000;
+    std::vector<std::atomic<size_t>> task_call_cnt(task_num);
+    executor(task_num, [&](size_t i) { task_call_cnt[i].fetch_add(1); });
+    for (const auto &cnt: task_call_cnt) {
+        if (cnt.load() != 1U) {
+            LogHelper::log(Error, "Build executor does not run every task once, seed: %lu", seed);
+            return false;
+        }
+    }
+#ifdef FPH_HAVE_EXCEPTIONS
+    std::atomic<size_t> running_task_num{0};
+    bool throw_flag = false;
+    try {
+        executor(task_num, [&](size_t i) {
+            running_task_num.fetch_add(1);
+            std::this_thread::yield();
+            running_task_num.fetch_sub(1);
+            if (i == task_num / 2U) {
+                throw std::runtime_error("task failed");
+            }
+        });
+    }
+    catch (const std::runtime_error &) {
+        throw_flag = true;
+    }
+    if (!throw_flag || running_task_num.load() != 0) {
+        LogHelper::log(Error, "Build executor does not rethrow the exception of a task, seed: %lu", seed);
+        return false;
+    }
+#endif
+    return true;
+}
 
-    using SeedHash = fph::SimpleSeedHash<KeyType>;
-//    using SeedHash = fph::StrongSeedHash<KeyType>;
-//    using SeedHash = fph::MixSeedHash<KeyType>;
-//    using SeedHash = TestKeySeedHash;
+// counts the calls of the seed hash
+size_t counting_seed_hash_call_cnt = 0;
 
-    using DyFphMap7bit = fph::DynamicFphMap<KeyType, ValueType, SeedHash, std::equal_to<>,
-    std::allocator<std::pair<const KeyType, ValueType>>, uint8_t, KeyRandomGen>;
-    using DyFphMap15bit = fph::DynamicFphMap<KeyType, ValueType, SeedHash, std::equal_to<>,
-    std::allocator<std::pair<const KeyType, ValueType>>, uint16_t, KeyRandomGen>;
-    using DyFphMap31bit = fph::DynamicFphMap<KeyType, ValueType, SeedHash, std::equal_to<>,
-    std::allocator<std::pair<const KeyType, ValueType>>, uint32_t, KeyRandomGen>;
-//    using DyFphMap63bit = fph::DynamicFphMap<KeyType, ValueType, SeedHash, std::equal_to<>,
-//    std::allocator<std::pair<const KeyType, ValueType>>, uint64_t, KeyRandomGen>;
+template<class T>
+struct CountingSeedHash {
+    size_t operator()(const T &x, size_t seed) const {
+        ++counting_seed_hash_call_cnt;
+        return fph::MixSeedHash<T>{}(x, seed);
+    }
+};
 
-    using MetaFphMap7bit = fph::MetaFphMap<KeyType, ValueType, SeedHash, std::equal_to<>,
-            std::allocator<std::pair<const KeyType, ValueType>>, uint8_t>;
-    using MetaFphMap15bit = fph::MetaFphMap<KeyType, ValueType, SeedHash, std::equal_to<>,
-            std::allocator<std::pair<const KeyType, ValueType>>, uint16_t>;
-    using MetaFphMap31bit = fph::MetaFphMap<KeyType, ValueType, SeedHash, std::equal_to<>,
-            std::allocator<std::pair<const KeyType, ValueType>>, uint32_t>;
+// A table storing the hashes should rehash and copy without hashing its keys again
+template<class Table>
+bool TestStoreHash(size_t elem_num, size_t seed) {
+    fph::dynamic::RandomGenerator<std::string> str_gen(seed);
+    std::mt19937_64 random_engine(seed);
+    std::unordered_map<std::string, uint64_t> bench_table;
+    Table table;
+    table.set_store_hash(true);
+    while (bench_table.size() < elem_num) {
+        auto key = str_gen();
+        uint64_t value = random_engine();
+        if (table.insert({key, value}).second != bench_table.insert({key, value}).second) {
+            LogHelper::log(Error, "Fail to insert key in table storing hashes, seed: %lu", seed);
+            return false;
+        }
+        if (random_engine() % 4U == 0) {
+            auto erase_key = bench_table.begin()->first;
+            bench_table.erase(erase_key);
+            table.erase(erase_key);
+        }
+    }
+    counting_seed_hash_call_cnt = 0;
+    table.rehash(table.size() * 8U);
+    auto copy_table = table;
+    // only the few fill keys of the empty slots may be hashed
+    if (counting_seed_hash_call_cnt > 64U) {
+        LogHelper::log(Error, "Table storing hashes hashes %lu keys in rehash and copy, seed: %lu",
+                       counting_seed_hash_call_cnt, seed);
+        return false;
+    }
+    for (const auto &[key, value]: bench_table) {
+        auto it = copy_table.find(key);
+        if (it == copy_table.end() || it->second != value || table.find(key) == table.end()) {
+            LogHelper::log(Error, "Fail to find key in table storing hashes, seed: %lu", seed);
+            return false;
+        }
+    }
+    auto absent_key = str_gen();
+    if (copy_table.size() != bench_table.size() ||
+        (copy_table.find(absent_key) == copy_table.end()) != (bench_table.count(absent_key) == 0)) {
+        LogHelper::log(Error, "Wrong table storing hashes, seed: %lu", seed);
+        return false;
+    }
+    return true;
+}
 
-    static_assert(is_pair<typename DyFphMap7bit::value_type>::value);
+// At a high load factor, most of the inserts that cannot move their buckets should be done by moving
+// a few other buckets instead of rebuilding the table
+template<class Table>
+bool TestInsertPathStats(size_t elem_num, size_t seed) {
+    std::mt19937_64 random_engine(seed);
+    std::unordered_map<uint64_t, uint64_t> bench_table;
+    Table table;
+    table.max_load_factor(0.9);
+    size_t new_key_cnt = 0;
+    while (bench_table.size() < elem_num) {
+        uint64_t key = random_engine(), value = random_engine();
+        bool insert_flag = table.insert({key, value}).second;
+        if (insert_flag != bench_table.insert({key, value}).second) {
+            LogHelper::log(Error, "Fail to insert key with insert path stats, seed: %lu", seed);
+            return false;
+        }
+        new_key_cnt += insert_flag;
+        if (random_engine() % 8U == 0) {
+            auto erase_key = bench_table.begin()->first;
+            bench_table.erase(erase_key);
+            table.erase(erase_key);
+        }
+    }
+    auto stats = table.insert_path_stats();
+    if (stats.free_slot_num + stats.bucket_move_num + stats.local_repair_num + stats.full_rebuild_num
+        != new_key_cnt || stats.local_repair_num == 0 || stats.full_rebuild_num > stats.local_repair_num) {
+        LogHelper::log(Error, "Wrong insert path stats, free slot: %lu, bucket move: %lu, local repair: %lu, "
+                              "full rebuild: %lu, new keys: %lu, seed: %lu", stats.free_slot_num,
+                       stats.bucket_move_num, stats.local_repair_num, stats.full_rebuild_num, new_key_cnt, seed);
+        return false;
+    }
+    for (const auto &[key, value]: bench_table) {
+        auto it = table.find(key);
+        if (it == table.end() || it->second != value) {
+            LogHelper::log(Error, "Fail to find key after local repairs, seed: %lu", seed);
+            return false;
+        }
+    }
+    table.reset_insert_path_stats();
+    if (table.size() != bench_table.size() || table.insert_path_stats().local_repair_num != 0) {
+        LogHelper::log(Error, "Wrong table after local repairs, seed: %lu", seed);
+        return false;
+    }
+    return true;
+}
 
-//    using HashMethod = robin_hood::hash<KeyType>;
-//    using HashMethod = absl::Hash<KeyType>;
-    using HashMethod = std::hash<KeyType>;
-//    using HashMethod = TestKeyHash;
+// With a stash, the inserts that cannot re-place their buckets put the new keys in the stash,
+// and all the lookups, erases and iterations should still see them
+template<class Table>
+bool TestStash(size_t elem_num, size_t seed) {
+    std::mt19937_64 random_engine(seed);
+    std::unordered_map<uint64_t, uint64_t> bench_table;
+    Table table;
+    table.max_load_factor(0.9);
+    table.max_stash_ratio(0.01);
+    // a rebuild merges the stash back, so keep inserting until some keys are in the stash
+    while (bench_table.size() < elem_num || (table.stash_size() == 0 && bench_table.size() < 4U * elem_num)) {
+        uint64_t key = random_engine(), value = random_engine();
+        if (table.insert({key, value}).second != bench_table.insert({key, value}).second) {
+            LogHelper::log(Error, "Fail to insert key with stash, seed: %lu", seed);
+            return false;
+        }
+        if (random_engine() % 8U == 0) {
+            auto erase_key = bench_table.begin()->first;
+            bench_table.erase(erase_key);
+            if (table.erase(erase_key) != 1U) {
+                LogHelper::log(Error, "Fail to erase key with stash, seed: %lu", seed);
+                return false;
+            }
+        }
+    }
+    if (table.insert_path_stats().stash_num == 0 || table.stash_size() == 0
+        || table.stash_size() > 0.01 * table.size() + 1) {
+        LogHelper::log(Error, "Wrong stash size: %lu, stashed inserts: %lu, seed: %lu", table.stash_size(),
+                       table.insert_path_stats().stash_num, seed);
+        return false;
+    }
+    for (const auto &[key, value]: bench_table) {
+        auto it = table.find(key);
+        if (it == table.end() || it->second != value || !table.contains(key) || table.at(key) != value
+            || table.GetPointerNoCheck(key) != it.operator->()) {
+            LogHelper::log(Error, "Fail to find key with stash, seed: %lu", seed);
+            return false;
+        }
+    }
+    size_t iter_cnt = 0;
+    for (const auto &[key, value]: table) {
+        auto bench_it = bench_table.find(key);
+        if (bench_it == bench_table.end() || bench_it->second != value) {
+            LogHelper::log(Error, "Wrong iteration with stash, seed: %lu", seed);
+            return false;
+        }
+        ++iter_cnt;
+    }
+    Table copy_table(table);
+    if (iter_cnt != bench_table.size() || copy_table.size() != table.size()
+        || copy_table.stash_size() != table.stash_size()) {
+        LogHelper::log(Error, "Wrong iteration or copy with stash, seed: %lu", seed);
+        return false;
+    }
+    // erase all the stashed keys by iterator
+    while (table.stash_size() != 0) {
+        auto erase_key = table.begin()->first;
+        table.erase(table.begin());
+        bench_table.erase(erase_key);
+    }
+    copy_table.rehash(copy_table.size());
+    if (copy_table.stash_size() != 0 || table.size() != bench_table.size()) {
+        LogHelper::log(Error, "Stash is not empty after rehash, seed: %lu", seed);
+        return false;
+    }
+    for (const auto &[key, value]: bench_table) {
+        auto it = copy_table.find(key);
+        if (it == copy_table.end() || it->second != value || table.find(key) == table.end()) {
+            LogHelper::log(Error, "Fail to find key after rehash with stash, seed: %lu", seed);
+            return false;
+        }
+    }
+    return true;
+}
 
-//    using BenchTable = absl::flat_hash_map<KeyType, ValueType, HashMethod>;
-    using BenchTable = std::unordered_map<KeyType, ValueType, HashMethod>;
+// GatherValues of a table with 64-bit integer keys, which goes through the vectorized kernels
+// when the cpu has them, against find() for the keys in the slots, in the stash and not in the table
+template<class Table>
+bool TestGatherValues(size_t elem_num, size_t seed) {
+    using mapped_type = typename Table::mapped_type;
+    std::mt19937_64 random_engine(seed);
+    Table table;
+    table.max_load_factor(0.9);
+    table.max_stash_ratio(0.01);
+    std::vector<uint64_t> key_vec;
+    while (table.size() < elem_num || (table.stash_size() == 0 && table.size() < 4U * elem_num)) {
+        uint64_t key = random_engine();
+        if (table.insert({key, static_cast<mapped_type>(random_engine())}).second) {
+            key_vec.push_back(key);
+        }
+    }
+    // the stash is iterated first
+    size_t stash_key_num = 0;
+    for (auto it = table.begin(); stash_key_num < table.stash_size(); ++it, ++stash_key_num) {
+        key_vec.push_back(it->first);
+        key_vec.push_back(it->first);
+    }
+    for (size_t i = 0, miss_num = key_vec.size(); i < miss_num; ++i) {
+        key_vec.push_back(random_engine());
+    }
+    std::shuffle(key_vec.begin(), key_vec.end(), random_engine);
+    // not a multiple of the kernel block size, so the tail goes through the scalar path
+    key_vec.push_back(random_engine());
+    if (key_vec.size() % 16U == 0) {
+        key_vec.push_back(key_vec.front());
+    }
+    const size_t key_num = key_vec.size();
+    std::vector<mapped_type> value_vec(key_num);
+    std::vector<uint64_t> bitmap((key_num + 63U) / 64U);
+    for (int isa: {fph::dynamic::detail::GATHER_KERNEL_SCALAR, fph::dynamic::detail::GATHER_KERNEL_AVX2,
+                   fph::dynamic::detail::GATHER_KERNEL_AVX512}) {
+        fph::dynamic::detail::LimitGatherKernelIsa(isa);
+        std::fill(value_vec.begin(), value_vec.end(), mapped_type(1));
+        std::fill(bitmap.begin(), bitmap.end(), ~uint64_t(0));
+        size_t found_cnt = table.GatherValues(key_vec.data(), key_num, value_vec.data(), bitmap.data());
+        size_t bench_found_cnt = 0;
+        for (size_t i = 0; i < key_num; ++i) {
+            auto it = table.find(key_vec[i]);
+            bool found = it != table.end();
+            bool bit_found = (bitmap[i / 64U] >> (i % 64U)) & 0x1U;
+            bench_found_cnt += found;
+            if (bit_found != found || value_vec[i] != (found ? it->second : mapped_type())) {
+                LogHelper::log(Error, "GatherValues result of key %lu not same as find with kernel %d, "
+                                      "seed: %lu", key_vec[i], isa, seed);
+                fph::dynamic::detail::LimitGatherKernelIsa(fph::dynamic::detail::GATHER_KERNEL_AVX512);
+                return false;
+            }
+        }
+        if (found_cnt != bench_found_cnt) {
+            LogHelper::log(Error, "GatherValues found %lu keys, find found %lu keys with kernel %d, seed: %lu",
+                           found_cnt, bench_found_cnt, isa, seed);
+            fph::dynamic::detail::LimitGatherKernelIsa(fph::dynamic::detail::GATHER_KERNEL_AVX512);
+            return false;
+        }
+    }
+    return true;
+}
 
-    using StdHashTable = std::unordered_map<KeyType, ValueType, HashMethod>;
-//    using AbslFlatTable = absl::flat_hash_map<KeyType, ValueType, HashMethod>;
-//    using RobinFlatTable = robin_hood::unordered_flat_map<KeyType, ValueType, HashMethod>;
+// The staged lookup, with the bucket params prefetched prefetch_distance keys ahead and the slots
+// prefetched half as far ahead, should give the same results as find() for the keys in the slots,
+// in the stash and not in the table
+template<class Table>
+bool TestStagedLookup(size_t elem_num, size_t seed) {
+    std::mt19937_64 random_engine(seed);
+    Table table;
+    table.max_load_factor(0.9);
+    table.max_stash_ratio(0.01);
+    std::vector<uint64_t> key_vec;
+    while (table.size() < elem_num || (table.stash_size() == 0 && table.size() < 4U * elem_num)) {
+        uint64_t key = random_engine();
+        if (table.insert({key, random_engine()}).second) {
+            key_vec.push_back(key);
+        }
+    }
+    // the stash is iterated first
+    size_t stash_key_num = 0;
+    for (auto it = table.begin(); stash_key_num < table.stash_size(); ++it, ++stash_key_num) {
+        key_vec.push_back(it->first);
+    }
+    for (size_t i = 0, miss_num = key_vec.size(); i < miss_num; ++i) {
+        key_vec.push_back(random_engine());
+    }
+    std::shuffle(key_vec.begin(), key_vec.end(), random_engine);
+    const size_t key_num = key_vec.size();
+    const Table &const_table = table;
+    for (size_t prefetch_distance: {size_t(2), size_t(16)}) {
+        const size_t slot_distance = prefetch_distance / 2U;
+        std::vector<size_t> seed0_hash_vec(key_num), slot_pos_vec(key_num);
+        for (size_t i = 0; i < key_num + prefetch_distance; ++i) {
+            if (i < key_num) {
+                seed0_hash_vec[i] = table.GetSeed0Hash(key_vec[i]);
+                table.PrefetchBucketParamBySeed0Hash(seed0_hash_vec[i]);
+            }
+            if (i >= slot_distance && i - slot_distance < key_num) {
+                size_t j = i - slot_distance;
+                slot_pos_vec[j] = table.GetSlotPosBySeed0Hash(seed0_hash_vec[j]);
+                table.PrefetchSlot(slot_pos_vec[j]);
+            }
+            if (i >= prefetch_distance) {
+                size_t j = i - prefetch_distance;
+                auto it = table.find(key_vec[j]);
+                auto *expected = it == table.end() ? nullptr : std::addressof(*it);
+                auto *pair_ptr = table.GetPointerBySlotPos(slot_pos_vec[j], seed0_hash_vec[j], key_vec[j]);
+                const auto *const_pair_ptr = const_table.GetPointerBySlotPos(slot_pos_vec[j],
+                        seed0_hash_vec[j], key_vec[j]);
+                if (pair_ptr != expected || const_pair_ptr != expected) {
+                    LogHelper::log(Error, "Staged lookup result of key %lu not same as find, seed: %lu",
+                                   key_vec[j], seed);
+                    return false;
+                }
+            }
+        }
+    }
+    for (size_t i = 0; i < key_num; ++i) {
+        table.Prefetch(key_vec[i]);
+        if (i >= 8U && table.contains(key_vec[i - 8U]) != (table.find(key_vec[i - 8U]) != table.end())) {
+            LogHelper::log(Error, "Wrong lookup after Prefetch, seed: %lu", seed);
+            return false;
+        }
+    }
+    return true;
+}
+
+// The empty slots of a dynamic table with keys that are not trivially copyable hold no key, so
+// build, rehash and clear construct no key per empty slot, and the lookups still find the keys
+// in the slots and in the stash
+bool TestUnconstructedEmptySlots(size_t elem_num, size_t seed) {
+    using Table = fph::DynamicFphMap<CountedKey, uint64_t, CountedKeySeedHash, std::equal_to<>,
+            std::allocator<std::pair<const CountedKey, uint64_t>>, uint32_t, CountedKeyRNG>;
+    static_assert(fph::dynamic::UnconstructedEmptySlots<CountedKey>::value);
+    std::mt19937_64 random_engine(seed);
+    fph::dynamic::RandomGenerator<std::string> string_gen(seed);
+    std::unordered_map<std::string, uint64_t> bench_table;
+    const int64_t base_live_num = CountedKey::live_num;
+    {
+        Table table;
+        table.max_stash_ratio(0.01);
+        table.reserve(elem_num * 16U);
+        // the fill keys of the table and the temporary keys
+        constexpr int64_t MAX_EXTRA_KEY_NUM = 8;
+        auto check_live_num = [&](const char *stage, size_t table_num = 1) {
+            int64_t live_num = CountedKey::live_num - base_live_num;
+            if (live_num > int64_t(table_num * (table.size() + MAX_EXTRA_KEY_NUM))) {
+                LogHelper::log(Error, "%ld live keys %s with %lu elements and %lu slots, seed: %lu",
+                               live_num, stage, table.size(), table.bucket_count(), seed);
+                return false;
+            }
+            return true;
+        };
+        while (bench_table.size() < elem_num) {
+            auto key = string_gen();
+            uint64_t value = random_engine();
+            if (bench_table.insert({key, value}).second != table.insert({CountedKey(key), value}).second) {
+                LogHelper::log(Error, "Fail to insert counted key, seed: %lu", seed);
+                return false;
+            }
+        }
+        if (!check_live_num("after inserts")) {
+            return false;
+        }
+        table.rehash(table.bucket_count() * 2U);
+        if (!check_live_num("after rehash")) {
+            return false;
+        }
+        size_t cnt = 0;
+        for (auto it = bench_table.begin(); it != bench_table.end();) {
+            if (cnt++ % 2U == 0) {
+                table.erase(CountedKey(it->first));
+                it = bench_table.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        for (const auto &[key, value]: bench_table) {
+            auto it = table.find(CountedKey(key));
+            if (it == table.end() || it->second != value || table.at(CountedKey(key)) != value) {
+                LogHelper::log(Error, "Fail to find counted key, seed: %lu", seed);
+                return false;
+            }
+        }
+        for (size_t i = 0; i < elem_num; ++i) {
+            CountedKey miss_key(string_gen());
+            if (bench_table.count(miss_key.data) == 0 && table.contains(miss_key)) {
+                LogHelper::log(Error, "Find a counted key not in the table, seed: %lu", seed);
+                return false;
+            }
+        }
+        {
+            Table copy_table(table);
+            if (copy_table.size() != bench_table.size() || !check_live_num("after copy", 2)) {
+                return false;
+            }
+        }
+        table.clear();
+        if (!check_live_num("after clear")) {
+            return false;
+        }
+    }
+    if (CountedKey::live_num != base_live_num) {
+        LogHelper::log(Error, "%ld counted keys leaked, seed: %lu", CountedKey::live_num - base_live_num, seed);
+        return false;
+    }
+    return true;
+}
+
+// The readers of a double-buffered table should always see a complete version while the writer
+// inserts and erases keys, and all the writes should be visible after Flush()
+template<class Table>
+bool TestDoubleBufferedTable(size_t elem_num, size_t reader_num, size_t seed) {
+    std::mt19937_64 random_engine(seed);
+    std::vector<std::pair<uint64_t, uint64_t>> init_pairs, new_pairs;
+    std::unordered_map<uint64_t, uint64_t> bench_table;
+    while (bench_table.size() < 2U * elem_num) {
+        uint64_t key = random_engine(), value = random_engine();
+        if (bench_table.insert({key, value}).second) {
+            (bench_table.size() <= elem_num ? init_pairs : new_pairs).emplace_back(key, value);
+        }
+    }
+    fph::DoubleBufferedTable<Table> table(init_pairs.begin(), init_pairs.end(), 256);
+    std::atomic<bool> stop_flag{false}, reader_fail_flag{false};
+    std::vector<std::thread> readers;
+    for (size_t t = 0; t < reader_num; ++t) {
+        readers.emplace_back([&, t]() {
+            size_t i = t;
+            while (!stop_flag.load(std::memory_order_relaxed)) {
+                // the initial keys are never erased
+                const auto &[key, value] = init_pairs[i++ % init_pairs.size()];
+                bool found = table.Visit(key, [&](const auto &pair) {
+                    if (pair.second != value) {
+                        reader_fail_flag.store(true);
+                    }
+                });
+                if (!found) {
+                    reader_fail_flag.store(true);
+                }
+            }
+        });
+    }
+    for (size_t i = 0; i < new_pairs.size(); ++i) {
+        table.insert(new_pairs[i]);
+        if (i % 4U == 0) {
+            table.erase(new_pairs[i].first);
+            bench_table.erase(new_pairs[i].first);
+        }
+    }
+    table.Flush();
+    stop_flag.store(true);
+    for (auto &reader: readers) {
+        reader.join();
+    }
+    if (reader_fail_flag.load()) {
+        LogHelper::log(Error, "Reader of double buffered table sees a wrong value, seed: %lu", seed);
+        return false;
+    }
+    if (table.size() != bench_table.size() || table.pending_size() != 0 || table.version() == 0) {
+        LogHelper::log(Error, "Wrong size of double buffered table: %lu, expected: %lu, seed: %lu",
+                       table.size(), bench_table.size(), seed);
+        return false;
+    }
+    auto snapshot = table.Snapshot();
+    for (const auto &[key, value]: bench_table) {
+        auto it = snapshot->find(key);
+        if (it == snapshot->end() || it->second != value) {
+            LogHelper::log(Error, "Fail to find key in double buffered table, seed: %lu", seed);
+            return false;
+        }
+    }
+    // a snapshot stays valid after the table is destroyed
+    std::shared_ptr<const Table> kept_snapshot;
+    {
+        fph::DoubleBufferedTable<Table> short_table(init_pairs.begin(), init_pairs.end(), 1);
+        short_table.insert(new_pairs[0]);
+        short_table.Flush();
+        kept_snapshot = short_table.Snapshot();
+        short_table.insert(new_pairs[1]);
+    }
+    if (kept_snapshot->size() != init_pairs.size() + 1 || !kept_snapshot->contains(new_pairs[0].first)) {
+        LogHelper::log(Error, "Wrong snapshot kept after the double buffered table is destroyed, seed: %lu",
+                       seed);
+        return false;
+    }
+    return true;
+}
+
+// The versions retired by the writer of a rcu table should not be freed while a reader that may
+// see them holds its guard, and should be freed once the reader leaves its epoch
+template<class Table>
+bool TestRcuTableReclaim(size_t elem_num, size_t seed) {
+    std::mt19937_64 random_engine(seed);
+    std::vector<std::pair<uint64_t, uint64_t>> init_pairs, new_pairs;
+    std::unordered_map<uint64_t, uint64_t> bench_table;
+    while (bench_table.size() < 2U * elem_num) {
+        uint64_t key = random_engine(), value = random_engine();
+        if (bench_table.insert({key, value}).second) {
+            (bench_table.size() <= elem_num ? init_pairs : new_pairs).emplace_back(key, value);
+        }
+    }
+    fph::RcuTable<Table> table(init_pairs.begin(), init_pairs.end());
+    auto guard = table.Read();
+    const auto *old_pair_ptr = guard.find(init_pairs[0].first);
+    if (old_pair_ptr == nullptr) {
+        LogHelper::log(Error, "Fail to find key in rcu table, seed: %lu", seed);
+        return false;
+    }
+    std::atomic<size_t> write_cnt{0};
+    // the erase retires the base holding old_pair_ptr, and the inserts merge the delta
+    std::thread writer([&]() {
+        table.erase(init_pairs[0].first);
+        write_cnt.fetch_add(1);
+        for (const auto &pair: new_pairs) {
+            table.insert(pair);
+            write_cnt.fetch_add(1);
+        }
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    // the writer waits in the reclaim for this reader, and the old element is still alive
+    bool writer_blocked = write_cnt.load() < new_pairs.size() + 1U;
+    bool old_pair_alive = old_pair_ptr->first == init_pairs[0].first &&
+            old_pair_ptr->second == init_pairs[0].second;
+    {
+        // a new reader sees the erase, and does not wait for the writer either
+        auto new_guard = table.Read();
+        if (new_guard.contains(init_pairs[0].first)) {
+            old_pair_alive = false;
+        }
+    }
+    {
+        auto released_guard = std::move(guard);
+    }
+    writer.join();
+    if (!writer_blocked || !old_pair_alive) {
+        LogHelper::log(Error, "Rcu table reclaimed a version still read, writer blocked: %d, seed: %lu",
+                       int(writer_blocked), seed);
+        return false;
+    }
+    table.Compact();
+    if (table.retired_size() != 0 || table.delta_size() != 0 || table.size() != 2U * elem_num - 1U) {
+        LogHelper::log(Error, "Rcu table keeps %lu retired versions after the readers left, seed: %lu",
+                       table.retired_size(), seed);
+        return false;
+    }
+    return true;
+}
+
+// A value whose copy throws if it is marked, moving it never throws
+struct ThrowOnCopyValue {
+    ThrowOnCopyValue() = default;
+    explicit ThrowOnCopyValue(bool throw_on_copy): throw_on_copy(throw_on_copy) {}
+    ThrowOnCopyValue(ThrowOnCopyValue &&) noexcept = default;
+    ThrowOnCopyValue& operator=(ThrowOnCopyValue &&) noexcept = default;
+    ThrowOnCopyValue(const ThrowOnCopyValue &o): throw_on_copy(o.throw_on_copy) {
+        if (throw_on_copy) {
+            throw std::runtime_error("copy of a marked value");
+        }
+    }
+    ThrowOnCopyValue& operator=(const ThrowOnCopyValue &o) {
+        if (o.throw_on_copy) {
+            throw std::runtime_error("copy of a marked value");
+        }
+        return *this;
+    }
+
+    bool throw_on_copy = false;
+};
+
+// The mapped values of a SoA map should follow their keys when the inserts re-place the buckets,
+// and a mapped value that throws on construction should leave no key behind
+bool TestSoaMapRelocation(size_t elem_num, size_t seed) {
+    std::mt19937_64 random_engine(seed);
+    fph::DynamicFphSoaMap<uint64_t, std::string> table;
+    table.max_load_factor(0.9);
+    std::unordered_map<uint64_t, std::string> bench_table;
+    while (bench_table.size() < elem_num) {
+        uint64_t key = random_engine();
+        std::string value = std::to_string(random_engine());
+        if (table.insert({key, value}).second != bench_table.insert({key, value}).second) {
+            LogHelper::log(Error, "Fail to insert key in soa map, seed: %lu", seed);
+            return false;
+        }
+        if (random_engine() % 8U == 0) {
+            auto erase_key = bench_table.begin()->first;
+            bench_table.erase(erase_key);
+            table.erase(erase_key);
+        }
+    }
+    for (const auto &[key, value]: bench_table) {
+        auto it = table.find(key);
+        if (it == table.end() || it->second != value) {
+            LogHelper::log(Error, "Mapped value of soa map not moved with its key, seed: %lu", seed);
+            return false;
+        }
+    }
+#ifdef FPH_HAVE_EXCEPTIONS
+    fph::DynamicFphSoaMap<uint64_t, ThrowOnCopyValue> throw_table;
+    for (uint64_t key = 0; key < elem_num; ++key) {
+        throw_table.try_emplace(key, false);
+    }
+    const ThrowOnCopyValue throw_value(true);
+    bool throw_flag = false;
+    try {
+        throw_table.try_emplace(elem_num, throw_value);
+    }
+    catch (const std::runtime_error &) {
+        throw_flag = true;
+    }
+    size_t iter_cnt = 0;
+    for (auto it = throw_table.begin(); it != throw_table.end(); ++it) {
+        ++iter_cnt;
+    }
+    if (!throw_flag || throw_table.size() != elem_num || throw_table.contains(elem_num) || iter_cnt != elem_num) {
+        LogHelper::log(Error, "Key left in soa map after its mapped value throws, seed: %lu", seed);
+        return false;
+    }
+#endif
+    return true;
+}
+
+// The writes of a double-buffered table should block while its pending list is full, and the
+// exception thrown by the worker should be rethrown by Flush() and the following writes
+bool TestDoubleBufferedTableLimits(size_t seed) {
+    std::mt19937_64 random_engine(seed);
+    {
+        using Table = fph::DynamicFphMap<uint64_t, uint64_t>;
+        constexpr size_t max_pending_op_num = 4, write_num = 64;
+        fph::DoubleBufferedTable<Table> table(1, max_pending_op_num);
+        std::atomic<bool> acquired_flag{false}, released_flag{false};
+        // the worker can not take the next batch while the first version is kept
+        std::thread holder([&]() {
+            auto snapshot = table.Snapshot();
+            acquired_flag.store(true);
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+            released_flag.store(true);
+        });
+        while (!acquired_flag.load()) {
+            std::this_thread::yield();
+        }
+        std::unordered_map<uint64_t, uint64_t> bench_table;
+        for (size_t i = 0; i < write_num; ++i) {
+            uint64_t key = random_engine(), value = random_engine();
+            table.insert({key, value});
+            bench_table[key] = value;
+            // the batch being applied is not in the pending list any more
+            if (table.pending_size() > 2U * max_pending_op_num) {
+                LogHelper::log(Error, "%lu pending operations of double buffered table, bound: %lu, seed: %lu",
+                               table.pending_size(), max_pending_op_num, seed);
+                holder.join();
+                return false;
+            }
+        }
+        bool released_before_writes = released_flag.load();
+        holder.join();
+        table.Flush();
+        if (!released_before_writes || table.size() != bench_table.size()) {
+            LogHelper::log(Error, "Writes of double buffered table not blocked by a full pending list, seed: %lu",
+                           seed);
+            return false;
+        }
+    }
+#ifdef FPH_HAVE_EXCEPTIONS
+    {
+        using Table = fph::DynamicFphMap<uint64_t, ThrowOnCopyValue>;
+        fph::DoubleBufferedTable<Table> table(1);
+        table.insert({1, ThrowOnCopyValue(false)});
+        table.Flush();
+        // the worker copies the value to the back copy
+        table.insert({2, ThrowOnCopyValue(true)});
+        bool flush_throw_flag = false, insert_throw_flag = false;
+        try {
+            table.Flush();
+        }
+        catch (const std::runtime_error &) {
+            flush_throw_flag = true;
+        }
+        try {
+            table.insert({3, ThrowOnCopyValue(false)});
+        }
+        catch (const std::runtime_error &) {
+            insert_throw_flag = true;
+        }
+        if (!flush_throw_flag || !insert_throw_flag || table.size() != 1U || !table.contains(1)) {
+            LogHelper::log(Error, "Exception of double buffered table worker not rethrown, seed: %lu", seed);
+            return false;
+        }
+    }
+#endif
+    return true;
+}
+
+// The readers of a rcu table should always find the keys never erased while one writer inserts
+// and erases keys, and every write should be visible as soon as it returns
+template<class Table>
+bool TestRcuTable(size_t elem_num, size_t reader_num, size_t seed) {
+    std::mt19937_64 random_engine(seed);
+    std::vector<std::pair<uint64_t, uint64_t>> init_pairs, new_pairs;
+    std::unordered_map<uint64_t, uint64_t> bench_table;
+    while (bench_table.size() < 2U * elem_num) {
+        uint64_t key = random_engine(), value = random_engine();
+        if (bench_table.insert({key, value}).second) {
+            (bench_table.size() <= elem_num ? init_pairs : new_pairs).emplace_back(key, value);
+        }
+    }
+    fph::RcuTable<Table> table(init_pairs.begin(), init_pairs.end());
+    std::atomic<bool> stop_flag{false}, reader_fail_flag{false};
+    std::vector<std::thread> readers;
+    for (size_t t = 0; t < reader_num; ++t) {
+        readers.emplace_back([&, t]() {
+            size_t i = t;
+            while (!stop_flag.load(std::memory_order_relaxed)) {
+                // the initial keys are never erased
+                const auto &[key, value] = init_pairs[i++ % init_pairs.size()];
+                auto guard = table.Read();
+                const auto *pair_ptr = guard.find(key);
+                if (pair_ptr == nullptr || pair_ptr->second != value) {
+                    reader_fail_flag.store(true);
+                }
+            }
+        });
+    }
+    for (size_t i = 0; i < new_pairs.size(); ++i) {
+        if (!table.insert(new_pairs[i]) || table.insert(new_pairs[i]) || !table.contains(new_pairs[i].first)) {
+            LogHelper::log(Error, "Fail to insert key to rcu table, seed: %lu", seed);
+            stop_flag.store(true);
+            break;
+        }
+        if (i % 4U == 0) {
+            // erase a new key, which may be in the delta or in the base
+            auto erase_key = new_pairs[i / 2U].first;
+            if (table.erase(erase_key) != bench_table.erase(erase_key) || table.contains(erase_key)) {
+                LogHelper::log(Error, "Fail to erase key from rcu table, seed: %lu", seed);
+                stop_flag.store(true);
+                break;
+            }
+        }
+    }
+    stop_flag.store(true);
+    for (auto &reader: readers) {
+        reader.join();
+    }
+    if (reader_fail_flag.load()) {
+        LogHelper::log(Error, "Reader of rcu table sees a wrong value, seed: %lu", seed);
+        return false;
+    }
+    if (table.size() != bench_table.size()) {
+        LogHelper::log(Error, "Wrong size of rcu table: %lu, expected: %lu, seed: %lu",
+                       table.size(), bench_table.size(), seed);
+        return false;
+    }
+    for (size_t round = 0; round < 2; ++round) {
+        {
+            auto guard = table.Read();
+            for (const auto &[key, value]: bench_table) {
+                const auto *pair_ptr = guard.find(key);
+                if (pair_ptr == nullptr || pair_ptr->second != value) {
+                    LogHelper::log(Error, "Fail to find key in rcu table, seed: %lu", seed);
+                    return false;
+                }
+            }
+        }
+        // the writer must not hold a guard
+        table.Compact();
+        if (table.delta_size() != 0) {
+            LogHelper::log(Error, "Delta of rcu table is not empty after compact, seed: %lu", seed);
+            return false;
+        }
+    }
+    return true;
+}
+
+// A sharded table built in parallel should hold all the keys, and the inserts, erases and
+// lookups from several threads should work on it at the same time
+template<class Table>
+bool TestShardedTable(size_t elem_num, size_t thread_num, size_t seed) {
+    std::mt19937_64 random_engine(seed);
+    std::vector<std::pair<uint64_t, uint64_t>> init_pairs, new_pairs;
+    std::unordered_map<uint64_t, uint64_t> bench_table;
+    while (bench_table.size() < 2U * elem_num) {
+        uint64_t key = random_engine(), value = random_engine();
+        if (bench_table.insert({key, value}).second) {
+            (bench_table.size() <= elem_num ? init_pairs : new_pairs).emplace_back(key, value);
+        }
+    }
+    Table table;
+    table.set_build_thread_num(thread_num);
+    table.InsertNoDuplicated(init_pairs.begin(), init_pairs.end());
+    if (table.size() != init_pairs.size()) {
+        LogHelper::log(Error, "Wrong size of sharded table after build: %lu, seed: %lu", table.size(), seed);
+        return false;
+    }
+    std::atomic<bool> fail_flag{false};
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < thread_num; ++t) {
+        threads.emplace_back([&, t]() {
+            for (size_t i = t; i < new_pairs.size(); i += thread_num) {
+                const auto &[init_key, init_value] = init_pairs[i % init_pairs.size()];
+                bool found = table.Visit(init_key, [&](const auto &pair) {
+                    if (pair.second != init_value) {
+                        fail_flag.store(true);
+                    }
+                });
+                if (!found || !table.insert(new_pairs[i]) || table.insert(new_pairs[i])) {
+                    fail_flag.store(true);
+                }
+                // erase the new keys with odd indices
+                if (i % 2U == 1U && table.erase(new_pairs[i].first) != 1U) {
+                    fail_flag.store(true);
+                }
+            }
+        });
+    }
+    for (auto &thread: threads) {
+        thread.join();
+    }
+    for (size_t i = 1; i < new_pairs.size(); i += 2) {
+        bench_table.erase(new_pairs[i].first);
+    }
+    if (fail_flag.load() || table.size() != bench_table.size()) {
+        LogHelper::log(Error, "Fail to insert or erase keys in sharded table from %lu threads, seed: %lu",
+                       thread_num, seed);
+        return false;
+    }
+    table.rehash(table.size() * 2U);
+    std::atomic<size_t> iter_cnt{0};
+    table.ForEach([&](const auto &pair) {
+        auto bench_it = bench_table.find(pair.first);
+        if (bench_it == bench_table.end() || bench_it->second != pair.second) {
+            fail_flag.store(true);
+        }
+        iter_cnt.fetch_add(1, std::memory_order_relaxed);
+    });
+    if (fail_flag.load() || iter_cnt.load() != bench_table.size()) {
+        LogHelper::log(Error, "Wrong iteration of sharded table, seed: %lu", seed);
+        return false;
+    }
+    for (const auto &[key, value]: bench_table) {
+        if (!table.contains(key) || table.ShardIndex(key) >= Table::SHARD_NUM) {
+            LogHelper::log(Error, "Fail to find key in sharded table, seed: %lu", seed);
+            return false;
+        }
+    }
+    return true;
+}
+
+// merge of tables with std::string keys, whose moved-from keys are empty strings
+template<class Table>
+bool TestStringMerge(size_t seed) {
+    std::mt19937_64 random_engine(seed);
+    auto make_value = [](const std::string &key) {
+        if constexpr (std::is_same_v<typename Table::value_type, std::string>) {
+            return key;
+        }
+        else {
+            return typename Table::value_type{key, key + "_value"};
+        }
+    };
+    auto key_of = [](const auto &value) -> const std::string& {
+        if constexpr (std::is_same_v<std::decay_t<decltype(value)>, std::string>) {
+            return value;
+        }
+        else {
+            return value.first;
+        }
+    };
+    // long keys so they are not in the small string buffer
+    std::vector<std::string> keys;
+    std::unordered_set<std::string> key_set;
+    while (keys.size() < 200) {
+        auto key = "merge_test_key_" + std::to_string(random_engine());
+        if (key_set.insert(key).second) {
+            keys.push_back(key);
+        }
+    }
+    // target has keys [0, 100), source has keys [50, 200)
+    Table target, source;
+    for (size_t i = 0; i < 100; ++i) {
+        target.insert(make_value(keys[i]));
+    }
+    for (size_t i = 50; i < 200; ++i) {
+        source.insert(make_value(keys[i]));
+    }
+    target.merge(source);
+    if (target.size() != 200 || source.size() != 50) {
+        LogHelper::log(Error, "Wrong sizes after merge of string keys, target: %lu, source: %lu, seed: %lu",
+                       target.size(), source.size(), seed);
+        return false;
+    }
+    for (size_t i = 0; i < 200; ++i) {
+        auto it = target.find(keys[i]);
+        if (it == target.end() || !(*it == make_value(keys[i]))) {
+            LogHelper::log(Error, "Fail to find string key in the target after merge, seed: %lu", seed);
+            return false;
+        }
+    }
+    std::unordered_set<std::string> left_keys;
+    for (const auto &value: source) {
+        left_keys.insert(key_of(value));
+    }
+    for (size_t i = 50; i < 100; ++i) {
+        auto it = source.find(keys[i]);
+        if (it == source.end() || !(*it == make_value(keys[i]))) {
+            LogHelper::log(Error, "Fail to find string key left in the source after merge, seed: %lu", seed);
+            return false;
+        }
+    }
+    if (left_keys.size() != 50) {
+        LogHelper::log(Error, "Source has %lu distinct keys after merge, expected: 50, seed: %lu",
+                       left_keys.size(), seed);
+        return false;
+    }
+    return true;
+}
+
+// InsertBulk, ApplyDelta and merge on a non-empty table should give the same elements as the
+// inserts and erases one by one: the existing keys and the first of the repeated keys win
+template<class Table>
+bool TestBulkUpdate(size_t elem_num, size_t seed) {
+    std::mt19937_64 random_engine(seed);
+    std::vector<std::pair<uint64_t, uint64_t>> init_pairs, bulk_pairs;
+    std::unordered_map<uint64_t, uint64_t> bench_table;
+    for (size_t i = 0; i < elem_num; ++i) {
+        uint64_t key = random_engine(), value = random_engine();
+        if (bench_table.insert({key, value}).second) {
+            init_pairs.emplace_back(key, value);
+        }
+    }
+    Table table(init_pairs.begin(), init_pairs.end());
+    for (size_t i = 0; i < elem_num; ++i) {
+        // some existing keys and some repeated new keys
+        uint64_t key = i % 4U == 0 ? init_pairs[i % init_pairs.size()].first
+                : (i % 4U == 1 && !bulk_pairs.empty() ? bulk_pairs.back().first : random_engine());
+        bulk_pairs.emplace_back(key, random_engine());
+        bench_table.insert(bulk_pairs.back());
+    }
+    auto check_table = [&](const Table &t, const char *stage) {
+        if (t.size() != bench_table.size()) {
+            LogHelper::log(Error, "Wrong size after %s: %lu, expected: %lu, seed: %lu",
+                           stage, t.size(), bench_table.size(), seed);
+            return false;
+        }
+        for (const auto &[key, value]: bench_table) {
+            auto it = t.find(key);
+            if (it == t.end() || it->second != value) {
+                LogHelper::log(Error, "Fail to find key after %s, seed: %lu", stage, seed);
+                return false;
+            }
+        }
+        return true;
+    };
+    table.InsertBulk(bulk_pairs.begin(), bulk_pairs.end());
+    if (!check_table(table, "InsertBulk")) {
+        return false;
+    }
+    // erase a quarter of the keys, replace the values of some of them and insert new keys
+    std::vector<uint64_t> erase_keys;
+    std::vector<std::pair<uint64_t, uint64_t>> delta_pairs;
+    size_t cnt = 0;
+    for (const auto &[key, value]: bench_table) {
+        if (cnt++ % 4U == 0) {
+            erase_keys.push_back(key);
+            if (cnt % 3U == 0) {
+                delta_pairs.emplace_back(key, value + 1U);
+            }
+        }
+    }
+    for (auto key: erase_keys) {
+        bench_table.erase(key);
+    }
+    for (size_t i = 0; i < elem_num / 2U; ++i) {
+        delta_pairs.emplace_back(random_engine(), random_engine());
+    }
+    for (const auto &pair: delta_pairs) {
+        bench_table.insert(pair);
+    }
+    table.ApplyDelta(delta_pairs.begin(), delta_pairs.end(), erase_keys.begin(), erase_keys.end());
+    if (!check_table(table, "ApplyDelta")) {
+        return false;
+    }
+    // the source keeps the keys already in the table
+    Table source;
+    std::vector<uint64_t> overlap_keys;
+    for (size_t i = 0; i < elem_num / 2U; ++i) {
+        uint64_t key = i % 2U == 0 ? delta_pairs[i].first : random_engine();
+        if (source.insert({key, random_engine()}).second && !bench_table.insert(*source.find(key)).second) {
+            overlap_keys.push_back(key);
+        }
+    }
+    table.merge(source);
+    if (source.size() != overlap_keys.size() || !check_table(table, "merge")) {
+        LogHelper::log(Error, "Wrong source size after merge: %lu, expected: %lu, seed: %lu",
+                       source.size(), overlap_keys.size(), seed);
+        return false;
+    }
+    for (auto key: overlap_keys) {
+        if (!source.contains(key)) {
+            LogHelper::log(Error, "Key left in the source is not found after merge, seed: %lu", seed);
+            return false;
+        }
+    }
+    return true;
+}
+
+// a frozen table should be looked up and iterated like before, and thaw itself on insert, erase
+// and clear
+template<class Table>
+bool TestFreeze(size_t elem_num, size_t seed) {
+    std::mt19937_64 random_engine(seed);
+    std::unordered_map<uint64_t, uint64_t> bench_table;
+    std::vector<std::pair<uint64_t, uint64_t>> pairs;
+    while (bench_table.size() < elem_num) {
+        uint64_t key = random_engine(), value = random_engine();
+        if (bench_table.insert({key, value}).second) {
+            pairs.emplace_back(key, value);
+        }
+    }
+    Table table(pairs.begin(), pairs.end());
+    auto check_table = [&](const Table &t, const char *stage) {
+        size_t iterate_num = 0;
+        for (auto it = t.begin(); it != t.end(); ++it) {
+            ++iterate_num;
+        }
+        if (t.size() != bench_table.size() || iterate_num != bench_table.size()) {
+            LogHelper::log(Error, "Wrong size after %s: %lu, iterated: %lu, expected: %lu, seed: %lu",
+                           stage, t.size(), iterate_num, bench_table.size(), seed);
+            return false;
+        }
+        for (const auto &[key, value]: bench_table) {
+            auto it = t.find(key);
+            if (it == t.end() || it->second != value) {
+                LogHelper::log(Error, "Fail to find key after %s, seed: %lu", stage, seed);
+                return false;
+            }
+        }
+        for (size_t i = 0; i < 100; ++i) {
+            uint64_t key = random_engine();
+            if (bench_table.count(key) == 0 && t.contains(key)) {
+                LogHelper::log(Error, "Find a key not inserted after %s, seed: %lu", stage, seed);
+                return false;
+            }
+        }
+        return true;
+    };
+    size_t released_bytes = table.Freeze();
+    if (released_bytes == 0 || !table.is_frozen() || table.Freeze() != 0) {
+        LogHelper::log(Error, "Freeze released %lu bytes, seed: %lu", released_bytes, seed);
+        return false;
+    }
+    Table copy_table(table);
+    if (!check_table(table, "Freeze") || !check_table(copy_table, "copy of frozen table")) {
+        return false;
+    }
+    // insert thaws the table
+    for (size_t i = 0; i < elem_num / 4U; ++i) {
+        uint64_t key = random_engine(), value = random_engine();
+        if (bench_table.insert({key, value}).second) {
+            table.insert({key, value});
+        }
+    }
+    if (table.is_frozen() || !check_table(table, "insert to frozen table")) {
+        return false;
+    }
+    // erase by key and by iterator thaw the table
+    table.Freeze();
+    auto erase_key = pairs[0].first;
+    table.erase(erase_key);
+    bench_table.erase(erase_key);
+    table.Freeze();
+    erase_key = pairs[1].first;
+    table.erase(table.find(erase_key));
+    bench_table.erase(erase_key);
+    if (table.is_frozen() || !check_table(table, "erase from frozen table")) {
+        return false;
+    }
+    table.Freeze();
+    table.clear();
+    bench_table.clear();
+    table.insert({pairs[0].first, pairs[0].second});
+    bench_table.insert(pairs[0]);
+    if (table.is_frozen() || !check_table(table, "clear of frozen table")) {
+        return false;
+    }
+    return true;
+}
+
+// the memory usage should count the bytes released by Freeze() in the cold part only
+template<class Table>
+bool TestMemoryUsage(size_t elem_num, size_t seed) {
+    std::mt19937_64 random_engine(seed);
+    std::vector<std::pair<uint64_t, uint64_t>> pairs;
+    for (size_t i = 0; i < elem_num; ++i) {
+        pairs.emplace_back(random_engine(), random_engine());
+    }
+    Table table;
+    for (const auto &pair: pairs) {
+        table.insert(pair);
+    }
+    auto usage = table.MemoryUsage();
+    if (usage.element_num != table.size() || usage.slot_num != table.bucket_count()
+        || usage.slot_bytes < usage.slot_num * sizeof(std::pair<uint64_t, uint64_t>)
+        || usage.cold_bytes() == 0 || usage.unused_bytes >= usage.total_bytes()
+        || usage.fragmentation() <= 0.0 || usage.fragmentation() >= 1.0) {
+        LogHelper::log(Error, "Wrong memory usage of %lu elements, hot: %lu, cold: %lu, unused: %lu, seed: %lu",
+                       table.size(), usage.hot_bytes(), usage.cold_bytes(), usage.unused_bytes, seed);
+        return false;
+    }
+    size_t released_bytes = table.Freeze();
+    auto frozen_usage = table.MemoryUsage();
+    if (frozen_usage.hot_bytes() != usage.hot_bytes()
+        || frozen_usage.cold_bytes() + released_bytes != usage.cold_bytes()) {
+        LogHelper::log(Error, "Wrong memory usage after Freeze, cold: %lu, before: %lu, released: %lu, seed: %lu",
+                       frozen_usage.cold_bytes(), usage.cold_bytes(), released_bytes, seed);
+        return false;
+    }
+    return true;
+}
+
+// for_each, iteration, copy and operator== of a sparse meta table should see every element once,
+// including the ones in the tail slots not covered by a whole metadata group
+template<class Table>
+bool TestMetaScan(size_t elem_num, size_t seed) {
+    std::mt19937_64 random_engine(seed);
+    for (size_t test_num : {size_t(1), size_t(33), elem_num}) {
+        Table table;
+        table.reserve(test_num * 8U);
+        std::unordered_map<uint64_t, std::string> bench_table;
+        while (bench_table.size() < test_num) {
+            uint64_t key = random_engine();
+            auto value = std::to_string(key);
+            if (bench_table.insert({key, value}).second) {
+                table.insert({key, value});
+            }
+        }
+        // erase some elements so begin() moves and the groups get holes
+        size_t cnt = 0;
+        for (auto it = bench_table.begin(); it != bench_table.end();) {
+            if (cnt++ % 3U == 1U) {
+                table.erase(it->first);
+                it = bench_table.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        size_t for_each_num = 0, iterate_num = 0;
+        bool value_matched = true;
+        table.for_each([&](const auto &pair) {
+            ++for_each_num;
+            auto bench_it = bench_table.find(pair.first);
+            value_matched &= bench_it != bench_table.end() && bench_it->second == pair.second;
+        });
+        for (const auto &pair: table) {
+            ++iterate_num;
+            value_matched &= bench_table.count(pair.first) != 0;
+        }
+        if (!value_matched || for_each_num != bench_table.size() || iterate_num != bench_table.size()) {
+            LogHelper::log(Error, "Wrong scan of %lu elements, for_each: %lu, iterate: %lu, seed: %lu",
+                           bench_table.size(), for_each_num, iterate_num, seed);
+            return false;
+        }
+        Table copy_table(table);
+        if (!(copy_table == table) || copy_table.size() != bench_table.size()) {
+            LogHelper::log(Error, "Copied table is not equal, seed: %lu", seed);
+            return false;
+        }
+        if (!bench_table.empty()) {
+            copy_table.erase(bench_table.begin()->first);
+            if (copy_table == table) {
+                LogHelper::log(Error, "Tables of different sizes are equal, seed: %lu", seed);
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// Iterating a sparse table skips the empty slots by the occupancy bits. After most keys are
+// erased, iteration should still visit every element left, including the stash, exactly once
+template<class Table>
+bool TestSparseIteration(size_t elem_num, size_t seed) {
+    std::mt19937_64 random_engine(seed);
+    Table table;
+    table.max_load_factor(0.9);
+    table.max_stash_ratio(0.01);
+    std::unordered_map<uint64_t, uint64_t> bench_table;
+    while (bench_table.size() < elem_num || (table.stash_size() == 0 && bench_table.size() < 4U * elem_num)) {
+        uint64_t key = random_engine(), value = random_engine();
+        if (bench_table.insert({key, value}).second) {
+            table.insert({key, value});
+        }
+    }
+    // the stash is iterated first, keep its keys
+    std::unordered_set<uint64_t> stash_keys;
+    for (auto it = table.begin(); stash_keys.size() < table.stash_size(); ++it) {
+        stash_keys.insert(it->first);
+    }
+    auto check_iteration = [&](const char *stage) {
+        std::unordered_set<uint64_t> visited_keys;
+        size_t iterate_num = 0;
+        const Table &const_table = table;
+        for (auto it = const_table.begin(); it != const_table.end(); ++it) {
+            ++iterate_num;
+            auto bench_it = bench_table.find(it->first);
+            if (bench_it == bench_table.end() || bench_it->second != it->second
+                    || !visited_keys.insert(it->first).second) {
+                LogHelper::log(Error, "Sparse iteration %s visits a wrong or repeated key, seed: %lu",
+                               stage, seed);
+                return false;
+            }
+        }
+        size_t mutable_iterate_num = 0;
+        for (auto &pair: table) {
+            (void)pair;
+            ++mutable_iterate_num;
+        }
+        if (iterate_num != bench_table.size() || mutable_iterate_num != bench_table.size()
+                || table.size() != bench_table.size() || (table.begin() == table.end()) != bench_table.empty()) {
+            LogHelper::log(Error, "Sparse iteration %s visits %lu elements, expected: %lu, seed: %lu",
+                           stage, iterate_num, bench_table.size(), seed);
+            return false;
+        }
+        return true;
+    };
+    // erase nine of ten keys, but not the keys in the stash
+    size_t cnt = 0;
+    for (auto it = bench_table.begin(); it != bench_table.end();) {
+        if (cnt++ % 10U != 0 && stash_keys.count(it->first) == 0) {
+            table.erase(it->first);
+            it = bench_table.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    if (table.stash_size() == 0 || !check_iteration("after erasing most keys")) {
+        return false;
+    }
+    // only the stash is left
+    for (auto it = bench_table.begin(); it != bench_table.end();) {
+        if (stash_keys.count(it->first) == 0) {
+            table.erase(it->first);
+            it = bench_table.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    if (!check_iteration("with only the stash")) {
+        return false;
+    }
+    // erase the elements by iterator, until the table is empty
+    while (table.begin() != table.end()) {
+        bench_table.erase(table.begin()->first);
+        table.erase(table.begin());
+    }
+    return check_iteration("of the empty table");
+}
+
+void TestFPH() {
+#if TEST_TABLE_CORRECT
+    using KeyType = uint32_t;
+//    using KeyType = TestKeyClass;
+//    using KeyType = std::string;
+//    using KeyType = const uint64_t*;
+//    using KeyType = enum {
+//        Type0,
+//        Type1,
+//        Type2,
+//        Type3,
+//    };
+    using ValueType = uint64_t;
+//    using ValueType = TestValueClass;
+//    using ValueType = std::string;
+//    using ValueType = FixSizeStruct<96>;
+//    using BucketParamType = uint32_t;
+
+//    using KeyRandomGen = KeyClassRNG;
+    using KeyRandomGen = fph::dynamic::RandomGenerator<KeyType>;
+
+    using ValueRandomGen = fph::dynamic::RandomGenerator<ValueType>;
+//    using ValueRandomGen = ValueClassRNG;
+
+    using RandomGenerator = RandomPairGen<KeyType, ValueType, KeyRandomGen , ValueRandomGen>;
+
+
+    using SeedHash = fph::SimpleSeedHash<KeyType>;
+//    using SeedHash = fph::StrongSeedHash<KeyType>;
+//    using SeedHash = fph::MixSeedHash<KeyType>;
+//    using SeedHash = TestKeySeedHash;
+
+    using DyFphMap7bit = fph::DynamicFphMap<KeyType, ValueType, SeedHash, std::equal_to<>,
+    std::allocator<std::pair<const KeyType, ValueType>>, uint8_t, KeyRandomGen>;
+    using DyFphMap15bit = fph::DynamicFphMap<KeyType, ValueType, SeedHash, std::equal_to<>,
+    std::allocator<std::pair<const KeyType, ValueType>>, uint16_t, KeyRandomGen>;
+    using DyFphMap31bit = fph::DynamicFphMap<KeyType, ValueType, SeedHash, std::equal_to<>,
+    std::allocator<std::pair<const KeyType, ValueType>>, uint32_t, KeyRandomGen>;
+//    using DyFphMap63bit = fph::DynamicFphMap<KeyType, ValueType, SeedHash, std::equal_to<>,
+//    std::allocator<std::pair<const KeyType, ValueType>>, uint64_t, KeyRandomGen>;
+    using DyFphSoaMap15bit = fph::DynamicFphSoaMap<KeyType, ValueType, SeedHash, std::equal_to<>,
+    std::allocator<std::pair<const KeyType, ValueType>>, uint16_t, KeyRandomGen>;
+    using DyFphSoaMap31bit = fph::DynamicFphSoaMap<KeyType, ValueType, SeedHash, std::equal_to<>,
+    std::allocator<std::pair<const KeyType, ValueType>>, uint32_t, KeyRandomGen>;
+    using DyFphDenseMap15bit = fph::DynamicFphDenseMap<KeyType, ValueType, SeedHash, std::equal_to<>,
+    std::allocator<std::pair<const KeyType, ValueType>>, uint16_t, KeyRandomGen>;
+    using DyFphDenseMap31bit = fph::DynamicFphDenseMap<KeyType, ValueType, SeedHash, std::equal_to<>,
+    std::allocator<std::pair<const KeyType, ValueType>>, uint32_t, KeyRandomGen>;
+
+    using MetaFphMap7bit = fph::MetaFphMap<KeyType, ValueType, SeedHash, std::equal_to<>,
+            std::allocator<std::pair<const KeyType, ValueType>>, uint8_t>;
+    using MetaFphMap15bit = fph::MetaFphMap<KeyType, ValueType, SeedHash, std::equal_to<>,
+            std::allocator<std::pair<const KeyType, ValueType>>, uint16_t>;
+    using MetaFphMap31bit = fph::MetaFphMap<KeyType, ValueType, SeedHash, std::equal_to<>,
+            std::allocator<std::pair<const KeyType, ValueType>>, uint32_t>;
+
+    static_assert(is_pair<typename DyFphMap7bit::value_type>::value);
+
+//    using HashMethod = robin_hood::hash<KeyType>;
+//    using HashMethod = absl::Hash<KeyType>;
+    using HashMethod = std::hash<KeyType>;
+//    using HashMethod = TestKeyHash;
+
+//    using BenchTable = absl::flat_hash_map<KeyType, ValueType, HashMethod>;
+    using BenchTable = std::unordered_map<KeyType, ValueType, HashMethod>;
+
+    using StdHashTable = std::unordered_map<KeyType, ValueType, HashMethod>;
+//    using AbslFlatTable = absl::flat_hash_map<KeyType, ValueType, HashMethod>;
+//    using RobinFlatTable = robin_hood::unordered_flat_map<KeyType, ValueType, HashMethod>;
 //    using SkaFlatTable = ska::flat_hash_map<KeyType, ValueType, HashMethod>;
 
 
@@ -1664,6 +3289,276 @@ void TestFPH() {
                            test_element_up_bound);
         }
     }
+    {
+        bool correct_test_ret;
+
+        size_t test_element_up_bound = 3000;
+        correct_test_ret = TestCorrectness<RandomGenerator, DyFphSoaMap15bit, BenchTable>(test_element_up_bound, 400);
+        if (!correct_test_ret) {
+            LogHelper::log(Error, "DyFphSoaMap15bit Fail to pass correct test with %lu max elements",
+                           test_element_up_bound);
+            return;
+        } else {
+            LogHelper::log(Info, "DyFphSoaMap15bit Pass correctness test  with %lu max elements",
+                           test_element_up_bound);
+        }
+
+        test_element_up_bound = 500000ULL;
+        correct_test_ret = TestCorrectness<RandomGenerator, DyFphSoaMap31bit, BenchTable>(test_element_up_bound, 1);
+        if (!correct_test_ret) {
+            LogHelper::log(Error, "DyFphSoaMap31bit Fail to pass correct test with %lu max elements",
+                           test_element_up_bound);
+            return;
+        } else {
+            LogHelper::log(Info, "DyFphSoaMap31bit Pass correctness test with %lu max elements",
+                           test_element_up_bound);
+        }
+    }
+    {
+        bool correct_test_ret;
+
+        size_t test_element_up_bound = 3000;
+        correct_test_ret = TestCorrectness<RandomGenerator, DyFphDenseMap15bit, BenchTable>(test_element_up_bound, 400);
+        if (!correct_test_ret) {
+            LogHelper::log(Error, "DyFphDenseMap15bit Fail to pass correct test with %lu max elements",
+                           test_element_up_bound);
+            return;
+        } else {
+            LogHelper::log(Info, "DyFphDenseMap15bit Pass correctness test  with %lu max elements",
+                           test_element_up_bound);
+        }
+
+        test_element_up_bound = 500000ULL;
+        correct_test_ret = TestCorrectness<RandomGenerator, DyFphDenseMap31bit, BenchTable>(test_element_up_bound, 1);
+        if (!correct_test_ret) {
+            LogHelper::log(Error, "DyFphDenseMap31bit Fail to pass correct test with %lu max elements",
+                           test_element_up_bound);
+            return;
+        } else {
+            LogHelper::log(Info, "DyFphDenseMap31bit Pass correctness test with %lu max elements",
+                           test_element_up_bound);
+        }
+    }
+    {
+        size_t test_element_up_bound = 20000;
+        auto test_seed = random_gen(random_device);
+        if (!TestStringTableCorrectness(test_element_up_bound, 100000, test_seed)) {
+            LogHelper::log(Error, "FphStringMap Fail to pass correct test with %lu max elements",
+                           test_element_up_bound);
+            return;
+        } else {
+            LogHelper::log(Info, "FphStringMap Pass correctness test with %lu max elements",
+                           test_element_up_bound);
+        }
+    }
+    {
+        size_t test_element_up_bound = 20000;
+        auto test_seed = random_gen(random_device);
+        if (!TestStringFingerprintCollision(test_element_up_bound, test_seed)) {
+            LogHelper::log(Error, "Fail to pass fingerprint collision test with %lu elements", test_element_up_bound);
+            return;
+        } else {
+            LogHelper::log(Info, "Pass fingerprint collision test with %lu elements", test_element_up_bound);
+        }
+    }
+    {
+        size_t test_element_up_bound = 200000;
+        auto test_seed = random_gen(random_device);
+        std::vector<std::pair<KeyType, ValueType>> src_vec;
+        std::unordered_set<KeyType> key_set;
+        RandomGenerator pair_gen;
+        while (src_vec.size() < test_element_up_bound) {
+            auto value = pair_gen();
+            if (key_set.insert(value.first).second) {
+                src_vec.emplace_back(value);
+            }
+        }
+        if (!TestParallelBuild<DyFphMap31bit>(src_vec, 4, test_seed) ||
+            !TestParallelBuild<MetaFphMap31bit>(src_vec, 4, test_seed)) {
+            LogHelper::log(Error, "Fail to pass parallel build test with %lu elements",
+                           test_element_up_bound);
+            return;
+        } else {
+            LogHelper::log(Info, "Pass parallel build test with %lu elements", test_element_up_bound);
+        }
+    }
+    {
+        size_t test_element_up_bound = 20000;
+        auto test_seed = random_gen(random_device);
+        using StrDyFphMap = fph::DynamicFphMap<std::string, uint64_t, CountingSeedHash<std::string>>;
+        using StrMetaFphMap = fph::MetaFphMap<std::string, uint64_t, CountingSeedHash<std::string>>;
+        if (!TestStoreHash<StrDyFphMap>(test_element_up_bound, test_seed) ||
+            !TestStoreHash<StrMetaFphMap>(test_element_up_bound, test_seed)) {
+            LogHelper::log(Error, "Fail to pass store hash test with %lu elements",
+                           test_element_up_bound);
+            return;
+        } else {
+            LogHelper::log(Info, "Pass store hash test with %lu elements", test_element_up_bound);
+        }
+    }
+    {
+        size_t test_element_up_bound = 20000;
+        auto test_seed = random_gen(random_device);
+        if (!TestInsertPathStats<fph::DynamicFphMap<uint64_t, uint64_t>>(test_element_up_bound, test_seed) ||
+            !TestInsertPathStats<fph::MetaFphMap<uint64_t, uint64_t>>(test_element_up_bound, test_seed)) {
+            LogHelper::log(Error, "Fail to pass insert path stats test with %lu elements",
+                           test_element_up_bound);
+            return;
+        } else {
+            LogHelper::log(Info, "Pass insert path stats test with %lu elements", test_element_up_bound);
+        }
+    }
+    {
+        size_t test_element_up_bound = 20000;
+        auto test_seed = random_gen(random_device);
+        if (!TestStash<fph::DynamicFphMap<uint64_t, uint64_t>>(test_element_up_bound, test_seed) ||
+            !TestStash<fph::MetaFphMap<uint64_t, uint64_t>>(test_element_up_bound, test_seed)) {
+            LogHelper::log(Error, "Fail to pass stash test with %lu elements", test_element_up_bound);
+            return;
+        } else {
+            LogHelper::log(Info, "Pass stash test with %lu elements", test_element_up_bound);
+        }
+    }
+    {
+        size_t test_element_up_bound = 20000;
+        auto test_seed = random_gen(random_device);
+        if (!TestGatherValues<fph::DynamicFphMap<uint64_t, uint64_t>>(test_element_up_bound, test_seed) ||
+            !TestGatherValues<fph::DynamicFphMap<uint64_t, uint32_t>>(test_element_up_bound, test_seed) ||
+            !TestGatherValues<fph::DynamicFphMap<uint64_t, uint64_t,
+                    fph::MixSeedHash<uint64_t>>>(test_element_up_bound, test_seed)) {
+            LogHelper::log(Error, "Fail to pass gather values test with %lu elements", test_element_up_bound);
+            return;
+        } else {
+            LogHelper::log(Info, "Pass gather values test with %lu elements", test_element_up_bound);
+        }
+    }
+    {
+        size_t test_element_up_bound = 20000;
+        auto test_seed = random_gen(random_device);
+        if (!TestStagedLookup<fph::DynamicFphMap<uint64_t, uint64_t>>(test_element_up_bound, test_seed) ||
+            !TestStagedLookup<fph::MetaFphMap<uint64_t, uint64_t>>(test_element_up_bound, test_seed)) {
+            LogHelper::log(Error, "Fail to pass staged lookup test with %lu elements", test_element_up_bound);
+            return;
+        } else {
+            LogHelper::log(Info, "Pass staged lookup test with %lu elements", test_element_up_bound);
+        }
+    }
+    {
+        size_t test_element_up_bound = 5000;
+        auto test_seed = random_gen(random_device);
+        if (!TestUnconstructedEmptySlots(test_element_up_bound, test_seed)) {
+            LogHelper::log(Error, "Fail to pass unconstructed empty slots test with %lu elements",
+                           test_element_up_bound);
+            return;
+        } else {
+            LogHelper::log(Info, "Pass unconstructed empty slots test with %lu elements", test_element_up_bound);
+        }
+    }
+    {
+        size_t test_element_up_bound = 20000;
+        auto test_seed = random_gen(random_device);
+        if (!TestSoaMapRelocation(test_element_up_bound, test_seed)) {
+            LogHelper::log(Error, "Fail to pass soa map relocation test with %lu elements", test_element_up_bound);
+            return;
+        } else {
+            LogHelper::log(Info, "Pass soa map relocation test with %lu elements", test_element_up_bound);
+        }
+    }
+    {
+        size_t test_element_up_bound = 20000;
+        auto test_seed = random_gen(random_device);
+        if (!TestDoubleBufferedTable<fph::DynamicFphMap<uint64_t, uint64_t>>(test_element_up_bound, 2, test_seed) ||
+            !TestDoubleBufferedTable<fph::MetaFphMap<uint64_t, uint64_t>>(test_element_up_bound, 2, test_seed) ||
+            !TestDoubleBufferedTableLimits(test_seed)) {
+            LogHelper::log(Error, "Fail to pass double buffered table test with %lu elements",
+                           test_element_up_bound);
+            return;
+        } else {
+            LogHelper::log(Info, "Pass double buffered table test with %lu elements", test_element_up_bound);
+        }
+    }
+    {
+        size_t test_element_up_bound = 20000;
+        auto test_seed = random_gen(random_device);
+        if (!TestRcuTable<fph::DynamicFphMap<uint64_t, uint64_t>>(test_element_up_bound, 2, test_seed) ||
+            !TestRcuTable<fph::MetaFphMap<uint64_t, uint64_t>>(test_element_up_bound, 2, test_seed) ||
+            !TestRcuTableReclaim<fph::DynamicFphMap<uint64_t, uint64_t>>(test_element_up_bound, test_seed)) {
+            LogHelper::log(Error, "Fail to pass rcu table test with %lu elements", test_element_up_bound);
+            return;
+        } else {
+            LogHelper::log(Info, "Pass rcu table test with %lu elements", test_element_up_bound);
+        }
+    }
+    {
+        size_t test_element_up_bound = 50000;
+        auto test_seed = random_gen(random_device);
+        if (!TestShardedTable<fph::ShardedFphMap<uint64_t, uint64_t, 16>>(test_element_up_bound, 4, test_seed) ||
+            !TestShardedTable<fph::ShardedMetaFphMap<uint64_t, uint64_t, 8>>(test_element_up_bound, 4, test_seed)) {
+            LogHelper::log(Error, "Fail to pass sharded table test with %lu elements", test_element_up_bound);
+            return;
+        } else {
+            LogHelper::log(Info, "Pass sharded table test with %lu elements", test_element_up_bound);
+        }
+    }
+    {
+        size_t test_element_up_bound = 20000;
+        auto test_seed = random_gen(random_device);
+        if (!TestBulkUpdate<fph::DynamicFphMap<uint64_t, uint64_t>>(test_element_up_bound, test_seed) ||
+            !TestBulkUpdate<fph::MetaFphMap<uint64_t, uint64_t>>(test_element_up_bound, test_seed) ||
+            !TestStringMerge<fph::DynamicFphSet<std::string>>(test_seed) ||
+            !TestStringMerge<fph::DynamicFphMap<std::string, std::string>>(test_seed) ||
+            !TestStringMerge<fph::MetaFphSet<std::string>>(test_seed) ||
+            !TestStringMerge<fph::MetaFphMap<std::string, std::string>>(test_seed)) {
+            LogHelper::log(Error, "Fail to pass bulk update test with %lu elements", test_element_up_bound);
+            return;
+        } else {
+            LogHelper::log(Info, "Pass bulk update test with %lu elements", test_element_up_bound);
+        }
+    }
+    {
+        size_t test_element_up_bound = 20000;
+        auto test_seed = random_gen(random_device);
+        if (!TestFreeze<fph::DynamicFphMap<uint64_t, uint64_t>>(test_element_up_bound, test_seed) ||
+            !TestFreeze<fph::MetaFphMap<uint64_t, uint64_t>>(test_element_up_bound, test_seed) ||
+            !TestFreeze<fph::DynamicFphDenseMap<uint64_t, uint64_t>>(test_element_up_bound, test_seed)) {
+            LogHelper::log(Error, "Fail to pass freeze test with %lu elements", test_element_up_bound);
+            return;
+        } else {
+            LogHelper::log(Info, "Pass freeze test with %lu elements", test_element_up_bound);
+        }
+    }
+    {
+        size_t test_element_up_bound = 20000;
+        auto test_seed = random_gen(random_device);
+        if (!TestMemoryUsage<fph::DynamicFphMap<uint64_t, uint64_t>>(test_element_up_bound, test_seed) ||
+            !TestMemoryUsage<fph::MetaFphMap<uint64_t, uint64_t>>(test_element_up_bound, test_seed)) {
+            LogHelper::log(Error, "Fail to pass memory usage test with %lu elements", test_element_up_bound);
+            return;
+        } else {
+            LogHelper::log(Info, "Pass memory usage test with %lu elements", test_element_up_bound);
+        }
+    }
+    {
+        size_t test_element_up_bound = 10000;
+        auto test_seed = random_gen(random_device);
+        if (!TestMetaScan<fph::MetaFphMap<uint64_t, std::string>>(test_element_up_bound, test_seed)) {
+            LogHelper::log(Error, "Fail to pass meta scan test with %lu elements", test_element_up_bound);
+            return;
+        } else {
+            LogHelper::log(Info, "Pass meta scan test with %lu elements", test_element_up_bound);
+        }
+    }
+    {
+        size_t test_element_up_bound = 20000;
+        auto test_seed = random_gen(random_device);
+        if (!TestSparseIteration<fph::DynamicFphMap<uint64_t, uint64_t>>(test_element_up_bound, test_seed) ||
+            !TestSparseIteration<fph::MetaFphMap<uint64_t, uint64_t>>(test_element_up_bound, test_seed)) {
+            LogHelper::log(Error, "Fail to pass sparse iteration test with %lu elements", test_element_up_bound);
+            return;
+        } else {
+            LogHelper::log(Info, "Pass sparse iteration test with %lu elements", test_element_up_bound);
+        }
+    }
 
 #endif
 
@@ -1736,4 +3631,17 @@ void TestMapPerformance() {
 
     TestTablePerformance<STD_HASH_TABLE, RandomGenerator, StdHashTable, PairType>(KEY_NUM, CONSTRUCT_TIME, LOOKUP_TIME,
                                                                                   performance_seed, c, TEST_MAX_LOAD_FACTOR);
+
+    using HugePageAllocator = fph::HugePageAllocator<std::pair<const KeyType, ValueType>>;
+    using HugePageMetaFphMap = fph::MetaFphMap<KeyType, ValueType, SeedHash, std::equal_to<>, HugePageAllocator,
+            BucketParamType>;
+    using HugePageDyFphMap = fph::DynamicFphMap<KeyType, ValueType, SeedHash, std::equal_to<>,
+            HugePageAllocator, BucketParamType, KeyRandomGen>;
+    constexpr size_t HUGE_PAGE_KEY_NUM = 8'000'000ULL;
+    constexpr size_t HUGE_PAGE_LOOKUP_TIME = 20'000'000ULL;
+
+    TestHugePageLookUpPerformance<DYNAMIC_FPH_TABLE, RandomGenerator, TestDyFphMap, HugePageDyFphMap, PairType>(
+            HUGE_PAGE_KEY_NUM, HUGE_PAGE_LOOKUP_TIME, performance_seed, c, TEST_MAX_LOAD_FACTOR);
+    TestHugePageLookUpPerformance<META_FPH_TABLE, RandomGenerator, TestMetaFphMap, HugePageMetaFphMap, PairType>(
+            HUGE_PAGE_KEY_NUM, HUGE_PAGE_LOOKUP_TIME, performance_seed, c, TEST_MAX_LOAD_FACTOR);
 }
@@ -0,0 +1,111 @@
+#include "fph/interleaved_lookup.h"
+#include "loghelper.h"
+
+#include <cstdint>
+#include <random>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#if FPH_HAVE_COROUTINE
+
+template<class Table, class Key>
+fph::LookupTask HandleRequest(Table &table, const Key &key,
+                              decltype(std::declval<Table&>().find(key).operator->()) &result) {
+    result = co_await fph::AsyncFind(table, key);
+}
+
+// The results of the interleaved lookups should be the same as find(), for the keys in the slots,
+// in the stash and not in the table
+template<class Table, class KeyGen>
+bool TestInterleavedLookup(size_t elem_num, size_t seed, KeyGen &&key_gen) {
+    using key_type = typename Table::key_type;
+    std::mt19937_64 random_engine(seed);
+    Table table;
+    table.max_load_factor(0.9);
+    table.max_stash_ratio(0.01);
+    std::vector<key_type> key_vec;
+    while (table.size() < elem_num || (table.stash_size() == 0 && table.size() < 4U * elem_num)) {
+        key_type key = key_gen(random_engine);
+        if (table.insert({key, typename Table::mapped_type{}}).second) {
+            key_vec.push_back(key);
+        }
+    }
+    if (table.stash_size() == 0) {
+        LogHelper::log(Error, "No key in the stash, seed: %lu", seed);
+        return false;
+    }
+    // the stash is iterated first
+    auto stash_it = table.begin();
+    for (size_t i = 0; i < table.stash_size(); ++i, ++stash_it) {
+        key_vec.push_back(stash_it->first);
+    }
+    for (size_t i = 0, miss_num = key_vec.size(); i < miss_num; ++i) {
+        key_vec.push_back(key_gen(random_engine));
+    }
+    std::shuffle(key_vec.begin(), key_vec.end(), random_engine);
+    const size_t key_num = key_vec.size();
+    std::vector<size_t> request_vec(key_num);
+    for (size_t i = 0; i < key_num; ++i) {
+        request_vec[i] = i;
+    }
+    const Table &const_table = table;
+    using pointer = decltype(table.find(key_vec[0]).operator->());
+    using const_pointer = decltype(const_table.find(key_vec[0]).operator->());
+    for (size_t max_in_flight: {size_t(1), size_t(4), fph::InterleavedLookup::DEFAULT_MAX_IN_FLIGHT}) {
+        std::vector<pointer> result_vec(key_num);
+        std::vector<const_pointer> const_result_vec(key_num);
+        fph::InterleavedLookup executor(max_in_flight);
+        executor.Run(request_vec.begin(), request_vec.end(), [&](size_t i) {
+            return HandleRequest(table, key_vec[i], result_vec[i]);
+        });
+        executor.Run(request_vec.begin(), request_vec.end(), [&](size_t i) {
+            return HandleRequest(const_table, key_vec[i], const_result_vec[i]);
+        });
+        for (size_t i = 0; i < key_num; ++i) {
+            auto it = table.find(key_vec[i]);
+            pointer expected = it == table.end() ? nullptr : it.operator->();
+            if (result_vec[i] != expected || const_result_vec[i] != expected) {
+                LogHelper::log(Error, "Interleaved lookup result not same as find with %lu requests "
+                                      "in flight, seed: %lu", max_in_flight, seed);
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+int main() {
+    std::random_device random_device;
+    std::mt19937_64 random_gen(random_device());
+    constexpr size_t test_element_up_bound = 20000;
+    auto test_seed = random_gen();
+    auto u64_key_gen = [](std::mt19937_64 &engine) {
+        return uint64_t(engine());
+    };
+    auto string_key_gen = [](std::mt19937_64 &engine) {
+        return "interleaved_key_" + std::to_string(engine());
+    };
+    if (!TestInterleavedLookup<fph::DynamicFphMap<uint64_t, uint64_t>>(test_element_up_bound, test_seed,
+                                                                       u64_key_gen) ||
+        !TestInterleavedLookup<fph::MetaFphMap<uint64_t, uint64_t>>(test_element_up_bound, test_seed,
+                                                                    u64_key_gen) ||
+        !TestInterleavedLookup<fph::DynamicFphMap<std::string, uint64_t>>(test_element_up_bound, test_seed,
+                                                                          string_key_gen) ||
+        !TestInterleavedLookup<fph::MetaFphMap<std::string, uint64_t>>(test_element_up_bound, test_seed,
+                                                                       string_key_gen)) {
+        LogHelper::log(Error, "Fail to pass interleaved lookup test with %lu elements", test_element_up_bound);
+        return -1;
+    }
+    LogHelper::log(Info, "Pass interleaved lookup test with %lu elements", test_element_up_bound);
+    return 0;
+}
+
+#else
+
+int main() {
+    LogHelper::log(Warn, "Skip interleaved lookup test, coroutines are not supported");
+    return 0;
+}
+
+#endif